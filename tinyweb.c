@@ -3,56 +3,507 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib-unix.h>
 
-#define DEFAULT_URL "https://github.com/0brym/tinyweb"
+#define DEFAULT_URL "tinyweb://start"
 #define MAX_URL_LENGTH 2048
 #define MAX_TITLE_LENGTH 1024
 #define MAX_LINE_LENGTH 4096
+#define DEFAULT_MAX_LIVE_TABS 4
+#define THUMBNAIL_WIDTH 320
+#define MAX_COMPLETIONS 10
+#define COMPLETION_SCAN_LIMIT 256
+#define COMPLETION_MAX_WORD_KEYS 4
 
+typedef struct _BrowserData BrowserData;
+typedef struct _History History;
+typedef struct _ContentBlocker ContentBlocker;
+typedef struct _Prefetcher Prefetcher;
+typedef struct _MemoryGuard MemoryGuard;
+typedef struct _SitePolicies SitePolicies;
+typedef struct _FrameProfiler FrameProfiler;
+typedef struct _DownloadManager DownloadManager;
+typedef struct _PageIndex PageIndex;
+typedef struct _BookmarkManager BookmarkManager;
+typedef struct _BookmarkTransfer BookmarkTransfer;
+
+// Timings and counters of the last navigation in a tab
+typedef struct {
+    gint64 start;
+    gdouble commit_ms;
+    gdouble finish_ms;
+    guint subresources;
+    guint blocked;
+    guint64 bytes;
+    gboolean failed;
+    gboolean prefetch_hit;
+} NavigationMetrics;
+
+// One notebook page. While a tab is discarded its web view is gone and only
+// the session state, last URI and a thumbnail are kept.
 typedef struct {
+    BrowserData *browser_data;
     WebKitWebView *web_view;
+    GtkWidget *page;
+    GtkWidget *scrolled_window;
+    GtkWidget *thumbnail_image;
+    GtkWidget *title_label;
+    WebKitWebViewSessionState *session_state;
+    cairo_surface_t *thumbnail;
+    GCancellable *discard_cancellable;
+    gchar *uri;
+    GHashTable *snapshots;      // Offline snapshot URI to the address it stands in for
+    gint64 last_focused;
+    NavigationMetrics metrics;
+    
+    // Saved session: back/forward list in SESSION_DIR/<session_id>.state
+    guint session_id;
+    gboolean session_dirty;
+    gint scroll_x;
+    gint scroll_y;
+    gboolean restore_scroll;
+    
+    const gchar *site_profile;  // Name of the profile the view runs with
+} Tab;
+
+// Address bar suggestion source (a bookmark, or later a history entry)
+typedef struct {
+    gchar *title;
+    gchar *url;
+    guint32 next_same_url;
+    guint32 frecency;
+    gboolean dead;
+    guint8 keys;               // Keys added for the entry, counted as dead on removal
+} CompletionEntry;
+
+typedef struct {
+    const gchar *key;
+    guint32 entry;
+} CompletionKey;
+
+// Prefix index for address bar completion: a sorted array of lowercase
+// keys (URL without scheme, title and title words) pointing at entries
+typedef struct {
+    GArray *entries;
+    GArray *keys;
+    GStringChunk *strings;
+    GHashTable *by_url;
+    guint dead_keys;
+} CompletionIndex;
+
+// A bookmark; search_text is " word word #tag " for matching
+typedef struct {
+    gchar *title;
+    gchar *url;
+    gchar *tags;               // Comma separated
+    guint64 record;            // Index of its add record in the journal
+    gchar *search_text;
+    gchar *key;                // Canonical URL key, see url_canonical_key()
+    gchar *collate_key;        // g_utf8_collate_key() of the title, made on first sort
+    guint seen;                // Query generation, to skip duplicate candidates
+} Bookmark;
+
+typedef struct {
+    const gchar *word;
+    Bookmark *bookmark;
+} BookmarkKey;
+
+// Word index for the bookmark manager: a sorted array of lowercase words
+// from titles, URLs and tags ("#tag") pointing at bookmarks
+typedef struct {
+    GArray *keys;
+    GStringChunk *words;
+    guint generation;
+} BookmarkIndex;
+
+struct _BrowserData {
+    GtkWidget *notebook;
+    GPtrArray *tabs;
+    GtkWidget *window;
+    WebKitSettings *settings;
+    WebKitUserContentManager *user_content_manager;
+    ContentBlocker *content_blocker;
+    Prefetcher *prefetcher;
+    MemoryGuard *memory_guard;
+    SitePolicies *site_policies;
+    FrameProfiler *frame_profiler;
+    DownloadManager *download_manager;
+    PageIndex *page_index;
+    WebKitWebContext *web_context;
+    gchar *cache_dir;
+    gboolean prefer_cache;
+    gchar *session_dir;
+    GThreadPool *session_writer;
+    guint session_source;
+    gboolean session_changed;
+    gboolean restore_session;
+    gboolean restoring_session;
+    gboolean shutting_down;
+    guint next_session_id;
+    int control_fd;
+    gchar *control_path;
+    guint control_source;
+    guint max_live_tabs;
+    const gchar *home_url;
+    gboolean deferred_loaded;
+    guint deferred_source;
     GtkWidget *url_entry;
-    GtkListStore *bookmarks_store;
+    GtkWidget *status_bar;
+    guint status_context;
+    guint hud_source;
+    int perf_log_fd;
+    GtkListStore *completion_store;
+    CompletionIndex *completion_index;
+    guint page_completion_source;  // Pending page search for the suggestions
+    History *history;
+    GPtrArray *bookmarks;
+    BookmarkIndex *bookmark_index;
+    GHashTable *bookmark_urls;     // Canonical URL key to the newest bookmark of that URL
     gchar *bookmarks_path;
-} BrowserData;
+    int bookmarks_fd;
+    guint64 bookmarks_next_record;
+    guint bookmarks_dead_records;
+    guint bookmarks_compact_source;
+    BookmarkManager *bookmark_manager;     // Open bookmark manager, if any
+    BookmarkTransfer *bookmark_transfer;   // Running import or export, if any
+};
 
-// URL validation for security
-static gboolean is_valid_url(const char *url) {
-    if (!url || strlen(url) > MAX_URL_LENGTH) {
-        return FALSE;
+// Tab shown in the notebook, or NULL before the first tab exists
+static Tab *get_current_tab(BrowserData *browser_data) {
+    GtkNotebook *notebook = GTK_NOTEBOOK(browser_data->notebook);
+    gint page_num = gtk_notebook_get_current_page(notebook);
+    if (page_num < 0) return NULL;
+    
+    GtkWidget *page = gtk_notebook_get_nth_page(notebook, page_num);
+    return g_object_get_data(G_OBJECT(page), "tab");
+}
+
+static WebKitWebView *get_current_web_view(BrowserData *browser_data) {
+    Tab *tab = get_current_tab(browser_data);
+    return tab ? tab->web_view : NULL;
+}
+
+// Address of the page a tab's view shows: the original address while an
+// offline snapshot of it is displayed, so the address bar, history,
+// bookmarks and the session never see the snapshot file
+static const gchar *tab_page_uri(Tab *tab) {
+    const gchar *uri = tab->web_view ? webkit_web_view_get_uri(tab->web_view) : NULL;
+    const gchar *source = uri && tab->snapshots ? g_hash_table_lookup(tab->snapshots, uri) : NULL;
+    return source ? source : uri;
+}
+
+// Startup trace, enabled with --startup-trace. Milestones are printed
+// relative to the moment the kernel started the process.
+enum {
+    STARTUP_WINDOW_MAPPED = 1 << 0,
+    STARTUP_FIRST_COMMIT = 1 << 1,
+    STARTUP_FIRST_FINISH = 1 << 2,
+};
+
+static gint64 startup_trace_origin;
+static guint startup_trace_seen;
+
+static gint64 get_boottime_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+// Process start in CLOCK_BOOTTIME microseconds, from field 22 of
+// /proc/self/stat; falls back to now when it cannot be read
+static gint64 get_process_start_us(void) {
+    gchar *stat = NULL;
+    gint64 start = get_boottime_us();
+    
+    if (g_file_get_contents("/proc/self/stat", &stat, NULL, NULL)) {
+        const gchar *p = strrchr(stat, ')');
+        guint64 ticks;
+        if (p && sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+                        " %*d %*d %*d %*d %*d %*d %" G_GUINT64_FORMAT, &ticks) == 1) {
+            start = (gint64)(ticks * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK));
+        }
+        g_free(stat);
     }
+    return start;
+}
+
+static void startup_trace_mark(const gchar *milestone) {
+    if (startup_trace_origin == 0) return;
     
-    // Check for JavaScript or data URLs (potential XSS vectors)
-    if (g_str_has_prefix(url, "javascript:") || 
-        g_str_has_prefix(url, "data:")) {
-        return FALSE;
+    g_printerr("startup-trace: %-28s %8.1f ms\n", milestone,
+               (get_boottime_us() - startup_trace_origin) / 1000.0);
+}
+
+// Print a milestone the first time it is reached
+static void startup_trace_once(guint milestone, const gchar *name) {
+    if (startup_trace_seen & milestone) return;
+    startup_trace_seen |= milestone;
+    startup_trace_mark(name);
+}
+
+// URLs are parsed, validated and normalized in one pass: the scheme and host
+// are lowercased, a default port is dropped, an empty path becomes "/" and
+// international host names are converted to ASCII (punycode). Input without
+// a scheme, as typed in the address bar, is taken as an http:// address.
+// The canonical key also drops the fragment and a trailing slash, so
+// "HTTP://Example.com:80/docs/#top" and "http://example.com/docs" are the
+// same key in a hash table.
+typedef enum {
+    URL_SCHEME_NONE,
+    URL_SCHEME_HTTP,
+    URL_SCHEME_HTTPS,
+    URL_SCHEME_FILE,
+    URL_SCHEME_ABOUT,
+    URL_SCHEME_TINYWEB,     // Built-in pages
+} UrlScheme;
+
+// A parsed URL. With text NULL the input is only validated.
+typedef struct {
+    GString *text;
+    gsize path_start;
+    gsize query_start;
+    gsize fragment_start;
+} UrlBuffer;
+
+// Characters refused in addresses typed without a scheme
+static const gboolean url_unsafe_chars[256] = {
+    ['<'] = TRUE, ['>'] = TRUE, ['"'] = TRUE, ['\''] = TRUE, ['\\'] = TRUE, ['('] = TRUE,
+    [')'] = TRUE, ['{'] = TRUE, ['}'] = TRUE, ['['] = TRUE, [']'] = TRUE, [';'] = TRUE,
+};
+
+static void url_put(UrlBuffer *url, const gchar *text, gsize length) {
+    if (url->text) g_string_append_len(url->text, text, length);
+}
+
+static void url_put_lower(UrlBuffer *url, const gchar *text, gsize length) {
+    if (!url->text) return;
+    for (gsize i = 0; i < length; i++) {
+        g_string_append_c(url->text, g_ascii_tolower(text[i]));
+    }
+}
+
+static gsize url_length(UrlBuffer *url) {
+    return url->text ? url->text->len : 0;
+}
+
+// Host names are letters, digits, '-', '.', '_' and '%' escapes, or the
+// non-ASCII bytes of an international name
+static gboolean url_host_char(guchar c) {
+    return g_ascii_isalnum(c) || c == '-' || c == '.' || c == '_' || c == '%' || c >= 0x80;
+}
+
+// Copy the authority with the host lowercased, an international host
+// converted to ASCII and a default port dropped. *position is left at the
+// start of the path.
+static gboolean url_parse_authority(const gchar **position, const gchar *end, guint default_port,
+                                    UrlBuffer *url) {
+    const gchar *p = *position;
+    const gchar *authority_end = p;
+    const gchar *at = NULL;
+    
+    while (authority_end < end && *authority_end != '/' && *authority_end != '?' && *authority_end != '#') {
+        if (*authority_end == '@') at = authority_end;
+        authority_end++;
     }
     
-    // Only allow common protocols
-    if (g_str_has_prefix(url, "http://") || 
-        g_str_has_prefix(url, "https://") ||
-        g_str_has_prefix(url, "file://") ||
-        g_str_has_prefix(url, "about:")) {
-        return TRUE;
+    // User info is kept as it is
+    if (at) {
+        url_put(url, p, at + 1 - p);
+        p = at + 1;
+    }
+    
+    // Host name, or an IPv6 literal in brackets
+    const gchar *host = p;
+    gboolean ascii = TRUE;
+    if (p < authority_end && *p == '[') {
+        const gchar *close = memchr(p, ']', authority_end - p);
+        if (!close) return FALSE;
+        for (const gchar *c = p + 1; c < close; c++) {
+            if (!g_ascii_isxdigit(*c) && *c != ':' && *c != '.') return FALSE;
+        }
+        p = close + 1;
+    } else {
+        while (p < authority_end && *p != ':') {
+            if (!url_host_char(*p)) return FALSE;
+            ascii = ascii && !((guchar)*p & 0x80);
+            p++;
+        }
+    }
+    
+    // A trailing dot names the same host
+    const gchar *host_end = p;
+    if (host_end - host > 1 && host_end[-1] == '.') host_end--;
+    if (host_end == host) return FALSE;
+    
+    if (ascii) {
+        url_put_lower(url, host, host_end - host);
+    } else {
+        gchar *name = g_strndup(host, host_end - host);
+        gchar *ascii_name = g_utf8_validate(name, -1, NULL) ? g_hostname_to_ascii(name) : NULL;
+        g_free(name);
+        if (!ascii_name) return FALSE;
+        
+        url_put_lower(url, ascii_name, strlen(ascii_name));
+        g_free(ascii_name);
+    }
+    
+    // Port; "host:" means the default port
+    if (p < authority_end) {
+        if (*p != ':') return FALSE;
+        
+        guint port = 0;
+        for (p++; p < authority_end; p++) {
+            if (!g_ascii_isdigit(*p)) return FALSE;
+            port = port * 10 + (*p - '0');
+            if (port > 65535) return FALSE;
+        }
+        if (port != 0 && port != default_port && url->text) {
+            g_string_append_printf(url->text, ":%u", port);
+        }
+    }
+    
+    *position = authority_end;
+    return TRUE;
+}
+
+static gboolean url_parse(const gchar *input, UrlBuffer *url) {
+    if (!input) return FALSE;
+    
+    // Typed addresses may come with surrounding spaces
+    while (g_ascii_isspace(*input)) input++;
+    const gchar *end = input + strlen(input);
+    while (end > input && g_ascii_isspace(end[-1])) end--;
+    if (end == input || end - input > MAX_URL_LENGTH) return FALSE;
+    
+    if (url->text) g_string_truncate(url->text, 0);
+    
+    // Only common protocols and tinyweb: are allowed, which rules out
+    // javascript: and data: URLs. "host:port" has no scheme.
+    const gchar *p = input;
+    const gchar *colon = p;
+    while (colon < end && (g_ascii_isalnum(*colon) || *colon == '+' || *colon == '-' || *colon == '.')) {
+        colon++;
     }
     
-    // For other inputs, they'll get http:// prefix - check for dangerous chars
-    const char *invalid_chars = "<>\"'\\(){}[];";
-    for (int i = 0; i < strlen(invalid_chars); i++) {
-        if (strchr(url, invalid_chars[i]) != NULL) {
+    UrlScheme scheme = URL_SCHEME_NONE;
+    if (colon < end && *colon == ':' && g_ascii_isalpha(*p)) {
+        gsize length = colon - p;
+        if (length == 4 && g_ascii_strncasecmp(p, "http", 4) == 0) {
+            scheme = URL_SCHEME_HTTP;
+        } else if (length == 5 && g_ascii_strncasecmp(p, "https", 5) == 0) {
+            scheme = URL_SCHEME_HTTPS;
+        } else if (length == 4 && g_ascii_strncasecmp(p, "file", 4) == 0) {
+            scheme = URL_SCHEME_FILE;
+        } else if (length == 5 && g_ascii_strncasecmp(p, "about", 5) == 0) {
+            scheme = URL_SCHEME_ABOUT;
+        } else if (length == 7 && g_ascii_strncasecmp(p, "tinyweb", 7) == 0) {
+            scheme = URL_SCHEME_TINYWEB;
+        } else if (colon + 1 == end || !g_ascii_isdigit(colon[1])) {
             return FALSE;
         }
     }
     
+    if (scheme == URL_SCHEME_FILE || scheme == URL_SCHEME_ABOUT) {
+        url_put(url, scheme == URL_SCHEME_FILE ? "file:" : "about:", scheme == URL_SCHEME_FILE ? 5 : 6);
+        p = colon + 1;
+    } else if (scheme == URL_SCHEME_NONE) {
+        // Typed addresses get http://, so refuse anything that looks like markup
+        for (const gchar *c = p; c < end; c++) {
+            if (url_unsafe_chars[(guchar)*c]) return FALSE;
+        }
+        url_put(url, "http://", 7);
+        if (!url_parse_authority(&p, end, 80, url)) return FALSE;
+    } else {
+        p = colon + 1;
+        if (end - p < 2 || p[0] != '/' || p[1] != '/') return FALSE;
+        p += 2;
+        
+        if (scheme == URL_SCHEME_TINYWEB) {
+            url_put(url, "tinyweb://", 10);
+            if (!url_parse_authority(&p, end, 0, url)) return FALSE;
+        } else {
+            gboolean https = scheme == URL_SCHEME_HTTPS;
+            url_put(url, https ? "https://" : "http://", https ? 8 : 7);
+            if (!url_parse_authority(&p, end, https ? 443 : 80, url)) return FALSE;
+        }
+    }
+    
+    // Path, query and fragment are kept as they are
+    url->path_start = url_length(url);
+    if (scheme != URL_SCHEME_FILE && scheme != URL_SCHEME_ABOUT && (p == end || *p == '?' || *p == '#')) {
+        url_put(url, "/", 1);
+    }
+    
+    gsize base = url_length(url);
+    const gchar *query = NULL, *fragment = NULL;
+    for (const gchar *c = p; c < end && !fragment; c++) {
+        if (*c == '#') {
+            fragment = c;
+        } else if (*c == '?' && !query) {
+            query = c;
+        }
+    }
+    url_put(url, p, end - p);
+    
+    url->fragment_start = fragment ? base + (fragment - p) : url_length(url);
+    url->query_start = query ? base + (query - p) : url->fragment_start;
     return TRUE;
 }
 
-// Safe string copy with bounds checking
-static void safe_strcpy(char *dest, const char *src, size_t dest_size) {
+// Canonical key of a parsed URL: no fragment and no trailing slash on a
+// path longer than "/"
+static void url_buffer_key(const UrlBuffer *url, GString *key) {
+    const gchar *text = url->text->str;
+    gsize path_end = url->query_start;
+    
+    if (path_end - url->path_start > 1 && text[path_end - 1] == '/') path_end--;
+    g_string_append_len(key, text, path_end);
+    g_string_append_len(key, text + url->query_start, url->fragment_start - url->query_start);
+}
+
+// Validate URL to prevent injection attacks
+static gboolean is_valid_url(const char *url) {
+    UrlBuffer buffer = { NULL, 0, 0, 0 };
+    return url_parse(url, &buffer);
+}
+
+// Normalized form of an address, or NULL if it is not valid
+static gchar *url_normalize(const gchar *input) {
+    UrlBuffer url = { g_string_new(NULL), 0, 0, 0 };
+    
+    if (!url_parse(input, &url)) {
+        g_string_free(url.text, TRUE);
+        return NULL;
+    }
+    return g_string_free(url.text, FALSE);
+}
+
+// Canonical key of an address for duplicate detection, or NULL if it is
+// not valid
+static gchar *url_canonical_key(const gchar *input) {
+    UrlBuffer url = { g_string_new(NULL), 0, 0, 0 };
+    GString *key = NULL;
+    
+    if (url_parse(input, &url)) {
+        key = g_string_sized_new(url.text->len);
+        url_buffer_key(&url, key);
+    }
+    g_string_free(url.text, TRUE);
+    return key ? g_string_free(key, FALSE) : NULL;
+}
+
+// Safe copy of a length-delimited string with bounds checking
+static void safe_strncpy(char *dest, const char *src, size_t src_len, size_t dest_size) {
     if (!dest || !src || dest_size == 0) return;
     
-    size_t src_len = strlen(src);
     size_t copy_len = src_len < (dest_size - 1) ? src_len : (dest_size - 1);
     
     memcpy(dest, src, copy_len);
@@ -75,8 +526,43 @@ static gchar *sanitize_string(const gchar *input) {
     return g_string_free(sanitized, FALSE);
 }
 
-// Get secure path to bookmarks file
-static gchar *get_bookmarks_path() {
+// Append a string as a quoted JSON string
+static void json_append_string(GString *json, const gchar *value) {
+    g_string_append_c(json, '"');
+    for (const guchar *p = (const guchar *)(value ? value : ""); *p; p++) {
+        switch (*p) {
+        case '"': g_string_append(json, "\\\""); break;
+        case '\\': g_string_append(json, "\\\\"); break;
+        case '\n': g_string_append(json, "\\n"); break;
+        case '\r': g_string_append(json, "\\r"); break;
+        case '\t': g_string_append(json, "\\t"); break;
+        default:
+            if (*p < 0x20) {
+                g_string_append_printf(json, "\\u%04x", *p);
+            } else {
+                g_string_append_c(json, *p);
+            }
+        }
+    }
+    g_string_append_c(json, '"');
+}
+
+// Write a whole buffer, retrying on short writes
+static gboolean write_all(int fd, const gchar *buffer, gsize length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return TRUE;
+}
+
+// Get secure path to a file in the tinyweb config directory
+static gchar *get_config_path(const gchar *filename) {
     const gchar *config_dir = g_get_user_config_dir();
     gchar *tinyweb_dir = g_build_filename(config_dir, "tinyweb", NULL);
     
@@ -87,346 +573,10751 @@ static gchar *get_bookmarks_path() {
         return NULL;
     }
     
-    gchar *bookmarks_path = g_build_filename(tinyweb_dir, "bookmarks.txt", NULL);
+    gchar *path = g_build_filename(tinyweb_dir, filename, NULL);
     g_free(tinyweb_dir);
     
-    return bookmarks_path;
+    return path;
 }
 
-// Callback to close the application
-static void on_destroy(GtkWidget *widget, gpointer data) {
-    BrowserData *browser_data = (BrowserData *)data;
+// Get secure path to bookmarks file
+static gchar *get_bookmarks_path() {
+    return get_config_path("bookmarks.txt");
+}
+
+#define COMPLETION_NO_ENTRY G_MAXUINT32
+
+static CompletionIndex *completion_index_new(void) {
+    CompletionIndex *index = g_new0(CompletionIndex, 1);
+    index->entries = g_array_new(FALSE, FALSE, sizeof(CompletionEntry));
+    index->keys = g_array_new(FALSE, FALSE, sizeof(CompletionKey));
+    index->strings = g_string_chunk_new(64 * 1024);
+    index->by_url = g_hash_table_new(g_str_hash, g_str_equal);
+    return index;
+}
+
+static gint compare_completion_keys(gconstpointer a, gconstpointer b) {
+    return strcmp(((const CompletionKey *)a)->key, ((const CompletionKey *)b)->key);
+}
+
+// First key position that is not less than the prefix
+static guint completion_index_lower_bound(CompletionIndex *index, const gchar *prefix) {
+    guint low = 0, high = index->keys->len;
+    
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+        if (strcmp(g_array_index(index->keys, CompletionKey, mid).key, prefix) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static guint completion_index_add_key(CompletionIndex *index, const gchar *text, gsize length,
+                                      guint32 entry, gboolean sorted) {
+    if (length == 0) return 0;
+    
+    gchar *lower = g_ascii_strdown(text, length);
+    CompletionKey key = { g_string_chunk_insert_const(index->strings, lower), entry };
+    g_free(lower);
+    
+    if (sorted) {
+        guint position = completion_index_lower_bound(index, key.key);
+        g_array_insert_val(index->keys, position, key);
+    } else {
+        g_array_append_val(index->keys, key);
+    }
+    return 1;
+}
+
+// Strip the scheme and a leading "www." so "exa" matches https://www.example.com
+static const gchar *completion_url_key(const gchar *url) {
+    const gchar *scheme_end = strstr(url, "://");
+    if (scheme_end) url = scheme_end + 3;
+    if (g_ascii_strncasecmp(url, "www.", 4) == 0) url += 4;
+    return url;
+}
+
+// Add an entry. While bulk loading, pass sorted = FALSE and call
+// completion_index_sort() once at the end.
+static guint32 completion_index_add(CompletionIndex *index, const gchar *title,
+                                    const gchar *url, gboolean sorted) {
+    CompletionEntry entry = { NULL, NULL, COMPLETION_NO_ENTRY, 0, FALSE, 0 };
+    guint32 id = index->entries->len;
+    
+    entry.title = g_string_chunk_insert(index->strings, title ? title : "");
+    entry.url = g_string_chunk_insert_const(index->strings, url);
+    
+    gpointer previous;
+    if (g_hash_table_lookup_extended(index->by_url, entry.url, NULL, &previous)) {
+        entry.next_same_url = GPOINTER_TO_UINT(previous);
+    }
+    g_hash_table_insert(index->by_url, entry.url, GUINT_TO_POINTER(id));
+    g_array_append_val(index->entries, entry);
     
-    // Close the WebView properly first
-    if (browser_data && browser_data->web_view) {
-        // Disconnect signals
-        g_signal_handlers_disconnect_matched(browser_data->web_view, 
-                                          G_SIGNAL_MATCH_DATA, 
-                                          0, 0, NULL, NULL, 
-                                          browser_data);
-                                          
-        // Load about:blank to stop any active processes
-        webkit_web_view_load_uri(browser_data->web_view, "about:blank");
+    const gchar *url_key = completion_url_key(url);
+    guint keys = completion_index_add_key(index, url_key, strlen(url_key), id, sorted);
+    
+    // Whole title, then the start of each following word
+    const gchar *p = entry.title;
+    guint words = 0;
+    while (*p && words <= COMPLETION_MAX_WORD_KEYS) {
+        while (*p == ' ') p++;
+        const gchar *word_end = p;
+        while (*word_end && *word_end != ' ') word_end++;
         
-        // Process pending events
-        while (gtk_events_pending())
-            gtk_main_iteration();
+        if (words == 0) {
+            keys += completion_index_add_key(index, p, strlen(p), id, sorted);
+        } else if (word_end - p >= 3) {
+            keys += completion_index_add_key(index, p, strlen(p), id, sorted);
+        }
+        words++;
+        p = word_end;
     }
+    g_array_index(index->entries, CompletionEntry, id).keys = keys;
+    
+    return id;
+}
+
+// Update the ranking of every entry for this URL, adding one if needed
+static void completion_index_set_frecency(CompletionIndex *index, const gchar *title,
+                                          const gchar *url, guint32 frecency, gboolean sorted) {
+    gpointer head;
+    guint32 id;
     
-    // Clean up resources
-    if (browser_data && browser_data->bookmarks_path) {
-        g_free(browser_data->bookmarks_path);
+    if (g_hash_table_lookup_extended(index->by_url, url, NULL, &head)) {
+        id = GPOINTER_TO_UINT(head);
+    } else {
+        id = completion_index_add(index, title, url, sorted);
     }
     
-    // Now exit
-    gtk_main_quit();
+    for (; id != COMPLETION_NO_ENTRY;
+         id = g_array_index(index->entries, CompletionEntry, id).next_same_url) {
+        g_array_index(index->entries, CompletionEntry, id).frecency = frecency;
+    }
 }
 
-// Navigate to URL from address bar
-static void navigate_to_url(GtkWidget *widget, gpointer data) {
-    BrowserData *browser_data = (BrowserData *)data;
-    const gchar *url = gtk_entry_get_text(GTK_ENTRY(browser_data->url_entry));
+static void completion_index_sort(CompletionIndex *index) {
+    g_array_sort(index->keys, compare_completion_keys);
+}
+
+// Drop keys of removed entries. Key order is kept, so no re-sort is needed.
+static void completion_index_compact(CompletionIndex *index) {
+    guint kept = 0;
+    
+    for (guint i = 0; i < index->keys->len; i++) {
+        CompletionKey key = g_array_index(index->keys, CompletionKey, i);
+        if (!g_array_index(index->entries, CompletionEntry, key.entry).dead) {
+            g_array_index(index->keys, CompletionKey, kept++) = key;
+        }
+    }
+    g_array_set_size(index->keys, kept);
+    index->dead_keys = 0;
+}
+
+// Mark one entry with this title and URL as removed
+static void completion_index_remove(CompletionIndex *index, const gchar *title, const gchar *url) {
+    gpointer head;
+    if (!url || !g_hash_table_lookup_extended(index->by_url, url, NULL, &head)) return;
+    
+    for (guint32 id = GPOINTER_TO_UINT(head); id != COMPLETION_NO_ENTRY;
+         id = g_array_index(index->entries, CompletionEntry, id).next_same_url) {
+        CompletionEntry *entry = &g_array_index(index->entries, CompletionEntry, id);
+        if (!entry->dead && g_strcmp0(entry->title, title ? title : "") == 0) {
+            entry->dead = TRUE;
+            index->dead_keys += entry->keys;
+            break;
+        }
+    }
+    
+    if (index->dead_keys > index->keys->len / 2) {
+        completion_index_compact(index);
+    }
+}
+
+// Collect up to max_results distinct entries whose keys start with the
+// typed text. URL matches rank before title matches, then higher frecency,
+// then shorter URLs.
+static guint completion_index_lookup(CompletionIndex *index, const gchar *text,
+                                     guint32 *results, guint max_results) {
+    gchar *prefix = g_ascii_strdown(completion_url_key(text), -1);
+    gsize prefix_length = strlen(prefix);
+    guint count = 0;
+    guint64 scores[MAX_COMPLETIONS];
+    
+    if (prefix_length == 0 || max_results > MAX_COMPLETIONS) {
+        g_free(prefix);
+        return 0;
+    }
+    
+    guint position = completion_index_lower_bound(index, prefix);
+    for (guint scanned = 0; position < index->keys->len && scanned < COMPLETION_SCAN_LIMIT;
+         position++, scanned++) {
+        CompletionKey *key = &g_array_index(index->keys, CompletionKey, position);
+        if (strncmp(key->key, prefix, prefix_length) != 0) break;
+        
+        CompletionEntry *entry = &g_array_index(index->entries, CompletionEntry, key->entry);
+        if (entry->dead) continue;
+        
+        gboolean duplicate = FALSE;
+        for (guint i = 0; i < count && !duplicate; i++) {
+            CompletionEntry *other = &g_array_index(index->entries, CompletionEntry, results[i]);
+            duplicate = results[i] == key->entry || strcmp(other->url, entry->url) == 0;
+        }
+        if (duplicate) continue;
+        
+        gboolean url_match = g_ascii_strncasecmp(completion_url_key(entry->url),
+                                                 prefix, prefix_length) == 0;
+        // Lower is better
+        guint64 score = ((guint64)(url_match ? 0 : 1) << 48) |
+                        ((guint64)(G_MAXUINT32 - entry->frecency) << 12) |
+                        MIN(strlen(entry->url), 4095);
+        
+        // Insertion into the small ranked result list
+        guint slot = count;
+        while (slot > 0 && scores[slot - 1] > score) slot--;
+        if (slot >= max_results) continue;
+        
+        guint last = count < max_results ? count : max_results - 1;
+        for (guint i = last; i > slot; i--) {
+            results[i] = results[i - 1];
+            scores[i] = scores[i - 1];
+        }
+        results[slot] = key->entry;
+        scores[slot] = score;
+        if (count < max_results) count++;
+    }
+    
+    g_free(prefix);
+    return count;
+}
+
+// Browsing history. Every visit is appended to history.log as
+// "V|time|url|title"; compaction folds visits into one
+// "E|count|t0|t1|t2|t3|url|title" record per URL, where t0..t3 are the
+// most recent visit times. Records are buffered on the main thread and
+// written by a single worker thread, so navigation never waits on disk.
+#define HISTORY_RECENT_VISITS 4
+#define HISTORY_FLUSH_INTERVAL 5
+#define HISTORY_FLUSH_BYTES (64 * 1024)
+#define HISTORY_COMPACT_MIN_RECORDS 10000
+
+typedef struct {
+    gchar *url;
+    gchar *title;
+    guint32 visit_count;
+    gint64 recent_visits[HISTORY_RECENT_VISITS];
+} HistoryEntry;
+
+struct _History {
+    gchar *path;
+    GHashTable *entries;
+    GString *pending;
+    GThreadPool *writer;
+    guint flush_source;
+    guint64 records_on_disk;
+    gboolean loaded;
+};
+
+typedef struct {
+    GString *data;
+    gboolean replace;
+} HistoryWriteJob;
+
+static void history_entry_free(gpointer data) {
+    HistoryEntry *entry = (HistoryEntry *)data;
+    g_free(entry->url);
+    g_free(entry->title);
+    g_free(entry);
+}
+
+// Weight of a visit by age, in the style of Firefox's frecency buckets
+static guint32 history_visit_weight(gint64 visit, gint64 now) {
+    gint64 age_days = (now - visit) / (24 * 60 * 60);
+    
+    if (age_days <= 4) return 100;
+    if (age_days <= 14) return 70;
+    if (age_days <= 31) return 50;
+    if (age_days <= 90) return 30;
+    return 10;
+}
+
+// Visit count scaled by the average weight of the most recent visits
+static guint32 history_entry_frecency(const HistoryEntry *entry, gint64 now) {
+    guint32 weights = 0, samples = 0;
+    
+    for (guint i = 0; i < HISTORY_RECENT_VISITS && entry->recent_visits[i] > 0; i++) {
+        weights += history_visit_weight(entry->recent_visits[i], now);
+        samples++;
+    }
+    if (samples == 0) return 0;
+    
+    guint64 frecency = (guint64)entry->visit_count * weights / samples;
+    return frecency > G_MAXUINT32 ? G_MAXUINT32 : (guint32)frecency;
+}
+
+// Remember a visit time, keeping the newest visits first
+static void history_entry_note_visit_time(HistoryEntry *entry, gint64 when) {
+    guint slot = 0;
+    while (slot < HISTORY_RECENT_VISITS && entry->recent_visits[slot] > when) slot++;
+    if (slot == HISTORY_RECENT_VISITS) return;
+    
+    memmove(&entry->recent_visits[slot + 1], &entry->recent_visits[slot],
+            (HISTORY_RECENT_VISITS - slot - 1) * sizeof(gint64));
+    entry->recent_visits[slot] = when;
+}
+
+static void history_entry_add_visit(HistoryEntry *entry, gint64 when) {
+    entry->visit_count++;
+    history_entry_note_visit_time(entry, when);
+}
+
+static HistoryEntry *history_lookup_or_add(History *history, const gchar *url, gsize url_length,
+                                           const gchar *title, gsize title_length) {
+    gchar *key = g_strndup(url, url_length);
+    HistoryEntry *entry = g_hash_table_lookup(history->entries, key);
     
-    // Add http:// prefix if missing
-    gchar *full_url;
-    if (strstr(url, "://") == NULL) {
-        full_url = g_strconcat("http://", url, NULL);
+    if (!entry) {
+        entry = g_new0(HistoryEntry, 1);
+        entry->url = key;
+        entry->title = g_strndup(title, title_length);
+        g_hash_table_insert(history->entries, entry->url, entry);
     } else {
-        full_url = g_strdup(url);
+        if (title_length > 0) {
+            g_free(entry->title);
+            entry->title = g_strndup(title, title_length);
+        }
+        g_free(key);
     }
+    return entry;
+}
+
+// Runs on the writer thread; jobs execute one at a time in queue order
+static void history_write_job(gpointer data, gpointer user_data) {
+    HistoryWriteJob *job = (HistoryWriteJob *)data;
+    const gchar *path = (const gchar *)user_data;
     
-    // Validate URL before loading
-    if (!is_valid_url(full_url)) {
-        GtkWidget *dialog = gtk_message_dialog_new(
-            GTK_WINDOW(gtk_widget_get_toplevel(widget)),
-            GTK_DIALOG_MODAL,
-            GTK_MESSAGE_ERROR,
-            GTK_BUTTONS_OK,
-            "Invalid or potentially unsafe URL"
-        );
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
-        g_free(full_url);
-        return;
+    if (job->replace) {
+        gchar *tmp_path = g_strconcat(path, ".tmp", NULL);
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        gboolean ok = fd >= 0 && write_all(fd, job->data->str, job->data->len) && fsync(fd) == 0;
+        if (fd >= 0) {
+            ok = close(fd) == 0 && ok;
+        }
+        if (!ok || rename(tmp_path, path) != 0) {
+            g_warning("Failed to compact history to %s: %s", tmp_path, g_strerror(errno));
+            unlink(tmp_path);
+        }
+        g_free(tmp_path);
+    } else {
+        int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0 || !write_all(fd, job->data->str, job->data->len)) {
+            g_warning("Failed to write history to %s: %s", path, g_strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
     }
     
-    webkit_web_view_load_uri(browser_data->web_view, full_url);
-    g_free(full_url);
+    g_string_free(job->data, TRUE);
+    g_free(job);
 }
 
-// Navigation button callbacks
-static void go_back(GtkWidget *widget, gpointer data) {
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(data);
-    if (webkit_web_view_can_go_back(web_view)) {
-        webkit_web_view_go_back(web_view);
+static void history_queue_write(History *history, GString *data, gboolean replace) {
+    HistoryWriteJob *job = g_new0(HistoryWriteJob, 1);
+    job->data = data;
+    job->replace = replace;
+    g_thread_pool_push(history->writer, job, NULL);
+}
+
+// Hand buffered visits to the writer thread
+static void history_flush(History *history) {
+    if (history->pending->len == 0) return;
+    
+    history_queue_write(history, history->pending, FALSE);
+    history->pending = g_string_new(NULL);
+}
+
+// Replace the log with one record per URL. Buffered visits are flushed
+// first, so the rewrite lands after every append that it covers.
+static void history_compact(History *history) {
+    GString *contents = g_string_new(NULL);
+    GHashTableIter iter;
+    gpointer value;
+    
+    history_flush(history);
+    
+    g_hash_table_iter_init(&iter, history->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        HistoryEntry *entry = (HistoryEntry *)value;
+        g_string_append_printf(contents, "E|%u", entry->visit_count);
+        for (guint i = 0; i < HISTORY_RECENT_VISITS; i++) {
+            g_string_append_printf(contents, "|%" G_GINT64_FORMAT, entry->recent_visits[i]);
+        }
+        g_string_append_printf(contents, "|%s|%s\n", entry->url, entry->title);
     }
+    
+    history->records_on_disk = g_hash_table_size(history->entries);
+    history_queue_write(history, contents, TRUE);
 }
 
-static void go_forward(GtkWidget *widget, gpointer data) {
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(data);
-    if (webkit_web_view_can_go_forward(web_view)) {
-        webkit_web_view_go_forward(web_view);
+static void history_maybe_compact(History *history) {
+    guint entries = g_hash_table_size(history->entries);
+    
+    if (history->records_on_disk >= HISTORY_COMPACT_MIN_RECORDS &&
+        history->records_on_disk > (guint64)entries * 2) {
+        history_compact(history);
+    }
+}
+
+static gboolean history_flush_timeout(gpointer data) {
+    History *history = (History *)data;
+    
+    history_flush(history);
+    history_maybe_compact(history);
+    return G_SOURCE_CONTINUE;
+}
+
+// Split a record into '|' separated fields; the last field takes the rest
+static guint split_record(const gchar *line, const gchar *line_end, const gchar **fields,
+                          gsize *lengths, guint max_fields) {
+    guint count = 0;
+    
+    while (count < max_fields) {
+        const gchar *delim = count + 1 < max_fields ? memchr(line, '|', line_end - line) : NULL;
+        fields[count] = line;
+        lengths[count] = (delim ? delim : line_end) - line;
+        count++;
+        if (!delim) break;
+        line = delim + 1;
+    }
+    return count;
+}
+
+// Replay the history log from a memory mapping. Visits recorded before the
+// log is loaded are merged into the same entries.
+static void history_load(History *history) {
+    GError *error = NULL;
+    GMappedFile *mapped = g_mapped_file_new(history->path, FALSE, &error);
+    if (!mapped) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning("Failed to load history: %s", error->message);
+        }
+        g_error_free(error);
+        return;
     }
+    
+    const gchar *p = g_mapped_file_get_contents(mapped);
+    const gchar *end = p + g_mapped_file_get_length(mapped);
+    const gchar *fields[4 + HISTORY_RECENT_VISITS];
+    gsize lengths[4 + HISTORY_RECENT_VISITS];
+    
+    while (p && p < end) {
+        const gchar *eol = memchr(p, '\n', end - p);
+        if (!eol) break; // Torn final record from an interrupted append
+        
+        if (p[0] == 'V') {
+            // V|time|url|title
+            if (split_record(p, eol, fields, lengths, 4) == 4 && lengths[2] > 0) {
+                HistoryEntry *entry = history_lookup_or_add(history, fields[2], lengths[2],
+                                                            fields[3], lengths[3]);
+                history_entry_add_visit(entry, g_ascii_strtoll(fields[1], NULL, 10));
+            }
+            history->records_on_disk++;
+        } else if (p[0] == 'E') {
+            // E|count|t0..t3|url|title
+            guint n = split_record(p, eol, fields, lengths, 4 + HISTORY_RECENT_VISITS);
+            if (n == 4 + HISTORY_RECENT_VISITS && lengths[2 + HISTORY_RECENT_VISITS] > 0) {
+                HistoryEntry *entry = history_lookup_or_add(history,
+                    fields[2 + HISTORY_RECENT_VISITS], lengths[2 + HISTORY_RECENT_VISITS],
+                    fields[3 + HISTORY_RECENT_VISITS], lengths[3 + HISTORY_RECENT_VISITS]);
+                entry->visit_count += (guint32)g_ascii_strtoull(fields[1], NULL, 10);
+                for (guint i = 0; i < HISTORY_RECENT_VISITS; i++) {
+                    gint64 when = g_ascii_strtoll(fields[2 + i], NULL, 10);
+                    if (when > 0) {
+                        history_entry_note_visit_time(entry, when);
+                    }
+                }
+            }
+            history->records_on_disk++;
+        }
+        
+        p = eol + 1;
+    }
+    
+    g_mapped_file_unref(mapped);
+    history->loaded = TRUE;
+    history_maybe_compact(history);
+    
+    // Nothing is written before the log is replayed, or visits made
+    // meanwhile would be counted twice
+    history->flush_source = g_timeout_add_seconds(HISTORY_FLUSH_INTERVAL,
+                                                  history_flush_timeout, history);
+}
+
+// Open the history without reading it; see history_load()
+static History *history_open(const gchar *path) {
+    History *history = g_new0(History, 1);
+    
+    history->path = g_strdup(path);
+    history->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, history_entry_free);
+    history->pending = g_string_new(NULL);
+    history->writer = g_thread_pool_new(history_write_job, history->path, 1, FALSE, NULL);
+    return history;
+}
+
+// Flush buffered visits and wait for the writer to finish
+// Hand the last visits to the writer and return it; the caller waits for
+// it with g_thread_pool_free(), off the main thread if it likes
+static GThreadPool *history_close(History *history) {
+    GThreadPool *writer = history->writer;
+    
+    if (history->flush_source) {
+        g_source_remove(history->flush_source);
+        history->flush_source = 0;
+    }
+    history_flush(history);
+    history->writer = NULL;
+    return writer;
+}
+
+// Record a visit in memory and buffer it for the writer thread
+static HistoryEntry *history_add_visit(History *history, const gchar *url, const gchar *title) {
+    // Normalized, so one page has one entry however its address was written
+    gchar *normalized = url_normalize(url);
+    gchar *safe_url = sanitize_string(normalized ? normalized : url);
+    g_free(normalized);
+    gchar *safe_title = sanitize_string(title);
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    
+    HistoryEntry *entry = history_lookup_or_add(history, safe_url, strlen(safe_url),
+                                                safe_title, strlen(safe_title));
+    history_entry_add_visit(entry, now);
+    
+    g_string_append_printf(history->pending, "V|%" G_GINT64_FORMAT "|%s|%s\n",
+                           now, safe_url, safe_title);
+    history->records_on_disk++;
+    if (history->loaded && history->pending->len >= HISTORY_FLUSH_BYTES) {
+        history_flush(history);
+    }
+    
+    g_free(safe_url);
+    g_free(safe_title);
+    return entry;
+}
+
+typedef struct {
+    HistoryEntry *entry;
+    guint32 frecency;
+} HistoryMatch;
+
+static gboolean history_match_better(const HistoryMatch *a, const HistoryMatch *b) {
+    if (a->frecency != b->frecency) return a->frecency > b->frecency;
+    return a->entry->recent_visits[0] > b->entry->recent_visits[0];
+}
+
+static gint compare_history_matches(gconstpointer a, gconstpointer b) {
+    const HistoryMatch *match_a = a, *match_b = b;
+    return history_match_better(match_a, match_b) ? -1 : history_match_better(match_b, match_a) ? 1 : 0;
+}
+
+// Whether haystack contains needle, ignoring ASCII case; needle is lowercase
+static gboolean history_text_contains(const gchar *haystack, const gchar *needle, gsize needle_length) {
+    for (const gchar *p = haystack; *p; p++) {
+        if (g_ascii_tolower(*p) == needle[0] && g_ascii_strncasecmp(p, needle, needle_length) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Entries whose URL or title contains text, ignoring case (all entries
+// when text is empty), best frecency first. Frecency is worked out once
+// per entry rather than in every comparison. The returned array does not
+// own the entries.
+static GPtrArray *history_query(History *history, const gchar *text, guint limit) {
+    gchar *needle = text && *text ? g_ascii_strdown(text, -1) : NULL;
+    gsize needle_length = needle ? strlen(needle) : 0;
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    GArray *matches = g_array_new(FALSE, FALSE, sizeof(HistoryMatch));
+    GHashTableIter iter;
+    gpointer value;
+    
+    g_hash_table_iter_init(&iter, history->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        HistoryEntry *entry = (HistoryEntry *)value;
+        if (needle && !history_text_contains(entry->url, needle, needle_length) &&
+            !history_text_contains(entry->title, needle, needle_length)) continue;
+        
+        HistoryMatch match = { entry, history_entry_frecency(entry, now) };
+        g_array_append_val(matches, match);
+    }
+    
+    g_array_sort(matches, compare_history_matches);
+    if (limit > 0 && matches->len > limit) {
+        g_array_set_size(matches, limit);
+    }
+    
+    GPtrArray *results = g_ptr_array_sized_new(matches->len);
+    for (guint i = 0; i < matches->len; i++) {
+        g_ptr_array_add(results, g_array_index(matches, HistoryMatch, i).entry);
+    }
+    
+    g_array_free(matches, TRUE);
+    g_free(needle);
+    return results;
+}
+
+// Feed every history entry into the address bar index
+static void history_fill_completion_index(History *history, CompletionIndex *index) {
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    GHashTableIter iter;
+    gpointer value;
+    
+    g_hash_table_iter_init(&iter, history->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        HistoryEntry *entry = (HistoryEntry *)value;
+        completion_index_set_frecency(index, entry->title, entry->url,
+                                      history_entry_frecency(entry, now), FALSE);
+    }
+    completion_index_sort(index);
+}
+
+// Full-text index of visited pages, enabled with --index-pages or with
+// index=true in the [pages] group of tinyweb.conf. When a page finishes
+// loading, its text is read with a script and handed to a worker thread
+// that splits it into lowercase words and adds them to an in-memory buffer.
+// Full buffers are written to the pages directory as immutable segments: a
+// term dictionary sorted for binary search, with a table of entry offsets,
+// followed by postings lists of (document gap, word count) varints. Newer
+// segments are merged into older ones of similar size, so a page is
+// rewritten a logarithmic number of times and few segments are searched.
+// The page list is appended to pages/docs as "D|id|time|length|url|title";
+// indexing a page again replaces its older document. Queries read the
+// memory-mapped segments and rank pages with BM25, all in memory.
+#define PAGE_INDEX_FLUSH_DOCS 1000
+#define PAGE_INDEX_FLUSH_INTERVAL 300     // Seconds; older buffers are written with the next page
+#define PAGE_INDEX_MAX_PENDING 32         // Pages waiting for the worker; more are dropped
+#define PAGE_INDEX_MIN_WORD 2             // Bytes
+#define PAGE_INDEX_MAX_WORD 32
+#define PAGE_INDEX_MAX_QUERY_WORDS 16
+#define PAGE_INDEX_PREFIX_TERMS 32        // Words a trailing partial word expands to, per segment
+#define PAGE_INDEX_TYPING_DELAY_MS 150    // Typing pause before suggestions search pages
+#define PAGE_INDEX_COMPACT_MIN_DEAD 1000
+#define PAGE_INDEX_BM25_K1 1.2
+#define PAGE_INDEX_BM25_B 0.75
+#define PAGE_SEGMENT_MAGIC "TWPAGES1"
+#define PAGE_SEGMENT_HEADER 32
+
+// The visible text of the page, at most 200000 characters of it
+#define PAGE_TEXT_SCRIPT \
+    "(document.body ? document.body.innerText : '').substring(0, 200000)"
+
+typedef struct {
+    const gchar *url;          // In the index's string chunk; NULL for ids without a record
+    const gchar *title;
+    gint64 time;
+    guint32 length;            // Words
+    gboolean deleted;          // Replaced by a newer document of the same URL
+} PageDoc;
+
+typedef struct {
+    guint32 doc;
+    guint32 count;
+} PagePosting;
+
+// A segment file mapped into memory. Header: magic, then little-endian
+// 32-bit term count, page count, first and own sequence number (a merged
+// segment replaces the sequence numbers from first to own) and dictionary
+// size. Dictionary entries: varint word length, word, varint page count,
+// postings offset and postings size.
+typedef struct {
+    GMappedFile *file;
+    gchar *path;
+    const guchar *data;
+    guint32 term_count;
+    guint32 page_count;
+    guint32 first_sequence;
+    guint32 sequence;
+    const guchar *offsets;
+    const guchar *dictionary;
+    const guchar *postings;
+    gsize postings_size;
+} PageSegment;
+
+// Documents not yet written to a segment
+typedef struct {
+    GHashTable *terms;         // Word -> GArray of PagePosting
+    GString *records;          // Their "D|..." lines
+    guint doc_count;
+    gint64 started;
+} PageBuffer;
+
+struct _PageIndex {
+    gchar *dir;
+    GThreadPool *worker;
+    
+    // The worker changes everything below and holds the lock while doing
+    // so; queries on the main thread take it to read
+    GMutex lock;
+    GArray *docs;              // PageDoc by document id
+    GStringChunk *strings;
+    GHashTable *by_url;        // URL -> document id + 1
+    GPtrArray *segments;       // By document id, oldest first
+    PageBuffer *buffer;        // Taking new documents
+    PageBuffer *flushing;      // Being written to a segment, still searched
+    guint live_docs;
+    guint64 total_length;      // Words in live documents
+    guint32 next_sequence;
+    
+    guint64 dropped;           // Main thread only
+};
+
+typedef enum {
+    PAGE_JOB_LOAD,
+    PAGE_JOB_ADD,
+    PAGE_JOB_FLUSH
+} PageJobType;
+
+typedef struct {
+    PageJobType type;
+    gchar *url;
+    gchar *title;
+    gchar *text;
+    gint64 time;
+} PageJob;
+
+// One ranked page; the strings belong to the index
+typedef struct {
+    const gchar *url;
+    const gchar *title;
+    gint64 time;
+    gdouble score;
+} PageHit;
+
+static void varint_append(GByteArray *out, guint64 value) {
+    guint8 bytes[10];
+    guint length = 0;
+    
+    while (value >= 0x80) {
+        bytes[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    bytes[length++] = value;
+    g_byte_array_append(out, bytes, length);
+}
+
+// FALSE at the end of the data or on a value longer than 64 bits
+static gboolean varint_read(const guchar **position, const guchar *end, guint64 *value) {
+    guint64 result = 0;
+    
+    for (guint shift = 0; *position < end && shift < 64; shift += 7) {
+        guchar byte = *(*position)++;
+        result |= (guint64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static guint32 read_le32(const guchar *p) {
+    guint32 value;
+    memcpy(&value, p, sizeof(value));
+    return GUINT32_FROM_LE(value);
+}
+
+static void append_le32(GByteArray *out, guint32 value) {
+    value = GUINT32_TO_LE(value);
+    g_byte_array_append(out, (const guint8 *)&value, sizeof(value));
+}
+
+static void page_index_count_word(GString *word, GHashTable *counts, GPtrArray *words, guint *total) {
+    if (word->len >= PAGE_INDEX_MIN_WORD && word->len <= PAGE_INDEX_MAX_WORD) {
+        gpointer key, count;
+        if (counts && g_hash_table_lookup_extended(counts, word->str, &key, &count)) {
+            // Steal first, or inserting the same key would free it
+            g_hash_table_steal(counts, key);
+            g_hash_table_insert(counts, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+        } else if (counts) {
+            g_hash_table_insert(counts, g_strdup(word->str), GUINT_TO_POINTER(1));
+        }
+        if (words) g_ptr_array_add(words, g_strdup(word->str));
+        (*total)++;
+    }
+    g_string_truncate(word, 0);
+}
+
+// Split UTF-8 text into lowercase words of letters and digits, counting
+// them into counts and/or listing them in words. Returns the number of
+// words kept; words shorter or longer than the limits are skipped.
+static guint page_index_split(const gchar *text, GHashTable *counts, GPtrArray *words) {
+    GString *word = g_string_new(NULL);
+    guint total = 0;
+    
+    for (const gchar *p = text; *p; p = g_utf8_next_char(p)) {
+        gunichar c = g_utf8_get_char(p);
+        if (c < 0x80 && g_ascii_isalnum(c)) {
+            g_string_append_c(word, g_ascii_tolower(c));
+        } else if (c >= 0x80 && g_unichar_isalnum(c)) {
+            g_string_append_unichar(word, g_unichar_tolower(c));
+        } else if (word->len) {
+            page_index_count_word(word, counts, words, &total);
+        }
+    }
+    if (word->len) page_index_count_word(word, counts, words, &total);
+    
+    g_string_free(word, TRUE);
+    return total;
+}
+
+static PageBuffer *page_buffer_new(void) {
+    PageBuffer *buffer = g_new0(PageBuffer, 1);
+    buffer->terms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+    buffer->records = g_string_new(NULL);
+    return buffer;
+}
+
+static void page_buffer_free(PageBuffer *buffer) {
+    g_hash_table_destroy(buffer->terms);
+    g_string_free(buffer->records, TRUE);
+    g_free(buffer);
+}
+
+static void page_segment_free(PageSegment *segment) {
+    g_mapped_file_unref(segment->file);
+    g_free(segment->path);
+    g_free(segment);
+}
+
+static PageSegment *page_segment_open(const gchar *path) {
+    GError *error = NULL;
+    GMappedFile *file = g_mapped_file_new(path, FALSE, &error);
+    if (!file) {
+        g_warning("Failed to open page index segment: %s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    
+    const guchar *data = (const guchar *)g_mapped_file_get_contents(file);
+    gsize size = g_mapped_file_get_length(file);
+    if (size < PAGE_SEGMENT_HEADER || memcmp(data, PAGE_SEGMENT_MAGIC, 8) != 0) {
+        g_warning("Ignoring page index segment %s: not a segment", path);
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+    
+    guint32 term_count = read_le32(data + 8);
+    guint32 dictionary_size = read_le32(data + 24);
+    guint64 postings_start = PAGE_SEGMENT_HEADER + 4 * (guint64)term_count + dictionary_size;
+    if (postings_start > size) {
+        g_warning("Ignoring page index segment %s: truncated", path);
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+    
+    PageSegment *segment = g_new0(PageSegment, 1);
+    segment->file = file;
+    segment->path = g_strdup(path);
+    segment->data = data;
+    segment->term_count = term_count;
+    segment->page_count = read_le32(data + 12);
+    segment->first_sequence = read_le32(data + 16);
+    segment->sequence = read_le32(data + 20);
+    segment->offsets = data + PAGE_SEGMENT_HEADER;
+    segment->dictionary = segment->offsets + 4 * (gsize)term_count;
+    segment->postings = data + postings_start;
+    segment->postings_size = size - postings_start;
+    return segment;
+}
+
+typedef struct {
+    const guchar *word;
+    guint64 length;
+    guint64 docs;
+    const guchar *postings;
+    const guchar *postings_end;
+} PageTerm;
+
+// Dictionary entry i; FALSE if it is corrupt
+static gboolean page_segment_term(const PageSegment *segment, guint32 i, PageTerm *term) {
+    const guchar *p = segment->data + read_le32(segment->offsets + 4 * (gsize)i);
+    const guchar *end = segment->postings;
+    guint64 offset, size;
+    
+    if (p < segment->dictionary || p >= end) return FALSE;
+    if (!varint_read(&p, end, &term->length) || term->length > (guint64)(end - p)) return FALSE;
+    term->word = p;
+    p += term->length;
+    if (!varint_read(&p, end, &term->docs) || !varint_read(&p, end, &offset) ||
+        !varint_read(&p, end, &size)) return FALSE;
+    if (offset > segment->postings_size || size > segment->postings_size - offset) return FALSE;
+    
+    term->postings = segment->postings + offset;
+    term->postings_end = term->postings + size;
+    return TRUE;
+}
+
+static gint page_term_compare(const guchar *word, gsize length, const gchar *key, gsize key_length) {
+    gint order = memcmp(word, key, MIN(length, key_length));
+    if (order != 0) return order;
+    return length < key_length ? -1 : length > key_length;
+}
+
+// Index of the first dictionary word not before key
+static guint32 page_segment_lower_bound(const PageSegment *segment, const gchar *key, gsize key_length) {
+    guint32 low = 0, high = segment->term_count;
+    
+    while (low < high) {
+        guint32 mid = low + (high - low) / 2;
+        PageTerm term;
+        if (page_segment_term(segment, mid, &term) &&
+            page_term_compare(term.word, term.length, key, key_length) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Builds a segment from words added in sorted order
+typedef struct {
+    GByteArray *dictionary;
+    GArray *offsets;
+    GByteArray *postings;
+} PageSegmentWriter;
+
+static void page_segment_writer_init(PageSegmentWriter *writer) {
+    writer->dictionary = g_byte_array_new();
+    writer->offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+    writer->postings = g_byte_array_new();
+}
+
+static void page_postings_append(GByteArray *list, guint32 *last_doc, guint32 doc, guint32 count) {
+    varint_append(list, doc - *last_doc);
+    varint_append(list, count);
+    *last_doc = doc;
+}
+
+static void page_segment_writer_add(PageSegmentWriter *writer, const guchar *word, gsize length,
+                                    guint64 docs, GByteArray *list) {
+    guint32 offset = writer->dictionary->len;
+    g_array_append_val(writer->offsets, offset);
+    varint_append(writer->dictionary, length);
+    g_byte_array_append(writer->dictionary, word, length);
+    varint_append(writer->dictionary, docs);
+    varint_append(writer->dictionary, writer->postings->len);
+    varint_append(writer->dictionary, list->len);
+    g_byte_array_append(writer->postings, list->data, list->len);
+}
+
+static GBytes *page_segment_writer_finish(PageSegmentWriter *writer, guint32 page_count,
+                                          guint32 first_sequence, guint32 sequence) {
+    guint32 term_count = writer->offsets->len;
+    gsize dictionary_start = PAGE_SEGMENT_HEADER + 4 * (gsize)term_count;
+    GByteArray *out = g_byte_array_sized_new(dictionary_start + writer->dictionary->len + writer->postings->len);
+    
+    g_byte_array_append(out, (const guint8 *)PAGE_SEGMENT_MAGIC, 8);
+    append_le32(out, term_count);
+    append_le32(out, page_count);
+    append_le32(out, first_sequence);
+    append_le32(out, sequence);
+    append_le32(out, writer->dictionary->len);
+    append_le32(out, 0);
+    for (guint32 i = 0; i < term_count; i++) {
+        append_le32(out, dictionary_start + g_array_index(writer->offsets, guint32, i));
+    }
+    g_byte_array_append(out, writer->dictionary->data, writer->dictionary->len);
+    g_byte_array_append(out, writer->postings->data, writer->postings->len);
+    
+    g_byte_array_free(writer->dictionary, TRUE);
+    g_array_free(writer->offsets, TRUE);
+    g_byte_array_free(writer->postings, TRUE);
+    return g_byte_array_free_to_bytes(out);
+}
+
+// Write a segment atomically and map it
+static PageSegment *page_segment_save(PageIndex *index, GBytes *bytes, guint32 sequence) {
+    gchar *name = g_strdup_printf("%08u.seg", sequence);
+    gchar *path = g_build_filename(index->dir, name, NULL);
+    GError *error = NULL;
+    PageSegment *segment = NULL;
+    gsize size;
+    const gchar *data = g_bytes_get_data(bytes, &size);
+    
+    if (g_file_set_contents(path, data, size, &error)) {
+        segment = page_segment_open(path);
+    } else {
+        g_warning("Failed to write page index segment: %s", error->message);
+        g_error_free(error);
+    }
+    
+    g_bytes_unref(bytes);
+    g_free(path);
+    g_free(name);
+    return segment;
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+static gboolean page_doc_live(PageIndex *index, guint64 doc) {
+    if (doc >= index->docs->len) return FALSE;
+    PageDoc *page = &g_array_index(index->docs, PageDoc, doc);
+    return page->url && !page->deleted;
+}
+
+// Merge the newest segments while the one before them holds no more pages
+// than they do together, like carries in a binary counter. Runs on the
+// worker, which is the only thread changing segments and documents, so it
+// reads them without the lock.
+static void page_index_merge(PageIndex *index) {
+    GPtrArray *segments = index->segments;
+    if (segments->len < 2) return;
+    
+    guint first = segments->len - 1;
+    guint64 pages = ((PageSegment *)g_ptr_array_index(segments, first))->page_count;
+    while (first > 0 && ((PageSegment *)g_ptr_array_index(segments, first - 1))->page_count <= pages) {
+        first--;
+        pages += ((PageSegment *)g_ptr_array_index(segments, first))->page_count;
+    }
+    if (segments->len - first < 2) return;
+    
+    guint inputs = segments->len - first;
+    guint32 *cursors = g_new0(guint32, inputs);
+    PageTerm *terms = g_new0(PageTerm, inputs);
+    gboolean *valid = g_new0(gboolean, inputs);
+    GByteArray *list = g_byte_array_new();
+    PageSegmentWriter writer;
+    page_segment_writer_init(&writer);
+    
+    for (guint s = 0; s < inputs; s++) {
+        PageSegment *segment = g_ptr_array_index(segments, first + s);
+        valid[s] = segment->term_count > 0 && page_segment_term(segment, 0, &terms[s]);
+    }
+    
+    // k-way merge of the dictionaries. Older segments hold lower document
+    // ids, so appending their postings in segment order keeps lists sorted.
+    while (TRUE) {
+        gint smallest = -1;
+        for (guint s = 0; s < inputs; s++) {
+            if (valid[s] && (smallest < 0 || page_term_compare(terms[s].word, terms[s].length,
+                                                               (const gchar *)terms[smallest].word,
+                                                               terms[smallest].length) < 0)) {
+                smallest = s;
+            }
+        }
+        if (smallest < 0) break;
+        
+        const guchar *word = terms[smallest].word;
+        gsize length = terms[smallest].length;
+        guint32 last_doc = 0;
+        guint64 docs = 0;
+        g_byte_array_set_size(list, 0);
+        
+        for (guint s = 0; s < inputs; s++) {
+            if (!valid[s] || page_term_compare(terms[s].word, terms[s].length, (const gchar *)word, length) != 0) {
+                continue;
+            }
+            
+            // Postings of replaced pages are dropped here
+            const guchar *p = terms[s].postings;
+            guint64 doc = 0, gap, count;
+            for (guint64 i = 0; i < terms[s].docs; i++) {
+                if (!varint_read(&p, terms[s].postings_end, &gap) ||
+                    !varint_read(&p, terms[s].postings_end, &count)) break;
+                doc += gap;
+                if (page_doc_live(index, doc) && (docs == 0 || doc > last_doc)) {
+                    page_postings_append(list, &last_doc, doc, count);
+                    docs++;
+                }
+            }
+            
+            PageSegment *segment = g_ptr_array_index(segments, first + s);
+            cursors[s]++;
+            valid[s] = cursors[s] < segment->term_count && page_segment_term(segment, cursors[s], &terms[s]);
+        }
+        
+        // The word still points into a mapped input, which stays until the end
+        if (docs > 0) {
+            page_segment_writer_add(&writer, word, length, docs, list);
+        }
+    }
+    
+    PageSegment *oldest = g_ptr_array_index(segments, first);
+    guint32 sequence = index->next_sequence++;
+    PageSegment *merged = page_segment_save(index, page_segment_writer_finish(&writer, pages, oldest->first_sequence,
+                                                                              sequence), sequence);
+    
+    if (merged) {
+        GPtrArray *replaced = g_ptr_array_new_with_free_func((GDestroyNotify)page_segment_free);
+        g_mutex_lock(&index->lock);
+        for (guint s = 0; s < inputs; s++) {
+            g_ptr_array_add(replaced, g_ptr_array_index(segments, first + s));
+        }
+        g_ptr_array_remove_range(segments, first, inputs);
+        g_ptr_array_add(segments, merged);
+        g_mutex_unlock(&index->lock);
+        
+        for (guint s = 0; s < replaced->len; s++) {
+            unlink(((PageSegment *)g_ptr_array_index(replaced, s))->path);
+        }
+        g_ptr_array_free(replaced, TRUE);
+    }
+    
+    g_byte_array_free(list, TRUE);
+    g_free(valid);
+    g_free(terms);
+    g_free(cursors);
+}
+
+// Append page records to the docs file
+static gboolean page_index_append_docs(PageIndex *index, GString *records) {
+    gchar *docs_path = g_build_filename(index->dir, "docs", NULL);
+    int fd = open(docs_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    gboolean written = fd >= 0 && write_all(fd, records->str, records->len);
+    
+    if (!written) {
+        g_warning("Failed to write page index %s: %s", docs_path, g_strerror(errno));
+    }
+    if (fd >= 0) close(fd);
+    g_free(docs_path);
+    return written;
+}
+
+// Write the buffer as a new segment, then its page records. A record
+// without its segment would hide the older copy of that page, and a
+// segment whose records are missing would lend its postings to the pages
+// that reuse those ids after a restart, so neither is kept alone.
+static void page_index_flush(PageIndex *index) {
+    g_mutex_lock(&index->lock);
+    if (index->buffer->doc_count == 0) {
+        g_mutex_unlock(&index->lock);
+        return;
+    }
+    PageBuffer *buffer = index->flushing = index->buffer;
+    index->buffer = page_buffer_new();
+    guint32 sequence = index->next_sequence++;
+    g_mutex_unlock(&index->lock);
+    
+    GPtrArray *words = g_ptr_array_sized_new(g_hash_table_size(buffer->terms));
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, buffer->terms);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_ptr_array_add(words, key);
+    }
+    g_ptr_array_sort(words, compare_strings);
+    
+    PageSegmentWriter writer;
+    GByteArray *list = g_byte_array_new();
+    page_segment_writer_init(&writer);
+    for (guint i = 0; i < words->len; i++) {
+        const gchar *word = g_ptr_array_index(words, i);
+        GArray *postings = g_hash_table_lookup(buffer->terms, word);
+        guint32 last_doc = 0;
+        
+        g_byte_array_set_size(list, 0);
+        for (guint j = 0; j < postings->len; j++) {
+            PagePosting *posting = &g_array_index(postings, PagePosting, j);
+            page_postings_append(list, &last_doc, posting->doc, posting->count);
+        }
+        page_segment_writer_add(&writer, (const guchar *)word, strlen(word), postings->len, list);
+    }
+    PageSegment *segment = page_segment_save(index, page_segment_writer_finish(&writer, buffer->doc_count,
+                                                                               sequence, sequence), sequence);
+    if (segment && !page_index_append_docs(index, buffer->records)) {
+        unlink(segment->path);
+        page_segment_free(segment);
+        segment = NULL;
+    }
+    
+    g_mutex_lock(&index->lock);
+    if (segment) g_ptr_array_add(index->segments, segment);
+    index->flushing = NULL;
+    g_mutex_unlock(&index->lock);
+    
+    g_byte_array_free(list, TRUE);
+    g_ptr_array_free(words, TRUE);
+    page_buffer_free(buffer);
+    page_index_merge(index);
+}
+
+// Index one page; url and title are already normalized and sanitized
+static void page_index_add_document(PageIndex *index, const gchar *url, const gchar *title,
+                                    const gchar *text, gint64 time) {
+    GHashTable *counts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    guint length = page_index_split(text, counts, NULL);
+    if (length == 0) {
+        g_hash_table_destroy(counts);
+        return;
+    }
+    
+    g_mutex_lock(&index->lock);
+    guint32 id = index->docs->len;
+    PageDoc doc = { g_string_chunk_insert_const(index->strings, url),
+                    g_string_chunk_insert(index->strings, title), time, length, FALSE };
+    
+    gpointer previous = g_hash_table_lookup(index->by_url, doc.url);
+    if (previous) {
+        PageDoc *old = &g_array_index(index->docs, PageDoc, GPOINTER_TO_UINT(previous) - 1);
+        old->deleted = TRUE;
+        index->live_docs--;
+        index->total_length -= old->length;
+    }
+    g_array_append_val(index->docs, doc);
+    g_hash_table_insert(index->by_url, (gpointer)doc.url, GUINT_TO_POINTER(id + 1));
+    index->live_docs++;
+    index->total_length += length;
+    
+    PageBuffer *buffer = index->buffer;
+    GHashTableIter iter;
+    gpointer word, count;
+    g_hash_table_iter_init(&iter, counts);
+    while (g_hash_table_iter_next(&iter, &word, &count)) {
+        GArray *postings = g_hash_table_lookup(buffer->terms, word);
+        if (!postings) {
+            postings = g_array_new(FALSE, FALSE, sizeof(PagePosting));
+            g_hash_table_insert(buffer->terms, g_strdup(word), postings);
+        }
+        PagePosting posting = { id, GPOINTER_TO_UINT(count) };
+        g_array_append_val(postings, posting);
+    }
+    g_string_append_printf(buffer->records, "D|%u|%" G_GINT64_FORMAT "|%u|%s|%s\n", id, time, length, url, title);
+    if (buffer->doc_count++ == 0) {
+        buffer->started = g_get_monotonic_time();
+    }
+    gboolean full = buffer->doc_count >= PAGE_INDEX_FLUSH_DOCS ||
+                    g_get_monotonic_time() - buffer->started > PAGE_INDEX_FLUSH_INTERVAL * G_USEC_PER_SEC;
+    g_mutex_unlock(&index->lock);
+    
+    g_hash_table_destroy(counts);
+    if (full) page_index_flush(index);
+}
+
+static gint compare_segments(gconstpointer a, gconstpointer b) {
+    const PageSegment *segment_a = *(PageSegment * const *)a;
+    const PageSegment *segment_b = *(PageSegment * const *)b;
+    return segment_a->sequence < segment_b->sequence ? 1 : segment_a->sequence > segment_b->sequence ? -1 : 0;
+}
+
+// Read segments and the page list; runs as the worker's first job. Segments
+// left behind by an interrupted merge are deleted, and the page list is
+// rewritten without replaced pages once they outnumber the live ones.
+static void page_index_load(PageIndex *index) {
+    GPtrArray *found = g_ptr_array_new();
+    GPtrArray *segments = g_ptr_array_new();
+    GDir *dir = g_dir_open(index->dir, 0, NULL);
+    const gchar *name;
+    
+    while (dir && (name = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(name, ".seg")) continue;
+        gchar *path = g_build_filename(index->dir, name, NULL);
+        PageSegment *segment = page_segment_open(path);
+        if (segment) g_ptr_array_add(found, segment);
+        g_free(path);
+    }
+    if (dir) g_dir_close(dir);
+    
+    // Newest first: a segment is stale if a newer merge covers it
+    guint32 next_sequence = 0;
+    g_ptr_array_sort(found, compare_segments);
+    for (guint i = 0; i < found->len; i++) {
+        PageSegment *segment = g_ptr_array_index(found, i);
+        gboolean covered = FALSE;
+        for (guint j = 0; j < segments->len && !covered; j++) {
+            PageSegment *kept = g_ptr_array_index(segments, j);
+            covered = segment->sequence >= kept->first_sequence && segment->sequence <= kept->sequence;
+        }
+        next_sequence = MAX(next_sequence, segment->sequence + 1);
+        if (covered) {
+            unlink(segment->path);
+            page_segment_free(segment);
+        } else {
+            g_ptr_array_insert(segments, 0, segment);
+        }
+    }
+    g_ptr_array_free(found, TRUE);
+    
+    // Replay the page list
+    GArray *docs = g_array_new(FALSE, TRUE, sizeof(PageDoc));
+    GStringChunk *strings = g_string_chunk_new(64 * 1024);
+    GHashTable *by_url = g_hash_table_new(g_str_hash, g_str_equal);
+    guint records = 0, live_docs = 0;
+    guint64 total_length = 0;
+    gboolean torn = FALSE;
+    gchar *docs_path = g_build_filename(index->dir, "docs", NULL);
+    GMappedFile *mapped = g_mapped_file_new(docs_path, FALSE, NULL);
+    
+    if (mapped) {
+        const gchar *p = g_mapped_file_get_contents(mapped);
+        const gchar *end = p + g_mapped_file_get_length(mapped);
+        const gchar *fields[6];
+        gsize lengths[6];
+        
+        while (p && p < end) {
+            const gchar *eol = memchr(p, '\n', end - p);
+            if (!eol) {
+                torn = TRUE;
+                break;
+            }
+            if (split_record(p, eol, fields, lengths, 6) == 6 && p[0] == 'D' && lengths[4] > 0) {
+                guint64 id = g_ascii_strtoull(fields[1], NULL, 10);
+                if (id < G_MAXUINT32) {
+                    if (id >= docs->len) g_array_set_size(docs, id + 1);
+                    PageDoc *doc = &g_array_index(docs, PageDoc, id);
+                    gchar *url = g_strndup(fields[4], lengths[4]);
+                    gchar *title = g_strndup(fields[5], lengths[5]);
+                    doc->url = g_string_chunk_insert_const(strings, url);
+                    doc->title = g_string_chunk_insert(strings, title);
+                    doc->time = g_ascii_strtoll(fields[2], NULL, 10);
+                    doc->length = (guint32)g_ascii_strtoull(fields[3], NULL, 10);
+                    g_free(title);
+                    g_free(url);
+                    records++;
+                }
+            }
+            p = eol + 1;
+        }
+        g_mapped_file_unref(mapped);
+    }
+    
+    for (guint id = 0; id < docs->len; id++) {
+        PageDoc *doc = &g_array_index(docs, PageDoc, id);
+        if (!doc->url) continue;
+        
+        gpointer previous = g_hash_table_lookup(by_url, doc->url);
+        if (previous) {
+            PageDoc *old = &g_array_index(docs, PageDoc, GPOINTER_TO_UINT(previous) - 1);
+            old->deleted = TRUE;
+            live_docs--;
+            total_length -= old->length;
+        }
+        g_hash_table_insert(by_url, (gpointer)doc->url, GUINT_TO_POINTER(id + 1));
+        live_docs++;
+        total_length += doc->length;
+    }
+    
+    if (torn || (records - live_docs >= PAGE_INDEX_COMPACT_MIN_DEAD && records - live_docs > live_docs)) {
+        GString *contents = g_string_new(NULL);
+        for (guint id = 0; id < docs->len; id++) {
+            PageDoc *doc = &g_array_index(docs, PageDoc, id);
+            if (!doc->url || doc->deleted) continue;
+            g_string_append_printf(contents, "D|%u|%" G_GINT64_FORMAT "|%u|%s|%s\n",
+                                   id, doc->time, doc->length, doc->url, doc->title);
+        }
+        GError *error = NULL;
+        if (!g_file_set_contents(docs_path, contents->str, contents->len, &error)) {
+            g_warning("Failed to compact page index: %s", error->message);
+            g_error_free(error);
+        }
+        g_string_free(contents, TRUE);
+    }
+    g_free(docs_path);
+    
+    g_mutex_lock(&index->lock);
+    g_ptr_array_free(index->segments, TRUE);
+    g_array_free(index->docs, TRUE);
+    g_string_chunk_free(index->strings);
+    g_hash_table_destroy(index->by_url);
+    index->segments = segments;
+    index->docs = docs;
+    index->strings = strings;
+    index->by_url = by_url;
+    index->live_docs = live_docs;
+    index->total_length = total_length;
+    index->next_sequence = next_sequence;
+    g_mutex_unlock(&index->lock);
+}
+
+static void page_job_free(PageJob *job) {
+    g_free(job->url);
+    g_free(job->title);
+    g_free(job->text);
+    g_free(job);
+}
+
+static void page_index_job(gpointer data, gpointer user_data) {
+    PageJob *job = (PageJob *)data;
+    PageIndex *index = (PageIndex *)user_data;
+    
+    switch (job->type) {
+    case PAGE_JOB_LOAD:
+        page_index_load(index);
+        break;
+    case PAGE_JOB_ADD:
+        page_index_add_document(index, job->url, job->title, job->text, job->time);
+        break;
+    case PAGE_JOB_FLUSH:
+        page_index_flush(index);
+        break;
+    }
+    page_job_free(job);
+}
+
+static void page_index_push(PageIndex *index, PageJobType type) {
+    PageJob *job = g_new0(PageJob, 1);
+    job->type = type;
+    g_thread_pool_push(index->worker, job, NULL);
+}
+
+static PageIndex *page_index_new(const gchar *dir) {
+    PageIndex *index = g_new0(PageIndex, 1);
+    
+    index->dir = g_strdup(dir);
+    g_mutex_init(&index->lock);
+    index->docs = g_array_new(FALSE, TRUE, sizeof(PageDoc));
+    index->strings = g_string_chunk_new(64 * 1024);
+    index->by_url = g_hash_table_new(g_str_hash, g_str_equal);
+    index->segments = g_ptr_array_new();
+    index->buffer = page_buffer_new();
+    return index;
+}
+
+// Only for --bench-index; the browser keeps its index until exit
+static void page_index_free(PageIndex *index) {
+    g_ptr_array_set_free_func(index->segments, (GDestroyNotify)page_segment_free);
+    g_ptr_array_free(index->segments, TRUE);
+    g_array_free(index->docs, TRUE);
+    g_string_chunk_free(index->strings);
+    g_hash_table_destroy(index->by_url);
+    page_buffer_free(index->buffer);
+    g_mutex_clear(&index->lock);
+    g_free(index->dir);
+    g_free(index);
+}
+
+// Open the index in the config directory; it is read on the worker
+static PageIndex *page_index_open(void) {
+    gchar *dir = get_config_path("pages");
+    if (!dir || g_mkdir_with_parents(dir, 0700) != 0) {
+        g_warning("Failed to create page index directory; pages will not be indexed");
+        g_free(dir);
+        return NULL;
+    }
+    
+    PageIndex *index = page_index_new(dir);
+    index->worker = g_thread_pool_new(page_index_job, index, 1, FALSE, NULL);
+    page_index_push(index, PAGE_JOB_LOAD);
+    g_free(dir);
+    return index;
+}
+
+// Write buffered pages and return the worker for the caller to wait on,
+// like history_close()
+static GThreadPool *page_index_close(PageIndex *index) {
+    GThreadPool *worker = index->worker;
+    
+    page_index_push(index, PAGE_JOB_FLUSH);
+    index->worker = NULL;
+    return worker;
+}
+
+// Queue a page for indexing; takes the text. Pages are dropped rather than
+// queued without limit when the worker falls behind.
+static void page_index_add(PageIndex *index, const gchar *url, const gchar *title, gchar *text) {
+    if (!index->worker || g_thread_pool_unprocessed(index->worker) >= PAGE_INDEX_MAX_PENDING) {
+        index->dropped++;
+        g_free(text);
+        return;
+    }
+    
+    gchar *normalized = url_normalize(url);
+    PageJob *job = g_new0(PageJob, 1);
+    job->type = PAGE_JOB_ADD;
+    job->url = sanitize_string(normalized ? normalized : url);
+    job->title = sanitize_string(title);
+    job->text = text;
+    job->time = g_get_real_time() / G_USEC_PER_SEC;
+    g_thread_pool_push(index->worker, job, NULL);
+    g_free(normalized);
+}
+
+// Per-page accumulator of a query
+typedef struct {
+    guint32 doc;
+    gfloat score;
+    guint8 matched;            // Query words found in the page
+    guint8 word;               // Last query word counted, plus one
+} PageScore;
+
+// Only pages that contain a query word get an accumulator, so a query
+// costs the postings it reads rather than every page ever indexed
+typedef struct {
+    PageIndex *index;
+    GArray *scores;            // PageScore of each page found
+    GHashTable *slots;         // Page id plus one to its index in scores plus one
+    guint8 word;
+    gdouble idf;
+    gdouble average_length;
+} PageQuery;
+
+static void page_query_score(PageQuery *query, guint64 doc, guint64 count) {
+    if (!page_doc_live(query->index, doc)) return;
+    
+    PageDoc *page = &g_array_index(query->index->docs, PageDoc, doc);
+    gpointer slot = g_hash_table_lookup(query->slots, GUINT_TO_POINTER(doc + 1));
+    if (!slot) {
+        PageScore empty = { doc, 0, 0, 0 };
+        g_array_append_val(query->scores, empty);
+        slot = GUINT_TO_POINTER(query->scores->len);
+        g_hash_table_insert(query->slots, GUINT_TO_POINTER(doc + 1), slot);
+    }
+    
+    PageScore *score = &g_array_index(query->scores, PageScore, GPOINTER_TO_UINT(slot) - 1);
+    gdouble norm = 1 - PAGE_INDEX_BM25_B + PAGE_INDEX_BM25_B * page->length / query->average_length;
+    
+    if (score->word != query->word) {
+        score->word = query->word;
+        score->matched++;
+    }
+    score->score += query->idf * count * (PAGE_INDEX_BM25_K1 + 1) / (count + PAGE_INDEX_BM25_K1 * norm);
+}
+
+static void page_query_add_term(PageQuery *query, const PageTerm *term) {
+    const guchar *p = term->postings;
+    guint64 doc = 0, gap, count;
+    
+    for (guint64 i = 0; i < term->docs; i++) {
+        if (!varint_read(&p, term->postings_end, &gap) || !varint_read(&p, term->postings_end, &count)) break;
+        doc += gap;
+        page_query_score(query, doc, count);
+    }
+}
+
+// Postings of a word in every segment and buffer, or of the words it
+// starts when prefix is set
+static void page_query_collect(PageIndex *index, const gchar *word, gboolean prefix,
+                               GArray *terms, GPtrArray *lists) {
+    gsize length = strlen(word);
+    
+    for (guint s = 0; s < index->segments->len; s++) {
+        PageSegment *segment = g_ptr_array_index(index->segments, s);
+        PageTerm term;
+        for (guint32 i = page_segment_lower_bound(segment, word, length), n = 0;
+             i < segment->term_count && n < (prefix ? PAGE_INDEX_PREFIX_TERMS : 1); i++, n++) {
+            if (!page_segment_term(segment, i, &term) || term.length < length ||
+                memcmp(term.word, word, length) != 0 || (!prefix && term.length != length)) break;
+            g_array_append_val(terms, term);
+        }
+    }
+    
+    PageBuffer *buffers[] = { index->flushing, index->buffer };
+    for (guint b = 0; b < G_N_ELEMENTS(buffers); b++) {
+        if (!buffers[b]) continue;
+        if (!prefix) {
+            GArray *postings = g_hash_table_lookup(buffers[b]->terms, word);
+            if (postings) g_ptr_array_add(lists, postings);
+            continue;
+        }
+        
+        GHashTableIter iter;
+        gpointer key, value;
+        g_hash_table_iter_init(&iter, buffers[b]->terms);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            if (g_str_has_prefix(key, word)) g_ptr_array_add(lists, value);
+        }
+    }
+}
+
+static gboolean page_score_better(const PageScore *a, const PageScore *b) {
+    return a->matched != b->matched ? a->matched > b->matched : a->score > b->score;
+}
+
+// Pages matching the words of text, those with the most words first and
+// then by BM25 score. With prefix set the last word also matches longer
+// words, for results while typing. Without wait, returns NULL instead of
+// waiting for the worker to let go of the index. Free the array with
+// g_ptr_array_free().
+static GPtrArray *page_index_search(PageIndex *index, const gchar *text, gboolean prefix, guint limit,
+                                    gboolean wait) {
+    GPtrArray *hits = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *words = g_ptr_array_new_with_free_func(g_free);
+    
+    page_index_split(text ? text : "", NULL, words);
+    if (words->len > PAGE_INDEX_MAX_QUERY_WORDS) g_ptr_array_set_size(words, PAGE_INDEX_MAX_QUERY_WORDS);
+    
+    // A partial word is still being typed unless the text ends in a separator
+    gsize text_length = text ? strlen(text) : 0;
+    prefix = prefix && text_length > 0 && g_ascii_isalnum(text[text_length - 1]);
+    
+    if (!wait && !g_mutex_trylock(&index->lock)) {
+        g_ptr_array_free(hits, TRUE);
+        g_ptr_array_free(words, TRUE);
+        return NULL;
+    }
+    if (wait) g_mutex_lock(&index->lock);
+    if (words->len == 0 || index->live_docs == 0 || limit == 0) {
+        g_mutex_unlock(&index->lock);
+        g_ptr_array_free(words, TRUE);
+        return hits;
+    }
+    
+    PageQuery query = { index, g_array_new(FALSE, FALSE, sizeof(PageScore)), g_hash_table_new(NULL, NULL),
+                        0, 0, (gdouble)index->total_length / index->live_docs };
+    GArray *terms = g_array_new(FALSE, FALSE, sizeof(PageTerm));
+    GPtrArray *lists = g_ptr_array_new();
+    
+    for (guint w = 0; w < words->len; w++) {
+        const gchar *word = g_ptr_array_index(words, w);
+        gboolean repeated = FALSE;
+        for (guint i = 0; i < w && !repeated; i++) {
+            repeated = strcmp(word, g_ptr_array_index(words, i)) == 0;
+        }
+        if (repeated) continue;
+        
+        g_array_set_size(terms, 0);
+        g_ptr_array_set_size(lists, 0);
+        page_query_collect(index, word, prefix && w + 1 == words->len, terms, lists);
+        
+        // Pages with the word, counting replaced ones; that only lowers the weight a little
+        guint64 docs = 0;
+        for (guint i = 0; i < terms->len; i++) docs += g_array_index(terms, PageTerm, i).docs;
+        for (guint i = 0; i < lists->len; i++) docs += ((GArray *)g_ptr_array_index(lists, i))->len;
+        docs = MIN(docs, index->live_docs);
+        
+        query.word = w + 1;
+        query.idf = log(1 + (index->live_docs - docs + 0.5) / (docs + 0.5));
+        for (guint i = 0; i < terms->len; i++) {
+            page_query_add_term(&query, &g_array_index(terms, PageTerm, i));
+        }
+        for (guint i = 0; i < lists->len; i++) {
+            GArray *postings = g_ptr_array_index(lists, i);
+            for (guint j = 0; j < postings->len; j++) {
+                PagePosting *posting = &g_array_index(postings, PagePosting, j);
+                page_query_score(&query, posting->doc, posting->count);
+            }
+        }
+    }
+    
+    // Keep the best limit pages in order with an insertion sort
+    PageScore **best = g_new(PageScore *, limit);
+    guint count = 0;
+    for (guint i = 0; i < query.scores->len; i++) {
+        PageScore *score = &g_array_index(query.scores, PageScore, i);
+        if (count == limit && !page_score_better(score, best[count - 1])) continue;
+        
+        guint k = count < limit ? count++ : limit - 1;
+        while (k > 0 && page_score_better(score, best[k - 1])) {
+            best[k] = best[k - 1];
+            k--;
+        }
+        best[k] = score;
+    }
+    for (guint i = 0; i < count; i++) {
+        PageDoc *doc = &g_array_index(index->docs, PageDoc, best[i]->doc);
+        PageHit *hit = g_new(PageHit, 1);
+        hit->url = doc->url;
+        hit->title = doc->title;
+        hit->time = doc->time;
+        hit->score = best[i]->score;
+        g_ptr_array_add(hits, hit);
+    }
+    g_mutex_unlock(&index->lock);
+    
+    g_free(best);
+    g_ptr_array_free(lists, TRUE);
+    g_array_free(terms, TRUE);
+    g_hash_table_destroy(query.slots);
+    g_array_free(query.scores, TRUE);
+    g_ptr_array_free(words, TRUE);
+    return hits;
+}
+
+static GPtrArray *page_index_query(PageIndex *index, const gchar *text, gboolean prefix, guint limit) {
+    return page_index_search(index, text, prefix, limit, TRUE);
+}
+
+// Pages, segments and their size on disk, for the stats page
+static void page_index_stats(PageIndex *index, guint *pages, guint *segments, guint64 *bytes) {
+    g_mutex_lock(&index->lock);
+    *pages = index->live_docs;
+    *segments = index->segments->len;
+    *bytes = 0;
+    for (guint i = 0; i < index->segments->len; i++) {
+        *bytes += g_mapped_file_get_length(((PageSegment *)g_ptr_array_index(index->segments, i))->file);
+    }
+    g_mutex_unlock(&index->lock);
+}
+
+static gboolean page_index_config_enabled(void) {
+    gchar *path = get_config_path("tinyweb.conf");
+    GKeyFile *key_file = g_key_file_new();
+    gboolean enabled = path && g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL) &&
+                       g_key_file_get_boolean(key_file, "pages", "index", NULL);
+    
+    g_key_file_free(key_file);
+    g_free(path);
+    return enabled;
+}
+
+// Content blocking with WebKit content-blocker rule lists. Every
+// filters/NAME.json in the config directory becomes a filter called NAME.
+// Compiled bytecode is kept in filters/compiled by WebKitUserContentFilterStore
+// with a NAME.stamp file recording the mtime and size of the source it was
+// built from, so startup only loads bytecode and never recompiles unchanged
+// lists. Compilation and loading are asynchronous, and the directory is
+// watched so edited lists are rebuilt in the background.
+#define FILTER_RESCAN_DELAY_MS 1000
+#define FILTER_BLOCKED_ERROR 104       // WebKit's policy error code for a content blocker rule
+
+struct _ContentBlocker {
+    WebKitUserContentManager *manager;
+    WebKitUserContentFilterStore *store;
+    gchar *source_dir;
+    gchar *compiled_dir;
+    GHashTable *applied;    // Filter identifier -> stamp of the applied source
+    GFileMonitor *monitor;
+    guint rescan_source;
+    guint pending;          // Loads and compiles in flight
+    gboolean rescan_wanted; // The directory changed while some were
+    guint64 blocked_total;
+};
+
+typedef struct {
+    ContentBlocker *blocker;
+    gchar *identifier;
+    gchar *source_path;
+    gchar *stamp;
+} FilterJob;
+
+static void filter_job_free(FilterJob *job) {
+    g_free(job->identifier);
+    g_free(job->source_path);
+    g_free(job->stamp);
+    g_free(job);
+}
+
+static gboolean content_blocker_rescan(gpointer data);
+
+// A load or compile finished; rescan if the directory changed meanwhile
+static void filter_job_done(FilterJob *job) {
+    ContentBlocker *blocker = job->blocker;
+    
+    filter_job_free(job);
+    if (--blocker->pending == 0 && blocker->rescan_wanted && !blocker->rescan_source) {
+        blocker->rescan_wanted = FALSE;
+        blocker->rescan_source = g_idle_add(content_blocker_rescan, blocker);
+    }
+}
+
+static gchar *get_filter_stamp_path(ContentBlocker *blocker, const gchar *identifier) {
+    gchar *name = g_strconcat(identifier, ".stamp", NULL);
+    gchar *path = g_build_filename(blocker->compiled_dir, name, NULL);
+    g_free(name);
+    return path;
+}
+
+// Install a compiled filter, replacing an older version of it
+static void content_blocker_apply(FilterJob *job, WebKitUserContentFilter *filter) {
+    ContentBlocker *blocker = job->blocker;
+    
+    webkit_user_content_manager_remove_filter_by_id(blocker->manager, job->identifier);
+    webkit_user_content_manager_add_filter(blocker->manager, filter);
+    webkit_user_content_filter_unref(filter);
+    g_hash_table_insert(blocker->applied, g_strdup(job->identifier), g_strdup(job->stamp));
+}
+
+static void on_filter_compiled(GObject *object, GAsyncResult *result, gpointer data) {
+    FilterJob *job = (FilterJob *)data;
+    GError *error = NULL;
+    WebKitUserContentFilter *filter =
+        webkit_user_content_filter_store_save_finish(WEBKIT_USER_CONTENT_FILTER_STORE(object),
+                                                     result, &error);
+    
+    if (filter) {
+        gchar *stamp_path = get_filter_stamp_path(job->blocker, job->identifier);
+        if (!g_file_set_contents(stamp_path, job->stamp, -1, &error)) {
+            g_warning("Failed to save filter stamp: %s", error->message);
+            g_clear_error(&error);
+        }
+        g_free(stamp_path);
+        content_blocker_apply(job, filter);
+    } else {
+        g_warning("Failed to compile content filter %s: %s", job->source_path, error->message);
+        g_error_free(error);
+    }
+    
+    filter_job_done(job);
+}
+
+static void on_filter_source_loaded(GObject *object, GAsyncResult *result, gpointer data) {
+    FilterJob *job = (FilterJob *)data;
+    GError *error = NULL;
+    gchar *contents;
+    gsize length;
+    
+    if (!g_file_load_contents_finish(G_FILE(object), result, &contents, &length, NULL, &error)) {
+        g_warning("Failed to read content filter %s: %s", job->source_path, error->message);
+        g_error_free(error);
+        filter_job_done(job);
+        return;
+    }
+    
+    // WebKit compiles the rules off the main thread
+    GBytes *source = g_bytes_new_take(contents, length);
+    webkit_user_content_filter_store_save(job->blocker->store, job->identifier, source,
+                                          NULL, on_filter_compiled, job);
+    g_bytes_unref(source);
+}
+
+static void content_blocker_compile(FilterJob *job) {
+    GFile *file = g_file_new_for_path(job->source_path);
+    g_file_load_contents_async(file, NULL, on_filter_source_loaded, job);
+    g_object_unref(file);
+}
+
+static void on_filter_loaded(GObject *object, GAsyncResult *result, gpointer data) {
+    FilterJob *job = (FilterJob *)data;
+    GError *error = NULL;
+    WebKitUserContentFilter *filter =
+        webkit_user_content_filter_store_load_finish(WEBKIT_USER_CONTENT_FILTER_STORE(object),
+                                                     result, &error);
+    
+    if (filter) {
+        content_blocker_apply(job, filter);
+        filter_job_done(job);
+    } else {
+        // Bytecode from another WebKit version or a damaged store
+        g_clear_error(&error);
+        content_blocker_compile(job);
+    }
+}
+
+// Load or rebuild every rule list whose source changed since it was
+// applied. While earlier loads or compiles are running, the scan waits for
+// them so a list is never built twice at once.
+static void content_blocker_scan(ContentBlocker *blocker) {
+    if (blocker->pending > 0) {
+        blocker->rescan_wanted = TRUE;
+        return;
+    }
+    
+    GDir *dir = g_dir_open(blocker->source_dir, 0, NULL);
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    const gchar *name;
+    
+    while (dir && (name = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(name, ".json")) continue;
+        
+        gchar *source_path = g_build_filename(blocker->source_dir, name, NULL);
+        struct stat st;
+        if (stat(source_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            g_free(source_path);
+            continue;
+        }
+        
+        FilterJob *job = g_new0(FilterJob, 1);
+        job->blocker = blocker;
+        job->identifier = g_strndup(name, strlen(name) - strlen(".json"));
+        job->source_path = source_path;
+        job->stamp = g_strdup_printf("%" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+                                     (gint64)st.st_mtime, (gint64)st.st_size);
+        g_hash_table_add(seen, g_strdup(job->identifier));
+        
+        if (g_strcmp0(g_hash_table_lookup(blocker->applied, job->identifier), job->stamp) == 0) {
+            filter_job_free(job);
+            continue;
+        }
+        
+        // Load stored bytecode when it was built from this exact source
+        gchar *stamp_path = get_filter_stamp_path(blocker, job->identifier);
+        gchar *stored_stamp = NULL;
+        g_file_get_contents(stamp_path, &stored_stamp, NULL, NULL);
+        g_free(stamp_path);
+        
+        blocker->pending++;
+        if (g_strcmp0(stored_stamp, job->stamp) == 0) {
+            webkit_user_content_filter_store_load(blocker->store, job->identifier, NULL,
+                                                  on_filter_loaded, job);
+        } else {
+            content_blocker_compile(job);
+        }
+        g_free(stored_stamp);
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+    
+    // Drop filters whose source was deleted
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, blocker->applied);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(seen, key)) {
+            webkit_user_content_manager_remove_filter_by_id(blocker->manager, key);
+            webkit_user_content_filter_store_remove(blocker->store, key, NULL, NULL, NULL);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    
+    g_hash_table_unref(seen);
+}
+
+static gboolean content_blocker_rescan(gpointer data) {
+    ContentBlocker *blocker = (ContentBlocker *)data;
+    
+    blocker->rescan_source = 0;
+    content_blocker_scan(blocker);
+    return G_SOURCE_REMOVE;
+}
+
+// Editors write files in several steps; rescan once things settle
+static void on_filter_dir_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                                  GFileMonitorEvent event, gpointer data) {
+    ContentBlocker *blocker = (ContentBlocker *)data;
+    
+    if (blocker->rescan_source) {
+        g_source_remove(blocker->rescan_source);
+    }
+    blocker->rescan_source = g_timeout_add(FILTER_RESCAN_DELAY_MS, content_blocker_rescan, blocker);
+}
+
+static ContentBlocker *content_blocker_new(WebKitUserContentManager *manager) {
+    gchar *source_dir = get_config_path("filters");
+    if (!source_dir) return NULL;
+    
+    ContentBlocker *blocker = g_new0(ContentBlocker, 1);
+    blocker->manager = manager;
+    blocker->source_dir = source_dir;
+    blocker->compiled_dir = g_build_filename(source_dir, "compiled", NULL);
+    if (g_mkdir_with_parents(blocker->compiled_dir, 0700) != 0) {
+        g_warning("Failed to create filter directory %s", blocker->compiled_dir);
+    }
+    blocker->store = webkit_user_content_filter_store_new(blocker->compiled_dir);
+    blocker->applied = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    
+    GFile *dir = g_file_new_for_path(source_dir);
+    blocker->monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_NONE, NULL, NULL);
+    if (blocker->monitor) {
+        g_signal_connect(blocker->monitor, "changed", G_CALLBACK(on_filter_dir_changed), blocker);
+    }
+    g_object_unref(dir);
+    
+    content_blocker_scan(blocker);
+    return blocker;
+}
+
+// Speculative DNS prefetch for hosts the user is likely to visit next: the
+// host being typed, hovered links and the most visited pages at startup.
+// Hosts are deduplicated for PREFETCH_TTL and a token bucket limits the
+// request rate. Navigations are counted as hits when their host was
+// prefetched, and time to commit is tracked separately for hits and misses.
+// WebKitGTK has no preconnect API, so warming stops at DNS.
+#define PREFETCH_TTL (60 * G_TIME_SPAN_SECOND)
+#define PREFETCH_TYPING_DELAY_MS 300
+#define PREFETCH_STARTUP_DELAY 3
+#define PREFETCH_MAX_HOSTS 4096
+
+typedef enum {
+    PREFETCH_OFF,
+    PREFETCH_CONSERVATIVE,
+    PREFETCH_AGGRESSIVE
+} PrefetchMode;
+
+struct _Prefetcher {
+    PrefetchMode mode;
+    WebKitWebContext *context;
+    GHashTable *hosts;      // Host -> time of the last prefetch
+    gdouble tokens;
+    gint64 last_refill;
+    guint typed_source;
+    gchar *typed_host;
+    guint64 issued;
+    guint64 deduplicated;
+    guint64 rate_limited;
+    guint64 hits;
+    guint64 misses;
+    gdouble hit_commit_ms;
+    gdouble miss_commit_ms;
+};
+
+static gboolean parse_prefetch_mode(const char *name, PrefetchMode *mode) {
+    if (g_strcmp0(name, "off") == 0) {
+        *mode = PREFETCH_OFF;
+    } else if (g_strcmp0(name, "conservative") == 0) {
+        *mode = PREFETCH_CONSERVATIVE;
+    } else if (g_strcmp0(name, "aggressive") == 0) {
+        *mode = PREFETCH_AGGRESSIVE;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Lowercase host of a URL or of typed text such as "example.com/path",
+// or NULL when there is none
+static gchar *extract_host(const gchar *url) {
+    if (!url) return NULL;
+    
+    const gchar *start = strstr(url, "://");
+    if (start) {
+        if (!g_str_has_prefix(url, "http")) return NULL;
+        start += 3;
+    } else {
+        start = url;
+    }
+    
+    const gchar *end = start + strcspn(start, "/?#");
+    const gchar *at = memchr(start, '@', end - start);
+    if (at) start = at + 1;
+    
+    const gchar *port = memchr(start, ':', end - start);
+    if (port) end = port;
+    
+    // Only things that look like a domain name
+    if (end - start < 3 || !memchr(start, '.', end - start)) return NULL;
+    for (const gchar *p = start; p < end; p++) {
+        if (!g_ascii_isalnum(*p) && *p != '.' && *p != '-') return NULL;
+    }
+    
+    return g_ascii_strdown(start, end - start);
+}
+
+// Token bucket: conservative allows 2 lookups a second in bursts of 5,
+// aggressive 10 a second in bursts of 20
+static gdouble prefetcher_burst(PrefetchMode mode) {
+    return mode == PREFETCH_AGGRESSIVE ? 20 : 5;
+}
+
+// The bucket starts full: right after startup, while the first address is
+// typed, is when lookups ahead of time pay off most
+static Prefetcher *prefetcher_new(PrefetchMode mode, WebKitWebContext *context) {
+    if (mode == PREFETCH_OFF) return NULL;
+    
+    Prefetcher *prefetcher = g_new0(Prefetcher, 1);
+    prefetcher->mode = mode;
+    prefetcher->context = context;
+    prefetcher->hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    prefetcher->tokens = prefetcher_burst(mode);
+    prefetcher->last_refill = g_get_monotonic_time();
+    return prefetcher;
+}
+
+static gboolean prefetcher_take_token(Prefetcher *prefetcher) {
+    gdouble rate = prefetcher->mode == PREFETCH_AGGRESSIVE ? 10 : 2;
+    gdouble burst = prefetcher_burst(prefetcher->mode);
+    gint64 now = g_get_monotonic_time();
+    
+    prefetcher->tokens += rate * (now - prefetcher->last_refill) / G_TIME_SPAN_SECOND;
+    if (prefetcher->tokens > burst) prefetcher->tokens = burst;
+    prefetcher->last_refill = now;
+    
+    if (prefetcher->tokens < 1) return FALSE;
+    prefetcher->tokens -= 1;
+    return TRUE;
+}
+
+static void prefetch_host(Prefetcher *prefetcher, const gchar *host) {
+    if (!prefetcher || !host) return;
+    
+    gint64 now = g_get_monotonic_time();
+    gint64 *last = g_hash_table_lookup(prefetcher->hosts, host);
+    if (last && now - *last < PREFETCH_TTL) {
+        prefetcher->deduplicated++;
+        return;
+    }
+    if (!prefetcher_take_token(prefetcher)) {
+        prefetcher->rate_limited++;
+        return;
+    }
+    
+    if (!last && g_hash_table_size(prefetcher->hosts) >= PREFETCH_MAX_HOSTS) {
+        g_hash_table_remove_all(prefetcher->hosts);
+    }
+    gint64 *when = g_new(gint64, 1);
+    *when = now;
+    g_hash_table_insert(prefetcher->hosts, g_strdup(host), when);
+    
+    webkit_web_context_prefetch_dns(prefetcher->context, host);
+    prefetcher->issued++;
+}
+
+static void prefetch_url(Prefetcher *prefetcher, const gchar *url) {
+    if (!prefetcher) return;
+    
+    gchar *host = extract_host(url);
+    prefetch_host(prefetcher, host);
+    g_free(host);
+}
+
+static gboolean prefetch_typed_host(gpointer data) {
+    Prefetcher *prefetcher = (Prefetcher *)data;
+    
+    prefetcher->typed_source = 0;
+    prefetch_host(prefetcher, prefetcher->typed_host);
+    g_clear_pointer(&prefetcher->typed_host, g_free);
+    return G_SOURCE_REMOVE;
+}
+
+// Wait for a typing pause so partial host names are not looked up
+static void prefetch_typed(Prefetcher *prefetcher, const gchar *text) {
+    if (!prefetcher) return;
+    
+    g_free(prefetcher->typed_host);
+    prefetcher->typed_host = extract_host(text);
+    if (prefetcher->typed_source) {
+        g_source_remove(prefetcher->typed_source);
+    }
+    prefetcher->typed_source = g_timeout_add(PREFETCH_TYPING_DELAY_MS, prefetch_typed_host, prefetcher);
+}
+
+// Classify a navigation as a prefetch hit or miss
+static gboolean prefetcher_note_navigation(Prefetcher *prefetcher, const gchar *url) {
+    if (!prefetcher) return FALSE;
+    
+    gchar *host = extract_host(url);
+    if (!host) return FALSE;
+    
+    gint64 *last = g_hash_table_lookup(prefetcher->hosts, host);
+    gboolean hit = last && g_get_monotonic_time() - *last < PREFETCH_TTL;
+    if (hit) {
+        prefetcher->hits++;
+    } else {
+        prefetcher->misses++;
+    }
+    
+    g_free(host);
+    return hit;
+}
+
+static void load_deferred_state(BrowserData *browser_data);
+
+// Prefetch the most visited sites, or the first bookmarks without history
+static gboolean prefetch_top_sites(gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    Prefetcher *prefetcher = browser_data->prefetcher;
+    guint limit = prefetcher->mode == PREFETCH_AGGRESSIVE ? 20 : 5;
+    guint count = 0;
+    
+    load_deferred_state(browser_data);
+    
+    if (browser_data->history) {
+        GPtrArray *top = history_query(browser_data->history, NULL, limit);
+        for (guint i = 0; i < top->len; i++, count++) {
+            prefetch_url(prefetcher, ((HistoryEntry *)g_ptr_array_index(top, i))->url);
+        }
+        g_ptr_array_free(top, TRUE);
+    }
+    
+    for (guint i = 0; i < browser_data->bookmarks->len && count < limit; i++, count++) {
+        prefetch_url(prefetcher, ((Bookmark *)g_ptr_array_index(browser_data->bookmarks, i))->url);
+    }
+    
+    return G_SOURCE_REMOVE;
+}
+
+static void prefetcher_note_commit(Prefetcher *prefetcher, gboolean hit, gdouble commit_ms) {
+    if (!prefetcher) return;
+    
+    if (hit) {
+        prefetcher->hit_commit_ms += commit_ms;
+    } else {
+        prefetcher->miss_commit_ms += commit_ms;
+    }
+}
+
+// Navigate to URL from address bar
+static void navigate_to_url(GtkWidget *widget, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    const gchar *url = gtk_entry_get_text(GTK_ENTRY(browser_data->url_entry));
+    
+    // "?words" searches the pages visited before
+    while (g_ascii_isspace(*url)) url++;
+    if (url[0] == '?') {
+        gchar *query = g_uri_escape_string(url + 1, NULL, FALSE);
+        gchar *search_url = g_strconcat("tinyweb://search?q=", query, NULL);
+        WebKitWebView *web_view = get_current_web_view(browser_data);
+        if (web_view) {
+            webkit_web_view_load_uri(web_view, search_url);
+        }
+        g_free(search_url);
+        g_free(query);
+        return;
+    }
+    
+    // Validate URL before loading; addresses without a scheme get http://
+    gchar *full_url = url_normalize(url);
+    if (!full_url) {
+        GtkWidget *dialog = gtk_message_dialog_new(
+            GTK_WINDOW(gtk_widget_get_toplevel(widget)),
+            GTK_DIALOG_MODAL,
+            GTK_MESSAGE_ERROR,
+            GTK_BUTTONS_OK,
+            "Invalid or potentially unsafe URL"
+        );
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+        return;
+    }
+    
+    WebKitWebView *web_view = get_current_web_view(browser_data);
+    if (web_view) {
+        webkit_web_view_load_uri(web_view, full_url);
+    }
+    g_free(full_url);
+}
+
+// Fill up the suggestions with pages whose text matches what looks like
+// words rather than an address. Runs after a typing pause and never waits
+// for the index worker; if it is busy, try again after another pause.
+static gboolean url_entry_search_pages(gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    const gchar *text = gtk_entry_get_text(GTK_ENTRY(browser_data->url_entry));
+    GtkTreeModel *model = GTK_TREE_MODEL(browser_data->completion_store);
+    guint count = gtk_tree_model_iter_n_children(model, NULL);
+    
+    if (count >= MAX_COMPLETIONS || strlen(text) < 3 || strpbrk(text, "/:.")) {
+        browser_data->page_completion_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+    
+    GPtrArray *hits = page_index_search(browser_data->page_index, text[0] == '?' ? text + 1 : text,
+                                        TRUE, MAX_COMPLETIONS - count, FALSE);
+    if (!hits) return G_SOURCE_CONTINUE;
+    browser_data->page_completion_source = 0;
+    
+    for (guint i = 0; i < hits->len; i++) {
+        PageHit *hit = g_ptr_array_index(hits, i);
+        gboolean listed = FALSE;
+        GtkTreeIter iter;
+        gboolean valid = gtk_tree_model_get_iter_first(model, &iter);
+        while (valid && !listed) {
+            gchar *url;
+            gtk_tree_model_get(model, &iter, 1, &url, -1);
+            listed = g_strcmp0(url, hit->url) == 0;
+            g_free(url);
+            valid = gtk_tree_model_iter_next(model, &iter);
+        }
+        if (!listed) {
+            gtk_list_store_insert_with_values(browser_data->completion_store, NULL, -1,
+                                              0, hit->title, 1, hit->url, -1);
+        }
+    }
+    g_ptr_array_free(hits, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+// Refill the suggestion list from the prefix index as the user types
+static void url_entry_changed(GtkEditable *editable, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    
+    // Ignore text set by page loads and tab switches
+    if (!gtk_widget_has_focus(browser_data->url_entry)) return;
+    
+    const gchar *text = gtk_entry_get_text(GTK_ENTRY(browser_data->url_entry));
+    guint32 results[MAX_COMPLETIONS];
+    
+    prefetch_typed(browser_data->prefetcher, text);
+    guint count = completion_index_lookup(browser_data->completion_index, text,
+                                          results, MAX_COMPLETIONS);
+    
+    gtk_list_store_clear(browser_data->completion_store);
+    for (guint i = 0; i < count; i++) {
+        CompletionEntry *entry = &g_array_index(browser_data->completion_index->entries,
+                                                CompletionEntry, results[i]);
+        gtk_list_store_insert_with_values(browser_data->completion_store, NULL, -1,
+                                          0, entry->title, 1, entry->url, -1);
+        
+        // The best suggestion is the likely destination
+        if (i == 0 && browser_data->prefetcher &&
+            browser_data->prefetcher->mode == PREFETCH_AGGRESSIVE) {
+            prefetch_url(browser_data->prefetcher, entry->url);
+        }
+    }
+    
+    // Pages follow once typing pauses
+    if (browser_data->page_completion_source) {
+        g_source_remove(browser_data->page_completion_source);
+        browser_data->page_completion_source = 0;
+    }
+    if (browser_data->page_index && count < MAX_COMPLETIONS && strlen(text) >= 3 &&
+        !strpbrk(text, "/:.")) {
+        browser_data->page_completion_source = g_timeout_add(PAGE_INDEX_TYPING_DELAY_MS,
+                                                             url_entry_search_pages, browser_data);
+    }
+}
+
+// The suggestion list is already filtered by the index
+static gboolean completion_match_all(GtkEntryCompletion *completion, const gchar *key,
+                                     GtkTreeIter *iter, gpointer data) {
+    return TRUE;
+}
+
+static gboolean completion_match_selected(GtkEntryCompletion *completion, GtkTreeModel *model,
+                                          GtkTreeIter *iter, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    gchar *url;
+    
+    gtk_tree_model_get(model, iter, 1, &url, -1);
+    gtk_entry_set_text(GTK_ENTRY(browser_data->url_entry), url ? url : "");
+    g_free(url);
+    
+    navigate_to_url(browser_data->url_entry, browser_data);
+    return TRUE;
+}
+
+// Navigation button callbacks
+static void go_back(GtkWidget *widget, gpointer data) {
+    WebKitWebView *web_view = get_current_web_view((BrowserData *)data);
+    if (web_view && webkit_web_view_can_go_back(web_view)) {
+        webkit_web_view_go_back(web_view);
+    }
+}
+
+static void go_forward(GtkWidget *widget, gpointer data) {
+    WebKitWebView *web_view = get_current_web_view((BrowserData *)data);
+    if (web_view && webkit_web_view_can_go_forward(web_view)) {
+        webkit_web_view_go_forward(web_view);
+    }
+}
+
+static void refresh_page(GtkWidget *widget, gpointer data) {
+    WebKitWebView *web_view = get_current_web_view((BrowserData *)data);
+    if (web_view) {
+        webkit_web_view_reload(web_view);
+    }
+}
+
+static void go_home(GtkWidget *widget, gpointer data) {
+    WebKitWebView *web_view = get_current_web_view((BrowserData *)data);
+    const gchar *home_url = g_object_get_data(G_OBJECT(widget), "home-url");
+    if (!web_view) return;
+    
+    gchar *url = home_url ? url_normalize(home_url) : NULL;
+    webkit_web_view_load_uri(web_view, url ? url : DEFAULT_URL);
+    g_free(url);
+}
+
+// Accepted self-signed or otherwise untrusted certificates, stored as
+// ~/.config/tinyweb/certificates/HOST.pem and applied to the browser's web
+// context at startup, so accepted hosts keep using the same network process
+// and cache
+static gboolean is_safe_host_name(const gchar *host) {
+    if (!host || !*host || host[0] == '.') return FALSE;
+    for (const gchar *p = host; *p; p++) {
+        if (!g_ascii_isalnum(*p) && !strchr(".-:[]", *p)) return FALSE;
+    }
+    return TRUE;
+}
+
+static void load_tls_exceptions(WebKitWebContext *context) {
+    gchar *dir_path = get_config_path("certificates");
+    GDir *dir = dir_path ? g_dir_open(dir_path, 0, NULL) : NULL;
+    const gchar *name;
+    
+    while (dir && (name = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(name, ".pem")) continue;
+        
+        gchar *host = g_strndup(name, strlen(name) - strlen(".pem"));
+        gchar *path = g_build_filename(dir_path, name, NULL);
+        GError *error = NULL;
+        GTlsCertificate *certificate = g_tls_certificate_new_from_file(path, &error);
+        
+        if (certificate && is_safe_host_name(host)) {
+            webkit_web_context_allow_tls_certificate_for_host(context, certificate, host);
+        } else if (!certificate) {
+            g_warning("Ignoring certificate exception %s: %s", path, error->message);
+            g_error_free(error);
+        }
+        
+        if (certificate) g_object_unref(certificate);
+        g_free(path);
+        g_free(host);
+    }
+    
+    if (dir) g_dir_close(dir);
+    g_free(dir_path);
+}
+
+static void save_tls_exception(const gchar *host, GTlsCertificate *certificate) {
+    gchar *dir_path = get_config_path("certificates");
+    gchar *pem = NULL;
+    
+    g_object_get(certificate, "certificate-pem", &pem, NULL);
+    if (dir_path && pem && g_mkdir_with_parents(dir_path, 0700) == 0) {
+        gchar *name = g_strconcat(host, ".pem", NULL);
+        gchar *path = g_build_filename(dir_path, name, NULL);
+        GError *error = NULL;
+        
+        if (!g_file_set_contents(path, pem, -1, &error)) {
+            g_warning("Failed to save certificate exception for %s: %s", host, error->message);
+            g_error_free(error);
+        }
+        g_free(path);
+        g_free(name);
+    }
+    
+    g_free(pem);
+    g_free(dir_path);
+}
+
+// Handle TLS errors: ask once per host, then trust that certificate in the
+// shared context and reload the same view
+static gboolean on_load_failed_with_tls_errors(WebKitWebView *web_view,
+                                           gchar *failing_uri,
+                                           GTlsCertificate *certificate,
+                                           GTlsCertificateFlags errors,
+                                           gpointer user_data) {
+    GtkWidget *dialog;
+    GtkWidget *window = gtk_widget_get_toplevel(GTK_WIDGET(web_view));
+    gint response;
+    
+    SoupURI *uri = soup_uri_new(failing_uri);
+    gchar *host = uri ? g_strdup(soup_uri_get_host(uri)) : NULL;
+    if (uri) soup_uri_free(uri);
+    if (!is_safe_host_name(host)) {
+        g_free(host);
+        return FALSE; // Let WebKit show its error page
+    }
+    
+    dialog = gtk_message_dialog_new(GTK_WINDOW(window),
+                                  GTK_DIALOG_MODAL,
+                                  GTK_MESSAGE_WARNING,
+                                  GTK_BUTTONS_YES_NO,
+                                  "The website's security certificate is not trusted:\n%s\n\n"
+                                  "Do you want to continue and always trust this certificate for %s?",
+                                  failing_uri, host);
+    
+    response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    
+    if (response == GTK_RESPONSE_YES) {
+        webkit_web_context_allow_tls_certificate_for_host(webkit_web_view_get_context(web_view),
+                                                          certificate, host);
+        save_tls_exception(host, certificate);
+        webkit_web_view_load_uri(web_view, failing_uri);
+    }
+    
+    g_free(host);
+    return TRUE; // We handled the error
+}
+
+#define WEB_PROCESS_RSS_INTERVAL (G_USEC_PER_SEC / 2)
+#define WEB_PROCESS_MAX_ANCESTORS 4
+
+// Resident memory of all WebKit web processes started by this browser, in
+// KiB. WebKit does not expose per-view process IDs, so child processes are
+// found through /proc. Under the bubblewrap sandbox a web process runs in
+// its own PID namespace and its parent here is bwrap rather than this
+// browser, so every WebKitWebProcess whose ancestors include this process
+// within a few generations is counted.
+static guint64 scan_web_process_rss_kb(void) {
+    GDir *proc = g_dir_open("/proc", 0, NULL);
+    GHashTable *parents = g_hash_table_new(NULL, NULL);
+    GArray *web_processes = g_array_new(FALSE, FALSE, sizeof(long));
+    long self = getpid();
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    guint64 total = 0;
+    const gchar *name;
+    
+    if (!proc) {
+        g_hash_table_destroy(parents);
+        g_array_free(web_processes, TRUE);
+        return 0;
+    }
+    
+    while ((name = g_dir_read_name(proc))) {
+        if (!g_ascii_isdigit(name[0])) continue;
+        
+        // /proc/PID/stat is "pid (comm) state ppid ..."
+        gchar *stat_path = g_build_filename("/proc", name, "stat", NULL);
+        gchar *stat = NULL;
+        if (g_file_get_contents(stat_path, &stat, NULL, NULL)) {
+            const gchar *comm_end = strrchr(stat, ')');
+            long pid = atol(name), ppid = 0;
+            if (comm_end && sscanf(comm_end + 1, " %*c %ld", &ppid) == 1) {
+                g_hash_table_insert(parents, GSIZE_TO_POINTER(pid), GSIZE_TO_POINTER(ppid));
+                if (strstr(stat, "(WebKitWebProces")) g_array_append_val(web_processes, pid);
+            }
+        }
+        g_free(stat);
+        g_free(stat_path);
+    }
+    g_dir_close(proc);
+    
+    for (guint i = 0; i < web_processes->len; i++) {
+        long pid = g_array_index(web_processes, long, i);
+        long ancestor = pid;
+        gboolean ours = FALSE;
+        for (guint depth = 0; depth < WEB_PROCESS_MAX_ANCESTORS && !ours && ancestor > 1; depth++) {
+            ancestor = GPOINTER_TO_SIZE(g_hash_table_lookup(parents, GSIZE_TO_POINTER(ancestor)));
+            ours = ancestor == self;
+        }
+        if (!ours) continue;
+        
+        gchar *statm_path = g_strdup_printf("/proc/%ld/statm", pid);
+        gchar *statm = NULL;
+        if (g_file_get_contents(statm_path, &statm, NULL, NULL)) {
+            unsigned long size, resident;
+            if (sscanf(statm, "%lu %lu", &size, &resident) == 2) {
+                total += (guint64)resident * page_kb;
+            }
+        }
+        g_free(statm);
+        g_free(statm_path);
+    }
+    
+    g_hash_table_destroy(parents);
+    g_array_free(web_processes, TRUE);
+    return total;
+}
+
+// Last total, refreshed on a worker thread so /proc is never walked on the
+// main thread. The HUD, the memory guard, the perf log and the stats page
+// all read the same sample.
+static struct {
+    GMutex lock;
+    guint64 rss_kb;
+    gint64 sampled;           // Monotonic time the last scan started
+    gboolean scanning;
+} web_process_memory;
+
+static gpointer web_process_rss_thread(gpointer data) {
+    guint64 total = scan_web_process_rss_kb();
+    
+    g_mutex_lock(&web_process_memory.lock);
+    web_process_memory.rss_kb = total;
+    web_process_memory.scanning = FALSE;
+    g_mutex_unlock(&web_process_memory.lock);
+    return NULL;
+}
+
+// The latest sample, at most about half a second old while it is asked for;
+// 0 until the first scan finishes
+static guint64 get_web_process_rss_kb(void) {
+    gint64 now = g_get_monotonic_time();
+    
+    g_mutex_lock(&web_process_memory.lock);
+    guint64 total = web_process_memory.rss_kb;
+    if (!web_process_memory.scanning && now - web_process_memory.sampled >= WEB_PROCESS_RSS_INTERVAL) {
+        web_process_memory.scanning = TRUE;
+        web_process_memory.sampled = now;
+        g_thread_unref(g_thread_new("web-process-rss", web_process_rss_thread, NULL));
+    }
+    g_mutex_unlock(&web_process_memory.lock);
+    return total;
+}
+
+// Memory budget. WebKit enforces memory_limit on each web process (one per
+// view) through WebKitMemoryPressureSettings; the guard below applies the
+// same limit and thresholds to all web processes together and reacts in
+// stages while the budget is exceeded.
+#define MEMORY_DEFAULT_CONSERVATIVE 0.5
+#define MEMORY_DEFAULT_STRICT 0.75
+#define MEMORY_DEFAULT_POLL_INTERVAL 5.0
+#define MEMORY_RELOAD_COOLDOWN (60 * G_TIME_SPAN_SECOND)
+
+#define PAUSE_MEDIA_SCRIPT \
+    "document.querySelectorAll('audio, video').forEach(function(m) { m.pause(); });"
+
+typedef struct {
+    guint limit_mb;           // 0 leaves memory management to WebKit defaults
+    gdouble conservative;     // Fractions of limit_mb
+    gdouble strict;
+    gdouble poll_interval;    // Seconds
+} MemoryConfig;
+
+typedef enum {
+    MEMORY_STAGE_NORMAL,
+    MEMORY_STAGE_DROP_CACHES,
+    MEMORY_STAGE_STOP_MEDIA,
+    MEMORY_STAGE_SUSPEND
+} MemoryStage;
+
+static const char *memory_stage_names[] = { "normal", "drop-caches", "stop-media", "suspend" };
+
+struct _MemoryGuard {
+    BrowserData *browser_data;
+    MemoryConfig config;
+    MemoryStage stage;
+    guint64 rss_kb;
+    guint64 peak_rss_kb;
+    gint64 last_reload;
+    guint poll_source;
+    
+    // Reactions so far, shown in the status bar tooltip
+    guint64 cache_drops;
+    guint64 media_stops;
+    guint64 suspends;
+    guint64 reloads;
+};
+
+// Frame profiler, enabled with --frame-profile. A user script times
+// requestAnimationFrame callbacks and long tasks in every page and posts
+// them once a second to the "tinywebFrames" message handler; frame times
+// are kept per page in 1 ms buckets and reported as JSON on exit.
+#define FRAME_BUDGET_MS (1000.0 / 60)
+#define FRAME_HISTOGRAM_MAX_MS 1000   // The last bucket collects slower frames
+#define FRAME_LONG_MS 50
+
+// Without PerformanceObserver support for "longtask" (WebKit has none), a
+// task that kept a 50 ms timer waiting for more than 50 ms counts as long
+#define FRAME_PROFILE_SCRIPT \
+    "(function() {" \
+    "  var handler = window.webkit && window.webkit.messageHandlers.tinywebFrames;" \
+    "  if (!handler) return;" \
+    "  var intervals = [], longTasks = 0, last = 0;" \
+    "  function frame(now) {" \
+    "    if (last && document.visibilityState === 'visible') intervals.push((now - last).toFixed(1));" \
+    "    last = now;" \
+    "    requestAnimationFrame(frame);" \
+    "  }" \
+    "  requestAnimationFrame(frame);" \
+    "  try {" \
+    "    new PerformanceObserver(function(list) { longTasks += list.getEntries().length; })" \
+    "      .observe({entryTypes: ['longtask']});" \
+    "  } catch (e) {" \
+    "    var tick = performance.now();" \
+    "    setInterval(function() {" \
+    "      var now = performance.now();" \
+    "      if (now - tick > 100 && document.visibilityState === 'visible') longTasks++;" \
+    "      tick = now;" \
+    "    }, 50);" \
+    "  }" \
+    "  function flush() {" \
+    "    if (intervals.length || longTasks)" \
+    "      handler.postMessage(longTasks + ' ' + location.href + '\\n' + intervals.join(','));" \
+    "    intervals = [];" \
+    "    longTasks = 0;" \
+    "  }" \
+    "  setInterval(flush, 1000);" \
+    "  addEventListener('pagehide', flush);" \
+    "  document.addEventListener('visibilitychange', function() { last = 0; flush(); });" \
+    "})();"
+
+typedef struct {
+    guint32 histogram[FRAME_HISTOGRAM_MAX_MS + 1];
+    guint64 frames;
+    guint64 dropped;            // Refreshes missed at 60 Hz
+    guint64 long_frames;        // Frames of FRAME_LONG_MS or more
+    guint64 long_tasks;
+    gdouble total_ms;
+    gdouble max_ms;
+} FrameStats;
+
+struct _FrameProfiler {
+    GHashTable *pages;          // URL without fragment -> FrameStats
+    GPtrArray *order;           // URLs in the order they were first seen
+    const gchar *hw_accel;
+};
+
+// Upper bounds (exclusive, in ms) of the buckets in the report
+static const guint frame_report_edges[] = { 17, 34, 50, 100, 250 };
+
+static gchar *frame_page_key(const gchar *uri) {
+    return g_strndup(uri, strcspn(uri, "#"));
+}
+
+static FrameStats *frame_profiler_lookup(FrameProfiler *profiler, const gchar *uri) {
+    if (!uri) return NULL;
+    
+    gchar *key = frame_page_key(uri);
+    FrameStats *stats = g_hash_table_lookup(profiler->pages, key);
+    g_free(key);
+    return stats;
+}
+
+// Nearest-rank percentile of the histogram, in whole ms
+static guint frame_stats_percentile(FrameStats *stats, guint percent) {
+    if (stats->frames == 0) return 0;
+    
+    guint64 rank = (stats->frames * percent + 99) / 100;
+    guint64 seen = 0;
+    
+    for (guint ms = 0; ms <= FRAME_HISTOGRAM_MAX_MS; ms++) {
+        seen += stats->histogram[ms];
+        if (seen >= rank) return ms;
+    }
+    return FRAME_HISTOGRAM_MAX_MS;
+}
+
+// A message is "LONG_TASKS URL\nINTERVAL,INTERVAL,..."
+static void on_frame_profile_message(WebKitUserContentManager *manager, WebKitJavascriptResult *js_result,
+                                     gpointer data) {
+    FrameProfiler *profiler = (FrameProfiler *)data;
+    gchar *message = jsc_value_to_string(webkit_javascript_result_get_js_value(js_result));
+    gchar **lines = g_strsplit(message, "\n", 2);
+    gchar *url = lines[0] ? strchr(lines[0], ' ') : NULL;
+    
+    if (url && lines[1]) {
+        gchar *key = frame_page_key(url + 1);
+        FrameStats *stats = g_hash_table_lookup(profiler->pages, key);
+        if (!stats) {
+            stats = g_new0(FrameStats, 1);
+            g_hash_table_insert(profiler->pages, key, stats);
+            g_ptr_array_add(profiler->order, key);
+        } else {
+            g_free(key);
+        }
+        
+        stats->long_tasks += g_ascii_strtoull(lines[0], NULL, 10);
+        for (gchar *p = lines[1]; *p; ) {
+            gchar *end;
+            gdouble interval = g_ascii_strtod(p, &end);
+            if (end == p) break;
+            
+            guint missed = (guint)(interval / FRAME_BUDGET_MS + 0.5);
+            stats->histogram[MIN((guint)interval, FRAME_HISTOGRAM_MAX_MS)]++;
+            stats->frames++;
+            stats->dropped += missed > 1 ? missed - 1 : 0;
+            stats->long_frames += interval >= FRAME_LONG_MS;
+            stats->total_ms += interval;
+            stats->max_ms = MAX(stats->max_ms, interval);
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    
+    g_strfreev(lines);
+    g_free(message);
+}
+
+static FrameProfiler *frame_profiler_new(WebKitUserContentManager *manager, const gchar *hw_accel) {
+    FrameProfiler *profiler = g_new0(FrameProfiler, 1);
+    profiler->pages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    profiler->order = g_ptr_array_new();
+    profiler->hw_accel = hw_accel;
+    
+    WebKitUserScript *script = webkit_user_script_new(FRAME_PROFILE_SCRIPT,
+                                                      WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
+                                                      WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START,
+                                                      NULL, NULL);
+    webkit_user_content_manager_add_script(manager, script);
+    webkit_user_script_unref(script);
+    
+    g_signal_connect(manager, "script-message-received::tinywebFrames",
+                     G_CALLBACK(on_frame_profile_message), profiler);
+    webkit_user_content_manager_register_script_message_handler(manager, "tinywebFrames");
+    return profiler;
+}
+
+// Print the frame times of every page profiled so far as JSON
+static void frame_profiler_report(FrameProfiler *profiler) {
+    GString *report = g_string_new("{\"hw_accel\": ");
+    json_append_string(report, profiler->hw_accel);
+    g_string_append_printf(report, ", \"frame_budget_ms\": %.1f, \"pages\": [", FRAME_BUDGET_MS);
+    
+    for (guint i = 0; i < profiler->order->len; i++) {
+        const gchar *url = g_ptr_array_index(profiler->order, i);
+        FrameStats *stats = g_hash_table_lookup(profiler->pages, url);
+        
+        g_string_append(report, i ? ",\n  {\"url\": " : "\n  {\"url\": ");
+        json_append_string(report, url);
+        g_string_append_printf(report,
+                               ", \"frames\": %" G_GUINT64_FORMAT ", \"dropped\": %" G_GUINT64_FORMAT ", "
+                               "\"long_frames\": %" G_GUINT64_FORMAT ", \"long_tasks\": %" G_GUINT64_FORMAT ", "
+                               "\"mean_ms\": %.1f, \"p50_ms\": %u, \"p95_ms\": %u, \"p99_ms\": %u, "
+                               "\"max_ms\": %.1f, \"histogram\": {",
+                               stats->frames, stats->dropped, stats->long_frames, stats->long_tasks,
+                               stats->frames ? stats->total_ms / stats->frames : 0.0,
+                               frame_stats_percentile(stats, 50), frame_stats_percentile(stats, 95),
+                               frame_stats_percentile(stats, 99), stats->max_ms);
+        
+        // Frames per bucket, keyed "LOW-HIGH" in ms
+        guint low = 0;
+        for (guint b = 0; b <= G_N_ELEMENTS(frame_report_edges); b++) {
+            guint high = b < G_N_ELEMENTS(frame_report_edges) ? frame_report_edges[b] : FRAME_HISTOGRAM_MAX_MS + 1;
+            guint64 count = 0;
+            for (guint ms = low; ms < high; ms++) {
+                count += stats->histogram[ms];
+            }
+            if (b < G_N_ELEMENTS(frame_report_edges)) {
+                g_string_append_printf(report, "%s\"%u-%u\": %" G_GUINT64_FORMAT, b ? ", " : "",
+                                       low, high - 1, count);
+            } else {
+                g_string_append_printf(report, ", \"%u+\": %" G_GUINT64_FORMAT, low, count);
+            }
+            low = high;
+        }
+        g_string_append(report, "}}");
+    }
+    
+    g_string_append(report, "\n]}\n");
+    g_print("%s", report->str);
+    g_string_free(report, TRUE);
+}
+
+// Show the current tab's navigation metrics in the status bar
+static gboolean update_performance_hud(gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    Tab *tab = get_current_tab(browser_data);
+    
+    browser_data->hud_source = 0;
+    if (!tab || !browser_data->status_bar) return G_SOURCE_REMOVE;
+    
+    NavigationMetrics *metrics = &tab->metrics;
+    gchar *bytes = g_format_size(metrics->bytes);
+    gchar *rss = g_format_size(get_web_process_rss_kb() * 1024);
+    gchar *commit = metrics->commit_ms > 0 ? g_strdup_printf("%.0f ms", metrics->commit_ms)
+                                           : g_strdup("–");
+    gchar *finish = metrics->finish_ms > 0 ? g_strdup_printf("%.0f ms", metrics->finish_ms)
+                                           : g_strdup("–");
+    gchar *blocked = browser_data->content_blocker
+        ? g_strdup_printf(" · %u blocked (%" G_GUINT64_FORMAT " total)", metrics->blocked,
+                          browser_data->content_blocker->blocked_total)
+        : g_strdup("");
+    Prefetcher *prefetcher = browser_data->prefetcher;
+    gchar *prefetch = prefetcher
+        ? g_strdup_printf(" · DNS prefetch %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " hits",
+                          prefetcher->hits, prefetcher->hits + prefetcher->misses)
+        : g_strdup("");
+    gchar *text = g_strdup_printf("Commit %s · Load %s%s · %u subresources%s · %s · Web processes %s%s"
+                                  " · Profile %s",
+                                  commit, finish, metrics->failed ? " (failed)" : "",
+                                  metrics->subresources, blocked, bytes, rss, prefetch,
+                                  tab->site_profile ? tab->site_profile : "default");
+    
+    GString *details = g_string_new(NULL);
+    if (prefetcher) {
+        g_string_append_printf(details,
+            "DNS prefetch: %" G_GUINT64_FORMAT " issued, %" G_GUINT64_FORMAT " deduplicated, "
+            "%" G_GUINT64_FORMAT " rate limited\n"
+            "Navigations: %" G_GUINT64_FORMAT " hits (avg commit %.0f ms), "
+            "%" G_GUINT64_FORMAT " misses (avg commit %.0f ms)",
+            prefetcher->issued, prefetcher->deduplicated, prefetcher->rate_limited,
+            prefetcher->hits, prefetcher->hits ? prefetcher->hit_commit_ms / prefetcher->hits : 0.0,
+            prefetcher->misses, prefetcher->misses ? prefetcher->miss_commit_ms / prefetcher->misses : 0.0);
+    }
+    MemoryGuard *guard = browser_data->memory_guard;
+    if (guard) {
+        g_string_append_printf(details,
+            "%sMemory: %s, peak %" G_GUINT64_FORMAT " MiB of %u MiB; %" G_GUINT64_FORMAT " cache drops, "
+            "%" G_GUINT64_FORMAT " media stops, %" G_GUINT64_FORMAT " suspends, %" G_GUINT64_FORMAT " reloads",
+            details->len ? "\n" : "", memory_stage_names[guard->stage], guard->peak_rss_kb / 1024,
+            guard->config.limit_mb, guard->cache_drops, guard->media_stops, guard->suspends, guard->reloads);
+    }
+    FrameStats *frames = browser_data->frame_profiler && tab->web_view
+        ? frame_profiler_lookup(browser_data->frame_profiler, webkit_web_view_get_uri(tab->web_view))
+        : NULL;
+    if (frames) {
+        g_string_append_printf(details,
+            "%sFrames: %" G_GUINT64_FORMAT ", p95 %u ms, %" G_GUINT64_FORMAT " dropped, "
+            "%" G_GUINT64_FORMAT " long tasks",
+            details->len ? "\n" : "", frames->frames, frame_stats_percentile(frames, 95),
+            frames->dropped, frames->long_tasks);
+    }
+    if (details->len) {
+        gtk_widget_set_tooltip_text(browser_data->status_bar, details->str);
+    }
+    g_string_free(details, TRUE);
+    
+    gtk_statusbar_remove_all(GTK_STATUSBAR(browser_data->status_bar), browser_data->status_context);
+    gtk_statusbar_push(GTK_STATUSBAR(browser_data->status_bar), browser_data->status_context, text);
+    
+    g_free(text);
+    g_free(prefetch);
+    g_free(blocked);
+    g_free(finish);
+    g_free(commit);
+    g_free(rss);
+    g_free(bytes);
+    return G_SOURCE_REMOVE;
+}
+
+// Coalesce status bar updates; busy pages start hundreds of requests
+static void schedule_performance_hud(BrowserData *browser_data) {
+    if (browser_data->hud_source == 0) {
+        browser_data->hud_source = g_timeout_add(250, update_performance_hud, browser_data);
+    }
+}
+
+// Append one JSON record for a finished navigation to the --perf-log file
+static void log_navigation_metrics(BrowserData *browser_data, Tab *tab, const gchar *uri) {
+    if (browser_data->perf_log_fd < 0) return;
+    
+    NavigationMetrics *metrics = &tab->metrics;
+    GString *record = g_string_new("{\"time\": ");
+    g_string_append_printf(record, "%" G_GINT64_FORMAT ", \"url\": ",
+                           g_get_real_time() / G_USEC_PER_SEC);
+    json_append_string(record, uri);
+    g_string_append_printf(record, ", \"commit_ms\": %.1f, \"finish_ms\": %.1f, "
+                           "\"subresources\": %u, \"blocked\": %u, \"bytes\": %" G_GUINT64_FORMAT ", "
+                           "\"web_process_rss_kb\": %" G_GUINT64_FORMAT ", \"prefetch_hit\": %s, "
+                           "\"failed\": %s, \"profile\": \"%s\"}\n",
+                           metrics->commit_ms, metrics->finish_ms, metrics->subresources,
+                           metrics->blocked, metrics->bytes, get_web_process_rss_kb(),
+                           metrics->prefetch_hit ? "true" : "false",
+                           metrics->failed ? "true" : "false",
+                           tab->site_profile ? tab->site_profile : "default");
+    
+    if (!write_all(browser_data->perf_log_fd, record->str, record->len)) {
+        g_warning("Failed to write performance log: %s", g_strerror(errno));
+    }
+    g_string_free(record, TRUE);
+}
+
+static void web_resource_finished(WebKitWebResource *resource, gpointer data) {
+    Tab *tab = g_object_get_data(G_OBJECT(data), "tab");
+    WebKitURIResponse *response = webkit_web_resource_get_response(resource);
+    
+    if (tab && response) {
+        tab->metrics.bytes += webkit_uri_response_get_content_length(response);
+        if (get_current_tab(tab->browser_data) == tab) {
+            schedule_performance_hud(tab->browser_data);
+        }
+    }
+}
+
+// Requests stopped by a content blocker rule fail with a policy error of
+// their own; cancelled loads and other policy errors are not counted
+static void web_resource_failed(WebKitWebResource *resource, GError *error, gpointer data) {
+    Tab *tab = g_object_get_data(G_OBJECT(data), "tab");
+    
+    if (tab && error && error->domain == WEBKIT_POLICY_ERROR && error->code == FILTER_BLOCKED_ERROR) {
+        tab->metrics.blocked++;
+        if (tab->browser_data->content_blocker) {
+            tab->browser_data->content_blocker->blocked_total++;
+        }
+        if (get_current_tab(tab->browser_data) == tab) {
+            schedule_performance_hud(tab->browser_data);
+        }
+    }
+}
+
+// Count subresources; the handlers are tied to the view so they go away with it
+static void web_view_resource_load_started(WebKitWebView *web_view, WebKitWebResource *resource,
+                                           WebKitURIRequest *request, gpointer data) {
+    Tab *tab = (Tab *)data;
+    
+    if (resource != webkit_web_view_get_main_resource(web_view)) {
+        tab->metrics.subresources++;
+    }
+    g_signal_connect_object(resource, "finished", G_CALLBACK(web_resource_finished), web_view, 0);
+    g_signal_connect_object(resource, "failed", G_CALLBACK(web_resource_failed), web_view, 0);
+}
+
+static gboolean web_view_load_failed(WebKitWebView *web_view, WebKitLoadEvent event,
+                                     gchar *failing_uri, GError *error, gpointer data) {
+    Tab *tab = (Tab *)data;
+    
+    tab->metrics.failed = TRUE;
+    return FALSE; // Let WebKit show its error page
+}
+
+static WebKitSettings *create_web_settings(void);
+
+// Per-site profiles. The [sites] group of tinyweb.conf assigns hosts a
+// profile, "lite", "default" or "full"; "example.com=lite" also covers its
+// subdomains and "*" sets the profile of unlisted hosts. Each profile is a
+// WebKitSettings of its own that the view switches to when a navigation
+// starts, before the page commits. A [profile NAME] group overrides single
+// features. tinyweb.conf is watched, so edits apply without a restart.
+#define SITE_POLICY_RELOAD_DELAY_MS 500
+
+typedef enum {
+    SITE_PROFILE_LITE,
+    SITE_PROFILE_DEFAULT,
+    SITE_PROFILE_FULL,
+    SITE_N_PROFILES
+} SiteProfile;
+
+static const gchar *site_profile_names[SITE_N_PROFILES] = { "lite", "default", "full" };
+
+struct _SitePolicies {
+    WebKitSettings *settings[SITE_N_PROFILES];
+    GHashTable *hosts;          // Host -> SiteProfile + 1
+    SiteProfile fallback;
+    gchar *config_path;
+    GFileMonitor *monitor;
+    guint reload_source;
+    BrowserData *browser_data;
+};
+
+static void site_set_autoplay(WebKitSettings *settings, gboolean enabled) {
+    webkit_settings_set_media_playback_requires_user_gesture(settings, !enabled);
+}
+
+// Features a profile switches, with their lite/default/full values
+typedef struct {
+    const gchar *key;
+    void (*apply)(WebKitSettings *settings, gboolean enabled);
+    gboolean values[SITE_N_PROFILES];
+} SiteFeature;
+
+static const SiteFeature site_features[] = {
+    { "javascript", webkit_settings_set_enable_javascript, { FALSE, TRUE, TRUE } },
+    { "webgl", webkit_settings_set_enable_webgl, { FALSE, TRUE, TRUE } },
+    { "webaudio", webkit_settings_set_enable_webaudio, { FALSE, TRUE, TRUE } },
+    { "mediasource", webkit_settings_set_enable_mediasource, { FALSE, TRUE, TRUE } },
+    { "autoplay", site_set_autoplay, { FALSE, FALSE, TRUE } },
+    { "clipboard", webkit_settings_set_javascript_can_access_clipboard, { FALSE, FALSE, TRUE } },
+    { "images", webkit_settings_set_auto_load_images, { TRUE, TRUE, TRUE } },
+};
+
+static gboolean parse_site_profile(const gchar *name, SiteProfile *profile) {
+    for (guint i = 0; i < SITE_N_PROFILES; i++) {
+        if (g_ascii_strcasecmp(name, site_profile_names[i]) == 0) {
+            *profile = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Profile of a URL: the most specific listed host wins
+static SiteProfile site_policies_lookup(SitePolicies *policies, const gchar *uri) {
+    SoupURI *parsed = uri ? soup_uri_new(uri) : NULL;
+    const gchar *host = parsed ? soup_uri_get_host(parsed) : NULL;
+    SiteProfile profile = policies->fallback;
+    
+    for (const gchar *suffix = host; suffix && *suffix; ) {
+        gpointer value = g_hash_table_lookup(policies->hosts, suffix);
+        if (value) {
+            profile = GPOINTER_TO_INT(value) - 1;
+            break;
+        }
+        suffix = strchr(suffix, '.');
+        if (suffix) suffix++;
+    }
+    
+    if (parsed) soup_uri_free(parsed);
+    return profile;
+}
+
+// Give a view the settings of the profile for the URL it is about to load
+static const gchar *site_policies_apply(SitePolicies *policies, WebKitWebView *web_view, const gchar *uri) {
+    SiteProfile profile = site_policies_lookup(policies, uri);
+    
+    if (webkit_web_view_get_settings(web_view) != policies->settings[profile]) {
+        webkit_web_view_set_settings(web_view, policies->settings[profile]);
+    }
+    return site_profile_names[profile];
+}
+
+// Read profiles and hosts from tinyweb.conf. The settings objects are
+// updated in place, so feature overrides reach open views at once.
+static void site_policies_load(SitePolicies *policies) {
+    GKeyFile *key_file = g_key_file_new();
+    gboolean loaded = policies->config_path &&
+                      g_key_file_load_from_file(key_file, policies->config_path, G_KEY_FILE_NONE, NULL);
+    
+    for (guint p = 0; p < SITE_N_PROFILES; p++) {
+        gchar *group = g_strconcat("profile ", site_profile_names[p], NULL);
+        
+        for (guint f = 0; f < G_N_ELEMENTS(site_features); f++) {
+            GError *error = NULL;
+            gboolean value = site_features[f].values[p];
+            if (loaded) {
+                gboolean override = g_key_file_get_boolean(key_file, group, site_features[f].key, &error);
+                if (!error) value = override;
+                g_clear_error(&error);
+            }
+            site_features[f].apply(policies->settings[p], value);
+        }
+        g_free(group);
+    }
+    
+    g_hash_table_remove_all(policies->hosts);
+    policies->fallback = SITE_PROFILE_DEFAULT;
+    
+    gchar **hosts = loaded ? g_key_file_get_keys(key_file, "sites", NULL, NULL) : NULL;
+    for (guint i = 0; hosts && hosts[i]; i++) {
+        gchar *name = g_key_file_get_string(key_file, "sites", hosts[i], NULL);
+        SiteProfile profile;
+        
+        if (!name || !parse_site_profile(g_strstrip(name), &profile)) {
+            g_warning("Unknown site profile for %s in %s, use lite, default or full",
+                      hosts[i], policies->config_path);
+        } else if (strcmp(hosts[i], "*") == 0) {
+            policies->fallback = profile;
+        } else {
+            g_hash_table_insert(policies->hosts, g_ascii_strdown(hosts[i], -1), GINT_TO_POINTER(profile + 1));
+        }
+        g_free(name);
+    }
+    
+    g_strfreev(hosts);
+    g_key_file_free(key_file);
+}
+
+// Reload the table and move open tabs to their new profiles; features that
+// only take effect on load apply from the next navigation
+static gboolean site_policies_reload(gpointer data) {
+    SitePolicies *policies = (SitePolicies *)data;
+    BrowserData *browser_data = policies->browser_data;
+    
+    policies->reload_source = 0;
+    site_policies_load(policies);
+    
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        if (tab->web_view) {
+            tab->site_profile = site_policies_apply(policies, tab->web_view,
+                                                    webkit_web_view_get_uri(tab->web_view));
+        }
+    }
+    g_debug("Reloaded site profiles: %u hosts", g_hash_table_size(policies->hosts));
+    return G_SOURCE_REMOVE;
+}
+
+static void on_site_config_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                                   GFileMonitorEvent event, gpointer data) {
+    SitePolicies *policies = (SitePolicies *)data;
+    
+    if (policies->reload_source) {
+        g_source_remove(policies->reload_source);
+    }
+    policies->reload_source = g_timeout_add(SITE_POLICY_RELOAD_DELAY_MS, site_policies_reload, policies);
+}
+
+// Every profile starts from the browser-wide settings of create_web_settings()
+static SitePolicies *site_policies_new(BrowserData *browser_data) {
+    SitePolicies *policies = g_new0(SitePolicies, 1);
+    policies->browser_data = browser_data;
+    policies->hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    policies->config_path = get_config_path("tinyweb.conf");
+    
+    for (guint p = 0; p < SITE_N_PROFILES; p++) {
+        policies->settings[p] = create_web_settings();
+    }
+    site_policies_load(policies);
+    
+    if (policies->config_path) {
+        GFile *file = g_file_new_for_path(policies->config_path);
+        policies->monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, NULL);
+        if (policies->monitor) {
+            g_signal_connect(policies->monitor, "changed", G_CALLBACK(on_site_config_changed), policies);
+        }
+        g_object_unref(file);
+    }
+    return policies;
+}
+
+typedef struct {
+    BrowserData *browser_data;
+    gchar *uri;
+} PageTextRequest;
+
+// Hand the text of a loaded page to the page index, unless the view has
+// moved on to another page meanwhile
+static void on_page_text_ready(GObject *object, GAsyncResult *result, gpointer data) {
+    PageTextRequest *request = (PageTextRequest *)data;
+    WebKitWebView *web_view = WEBKIT_WEB_VIEW(object);
+    WebKitJavascriptResult *js_result = webkit_web_view_run_javascript_finish(web_view, result, NULL);
+    
+    // Without JavaScript the script returns undefined rather than a string
+    JSCValue *value = js_result ? webkit_javascript_result_get_js_value(js_result) : NULL;
+    if (value && jsc_value_is_string(value) && !request->browser_data->shutting_down &&
+        g_strcmp0(webkit_web_view_get_uri(web_view), request->uri) == 0) {
+        gchar *text = jsc_value_to_string(value);
+        page_index_add(request->browser_data->page_index, request->uri, webkit_web_view_get_title(web_view), text);
+    }
+    if (js_result) webkit_javascript_result_unref(js_result);
+    g_free(request->uri);
+    g_free(request);
+}
+
+// Update address bar when page loads
+static void web_view_load_changed(WebKitWebView *web_view, WebKitLoadEvent event, gpointer data) {
+    Tab *tab = (Tab *)data;
+    BrowserData *browser_data = tab->browser_data;
+    gdouble elapsed_ms = (g_get_monotonic_time() - tab->metrics.start) / 1000.0;
+    
+    // Switch to the profile of the site before the page commits; this fires
+    // for the main frame only, so iframes keep the profile of their page
+    if (event == WEBKIT_LOAD_STARTED || event == WEBKIT_LOAD_REDIRECTED) {
+        tab->site_profile = site_policies_apply(browser_data->site_policies, web_view, tab_page_uri(tab));
+    }
+    
+    if (event == WEBKIT_LOAD_STARTED) {
+        memset(&tab->metrics, 0, sizeof(tab->metrics));
+        tab->metrics.start = g_get_monotonic_time();
+        tab->metrics.prefetch_hit = prefetcher_note_navigation(browser_data->prefetcher,
+                                                               webkit_web_view_get_uri(web_view));
+    } else if (event == WEBKIT_LOAD_COMMITTED) {
+        startup_trace_once(STARTUP_FIRST_COMMIT, "first-navigation-committed");
+        tab->metrics.commit_ms = elapsed_ms;
+        tab->session_dirty = TRUE;
+        prefetcher_note_commit(browser_data->prefetcher, tab->metrics.prefetch_hit, elapsed_ms);
+    }
+    
+    if (get_current_tab(browser_data) == tab) {
+        schedule_performance_hud(browser_data);
+    }
+    
+    if (event == WEBKIT_LOAD_FINISHED) {
+        const gchar *uri = tab_page_uri(tab);
+        gboolean snapshot = g_strcmp0(uri, webkit_web_view_get_uri(web_view)) != 0;
+        
+        startup_trace_once(STARTUP_FIRST_FINISH, "first-load-finished");
+        tab->metrics.finish_ms = elapsed_ms;
+        log_navigation_metrics(browser_data, tab, uri);
+        
+        g_free(tab->uri);
+        tab->uri = g_strdup(uri);
+        if (get_current_tab(browser_data) == tab) {
+            gtk_entry_set_text(GTK_ENTRY(browser_data->url_entry), uri ? uri : "");
+        }
+        
+        // Put a restored page back where it was scrolled to
+        if (tab->restore_scroll) {
+            gchar *script = g_strdup_printf("window.scrollTo(%d, %d);", tab->scroll_x, tab->scroll_y);
+            webkit_web_view_run_javascript(web_view, script, NULL, NULL, NULL);
+            tab->restore_scroll = FALSE;
+            g_free(script);
+        }
+        
+        // Record the visit; the history writer thread does the disk I/O
+        if (browser_data->history && uri && is_valid_url(uri) &&
+            !g_str_has_prefix(uri, "about:") && !g_str_has_prefix(uri, "tinyweb:")) {
+            HistoryEntry *entry = history_add_visit(browser_data->history, uri,
+                                                    webkit_web_view_get_title(web_view));
+            completion_index_set_frecency(browser_data->completion_index, entry->title, entry->url,
+                                          history_entry_frecency(entry, entry->recent_visits[0]),
+                                          TRUE);
+        }
+        
+        // Index the text of web pages; the page index splits it on its worker
+        if (browser_data->page_index && uri && !tab->metrics.failed && !snapshot &&
+            (g_str_has_prefix(uri, "http://") || g_str_has_prefix(uri, "https://"))) {
+            PageTextRequest *request = g_new(PageTextRequest, 1);
+            request->browser_data = browser_data;
+            request->uri = g_strdup(uri);
+            webkit_web_view_run_javascript(web_view, PAGE_TEXT_SCRIPT, NULL, on_page_text_ready, request);
+        }
+    }
+}
+
+// Warm DNS for links under the pointer
+static void web_view_mouse_target_changed(WebKitWebView *web_view, WebKitHitTestResult *hit_test,
+                                          guint modifiers, gpointer data) {
+    Tab *tab = (Tab *)data;
+    
+    if (webkit_hit_test_result_context_is_link(hit_test)) {
+        prefetch_url(tab->browser_data->prefetcher, webkit_hit_test_result_get_link_uri(hit_test));
+    }
+}
+
+// Keep the tab label in sync with the page title
+static void web_view_title_changed(WebKitWebView *web_view, GParamSpec *pspec, gpointer data) {
+    Tab *tab = (Tab *)data;
+    const gchar *title = webkit_web_view_get_title(web_view);
+    
+    if (title && *title) {
+        gtk_label_set_text(GTK_LABEL(tab->title_label), title);
+        gtk_widget_set_tooltip_text(tab->title_label, title);
+        tab->browser_data->session_changed = TRUE;
+    }
+}
+
+// Offline snapshots: MHTML copies of pages saved by --prewarm under
+// CACHE_DIR/offline, keyed by the SHA-1 of the URL
+static gchar *offline_snapshot_path(const gchar *cache_dir, const gchar *url) {
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, url, -1);
+    gchar *name = g_strconcat(hash, ".mhtml", NULL);
+    gchar *path = g_build_filename(cache_dir, "offline", name, NULL);
+    
+    g_free(name);
+    g_free(hash);
+    return path;
+}
+
+// With --prefer-cache, serve pages that have a snapshot from disk instead
+// of revalidating them over the network
+static gboolean web_view_decide_policy(WebKitWebView *web_view, WebKitPolicyDecision *decision,
+                                       WebKitPolicyDecisionType type, gpointer data) {
+    Tab *tab = (Tab *)data;
+    
+    if (type != WEBKIT_POLICY_DECISION_TYPE_NAVIGATION_ACTION) return FALSE;
+    
+    WebKitNavigationAction *action =
+        webkit_navigation_policy_decision_get_navigation_action(WEBKIT_NAVIGATION_POLICY_DECISION(decision));
+    const gchar *uri = webkit_uri_request_get_uri(webkit_navigation_action_get_request(action));
+    if (!g_str_has_prefix(uri, "http://") && !g_str_has_prefix(uri, "https://")) return FALSE;
+    
+    gchar *path = offline_snapshot_path(tab->browser_data->cache_dir, uri);
+    gboolean handled = FALSE;
+    
+    if (g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+        gchar *snapshot_uri = g_filename_to_uri(path, NULL, NULL);
+        if (snapshot_uri) {
+            if (!tab->snapshots) {
+                tab->snapshots = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+            }
+            g_hash_table_replace(tab->snapshots, g_strdup(snapshot_uri), g_strdup(uri));
+            webkit_policy_decision_ignore(decision);
+            webkit_web_view_load_uri(web_view, snapshot_uri);
+            handled = TRUE;
+            g_free(snapshot_uri);
+        }
+    }
+    
+    g_free(path);
+    return handled;
+}
+
+static void tab_connect_view_signals(Tab *tab) {
+    // Handle TLS errors
+    g_signal_connect(tab->web_view, "load-failed-with-tls-errors", 
+                    G_CALLBACK(on_load_failed_with_tls_errors), tab);
+    
+    // Connect load changed signal
+    g_signal_connect(tab->web_view, "load-changed", 
+                    G_CALLBACK(web_view_load_changed), tab);
+    g_signal_connect(tab->web_view, "notify::title", 
+                    G_CALLBACK(web_view_title_changed), tab);
+    
+    g_signal_connect(tab->web_view, "mouse-target-changed", 
+                    G_CALLBACK(web_view_mouse_target_changed), tab);
+    
+    // Performance HUD counters
+    g_object_set_data(G_OBJECT(tab->web_view), "tab", tab);
+    g_signal_connect(tab->web_view, "resource-load-started", 
+                    G_CALLBACK(web_view_resource_load_started), tab);
+    g_signal_connect(tab->web_view, "load-failed", 
+                    G_CALLBACK(web_view_load_failed), tab);
+    
+    if (tab->browser_data->prefer_cache) {
+        g_signal_connect(tab->web_view, "decide-policy",
+                        G_CALLBACK(web_view_decide_policy), tab);
+    }
+}
+
+// Create a live web view for a tab. Every view is built from the settings of
+// its site's profile and the shared user content manager, and lives in the
+// browser's web context.
+static void tab_create_view(Tab *tab) {
+    SitePolicies *policies = tab->browser_data->site_policies;
+    SiteProfile profile = site_policies_lookup(policies, tab->uri);
+    
+    tab->site_profile = site_profile_names[profile];
+    tab->web_view = WEBKIT_WEB_VIEW(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+                                                 "web-context", tab->browser_data->web_context,
+                                                 "settings", policies->settings[profile],
+                                                 "user-content-manager",
+                                                 tab->browser_data->user_content_manager,
+                                                 NULL));
+    tab_connect_view_signals(tab);
+    
+    // Create WebView container
+    tab->scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(tab->scrolled_window),
+                                GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(tab->scrolled_window), GTK_WIDGET(tab->web_view));
+    gtk_box_pack_start(GTK_BOX(tab->page), tab->scrolled_window, TRUE, TRUE, 0);
+    gtk_widget_show_all(tab->scrolled_window);
+}
+
+// Scale a page snapshot down to a thumbnail so discarded tabs stay cheap
+static cairo_surface_t *make_thumbnail(cairo_surface_t *snapshot) {
+    int width = cairo_image_surface_get_width(snapshot);
+    int height = cairo_image_surface_get_height(snapshot);
+    if (width <= 0 || height <= 0) return NULL;
+    
+    double scale = width > THUMBNAIL_WIDTH ? (double)THUMBNAIL_WIDTH / width : 1.0;
+    int thumb_width = (int)(width * scale);
+    int thumb_height = (int)(height * scale);
+    if (thumb_width < 1) thumb_width = 1;
+    if (thumb_height < 1) thumb_height = 1;
+    
+    cairo_surface_t *thumbnail = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                            thumb_width, thumb_height);
+    cairo_t *cr = cairo_create(thumbnail);
+    cairo_scale(cr, scale, scale);
+    cairo_set_source_surface(cr, snapshot, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    
+    return thumbnail;
+}
+
+// Drop the web view of a tab and keep only what is needed to bring it back
+static void tab_finish_discard(Tab *tab) {
+    if (!tab->web_view) return;
+    
+    if (tab->session_state) {
+        webkit_web_view_session_state_unref(tab->session_state);
+    }
+    tab->session_state = webkit_web_view_get_session_state(tab->web_view);
+    
+    const gchar *uri = tab_page_uri(tab);
+    if (uri) {
+        g_free(tab->uri);
+        tab->uri = g_strdup(uri);
+    }
+    
+    // Destroying the view releases its web process
+    g_signal_handlers_disconnect_by_data(tab->web_view, tab);
+    gtk_widget_destroy(tab->scrolled_window);
+    tab->scrolled_window = NULL;
+    tab->web_view = NULL;
+    
+    if (tab->thumbnail) {
+        tab->thumbnail_image = gtk_image_new_from_surface(tab->thumbnail);
+    } else {
+        tab->thumbnail_image = gtk_label_new(tab->uri ? tab->uri : "");
+    }
+    gtk_box_pack_start(GTK_BOX(tab->page), tab->thumbnail_image, TRUE, TRUE, 0);
+    gtk_widget_show(tab->thumbnail_image);
+}
+
+static void on_discard_snapshot_ready(GObject *object, GAsyncResult *result, gpointer data) {
+    GError *error = NULL;
+    cairo_surface_t *snapshot = webkit_web_view_get_snapshot_finish(WEBKIT_WEB_VIEW(object),
+                                                                    result, &error);
+    
+    // The tab was focused again or closed while the snapshot was taken
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free(error);
+        return;
+    }
+    
+    Tab *tab = (Tab *)data;
+    g_clear_object(&tab->discard_cancellable);
+    
+    if (snapshot) {
+        if (tab->thumbnail) {
+            cairo_surface_destroy(tab->thumbnail);
+        }
+        tab->thumbnail = make_thumbnail(snapshot);
+        cairo_surface_destroy(snapshot);
+    } else {
+        g_warning("Failed to snapshot tab: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+    }
+    
+    tab_finish_discard(tab);
+}
+
+static void tab_discard(Tab *tab) {
+    if (!tab->web_view || tab->discard_cancellable) return;
+    
+    tab->discard_cancellable = g_cancellable_new();
+    webkit_web_view_get_snapshot(tab->web_view,
+                                 WEBKIT_SNAPSHOT_REGION_VISIBLE,
+                                 WEBKIT_SNAPSHOT_OPTIONS_NONE,
+                                 tab->discard_cancellable,
+                                 on_discard_snapshot_ready, tab);
+}
+
+// Bring a discarded tab back from its saved session state
+static void tab_restore(Tab *tab) {
+    if (tab->discard_cancellable) {
+        g_cancellable_cancel(tab->discard_cancellable);
+        g_clear_object(&tab->discard_cancellable);
+    }
+    if (tab->web_view) return;
+    
+    if (tab->thumbnail_image) {
+        gtk_widget_destroy(tab->thumbnail_image);
+        tab->thumbnail_image = NULL;
+    }
+    
+    tab_create_view(tab);
+    
+    if (tab->session_state) {
+        webkit_web_view_restore_session_state(tab->web_view, tab->session_state);
+        webkit_web_view_session_state_unref(tab->session_state);
+        tab->session_state = NULL;
+        
+        WebKitBackForwardList *list = webkit_web_view_get_back_forward_list(tab->web_view);
+        WebKitBackForwardListItem *item = webkit_back_forward_list_get_current_item(list);
+        if (item) {
+            webkit_web_view_go_to_back_forward_list_item(tab->web_view, item);
+            return;
+        }
+    }
+    
+    if (tab->uri) {
+        webkit_web_view_load_uri(tab->web_view, tab->uri);
+    }
+}
+
+static gint compare_tabs_by_last_focused(gconstpointer a, gconstpointer b) {
+    const Tab *tab_a = *(Tab * const *)a;
+    const Tab *tab_b = *(Tab * const *)b;
+    
+    if (tab_a->last_focused < tab_b->last_focused) return -1;
+    if (tab_a->last_focused > tab_b->last_focused) return 1;
+    return 0;
+}
+
+// Discard the least recently focused background tabs over the live limit
+static void enforce_live_tab_limit(BrowserData *browser_data) {
+    Tab *current = get_current_tab(browser_data);
+    GPtrArray *live = g_ptr_array_new();
+    
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        if (tab != current && tab->web_view && !tab->discard_cancellable) {
+            g_ptr_array_add(live, tab);
+        }
+    }
+    
+    if (live->len > browser_data->max_live_tabs) {
+        g_ptr_array_sort(live, compare_tabs_by_last_focused);
+        guint excess = live->len - browser_data->max_live_tabs;
+        for (guint i = 0; i < excess; i++) {
+            tab_discard(g_ptr_array_index(live, i));
+        }
+    }
+    
+    g_ptr_array_free(live, TRUE);
+}
+
+static gboolean enforce_live_tab_limit_idle(gpointer data) {
+    enforce_live_tab_limit((BrowserData *)data);
+    return G_SOURCE_REMOVE;
+}
+
+static void memory_config_init(MemoryConfig *config) {
+    config->limit_mb = 0;
+    config->conservative = MEMORY_DEFAULT_CONSERVATIVE;
+    config->strict = MEMORY_DEFAULT_STRICT;
+    config->poll_interval = MEMORY_DEFAULT_POLL_INTERVAL;
+}
+
+// Read the [memory] group of ~/.config/tinyweb/tinyweb.conf; missing keys
+// keep their current value
+static void memory_config_load(MemoryConfig *config) {
+    gchar *path = get_config_path("tinyweb.conf");
+    GKeyFile *key_file = g_key_file_new();
+    
+    if (path && g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL)) {
+        GError *error = NULL;
+        gint limit = g_key_file_get_integer(key_file, "memory", "limit-mb", &error);
+        if (!error && limit >= 0) config->limit_mb = (guint)limit;
+        g_clear_error(&error);
+        
+        gdouble value = g_key_file_get_double(key_file, "memory", "conservative-threshold", &error);
+        if (!error) config->conservative = value;
+        g_clear_error(&error);
+        value = g_key_file_get_double(key_file, "memory", "strict-threshold", &error);
+        if (!error) config->strict = value;
+        g_clear_error(&error);
+        value = g_key_file_get_double(key_file, "memory", "poll-interval", &error);
+        if (!error) config->poll_interval = value;
+        g_clear_error(&error);
+    }
+    
+    g_key_file_free(key_file);
+    g_free(path);
+}
+
+// Fall back to the defaults for values WebKit would reject
+static void memory_config_validate(MemoryConfig *config) {
+    if (config->conservative <= 0 || config->conservative >= 1 ||
+        config->strict <= 0 || config->strict >= 1 || config->strict <= config->conservative) {
+        g_print("Warning: Invalid memory thresholds, using %.2f and %.2f\n",
+                MEMORY_DEFAULT_CONSERVATIVE, MEMORY_DEFAULT_STRICT);
+        config->conservative = MEMORY_DEFAULT_CONSERVATIVE;
+        config->strict = MEMORY_DEFAULT_STRICT;
+    }
+    if (config->poll_interval <= 0) {
+        g_print("Warning: Invalid memory poll interval, using %.0f seconds\n",
+                MEMORY_DEFAULT_POLL_INTERVAL);
+        config->poll_interval = MEMORY_DEFAULT_POLL_INTERVAL;
+    }
+}
+
+// Pressure settings for WebKit's own per-process handling, or NULL
+static WebKitMemoryPressureSettings *memory_config_to_webkit(const MemoryConfig *config) {
+    if (config->limit_mb == 0) return NULL;
+    
+    WebKitMemoryPressureSettings *settings = webkit_memory_pressure_settings_new();
+    webkit_memory_pressure_settings_set_memory_limit(settings, config->limit_mb);
+    webkit_memory_pressure_settings_set_conservative_threshold(settings, config->conservative);
+    webkit_memory_pressure_settings_set_strict_threshold(settings, config->strict);
+    webkit_memory_pressure_settings_set_poll_interval(settings, config->poll_interval);
+    return settings;
+}
+
+static MemoryStage memory_guard_classify(MemoryGuard *guard) {
+    gdouble limit_kb = guard->config.limit_mb * 1024.0;
+    
+    if (guard->rss_kb >= limit_kb) return MEMORY_STAGE_SUSPEND;
+    if (guard->rss_kb >= limit_kb * guard->config.strict) return MEMORY_STAGE_STOP_MEDIA;
+    if (guard->rss_kb >= limit_kb * guard->config.conservative) return MEMORY_STAGE_DROP_CACHES;
+    return MEMORY_STAGE_NORMAL;
+}
+
+static void memory_guard_drop_caches(MemoryGuard *guard) {
+    WebKitWebsiteDataManager *manager =
+        webkit_web_context_get_website_data_manager(guard->browser_data->web_context);
+    webkit_website_data_manager_clear(manager, WEBKIT_WEBSITE_DATA_MEMORY_CACHE, 0, NULL, NULL, NULL);
+    guard->cache_drops++;
+}
+
+// Pause audio and video in every background tab
+static void memory_guard_stop_media(MemoryGuard *guard) {
+    BrowserData *browser_data = guard->browser_data;
+    Tab *current = get_current_tab(browser_data);
+    
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        if (tab != current && tab->web_view) {
+            webkit_web_view_run_javascript(tab->web_view, PAUSE_MEDIA_SCRIPT, NULL, NULL, NULL);
+        }
+    }
+    guard->media_stops++;
+}
+
+// Suspend the least recently focused background tab, one per poll so the
+// effect can be measured; with none left, reload the current view
+static void memory_guard_suspend(MemoryGuard *guard) {
+    BrowserData *browser_data = guard->browser_data;
+    Tab *current = get_current_tab(browser_data);
+    Tab *oldest = NULL;
+    
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        if (tab == current || !tab->web_view || tab->discard_cancellable) continue;
+        if (!oldest || tab->last_focused < oldest->last_focused) {
+            oldest = tab;
+        }
+    }
+    
+    if (oldest) {
+        g_debug("Memory: suspending the least recently used background tab");
+        tab_discard(oldest);
+        guard->suspends++;
+        return;
+    }
+    
+    gint64 now = g_get_monotonic_time();
+    if (current && current->web_view && now - guard->last_reload >= MEMORY_RELOAD_COOLDOWN) {
+        g_debug("Memory: reloading the current tab");
+        webkit_web_view_reload(current->web_view);
+        guard->last_reload = now;
+        guard->reloads++;
+    }
+}
+
+static gboolean memory_guard_poll(gpointer data) {
+    MemoryGuard *guard = (MemoryGuard *)data;
+    MemoryStage previous = guard->stage;
+    
+    guard->rss_kb = get_web_process_rss_kb();
+    guard->peak_rss_kb = MAX(guard->peak_rss_kb, guard->rss_kb);
+    guard->stage = memory_guard_classify(guard);
+    
+    if (guard->stage != previous) {
+        g_debug("Memory: web processes %" G_GUINT64_FORMAT " MiB of %u MiB, %s -> %s",
+                guard->rss_kb / 1024, guard->config.limit_mb,
+                memory_stage_names[previous], memory_stage_names[guard->stage]);
+    }
+    
+    // Cheaper reactions run once when their stage is entered; suspending
+    // repeats every poll while the budget is exceeded
+    if (guard->stage >= MEMORY_STAGE_DROP_CACHES && previous < MEMORY_STAGE_DROP_CACHES) {
+        memory_guard_drop_caches(guard);
+    }
+    if (guard->stage >= MEMORY_STAGE_STOP_MEDIA && previous < MEMORY_STAGE_STOP_MEDIA) {
+        memory_guard_stop_media(guard);
+    }
+    if (guard->stage == MEMORY_STAGE_SUSPEND) {
+        memory_guard_suspend(guard);
+    }
+    
+    return G_SOURCE_CONTINUE;
+}
+
+static MemoryGuard *memory_guard_new(BrowserData *browser_data, const MemoryConfig *config) {
+    if (config->limit_mb == 0) return NULL;
+    
+    MemoryGuard *guard = g_new0(MemoryGuard, 1);
+    guard->browser_data = browser_data;
+    guard->config = *config;
+    guard->poll_source = g_timeout_add((guint)(config->poll_interval * 1000), memory_guard_poll, guard);
+    return guard;
+}
+
+static void session_forget_tab(BrowserData *browser_data, Tab *tab);
+static void session_save(BrowserData *browser_data);
+
+static void close_tab(GtkWidget *widget, gpointer data) {
+    Tab *tab = (Tab *)data;
+    BrowserData *browser_data = tab->browser_data;
+    
+    if (tab->discard_cancellable) {
+        g_cancellable_cancel(tab->discard_cancellable);
+        g_clear_object(&tab->discard_cancellable);
+    }
+    if (tab->web_view) {
+        g_signal_handlers_disconnect_by_data(tab->web_view, tab);
+    }
+    
+    // Closing the last tab closes the browser. Its session is saved as it
+    // is now, with this tab, and left alone on exit so it can be restored.
+    gboolean last = browser_data->tabs->len == 1;
+    if (last) {
+        session_save(browser_data);
+    }
+    g_ptr_array_remove(browser_data->tabs, tab);
+    if (!last) {
+        session_forget_tab(browser_data, tab);
+    }
+    
+    if (last) {
+        gtk_widget_destroy(gtk_widget_get_toplevel(browser_data->notebook));
+    } else {
+        gtk_widget_destroy(tab->page);
+    }
+    
+    if (tab->session_state) {
+        webkit_web_view_session_state_unref(tab->session_state);
+    }
+    if (tab->thumbnail) {
+        cairo_surface_destroy(tab->thumbnail);
+    }
+    if (tab->snapshots) {
+        g_hash_table_destroy(tab->snapshots);
+    }
+    g_free(tab->uri);
+    g_free(tab);
+}
+
+// Create a tab with its label but no web view yet; see tab_attach()
+static Tab *tab_new(BrowserData *browser_data, const gchar *uri, const gchar *title) {
+    Tab *tab = g_new0(Tab, 1);
+    tab->browser_data = browser_data;
+    tab->uri = g_strdup(uri);
+    tab->last_focused = g_get_monotonic_time();
+    tab->session_id = ++browser_data->next_session_id;
+    tab->page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    g_object_set_data(G_OBJECT(tab->page), "tab", tab);
+    
+    // Tab label with a close button
+    GtkWidget *label_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    tab->title_label = gtk_label_new(title);
+    gtk_label_set_ellipsize(GTK_LABEL(tab->title_label), PANGO_ELLIPSIZE_END);
+    gtk_label_set_width_chars(GTK_LABEL(tab->title_label), 16);
+    gtk_label_set_max_width_chars(GTK_LABEL(tab->title_label), 16);
+    gtk_box_pack_start(GTK_BOX(label_box), tab->title_label, TRUE, TRUE, 0);
+    
+    GtkWidget *close_button = gtk_button_new_with_label("×");
+    gtk_button_set_relief(GTK_BUTTON(close_button), GTK_RELIEF_NONE);
+    gtk_widget_set_tooltip_text(close_button, "Close tab");
+    g_signal_connect(close_button, "clicked", G_CALLBACK(close_tab), tab);
+    gtk_box_pack_start(GTK_BOX(label_box), close_button, FALSE, FALSE, 0);
+    gtk_widget_show_all(label_box);
+    g_object_set_data(G_OBJECT(tab->page), "label-box", label_box);
+    
+    return tab;
+}
+
+// Add a tab to the notebook. The first page added becomes current, which
+// restores it, so live tabs need their view before this.
+static void tab_attach(Tab *tab) {
+    BrowserData *browser_data = tab->browser_data;
+    GtkWidget *label_box = g_object_get_data(G_OBJECT(tab->page), "label-box");
+    
+    g_ptr_array_add(browser_data->tabs, tab);
+    gtk_widget_show(tab->page);
+    gtk_notebook_append_page(GTK_NOTEBOOK(browser_data->notebook), tab->page, label_box);
+    gtk_notebook_set_tab_reorderable(GTK_NOTEBOOK(browser_data->notebook), tab->page, TRUE);
+    browser_data->session_changed = TRUE;
+}
+
+// Open a new tab; the page is loaded in a fresh view in the shared context
+static Tab *open_tab(BrowserData *browser_data, const gchar *uri, gboolean focus) {
+    Tab *tab = tab_new(browser_data, uri, uri);
+    tab_create_view(tab);
+    tab_attach(tab);
+    
+    // Load the specified URL after validating
+    gchar *url = url_normalize(uri);
+    webkit_web_view_load_uri(tab->web_view, url ? url : DEFAULT_URL);
+    g_free(url);
+    
+    if (focus) {
+        GtkNotebook *notebook = GTK_NOTEBOOK(browser_data->notebook);
+        gtk_notebook_set_current_page(notebook, gtk_notebook_page_num(notebook, tab->page));
+    }
+    enforce_live_tab_limit(browser_data);
+    
+    return tab;
+}
+
+static gboolean on_window_mapped(GtkWidget *widget, GdkEvent *event, gpointer data) {
+    startup_trace_once(STARTUP_WINDOW_MAPPED, "window-mapped");
+    return FALSE;
+}
+
+static void new_tab(GtkWidget *widget, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    const gchar *home_url = g_object_get_data(G_OBJECT(widget), "home-url");
+    
+    open_tab(browser_data, home_url, TRUE);
+}
+
+// Restore the focused tab and push older background tabs over the limit
+static void on_switch_page(GtkNotebook *notebook, GtkWidget *page, guint page_num, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    Tab *tab = g_object_get_data(G_OBJECT(page), "tab");
+    if (!tab) return;
+    
+    // Still the tab being left at this point
+    Tab *previous = get_current_tab(browser_data);
+    if (previous) {
+        previous->last_focused = g_get_monotonic_time();
+    }
+    
+    tab->last_focused = g_get_monotonic_time();
+    browser_data->session_changed = TRUE;
+    
+    // While a session is restored only the tab focused last time is loaded;
+    // pages removed during shutdown must not bring views back
+    if (browser_data->restoring_session || browser_data->shutting_down) return;
+    
+    tab_restore(tab);
+    gtk_entry_set_text(GTK_ENTRY(browser_data->url_entry), tab->uri ? tab->uri : "");
+    schedule_performance_hud(browser_data);
+    
+    // The notebook only updates its current page after this handler runs
+    g_idle_add(enforce_live_tab_limit_idle, browser_data);
+}
+
+static void on_page_reordered(GtkNotebook *notebook, GtkWidget *child, guint page_num, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    Tab *tab = g_object_get_data(G_OBJECT(child), "tab");
+    
+    // Keep the tab array in notebook order for the saved session
+    if (tab && g_ptr_array_remove(browser_data->tabs, tab)) {
+        g_ptr_array_insert(browser_data->tabs, page_num, tab);
+    }
+    browser_data->session_changed = TRUE;
+}
+
+// Session: the open tabs are saved to SESSION_DIR/session.txt, one
+// "T|id|scroll_x|scroll_y|uri|title" line per tab and a "C|index" line for
+// the current tab. Each tab's back/forward list is a serialized
+// WebKitWebViewSessionState in SESSION_DIR/<id>.state, rewritten only when
+// the tab navigated. All writes happen on a writer thread.
+#define SESSION_SAVE_INTERVAL 15
+#define SCROLL_POSITION_SCRIPT "window.scrollX + ',' + window.scrollY"
+
+typedef struct {
+    gchar *path;
+    GBytes *data;    // NULL deletes the file
+} SessionWriteJob;
+
+// Runs on the writer thread; g_file_set_contents() replaces files atomically
+static void session_write_job(gpointer data, gpointer user_data) {
+    SessionWriteJob *job = (SessionWriteJob *)data;
+    GError *error = NULL;
+    
+    if (!job->data) {
+        unlink(job->path);
+    } else if (!g_file_set_contents(job->path, g_bytes_get_data(job->data, NULL),
+                                    g_bytes_get_size(job->data), &error)) {
+        g_warning("Failed to save session: %s", error->message);
+        g_error_free(error);
+    }
+    
+    if (job->data) {
+        g_bytes_unref(job->data);
+    }
+    g_free(job->path);
+    g_free(job);
+}
+
+static gchar *session_state_path(BrowserData *browser_data, guint session_id) {
+    gchar *name = g_strdup_printf("%u.state", session_id);
+    gchar *path = g_build_filename(browser_data->session_dir, name, NULL);
+    g_free(name);
+    return path;
+}
+
+static void session_queue_write(BrowserData *browser_data, gchar *path, GBytes *data) {
+    SessionWriteJob *job = g_new0(SessionWriteJob, 1);
+    job->path = path;
+    job->data = data;
+    g_thread_pool_push(browser_data->session_writer, job, NULL);
+}
+
+static void session_forget_tab(BrowserData *browser_data, Tab *tab) {
+    if (!browser_data->session_writer) return;
+    
+    session_queue_write(browser_data, session_state_path(browser_data, tab->session_id), NULL);
+    browser_data->session_changed = TRUE;
+}
+
+static void on_scroll_position_ready(GObject *object, GAsyncResult *result, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    WebKitJavascriptResult *js_result = webkit_web_view_run_javascript_finish(WEBKIT_WEB_VIEW(object),
+                                                                              result, NULL);
+    if (!js_result) return;
+    
+    // The tab may have been closed or discarded meanwhile
+    Tab *tab = g_object_get_data(object, "tab");
+    if (tab && g_ptr_array_find(browser_data->tabs, tab, NULL) &&
+        tab->web_view == WEBKIT_WEB_VIEW(object)) {
+        gchar *position = jsc_value_to_string(webkit_javascript_result_get_js_value(js_result));
+        gint x = 0, y = 0;
+        if (sscanf(position, "%d,%d", &x, &y) == 2 && (x != tab->scroll_x || y != tab->scroll_y)) {
+            tab->scroll_x = x;
+            tab->scroll_y = y;
+            browser_data->session_changed = TRUE;
+        }
+        g_free(position);
+    }
+    webkit_javascript_result_unref(js_result);
+}
+
+// Queue the state of tabs that navigated, and the tab list if it changed
+static void session_save(BrowserData *browser_data) {
+    if (!browser_data->session_writer) return;
+    
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        if (!tab->session_dirty) continue;
+        
+        WebKitWebViewSessionState *state = tab->web_view
+            ? webkit_web_view_get_session_state(tab->web_view)
+            : (tab->session_state ? webkit_web_view_session_state_ref(tab->session_state) : NULL);
+        if (state) {
+            session_queue_write(browser_data, session_state_path(browser_data, tab->session_id),
+                                webkit_web_view_session_state_serialize(state));
+            webkit_web_view_session_state_unref(state);
+        }
+        tab->session_dirty = FALSE;
+        browser_data->session_changed = TRUE;
+    }
+    
+    if (!browser_data->session_changed) return;
+    browser_data->session_changed = FALSE;
+    
+    GString *manifest = g_string_new(NULL);
+    g_string_append_printf(manifest, "C|%d\n",
+                           gtk_notebook_get_current_page(GTK_NOTEBOOK(browser_data->notebook)));
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        const gchar *uri = tab->web_view ? tab_page_uri(tab) : tab->uri;
+        gchar *safe_uri = sanitize_string(uri ? uri : tab->uri);
+        gchar *safe_title = sanitize_string(gtk_label_get_text(GTK_LABEL(tab->title_label)));
+        
+        g_string_append_printf(manifest, "T|%u|%d|%d|%s|%s\n", tab->session_id,
+                               tab->scroll_x, tab->scroll_y, safe_uri, safe_title);
+        g_free(safe_title);
+        g_free(safe_uri);
+    }
+    session_queue_write(browser_data, g_build_filename(browser_data->session_dir, "session.txt", NULL),
+                        g_string_free_to_bytes(manifest));
+}
+
+static gboolean session_autosave(gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    
+    session_save(browser_data);
+    
+    // Scroll positions are read asynchronously and saved with the next round
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        if (tab->web_view) {
+            webkit_web_view_run_javascript(tab->web_view, SCROLL_POSITION_SCRIPT, NULL,
+                                           on_scroll_position_ready, browser_data);
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void session_open(BrowserData *browser_data) {
+    browser_data->session_dir = get_config_path("session");
+    if (!browser_data->session_dir || g_mkdir_with_parents(browser_data->session_dir, 0700) != 0) {
+        g_warning("Failed to create session directory; the session will not be saved");
+        g_clear_pointer(&browser_data->session_dir, g_free);
+        return;
+    }
+    
+    browser_data->session_writer = g_thread_pool_new(session_write_job, NULL, 1, FALSE, NULL);
+    browser_data->session_source = g_timeout_add_seconds(SESSION_SAVE_INTERVAL, session_autosave,
+                                                         browser_data);
+}
+
+// Final save on exit. Returns the writer, which the caller waits for.
+static GThreadPool *session_close(BrowserData *browser_data) {
+    GThreadPool *writer = browser_data->session_writer;
+    if (!writer) return NULL;
+    
+    if (browser_data->session_source) {
+        g_source_remove(browser_data->session_source);
+        browser_data->session_source = 0;
+    }
+    session_save(browser_data);
+    browser_data->session_writer = NULL;
+    return writer;
+}
+
+// Delete state files of tabs that are not open
+static void session_prune(BrowserData *browser_data) {
+    GDir *dir = g_dir_open(browser_data->session_dir, 0, NULL);
+    const gchar *name;
+    if (!dir) return;
+    
+    GHashTable *live = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        g_hash_table_add(live, GUINT_TO_POINTER(tab->session_id));
+    }
+    
+    while ((name = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(name, ".state")) continue;
+        guint id = (guint)g_ascii_strtoull(name, NULL, 10);
+        if (!g_hash_table_contains(live, GUINT_TO_POINTER(id))) {
+            session_queue_write(browser_data, g_build_filename(browser_data->session_dir, name, NULL), NULL);
+        }
+    }
+    
+    g_hash_table_destroy(live);
+    g_dir_close(dir);
+}
+
+// Reopen the saved tabs. Only the current one gets a web view; it rebuilds
+// its back/forward list from the saved state and loads just the current
+// entry. The others stay discarded until they are focused.
+static gboolean session_restore(BrowserData *browser_data) {
+    gchar *path = g_build_filename(browser_data->session_dir, "session.txt", NULL);
+    gchar *contents = NULL;
+    gboolean ok = g_file_get_contents(path, &contents, NULL, NULL);
+    g_free(path);
+    if (!ok) return FALSE;
+    
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gint current = 0;
+    
+    browser_data->restoring_session = TRUE;
+    for (guint i = 0; lines[i]; i++) {
+        const gchar *fields[6];
+        gsize lengths[6];
+        guint count = split_record(lines[i], lines[i] + strlen(lines[i]), fields, lengths, 6);
+        
+        if (count == 2 && lengths[0] == 1 && fields[0][0] == 'C') {
+            current = (gint)g_ascii_strtoll(fields[1], NULL, 10);
+            continue;
+        }
+        if (count != 6 || lengths[0] != 1 || fields[0][0] != 'T') continue;
+        
+        guint id = (guint)g_ascii_strtoull(fields[1], NULL, 10);
+        gchar *uri = g_strndup(fields[4], lengths[4]);
+        gchar *title = g_strndup(fields[5], lengths[5]);
+        if (id == 0 || !is_valid_url(uri)) {
+            g_free(title);
+            g_free(uri);
+            continue;
+        }
+        
+        Tab *tab = tab_new(browser_data, uri, *title ? title : uri);
+        tab->session_id = id;
+        browser_data->next_session_id = MAX(browser_data->next_session_id, id);
+        tab->scroll_x = (gint)g_ascii_strtoll(fields[2], NULL, 10);
+        tab->scroll_y = (gint)g_ascii_strtoll(fields[3], NULL, 10);
+        tab->restore_scroll = tab->scroll_x != 0 || tab->scroll_y != 0;
+        
+        gchar *state_path = session_state_path(browser_data, id);
+        gchar *state_data;
+        gsize state_length;
+        if (g_file_get_contents(state_path, &state_data, &state_length, NULL)) {
+            GBytes *bytes = g_bytes_new_take(state_data, state_length);
+            tab->session_state = webkit_web_view_session_state_new(bytes);
+            g_bytes_unref(bytes);
+        }
+        g_free(state_path);
+        
+        // Same placeholder as a discarded tab without a thumbnail
+        tab->thumbnail_image = gtk_label_new(uri);
+        gtk_box_pack_start(GTK_BOX(tab->page), tab->thumbnail_image, TRUE, TRUE, 0);
+        gtk_widget_show(tab->thumbnail_image);
+        tab_attach(tab);
+        
+        g_free(title);
+        g_free(uri);
+    }
+    browser_data->restoring_session = FALSE;
+    g_strfreev(lines);
+    g_free(contents);
+    
+    if (browser_data->tabs->len == 0) return FALSE;
+
+    
+    if (current < 0 || (guint)current >= browser_data->tabs->len) current = 0;
+    GtkNotebook *notebook = GTK_NOTEBOOK(browser_data->notebook);
+    Tab *tab = g_ptr_array_index(browser_data->tabs, current);
+    gtk_notebook_set_current_page(notebook, current);
+    tab->last_focused = g_get_monotonic_time();
+    tab_restore(tab);
+    gtk_entry_set_text(GTK_ENTRY(browser_data->url_entry), tab->uri ? tab->uri : "");
+    return TRUE;
+}
+
+// Create the first view once the window is up, restoring the last
+// session unless a URL was given
+static gboolean open_first_tab(gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    
+    if (!browser_data->restore_session || !session_restore(browser_data)) {
+        open_tab(browser_data, browser_data->home_url, TRUE);
+    }
+    if (browser_data->session_dir) {
+        session_prune(browser_data);
+    }
+    startup_trace_mark("first-navigation-started");
+    return G_SOURCE_REMOVE;
+}
+
+// Single instance: the first tinyweb listens on a Unix socket in the user's
+// runtime directory, and later invocations hand it their URL and exit
+// before initializing GTK. The socket doubles as a control API for scripts:
+// a client sends one command line and reads one reply line, "ok[ VALUE]"
+// or "error MESSAGE".
+//
+//   open URL     open URL in a new tab
+//   load URL     load URL in the current tab
+//   reload       reload the current tab
+//   uri          URI of the current tab
+//   title        title of the current tab
+//   present      raise the window
+#define CONTROL_TIMEOUT_SECONDS 5
+
+typedef struct {
+    BrowserData *browser_data;
+    int fd;
+    GString *request;
+    guint watch_id;
+    guint timeout_id; // Drops clients that connect but never finish a request
+} ControlClient;
+
+static gchar *control_socket_path(void) {
+    return g_build_filename(g_get_user_runtime_dir(), "tinyweb", "control", NULL);
+}
+
+static gboolean control_socket_address(const gchar *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) return FALSE;
+    
+    strcpy(address->sun_path, path);
+    return TRUE;
+}
+
+// Like write_all(), but a peer that went away is an error, not SIGPIPE
+static gboolean control_write(int fd, const gchar *buffer, gsize length) {
+    while (length > 0) {
+        ssize_t written = send(fd, buffer, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return TRUE;
+}
+
+// Connect to the running instance, or return -1 if there is none
+static int control_connect(void) {
+    gchar *path = control_socket_path();
+    struct sockaddr_un address;
+    int fd = -1;
+    
+    if (control_socket_address(path, &address)) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    
+    g_free(path);
+    return fd;
+}
+
+// Send one command and return the reply line, or NULL when no instance is
+// running or it did not answer in time
+static gchar *control_send(const gchar *command) {
+    int fd = control_connect();
+    if (fd < 0) return NULL;
+    
+    struct timeval timeout = { CONTROL_TIMEOUT_SECONDS, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    gchar *request = g_strconcat(command, "\n", NULL);
+    GString *reply = g_string_new(NULL);
+    gchar *newline = NULL;
+    
+    if (control_write(fd, request, strlen(request))) {
+        char buffer[1024];
+        while (!newline && reply->len < MAX_LINE_LENGTH) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            
+            g_string_append_len(reply, buffer, n);
+            newline = strchr(reply->str, '\n');
+        }
+    }
+    
+    close(fd);
+    g_free(request);
+    if (!newline) {
+        g_string_free(reply, TRUE);
+        return NULL;
+    }
+    g_string_truncate(reply, newline - reply->str);
+    return g_string_free(reply, FALSE);
+}
+
+// Work out what to send to a running instance, or NULL when this process
+// must run on its own. *remote_only is set for --remote, which never
+// starts a browser.
+static gchar *control_command_from_args(int argc, char *argv[], gboolean *remote_only) {
+    gchar *command = NULL;
+    const char *import_path = NULL, *export_path = NULL, *export_format = NULL;
+    
+    *remote_only = FALSE;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--new-instance") == 0 || strcmp(argv[i], "--bench") == 0 ||
+            strcmp(argv[i], "--bench-bookmarks") == 0 || strcmp(argv[i], "--prewarm") == 0 ||
+            strcmp(argv[i], "--render") == 0 || strcmp(argv[i], "--bench-urls") == 0 ||
+            strcmp(argv[i], "--download") == 0 || strcmp(argv[i], "--bench-index") == 0 ||
+            strcmp(argv[i], "--bench-import") == 0 || strcmp(argv[i], "--help") == 0) {
+            g_free(command);
+            return NULL;
+        } else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc) {
+            import_path = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_path = argv[++i];
+        } else if (strcmp(argv[i], "--export-format") == 0 && i + 1 < argc) {
+            export_format = argv[++i];
+        } else if (strcmp(argv[i], "--remote") == 0 && i + 1 < argc) {
+            // --remote COMMAND [ARGUMENT]
+            g_free(command);
+            if (i + 2 < argc && strncmp(argv[i + 2], "--", 2) != 0) {
+                command = g_strdup_printf("%s %s", argv[i + 1], argv[i + 2]);
+            } else {
+                command = g_strdup(argv[i + 1]);
+            }
+            *remote_only = TRUE;
+            return command;
+        } else if ((strcmp(argv[i], "--home") == 0 || strcmp(argv[i], "-h") == 0) && i + 1 < argc) {
+            if (is_valid_url(argv[++i])) {
+                g_free(command);
+                command = g_strdup_printf("open %s", argv[i]);
+            }
+        } else if (strstr(argv[i], "://") != NULL && is_valid_url(argv[i])) {
+            g_free(command);
+            command = g_strdup_printf("open %s", argv[i]);
+        } else if (argv[i][0] == '-') {
+            // Any other option configures this process (--hw-accel, --cache-dir,
+            // --max-live-tabs, ...); a running instance could not honour it
+            g_free(command);
+            return NULL;
+        }
+    }
+    
+    // A running browser owns the bookmarks journal, so it does the transfer.
+    // It runs one at a time; asking for both is refused later on.
+    if (import_path && export_path) {
+        g_free(command);
+        return NULL;
+    } else if (import_path || export_path) {
+        gchar *path = g_canonicalize_filename(import_path ? import_path : export_path, NULL);
+        g_free(command);
+        command = g_strdup_printf("%s %s%s%s", import_path ? "import" : "export",
+                                  export_format && !import_path ? export_format : "",
+                                  export_format && !import_path ? " " : "", path);
+        g_free(path);
+    }
+    
+    return command ? command : g_strdup("present");
+}
+
+static gchar *begin_bookmark_transfer(BrowserData *browser_data, gboolean exporting, const gchar *path,
+                                      const gchar *format_name);
+
+// Run one command and return the reply line
+static gchar *control_handle(BrowserData *browser_data, const gchar *request) {
+    if (browser_data->shutting_down) return g_strdup("error shutting down");
+    
+    const gchar *argument = strchr(request, ' ');
+    gchar *name = argument ? g_strndup(request, argument - request) : g_strdup(request);
+    argument = argument ? argument + 1 : "";
+    
+    Tab *tab = get_current_tab(browser_data);
+    gchar *reply;
+    
+    if (strcmp(name, "open") == 0 || strcmp(name, "load") == 0) {
+        gchar *url = url_normalize(argument);
+        if (!url) {
+            reply = g_strdup("error invalid URL");
+        } else if (name[0] == 'o' || !tab || !tab->web_view) {
+            open_tab(browser_data, url, TRUE);
+            gtk_window_present(GTK_WINDOW(browser_data->window));
+            reply = g_strdup("ok");
+        } else {
+            webkit_web_view_load_uri(tab->web_view, url);
+            reply = g_strdup("ok");
+        }
+        g_free(url);
+    } else if (strcmp(name, "reload") == 0) {
+        if (tab && tab->web_view) {
+            webkit_web_view_reload(tab->web_view);
+            reply = g_strdup("ok");
+        } else {
+            reply = g_strdup("error no tab");
+        }
+    } else if (strcmp(name, "uri") == 0 || strcmp(name, "title") == 0) {
+        if (tab) {
+            const gchar *value = name[0] == 'u'
+                ? (tab->web_view ? tab_page_uri(tab) : tab->uri)
+                : (tab->web_view ? webkit_web_view_get_title(tab->web_view) : NULL);
+            reply = g_strdup_printf("ok %s", value ? value : "");
+            g_strdelimit(reply, "\r\n", ' '); // One reply, one line
+        } else {
+            reply = g_strdup("error no tab");
+        }
+    } else if (strcmp(name, "present") == 0) {
+        gtk_window_present(GTK_WINDOW(browser_data->window));
+        reply = g_strdup("ok");
+    } else if (strcmp(name, "import") == 0 || strcmp(name, "export") == 0) {
+        // import PATH, export [FORMAT] PATH; runs in the background
+        gboolean exporting = name[0] == 'e';
+        const gchar *path = argument;
+        gchar *format = NULL;
+        if (exporting && !g_path_is_absolute(argument) && (path = strchr(argument, ' '))) {
+            format = g_strndup(argument, path++ - argument);
+        }
+        
+        if (!path || !g_path_is_absolute(path)) {
+            reply = g_strdup("error expected an absolute path");
+        } else {
+            gchar *error = begin_bookmark_transfer(browser_data, exporting, path, format);
+            reply = error ? g_strdup_printf("error %s", error) : g_strdup("ok");
+            g_free(error);
+        }
+        g_free(format);
+    } else {
+        reply = g_strdup_printf("error unknown command %s", name);
+    }
+    
+    g_free(name);
+    return reply;
+}
+
+static void control_client_free(ControlClient *client) {
+    if (client->watch_id) g_source_remove(client->watch_id);
+    if (client->timeout_id) g_source_remove(client->timeout_id);
+    close(client->fd);
+    g_string_free(client->request, TRUE);
+    g_free(client);
+}
+
+// A client that never sends a full line is hung up on after the timeout
+static gboolean control_client_timeout(gpointer data) {
+    ControlClient *client = (ControlClient *)data;
+    client->timeout_id = 0;
+    control_client_free(client);
+    return G_SOURCE_REMOVE;
+}
+
+// Read until the request line is complete, then answer and hang up
+static gboolean control_client_readable(gint fd, GIOCondition condition, gpointer data) {
+    ControlClient *client = (ControlClient *)data;
+    char buffer[1024];
+    gboolean done = FALSE;
+    
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) {
+            done = TRUE; // Peer closed; answer what was sent, if anything
+            break;
+        }
+        g_string_append_len(client->request, buffer, n);
+        if (memchr(buffer, '\n', n) || client->request->len > MAX_LINE_LENGTH) {
+            done = TRUE;
+            break;
+        }
+    }
+    if (!done) return G_SOURCE_CONTINUE;
+    client->watch_id = 0; // Removed by returning G_SOURCE_REMOVE below
+    
+    gchar *newline = strchr(client->request->str, '\n');
+    if (newline) {
+        g_string_truncate(client->request, newline - client->request->str);
+    }
+    if (client->request->len > 0 && client->request->str[client->request->len - 1] == '\r') {
+        g_string_truncate(client->request, client->request->len - 1);
+    }
+    
+    if (client->request->len > 0) {
+        gchar *reply = client->request->len > MAX_LINE_LENGTH
+            ? g_strdup("error request too long")
+            : control_handle(client->browser_data, client->request->str);
+        gchar *line = g_strconcat(reply, "\n", NULL);
+        control_write(fd, line, strlen(line));
+        g_free(line);
+        g_free(reply);
+    }
+    
+    control_client_free(client);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean control_accept(gint fd, GIOCondition condition, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    int client_fd;
+    
+    while ((client_fd = accept(fd, NULL, NULL)) >= 0) {
+        fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+        g_unix_set_fd_nonblocking(client_fd, TRUE, NULL);
+        
+        ControlClient *client = g_new0(ControlClient, 1);
+        client->browser_data = browser_data;
+        client->fd = client_fd;
+        client->request = g_string_new(NULL);
+        client->watch_id = g_unix_fd_add(client_fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                         control_client_readable, client);
+        client->timeout_id = g_timeout_add_seconds(CONTROL_TIMEOUT_SECONDS, control_client_timeout, client);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Bind the control socket and return it, or -1
+static int control_listen(const gchar *path) {
+    struct sockaddr_un address;
+    if (!control_socket_address(path, &address)) return -1;
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+    
+    gboolean bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // Either another instance started at the same time, or a crashed
+        // one left its socket behind
+        int other = control_connect();
+        if (other >= 0) {
+            close(other);
+            close(fd);
+            g_warning("Another tinyweb is running, this one will not accept remote commands");
+            return -1;
+        }
+        unlink(path);
+        bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    }
+    
+    if (!bound || listen(fd, 16) != 0) {
+        g_warning("Cannot listen on %s: %s", path, g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Listen for other invocations and control clients
+static void control_server_start(BrowserData *browser_data) {
+    gchar *path = control_socket_path();
+    gchar *dir = g_path_get_dirname(path);
+    int fd = -1;
+    
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        g_warning("Failed to create runtime directory %s", dir);
+    } else {
+        fd = control_listen(path);
+    }
+    
+    if (fd >= 0) {
+        browser_data->control_fd = fd;
+        browser_data->control_path = path;
+        browser_data->control_source = g_unix_fd_add(fd, G_IO_IN, control_accept, browser_data);
+    } else {
+        g_free(path);
+    }
+    g_free(dir);
+}
+
+static void control_server_stop(BrowserData *browser_data) {
+    if (browser_data->control_fd < 0) return;
+    
+    g_source_remove(browser_data->control_source);
+    close(browser_data->control_fd);
+    unlink(browser_data->control_path);
+    g_clear_pointer(&browser_data->control_path, g_free);
+    browser_data->control_fd = -1;
+}
+
+// Shutdown runs in phases under a time budget: the window is already gone
+// when "destroy" fires, state that needs the views is saved and the web
+// processes are terminated on the main thread, then a worker waits for the
+// writer threads and syncs the open files. The main loop exits when the
+// worker is done or the budget runs out, whichever comes first.
+#define SHUTDOWN_BUDGET_MS 3000
+
+static gboolean shutdown_trace;
+
+typedef struct {
+    gint64 start;
+    gdouble save_ms;
+    gdouble views_ms;
+    gdouble flush_ms;
+    guint deadline_source;
+    GThreadPool *writers[3];
+    int fds[2];
+} Shutdown;
+
+static gdouble shutdown_elapsed_ms(Shutdown *shutdown) {
+    return (g_get_monotonic_time() - shutdown->start) / 1000.0;
+}
+
+static void shutdown_report(Shutdown *shutdown, gboolean timed_out) {
+    gdouble total_ms = shutdown_elapsed_ms(shutdown);
+    
+    if (timed_out) {
+        g_warning("Shutdown took longer than %d ms, exiting before state was flushed", SHUTDOWN_BUDGET_MS);
+    }
+    if (shutdown_trace || timed_out) {
+        gchar flush[32] = "unfinished";
+        if (!timed_out) {
+            g_snprintf(flush, sizeof(flush), "%.1f ms", shutdown->flush_ms - shutdown->views_ms);
+        }
+        g_printerr("shutdown-trace: save %.1f ms, terminate views %.1f ms, flush %s, total %.1f ms\n",
+                   shutdown->save_ms, shutdown->views_ms - shutdown->save_ms, flush, total_ms);
+    }
+}
+
+static gboolean shutdown_flushed(gpointer data) {
+    Shutdown *shutdown = (Shutdown *)data;
+    
+    shutdown->flush_ms = shutdown_elapsed_ms(shutdown);
+    if (shutdown->deadline_source) {
+        g_source_remove(shutdown->deadline_source);
+        shutdown->deadline_source = 0;
+        shutdown_report(shutdown, FALSE);
+        gtk_main_quit();
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean shutdown_deadline(gpointer data) {
+    Shutdown *shutdown = (Shutdown *)data;
+    
+    // The worker may still be writing; appends and renames keep files
+    // consistent if the process exits under it
+    shutdown->deadline_source = 0;
+    shutdown_report(shutdown, TRUE);
+    gtk_main_quit();
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer shutdown_flush_thread(gpointer data) {
+    Shutdown *shutdown = (Shutdown *)data;
+    
+    for (guint i = 0; i < G_N_ELEMENTS(shutdown->writers); i++) {
+        if (shutdown->writers[i]) {
+            g_thread_pool_free(shutdown->writers[i], FALSE, TRUE);
+        }
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(shutdown->fds); i++) {
+        if (shutdown->fds[i] >= 0) {
+            fsync(shutdown->fds[i]);
+            close(shutdown->fds[i]);
+        }
+    }
+    
+    g_idle_add(shutdown_flushed, shutdown);
+    return NULL;
+}
+
+static void download_manager_close(DownloadManager *manager);
+static void bookmark_transfer_cancel(BookmarkTransfer *transfer);
+
+// Callback to close the application
+static void on_destroy(GtkWidget *widget, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    static Shutdown shutdown;
+    
+    shutdown.start = g_get_monotonic_time();
+    browser_data->shutting_down = TRUE;
+    
+    // Stop background work; deferred loading is no longer worth doing
+    browser_data->deferred_loaded = TRUE;
+    if (browser_data->deferred_source) {
+        g_source_remove(browser_data->deferred_source);
+        browser_data->deferred_source = 0;
+    }
+    if (browser_data->hud_source) {
+        g_source_remove(browser_data->hud_source);
+        browser_data->hud_source = 0;
+    }
+    if (browser_data->bookmarks_compact_source) {
+        // The journal is valid as is; the next start compacts it
+        g_source_remove(browser_data->bookmarks_compact_source);
+        browser_data->bookmarks_compact_source = 0;
+    }
+    if (browser_data->bookmark_transfer) {
+        // An import stops before its next batch; an export leaves no file behind
+        bookmark_transfer_cancel(browser_data->bookmark_transfer);
+    }
+    if (browser_data->memory_guard && browser_data->memory_guard->poll_source) {
+        g_source_remove(browser_data->memory_guard->poll_source);
+        browser_data->memory_guard->poll_source = 0;
+    }
+    if (browser_data->prefetcher && browser_data->prefetcher->typed_source) {
+        g_source_remove(browser_data->prefetcher->typed_source);
+        browser_data->prefetcher->typed_source = 0;
+    }
+    if (browser_data->page_completion_source) {
+        g_source_remove(browser_data->page_completion_source);
+        browser_data->page_completion_source = 0;
+    }
+    
+    // Later invocations start their own instance from here on
+    control_server_stop(browser_data);
+    
+    // Frames of the last second before exit are not reported
+    if (browser_data->frame_profiler) {
+        frame_profiler_report(browser_data->frame_profiler);
+    }
+    
+    // Save navigation state while the views still have it
+    if (browser_data->download_manager) {
+        download_manager_close(browser_data->download_manager);
+    }
+    shutdown.writers[0] = session_close(browser_data);
+    shutdown.writers[1] = browser_data->history ? history_close(browser_data->history) : NULL;
+    shutdown.writers[2] = browser_data->page_index ? page_index_close(browser_data->page_index) : NULL;
+    shutdown.save_ms = shutdown_elapsed_ms(&shutdown);
+    
+    // Terminate the web processes instead of waiting for pages to unload
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        if (tab->discard_cancellable) {
+            g_cancellable_cancel(tab->discard_cancellable);
+        }
+        if (!tab->web_view) continue;
+        
+        g_signal_handlers_disconnect_by_data(tab->web_view, tab);
+        webkit_web_view_terminate_web_process(tab->web_view);
+    }
+    shutdown.views_ms = shutdown_elapsed_ms(&shutdown);
+    
+    // Files are synced and closed by the worker
+    shutdown.fds[0] = browser_data->bookmarks_fd;
+    shutdown.fds[1] = browser_data->perf_log_fd;
+    browser_data->bookmarks_fd = -1;
+    browser_data->perf_log_fd = -1;
+    
+    shutdown.deadline_source = g_timeout_add(SHUTDOWN_BUDGET_MS, shutdown_deadline, &shutdown);
+    g_thread_unref(g_thread_new("shutdown", shutdown_flush_thread, &shutdown));
+}
+
+// Bookmarks are kept in an append-only journal. An add record is the
+// classic "title|url" line, with an optional third "|tags" field, so a
+// compacted journal without tags is a plain bookmarks.txt. A delete record
+// is "||N", where N is the index of the add record it cancels; every
+// Bookmark remembers the index of its own add record.
+#define BOOKMARK_COMPACT_MIN_DEAD 256
+
+// Open the journal for appending, repairing a torn final record if needed
+static gboolean open_bookmark_journal(BrowserData *browser_data) {
+    if (browser_data->bookmarks_fd >= 0) return TRUE;
+    if (!browser_data->bookmarks_path) return FALSE;
+    
+    int fd = open(browser_data->bookmarks_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_warning("Failed to open bookmarks journal %s: %s",
+                  browser_data->bookmarks_path, g_strerror(errno));
+        return FALSE;
+    }
+    
+    // An interrupted append leaves a line without a newline. The loader
+    // ignores it, so cut it off before the next record is written.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        char chunk[MAX_LINE_LENGTH];
+        off_t end = st.st_size;
+        
+        while (end > 0) {
+            off_t start = end > (off_t)sizeof(chunk) ? end - (off_t)sizeof(chunk) : 0;
+            ssize_t got = pread(fd, chunk, end - start, start);
+            if (got != end - start) break;
+            
+            ssize_t k = got - 1;
+            while (k >= 0 && chunk[k] != '\n') k--;
+            if (k >= 0) {
+                end = start + k + 1;
+                break;
+            }
+            end = start;
+        }
+        
+        if (end < st.st_size && ftruncate(fd, end) != 0) {
+            g_warning("Failed to repair bookmarks journal %s: %s",
+                      browser_data->bookmarks_path, g_strerror(errno));
+        }
+    }
+    
+    browser_data->bookmarks_fd = fd;
+    return TRUE;
+}
+
+static gboolean append_bookmark_record(BrowserData *browser_data, const gchar *record, gsize length) {
+    if (!open_bookmark_journal(browser_data)) return FALSE;
+    
+    // Records are small, so a single O_APPEND write lands as one unit. An
+    // imported batch is larger; if it fails part way, cut it off again so
+    // record indexes stay in step with the journal.
+    off_t size = lseek(browser_data->bookmarks_fd, 0, SEEK_END);
+    if (!write_all(browser_data->bookmarks_fd, record, length)) {
+        g_warning("Failed to append to bookmarks journal %s: %s",
+                  browser_data->bookmarks_path, g_strerror(errno));
+        if (size >= 0 && ftruncate(browser_data->bookmarks_fd, size) != 0) {
+            g_warning("Failed to repair bookmarks journal %s: %s",
+                      browser_data->bookmarks_path, g_strerror(errno));
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Split text into lowercase words for the bookmark index. Bytes outside
+// ASCII count as word characters, so UTF-8 words stay whole.
+static void bookmark_split_words(const gchar *text, GString *out) {
+    for (const gchar *p = text; *p; ) {
+        while (*p && g_ascii_isascii(*p) && !g_ascii_isalnum(*p)) p++;
+        if (!*p) break;
+        
+        g_string_append_c(out, ' ');
+        while (*p && (!g_ascii_isascii(*p) || g_ascii_isalnum(*p))) {
+            g_string_append_c(out, g_ascii_tolower(*p++));
+        }
+    }
+}
+
+// Build " word word ... #tag #tag " for matching and indexing
+static gchar *bookmark_search_text(const gchar *title, const gchar *url, const gchar *tags) {
+    GString *text = g_string_new(NULL);
+    
+    bookmark_split_words(title, text);
+    bookmark_split_words(completion_url_key(url), text);
+    
+    gchar **tag_list = g_strsplit(tags, ",", -1);
+    for (guint i = 0; tag_list[i]; i++) {
+        gchar *tag = g_ascii_strdown(g_strstrip(tag_list[i]), -1);
+        if (*tag && !strchr(tag, ' ')) {
+            g_string_append_printf(text, " #%s", tag);
+        }
+        g_free(tag);
+    }
+    g_strfreev(tag_list);
+    
+    g_string_append_c(text, ' ');
+    return g_string_free(text, FALSE);
+}
+
+// Normalize comma separated tags to "a, b, c" without empty or duplicate
+// tags. Spaces and '|' inside a tag become '-'.
+static gchar *normalize_bookmark_tags(const gchar *text) {
+    gchar **parts = g_strsplit(text, ",", -1);
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GString *tags = g_string_new(NULL);
+    
+    for (guint i = 0; parts[i]; i++) {
+        gchar *tag = g_strdelimit(g_strstrip(parts[i]), " |", '-');
+        if (*tag && g_hash_table_add(seen, g_ascii_strdown(tag, -1))) {
+            if (tags->len) g_string_append(tags, ", ");
+            g_string_append(tags, tag);
+        }
+    }
+    g_hash_table_destroy(seen);
+    g_strfreev(parts);
+    return g_string_free(tags, FALSE);
+}
+
+static Bookmark *bookmark_new(const gchar *title, const gchar *url, const gchar *tags, guint64 record) {
+    Bookmark *bookmark = g_new0(Bookmark, 1);
+    bookmark->title = g_strdup(title);
+    bookmark->url = g_strdup(url);
+    bookmark->tags = g_strdup(tags);
+    bookmark->record = record;
+    bookmark->search_text = bookmark_search_text(title, url, tags);
+    bookmark->key = url_canonical_key(url);
+    if (!bookmark->key) {
+        bookmark->key = g_strdup(url);
+    }
+    return bookmark;
+}
+
+static void bookmark_free(gpointer data) {
+    Bookmark *bookmark = (Bookmark *)data;
+    g_free(bookmark->title);
+    g_free(bookmark->url);
+    g_free(bookmark->tags);
+    g_free(bookmark->search_text);
+    g_free(bookmark->key);
+    g_free(bookmark->collate_key);
+    g_free(bookmark);
+}
+
+static BookmarkIndex *bookmark_index_new(void) {
+    BookmarkIndex *index = g_new0(BookmarkIndex, 1);
+    index->keys = g_array_new(FALSE, FALSE, sizeof(BookmarkKey));
+    index->words = g_string_chunk_new(64 * 1024);
+    return index;
+}
+
+static gint compare_bookmark_keys(gconstpointer a, gconstpointer b) {
+    const BookmarkKey *x = (const BookmarkKey *)a, *y = (const BookmarkKey *)b;
+    gint result = strcmp(x->word, y->word);
+    if (result != 0) return result;
+    return x->bookmark < y->bookmark ? -1 : (x->bookmark > y->bookmark ? 1 : 0);
+}
+
+// First key position that is not less than the word
+static guint bookmark_index_lower_bound(BookmarkIndex *index, const gchar *word) {
+    guint low = 0, high = index->keys->len;
+    
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+        if (strcmp(g_array_index(index->keys, BookmarkKey, mid).word, word) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Call fn for each distinct word of a bookmark's search text
+static void bookmark_foreach_word(Bookmark *bookmark, void (*fn)(BookmarkIndex *, const gchar *, Bookmark *),
+                                  BookmarkIndex *index) {
+    gchar **words = g_strsplit(bookmark->search_text, " ", -1);
+    
+    for (guint i = 0; words[i]; i++) {
+        if (!*words[i]) continue;
+        
+        gboolean repeated = FALSE;
+        for (guint j = 0; j < i && !repeated; j++) {
+            repeated = strcmp(words[i], words[j]) == 0;
+        }
+        if (!repeated) {
+            fn(index, words[i], bookmark);
+        }
+    }
+    g_strfreev(words);
+}
+
+static void bookmark_index_append_word(BookmarkIndex *index, const gchar *word, Bookmark *bookmark) {
+    BookmarkKey key = { g_string_chunk_insert_const(index->words, word), bookmark };
+    g_array_append_val(index->keys, key);
+}
+
+// Position of a key in the (word, bookmark) order of the index
+static guint bookmark_index_key_position(BookmarkIndex *index, const BookmarkKey *key) {
+    guint low = 0, high = index->keys->len;
+    
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+        if (compare_bookmark_keys(&g_array_index(index->keys, BookmarkKey, mid), key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void bookmark_index_insert_word(BookmarkIndex *index, const gchar *word, Bookmark *bookmark) {
+    BookmarkKey key = { g_string_chunk_insert_const(index->words, word), bookmark };
+    g_array_insert_val(index->keys, bookmark_index_key_position(index, &key), key);
+}
+
+static void bookmark_index_remove_word(BookmarkIndex *index, const gchar *word, Bookmark *bookmark) {
+    BookmarkKey key = { word, bookmark };
+    guint position = bookmark_index_key_position(index, &key);
+    
+    if (position < index->keys->len &&
+        g_array_index(index->keys, BookmarkKey, position).bookmark == bookmark &&
+        strcmp(g_array_index(index->keys, BookmarkKey, position).word, word) == 0) {
+        g_array_remove_index(index->keys, position);
+    }
+}
+
+// Add a bookmark. While bulk loading, pass sorted = FALSE and call
+// bookmark_index_sort() once at the end.
+static void bookmark_index_add(BookmarkIndex *index, Bookmark *bookmark, gboolean sorted) {
+    bookmark_foreach_word(bookmark, sorted ? bookmark_index_insert_word : bookmark_index_append_word, index);
+}
+
+static void bookmark_index_sort(BookmarkIndex *index) {
+    g_array_sort(index->keys, compare_bookmark_keys);
+}
+
+static void bookmark_index_remove(BookmarkIndex *index, Bookmark *bookmark) {
+    bookmark_foreach_word(bookmark, bookmark_index_remove_word, index);
+}
+
+static gint compare_bookmarks_by_record(gconstpointer a, gconstpointer b) {
+    const Bookmark *x = *(Bookmark * const *)a, *y = *(Bookmark * const *)b;
+    return x->record < y->record ? -1 : (x->record > y->record ? 1 : 0);
+}
+
+// Collect the bookmarks matching every word of the query, and the tag if
+// given, in the order they were added. Candidates come from the index range
+// of the most selective word; only those are checked against the others,
+// so the cost follows the number of matches rather than of bookmarks.
+static void bookmark_index_query(BookmarkIndex *index, GPtrArray *bookmarks, const gchar *query,
+                                 const gchar *tag, GPtrArray *results) {
+    GString *text = g_string_new(NULL);
+    bookmark_split_words(query ? query : "", text);
+    if (tag && *tag) {
+        gchar *lower = g_ascii_strdown(tag, -1);
+        g_string_append_printf(text, " #%s", lower);
+        g_free(lower);
+    }
+    
+    gchar **words = g_strsplit(text->str, " ", -1);
+    GPtrArray *needles = g_ptr_array_new_with_free_func(g_free);
+    guint best_low = 0, best_high = 0;
+    gboolean have_range = FALSE;
+    
+    for (guint i = 0; words[i]; i++) {
+        if (!*words[i]) continue;
+        
+        // Query words match word prefixes; the tag must match exactly
+        gboolean exact = words[i][0] == '#';
+        g_ptr_array_add(needles, g_strconcat(" ", words[i], exact ? " " : NULL, NULL));
+        
+        gsize length = strlen(words[i]);
+        guint low = bookmark_index_lower_bound(index, words[i]);
+        guint high = low;
+        while (high < index->keys->len &&
+               strncmp(g_array_index(index->keys, BookmarkKey, high).word, words[i], length) == 0) {
+            high++;
+        }
+        if (!have_range || high - low < best_high - best_low) {
+            best_low = low;
+            best_high = high;
+            have_range = TRUE;
+        }
+    }
+    
+    if (!have_range) {
+        // No query: everything, already in order
+        for (guint i = 0; i < bookmarks->len; i++) {
+            g_ptr_array_add(results, g_ptr_array_index(bookmarks, i));
+        }
+    } else {
+        guint generation = ++index->generation;
+        
+        for (guint i = best_low; i < best_high; i++) {
+            Bookmark *bookmark = g_array_index(index->keys, BookmarkKey, i).bookmark;
+            if (bookmark->seen == generation) continue;
+            bookmark->seen = generation;
+            
+            gboolean match = TRUE;
+            for (guint n = 0; n < needles->len && match; n++) {
+                match = strstr(bookmark->search_text, g_ptr_array_index(needles, n)) != NULL;
+            }
+            if (match) {
+                g_ptr_array_add(results, bookmark);
+            }
+        }
+        g_ptr_array_sort(results, compare_bookmarks_by_record);
+    }
+    
+    g_ptr_array_free(needles, TRUE);
+    g_strfreev(words);
+    g_string_free(text, TRUE);
+}
+
+// Distinct tags, which the bookmark manager offers as folders. Tag keys
+// start with '#', so they are one contiguous run of the sorted index.
+static GPtrArray *bookmark_index_tags(BookmarkIndex *index) {
+    GPtrArray *tags = g_ptr_array_new();
+    const gchar *previous = NULL;
+    
+    for (guint i = bookmark_index_lower_bound(index, "#"); i < index->keys->len; i++) {
+        const gchar *word = g_array_index(index->keys, BookmarkKey, i).word;
+        if (word[0] != '#') break;
+        if (!previous || strcmp(previous, word) != 0) {
+            g_ptr_array_add(tags, (gpointer)(word + 1));
+        }
+        previous = word;
+    }
+    return tags;
+}
+
+// Rewrite the journal with only live bookmarks and atomically replace it
+static gboolean compact_bookmarks(gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    
+    browser_data->bookmarks_compact_source = 0;
+    if (!browser_data->bookmarks_path) return G_SOURCE_REMOVE;
+    
+    GString *contents = g_string_new(NULL);
+    for (guint i = 0; i < browser_data->bookmarks->len; i++) {
+        Bookmark *bookmark = g_ptr_array_index(browser_data->bookmarks, i);
+        
+        // Sanitize data before saving
+        gchar *safe_title = sanitize_string(bookmark->title);
+        gchar *safe_url = sanitize_string(bookmark->url);
+        gchar *safe_tags = sanitize_string(bookmark->tags);
+        g_string_append_printf(contents, "%s|%s%s%s\n", safe_title, safe_url,
+                               *safe_tags ? "|" : "", safe_tags);
+        
+        g_free(safe_tags);
+        g_free(safe_title);
+        g_free(safe_url);
+    }
+    
+    gchar *tmp_path = g_strconcat(browser_data->bookmarks_path, ".tmp", NULL);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    gboolean ok = fd >= 0 && write_all(fd, contents->str, contents->len) && fsync(fd) == 0;
+    if (fd >= 0) {
+        ok = close(fd) == 0 && ok;
+    }
+    ok = ok && rename(tmp_path, browser_data->bookmarks_path) == 0;
+    
+    if (ok) {
+        // Record indexes restart from zero in the compacted journal
+        for (guint i = 0; i < browser_data->bookmarks->len; i++) {
+            ((Bookmark *)g_ptr_array_index(browser_data->bookmarks, i))->record = i;
+        }
+        
+        if (browser_data->bookmarks_fd >= 0) {
+            close(browser_data->bookmarks_fd);
+            browser_data->bookmarks_fd = -1;
+        }
+        browser_data->bookmarks_next_record = browser_data->bookmarks->len;
+        browser_data->bookmarks_dead_records = 0;
+    } else {
+        g_warning("Failed to compact bookmarks to %s: %s", tmp_path, g_strerror(errno));
+        unlink(tmp_path);
+    }
+    
+    g_free(tmp_path);
+    g_string_free(contents, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+// Compact once dead records outnumber live bookmarks. Not while an export
+// runs: it walks the bookmarks by record index, which compaction renumbers.
+static void maybe_compact_bookmarks(BrowserData *browser_data) {
+    guint live = browser_data->bookmarks->len;
+    
+    if (browser_data->bookmarks_dead_records >= BOOKMARK_COMPACT_MIN_DEAD &&
+        browser_data->bookmarks_dead_records > live &&
+        browser_data->bookmarks_compact_source == 0 && !browser_data->bookmark_transfer) {
+        browser_data->bookmarks_compact_source = g_idle_add(compact_bookmarks, browser_data);
+    }
+}
+
+typedef struct {
+    const gchar *title;
+    gsize title_length;
+    const gchar *url;
+    gsize url_length;
+    const gchar *tags;
+    gsize tags_length;
+    gboolean live;
+} BookmarkRecord;
+
+// Load bookmarks by replaying the journal from a memory mapping
+static void load_bookmarks(BrowserData *browser_data) {
+    if (!browser_data->bookmarks_path) return;
+    
+    GError *error = NULL;
+    GMappedFile *mapped = g_mapped_file_new(browser_data->bookmarks_path, FALSE, &error);
+    if (!mapped) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning("Failed to load bookmarks: %s", error->message);
+        }
+        g_error_free(error);
+        return;
+    }
+    
+    const gchar *p = g_mapped_file_get_contents(mapped);
+    const gchar *end = p + g_mapped_file_get_length(mapped);
+    GArray *records = g_array_new(FALSE, FALSE, sizeof(BookmarkRecord));
+    guint dead = 0;
+    
+    while (p && p < end) {
+        const gchar *eol = memchr(p, '\n', end - p);
+        if (!eol) break; // Torn final record from an interrupted append
+        
+        const gchar *line_end = eol;
+        if (line_end > p && line_end[-1] == '\r') line_end--;
+        
+        if (line_end - p >= 2 && p[0] == '|' && p[1] == '|') {
+            // Delete record
+            guint64 index = g_ascii_strtoull(p + 2, NULL, 10);
+            if (index < records->len && g_array_index(records, BookmarkRecord, index).live) {
+                g_array_index(records, BookmarkRecord, index).live = FALSE;
+                dead++;
+            }
+            dead++;
+        } else {
+            // Add record; every one takes an index, even if it is rejected
+            BookmarkRecord record = { NULL, 0, NULL, 0, NULL, 0, FALSE };
+            const gchar *fields[3];
+            gsize lengths[3];
+            guint count = split_record(p, line_end, fields, lengths, 3);
+            if (count >= 2) {
+                record.title = fields[0];
+                record.title_length = lengths[0];
+                record.url = fields[1];
+                record.url_length = lengths[1];
+                record.tags = count == 3 ? fields[2] : "";
+                record.tags_length = count == 3 ? lengths[2] : 0;
+                record.live = TRUE;
+            } else {
+                dead++;
+            }
+            g_array_append_val(records, record);
+        }
+        
+        p = eol + 1;
+    }
+    
+    char title[MAX_TITLE_LENGTH];
+    char url[MAX_URL_LENGTH];
+    char tags[MAX_TITLE_LENGTH];
+    
+    for (guint i = 0; i < records->len; i++) {
+        BookmarkRecord *record = &g_array_index(records, BookmarkRecord, i);
+        if (!record->live) continue;
+        
+        // Split into title and URL with size limits
+        safe_strncpy(title, record->title, record->title_length, MAX_TITLE_LENGTH);
+        safe_strncpy(url, record->url, record->url_length, MAX_URL_LENGTH);
+        safe_strncpy(tags, record->tags, record->tags_length, MAX_TITLE_LENGTH);
+        
+        // Only add if URL is valid
+        if (is_valid_url(url)) {
+            Bookmark *bookmark = bookmark_new(title, url, tags, i);
+            g_ptr_array_add(browser_data->bookmarks, bookmark);
+            bookmark_index_add(browser_data->bookmark_index, bookmark, FALSE);
+            g_hash_table_replace(browser_data->bookmark_urls, bookmark->key, bookmark);
+            completion_index_add(browser_data->completion_index, title, url, FALSE);
+        } else {
+            dead++;
+        }
+    }
+    
+    browser_data->bookmarks_next_record = records->len;
+    browser_data->bookmarks_dead_records = dead;
+    
+    g_array_free(records, TRUE);
+    g_mapped_file_unref(mapped);
+    bookmark_index_sort(browser_data->bookmark_index);
+    completion_index_sort(browser_data->completion_index);
+    
+    maybe_compact_bookmarks(browser_data);
+}
+
+// Add a bookmark whose record was just appended to the in-memory set
+static Bookmark *keep_bookmark(BrowserData *browser_data, const gchar *title, const gchar *url,
+                               const gchar *tags) {
+    Bookmark *bookmark = bookmark_new(title, url, tags, browser_data->bookmarks_next_record++);
+    g_ptr_array_add(browser_data->bookmarks, bookmark);
+    bookmark_index_add(browser_data->bookmark_index, bookmark, TRUE);
+    g_hash_table_replace(browser_data->bookmark_urls, bookmark->key, bookmark);
+    completion_index_add(browser_data->completion_index, title, url, TRUE);
+    return bookmark;
+}
+
+// Drop a bookmark whose cancel record was just appended, and free it
+static void forget_bookmark(BrowserData *browser_data, Bookmark *bookmark) {
+    completion_index_remove(browser_data->completion_index, bookmark->title, bookmark->url);
+    bookmark_index_remove(browser_data->bookmark_index, bookmark);
+    if (g_hash_table_lookup(browser_data->bookmark_urls, bookmark->key) == bookmark) {
+        g_hash_table_remove(browser_data->bookmark_urls, bookmark->key);
+    }
+    browser_data->bookmarks_dead_records += 2;
+    g_ptr_array_remove(browser_data->bookmarks, bookmark); // Frees it
+}
+
+// Append a bookmark to the journal and the in-memory set
+static Bookmark *store_bookmark(BrowserData *browser_data, const gchar *title, const gchar *url,
+                                const gchar *tags) {
+    // Sanitize data before saving
+    gchar *safe_title = sanitize_string(title);
+    gchar *safe_url = sanitize_string(url);
+    gchar *safe_tags = sanitize_string(tags);
+    gchar *record = g_strdup_printf("%s|%s%s%s\n", safe_title, safe_url, *safe_tags ? "|" : "", safe_tags);
+    Bookmark *bookmark = NULL;
+    
+    if (append_bookmark_record(browser_data, record, strlen(record))) {
+        bookmark = keep_bookmark(browser_data, title, url, safe_tags);
+    }
+    
+    g_free(record);
+    g_free(safe_tags);
+    g_free(safe_title);
+    g_free(safe_url);
+    return bookmark;
+}
+
+// Cancel a bookmark in the journal and free it
+static gboolean remove_bookmark(BrowserData *browser_data, Bookmark *bookmark) {
+    gchar record[32];
+    gint length = g_snprintf(record, sizeof(record), "||%" G_GUINT64_FORMAT "\n", bookmark->record);
+    if (!append_bookmark_record(browser_data, record, length)) return FALSE;
+    
+    forget_bookmark(browser_data, bookmark);
+    maybe_compact_bookmarks(browser_data);
+    return TRUE;
+}
+
+// Write a bookmark again with new tags and cancel its old record. Both go
+// in one append, so a failed write leaves the journal as it was.
+static Bookmark *replace_bookmark(BrowserData *browser_data, Bookmark *bookmark, const gchar *tags) {
+    gchar *safe_title = sanitize_string(bookmark->title);
+    gchar *safe_url = sanitize_string(bookmark->url);
+    gchar *safe_tags = sanitize_string(tags);
+    gchar *record = g_strdup_printf("%s|%s%s%s\n||%" G_GUINT64_FORMAT "\n", safe_title, safe_url,
+                                    *safe_tags ? "|" : "", safe_tags, bookmark->record);
+    Bookmark *updated = NULL;
+    
+    if (append_bookmark_record(browser_data, record, strlen(record))) {
+        updated = keep_bookmark(browser_data, bookmark->title, bookmark->url, safe_tags);
+        forget_bookmark(browser_data, bookmark);
+        maybe_compact_bookmarks(browser_data);
+    }
+    
+    g_free(record);
+    g_free(safe_tags);
+    g_free(safe_title);
+    g_free(safe_url);
+    return updated;
+}
+
+// Add current page to bookmarks
+static void add_bookmark(GtkWidget *widget, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    Tab *tab = get_current_tab(browser_data);
+    WebKitWebView *web_view = tab ? tab->web_view : NULL;
+    if (!web_view) return;
+    
+    // Record indexes are only known once the journal has been replayed
+    load_deferred_state(browser_data);
+    
+    const gchar *uri = tab_page_uri(tab);
+    const gchar *title = webkit_web_view_get_title(web_view);
+    
+    gchar *key = url_canonical_key(uri);
+    if (key && g_hash_table_contains(browser_data->bookmark_urls, key)) {
+        gtk_statusbar_push(GTK_STATUSBAR(browser_data->status_bar), browser_data->status_context,
+                           "Already bookmarked");
+    } else if (key) {
+        // Limit title length
+        gchar *safe_title;
+        if (title) {
+            safe_title = g_strndup(title, MAX_TITLE_LENGTH - 1);
+        } else {
+            safe_title = g_strndup(uri, MAX_TITLE_LENGTH - 1);
+        }
+        
+        store_bookmark(browser_data, safe_title, uri, "");
+        
+        g_free(safe_title);
+    }
+    g_free(key);
+}
+
+// Load state that the first frame and first navigation do not need
+static void load_deferred_state(BrowserData *browser_data) {
+    if (browser_data->deferred_loaded) return;
+    browser_data->deferred_loaded = TRUE;
+    
+    if (browser_data->deferred_source) {
+        g_source_remove(browser_data->deferred_source);
+        browser_data->deferred_source = 0;
+    }
+    
+    load_bookmarks(browser_data);
+    startup_trace_mark("bookmarks-loaded");
+    
+    if (browser_data->history) {
+        history_load(browser_data->history);
+        history_fill_completion_index(browser_data->history, browser_data->completion_index);
+        startup_trace_mark("history-loaded");
+    }
+    
+    // Start pages shown before now lack bookmarks and history
+    for (guint i = 0; browser_data->tabs && i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        const gchar *uri = tab->web_view ? webkit_web_view_get_uri(tab->web_view) : NULL;
+        if (uri && g_str_has_prefix(uri, "tinyweb://start")) {
+            webkit_web_view_reload(tab->web_view);
+        }
+    }
+}
+
+static gboolean load_deferred_state_idle(gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    
+    browser_data->deferred_source = 0;
+    load_deferred_state(browser_data);
+    return G_SOURCE_REMOVE;
+}
+
+// Bookmark import and export. Netscape bookmark HTML, which every browser
+// can export, and Chrome and Firefox JSON are read on a worker thread by
+// streaming parsers that keep only the entry being read and the folder
+// path, so memory does not grow with the file. Entries reach the main
+// thread in batches; a batch is one journal write and one merge into each
+// sorted index. Export formats slices of the bookmark list on the main
+// thread and a worker writes them to PATH.tmp, renamed into place at the end.
+#define BOOKMARK_IO_BATCH 5000
+#define BOOKMARK_IO_MAX_QUEUED 4
+#define BOOKMARK_IO_READ_SIZE (64 * 1024)
+#define BOOKMARK_IO_MAX_DEPTH 128
+#define BOOKMARK_IO_MAX_FOLDER_TAGS 8
+#define BOOKMARK_IO_MAX_VALUE (MAX_URL_LENGTH + 1)
+
+typedef enum {
+    BOOKMARK_FORMAT_HTML,
+    BOOKMARK_FORMAT_CHROME,
+    BOOKMARK_FORMAT_FIREFOX,
+} BookmarkFormat;
+
+static const char *bookmark_format_names[] = { "html", "chrome", "firefox" };
+
+static gboolean parse_bookmark_format(const char *name, BookmarkFormat *format) {
+    for (guint i = 0; i < G_N_ELEMENTS(bookmark_format_names); i++) {
+        if (strcmp(name, bookmark_format_names[i]) == 0) {
+            *format = (BookmarkFormat)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Export format when none is given: Firefox JSON for .json, else HTML
+static BookmarkFormat bookmark_format_for_path(const gchar *path) {
+    gchar *lower = g_ascii_strdown(path, -1);
+    BookmarkFormat format = g_str_has_suffix(lower, ".json") ? BOOKMARK_FORMAT_FIREFOX : BOOKMARK_FORMAT_HTML;
+    g_free(lower);
+    return format;
+}
+
+typedef void (*BookmarkTransferNotify)(BookmarkTransfer *transfer, gpointer data);
+
+struct _BookmarkTransfer {
+    BrowserData *browser_data;
+    gboolean exporting;
+    BookmarkFormat format;
+    gchar *path;
+    GCancellable *cancellable;
+    BookmarkTransferNotify notify;   // On progress, and once when finished
+    gpointer notify_data;
+    gint64 start;
+    
+    // Import: the parser thread waits while too many batches are queued
+    GThread *thread;
+    GMutex lock;
+    GCond drained;
+    guint queued;
+    guint peak_queued;
+    
+    // Export: one worker writes the slices in order
+    GThreadPool *writer;
+    gchar *tmp_path;
+    int fd;
+    gint write_errno;
+    guint64 next_record;
+    guint source;
+    
+    guint64 done;                    // Bytes read, or bookmarks written
+    guint64 total;
+    guint added;
+    guint duplicates;
+    guint invalid;
+    gchar *error;
+    gboolean finished;
+};
+
+// Parsed entries on their way to the main thread, as "title\0url\0tags\0"
+typedef struct {
+    BookmarkTransfer *transfer;
+    GString *entries;
+    guint count;
+    guint invalid;
+    guint64 done;
+    gboolean last;
+    gchar *error;
+} BookmarkBatch;
+
+// Where the parsers put entries, on the parser thread
+typedef struct {
+    BookmarkTransfer *transfer;
+    BookmarkBatch *batch;
+    guint64 done;
+    GString *tags;
+} BookmarkSink;
+
+static BookmarkBatch *bookmark_batch_new(BookmarkTransfer *transfer) {
+    BookmarkBatch *batch = g_new0(BookmarkBatch, 1);
+    batch->transfer = transfer;
+    batch->entries = g_string_sized_new(BOOKMARK_IO_BATCH * 128);
+    return batch;
+}
+
+static void bookmark_batch_free(BookmarkBatch *batch) {
+    g_string_free(batch->entries, TRUE);
+    g_free(batch->error);
+    g_free(batch);
+}
+
+static gboolean bookmark_batch_idle(gpointer data);
+
+// Hand the batch to the main thread, then wait until it has caught up
+static void bookmark_sink_flush(BookmarkSink *sink, gboolean last, const gchar *error) {
+    BookmarkTransfer *transfer = sink->transfer;
+    BookmarkBatch *batch = sink->batch;
+    
+    batch->done = sink->done;
+    batch->last = last;
+    batch->error = g_strdup(error);
+    sink->batch = last ? NULL : bookmark_batch_new(transfer);
+    
+    g_mutex_lock(&transfer->lock);
+    transfer->queued++;
+    transfer->peak_queued = MAX(transfer->peak_queued, transfer->queued);
+    g_mutex_unlock(&transfer->lock);
+    g_idle_add(bookmark_batch_idle, batch);
+    if (last) return;
+    
+    g_mutex_lock(&transfer->lock);
+    while (transfer->queued >= BOOKMARK_IO_MAX_QUEUED && !g_cancellable_is_cancelled(transfer->cancellable)) {
+        g_cond_wait(&transfer->drained, &transfer->lock);
+    }
+    g_mutex_unlock(&transfer->lock);
+}
+
+// UTF-8 version of text that is not valid UTF-8, or NULL if it is. Older
+// browsers export Netscape files in their Windows code page; bytes that
+// are not Windows-1252 either become replacement characters.
+static gchar *bookmark_sink_repair(const gchar *text) {
+    if (g_utf8_validate(text, -1, NULL)) return NULL;
+    
+    gchar *converted = g_convert(text, -1, "UTF-8", "WINDOWS-1252", NULL, NULL, NULL);
+    return converted ? converted : g_utf8_make_valid(text, -1);
+}
+
+// Copy with the same limits as the journal loader, without leaving half a
+// UTF-8 character at the cut
+static void bookmark_sink_copy(char *dest, const gchar *src, gsize dest_size) {
+    gchar *repaired = bookmark_sink_repair(src);
+    const gchar *end;
+    
+    if (repaired) src = repaired;
+    safe_strncpy(dest, src, strlen(src), dest_size);
+    g_utf8_validate(dest, -1, &end);
+    *(gchar *)end = '\0';
+    g_free(repaired);
+}
+
+// Validate an entry and add it to the batch. Folder names become tags, as
+// the bookmark manager shows tags as folders.
+static void bookmark_sink_add(BookmarkSink *sink, const gchar *title, const gchar *url, const gchar *tags,
+                              const gchar **folders, guint n_folders) {
+    char safe_title[MAX_TITLE_LENGTH];
+    char safe_url[MAX_URL_LENGTH];
+    char safe_tags[MAX_TITLE_LENGTH];
+    
+    while (g_ascii_isspace(*url)) url++;
+    gsize url_length = strlen(url);
+    while (url_length > 0 && g_ascii_isspace(url[url_length - 1])) url_length--;
+    
+    // Longer URLs would be cut, so they are refused rather than copied.
+    // Bookmarks keep the address the way the browser loads it.
+    if (url_length == 0 || url_length >= MAX_URL_LENGTH) {
+        sink->batch->invalid++;
+        return;
+    }
+    safe_strncpy(safe_url, url, url_length, MAX_URL_LENGTH);
+    gchar *normalized_url = url_normalize(safe_url);
+    if (!normalized_url || strlen(normalized_url) >= MAX_URL_LENGTH) {
+        g_free(normalized_url);
+        sink->batch->invalid++;
+        return;
+    }
+    g_strlcpy(safe_url, normalized_url, MAX_URL_LENGTH);
+    g_free(normalized_url);
+    
+    while (g_ascii_isspace(*title)) title++;
+    bookmark_sink_copy(safe_title, *title ? title : safe_url, MAX_TITLE_LENGTH);
+    g_strchomp(safe_title);
+    
+    // Innermost folders first; commas would split a folder name in two
+    g_string_truncate(sink->tags, 0);
+    for (guint i = n_folders; i > 0 && n_folders - i < BOOKMARK_IO_MAX_FOLDER_TAGS; i--) {
+        for (const gchar *p = folders[i - 1]; *p; p++) {
+            g_string_append_c(sink->tags, *p == ',' ? ' ' : *p);
+        }
+        g_string_append_c(sink->tags, ',');
+    }
+    g_string_append(sink->tags, tags);
+    gchar *repaired = bookmark_sink_repair(sink->tags->str);
+    gchar *normalized = normalize_bookmark_tags(repaired ? repaired : sink->tags->str);
+    g_free(repaired);
+    bookmark_sink_copy(safe_tags, normalized, MAX_TITLE_LENGTH);
+    g_free(normalized);
+    
+    // Do not keep a tag cut in half
+    if (strlen(safe_tags) == MAX_TITLE_LENGTH - 1) {
+        gchar *last = g_strrstr(safe_tags, ", ");
+        *(last ? last : safe_tags) = '\0';
+    }
+    
+    BookmarkBatch *batch = sink->batch;
+    g_string_append_len(batch->entries, safe_title, strlen(safe_title) + 1);
+    g_string_append_len(batch->entries, safe_url, strlen(safe_url) + 1);
+    g_string_append_len(batch->entries, safe_tags, strlen(safe_tags) + 1);
+    if (++batch->count >= BOOKMARK_IO_BATCH) {
+        bookmark_sink_flush(sink, FALSE, NULL);
+    }
+}
+
+// Replace character references in place; unknown ones are kept as written.
+// No reference is shorter than the UTF-8 it stands for.
+static void html_decode_entities(GString *text) {
+    static const struct { const gchar *name; gunichar character; } names[] = {
+        { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' }, { "nbsp", ' ' }
+    };
+    gsize out = 0;
+    
+    for (gsize i = 0; i < text->len; ) {
+        const gchar *semicolon = text->str[i] == '&' ? memchr(text->str + i, ';', MIN(text->len - i, 12)) : NULL;
+        gunichar character = 0;
+        
+        if (semicolon) {
+            const gchar *name = text->str + i + 1;
+            gsize length = semicolon - name;
+            
+            if (length > 1 && name[0] == '#') {
+                gboolean hex = name[1] == 'x' || name[1] == 'X';
+                gchar *end;
+                guint64 value = g_ascii_strtoull(name + (hex ? 2 : 1), &end, hex ? 16 : 10);
+                if (end == semicolon && value <= 0x10FFFF) character = (gunichar)value;
+            } else {
+                for (guint n = 0; n < G_N_ELEMENTS(names); n++) {
+                    if (strlen(names[n].name) == length && strncmp(name, names[n].name, length) == 0) {
+                        character = names[n].character;
+                    }
+                }
+            }
+        }
+        
+        if (character != 0 && g_unichar_validate(character)) {
+            out += g_unichar_to_utf8(character, text->str + out);
+            i = semicolon - text->str + 1;
+        } else {
+            text->str[out++] = text->str[i++];
+        }
+    }
+    g_string_truncate(text, out);
+}
+
+// Netscape bookmark file: <DT><H3>Folder</H3> followed by <DL> with the
+// folder's entries, and <DT><A HREF="..." TAGS="...">Title</A>. Only HREF
+// and TAGS values are kept, so large ICON data URIs are skipped over.
+typedef enum {
+    HTML_TEXT,
+    HTML_TAG_NAME,
+    HTML_ATTRIBUTES,
+    HTML_ATTRIBUTE_NAME,
+    HTML_AFTER_ATTRIBUTE_NAME,
+    HTML_BEFORE_VALUE,
+    HTML_VALUE,
+    HTML_COMMENT,
+} HtmlState;
+
+typedef struct {
+    BookmarkSink *sink;
+    HtmlState state;
+    gchar tag[16];
+    guint tag_length;
+    gboolean closing;
+    gchar attribute[32];
+    guint attribute_length;
+    gchar quote;
+    GString *value;            // Value of the current attribute, if it is kept
+    gboolean keep_value;
+    gboolean value_overflow;
+    guint dashes;
+    
+    GString *href;
+    GString *tags;
+    GString *text;             // Link or folder title, whitespace collapsed
+    gboolean in_link;
+    gboolean in_folder;
+    gboolean folder_root;      // Toolbar and unfiled roots are not tags
+    gchar *pending_folder;     // Folder title waiting for its <DL>
+    GPtrArray *folders;
+    gchar *error;
+} HtmlBookmarkParser;
+
+static HtmlBookmarkParser *html_bookmark_parser_new(BookmarkSink *sink) {
+    HtmlBookmarkParser *parser = g_new0(HtmlBookmarkParser, 1);
+    parser->sink = sink;
+    parser->value = g_string_new(NULL);
+    parser->href = g_string_new(NULL);
+    parser->tags = g_string_new(NULL);
+    parser->text = g_string_new(NULL);
+    parser->folders = g_ptr_array_new_with_free_func(g_free);
+    return parser;
+}
+
+static void html_bookmark_parser_free(HtmlBookmarkParser *parser) {
+    g_string_free(parser->value, TRUE);
+    g_string_free(parser->href, TRUE);
+    g_string_free(parser->tags, TRUE);
+    g_string_free(parser->text, TRUE);
+    g_free(parser->pending_folder);
+    g_ptr_array_free(parser->folders, TRUE);
+    g_free(parser->error);
+    g_free(parser);
+}
+
+// Titles are cut at a byte limit while they are read. Drop a UTF-8
+// character left incomplete by the cut, so that the title is still valid
+// and is not taken for Windows-1252 by bookmark_sink_repair().
+static void html_bookmark_parser_trim_text(HtmlBookmarkParser *parser) {
+    GString *text = parser->text;
+    gsize lead = text->len;
+    if (text->len < MAX_TITLE_LENGTH * 2) return;
+    
+    while (lead > 0 && text->len - lead < 3 && ((guchar)text->str[lead - 1] & 0xC0) == 0x80) lead--;
+    if (lead == 0) return;
+    lead--;
+    
+    guchar c = text->str[lead];
+    gsize needed = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    if (text->len - lead < needed) {
+        g_string_truncate(text, lead);
+    }
+}
+
+static void html_bookmark_parser_emit(HtmlBookmarkParser *parser) {
+    html_bookmark_parser_trim_text(parser);
+    html_decode_entities(parser->text);
+    html_decode_entities(parser->href);
+    html_decode_entities(parser->tags);
+    bookmark_sink_add(parser->sink, parser->text->str, parser->href->str, parser->tags->str,
+                      (const gchar **)parser->folders->pdata, parser->folders->len);
+    parser->in_link = FALSE;
+}
+
+// The tag name is known; attributes follow
+static void html_bookmark_parser_tag_started(HtmlBookmarkParser *parser) {
+    parser->tag[parser->tag_length] = '\0';
+    if (parser->closing) return;
+    
+    if (strcmp(parser->tag, "a") == 0) {
+        // An unclosed link ends where the next one starts
+        if (parser->in_link) html_bookmark_parser_emit(parser);
+        g_string_truncate(parser->href, 0);
+        g_string_truncate(parser->tags, 0);
+    } else if (strcmp(parser->tag, "h3") == 0) {
+        parser->folder_root = FALSE;
+    }
+}
+
+static void html_bookmark_parser_attribute(HtmlBookmarkParser *parser) {
+    parser->attribute[parser->attribute_length] = '\0';
+    if (parser->closing) return;
+    
+    if (strcmp(parser->tag, "a") == 0 && parser->keep_value) {
+        // A cut address would point somewhere else; leaving it empty rejects it
+        gboolean href = strcmp(parser->attribute, "href") == 0;
+        g_string_assign(href ? parser->href : parser->tags,
+                        href && parser->value_overflow ? "" : parser->value->str);
+    } else if (strcmp(parser->tag, "h3") == 0 &&
+               (strcmp(parser->attribute, "personal_toolbar_folder") == 0 ||
+                strcmp(parser->attribute, "unfiled_bookmarks_folder") == 0)) {
+        parser->folder_root = TRUE;
+    }
+    parser->keep_value = FALSE;
+}
+
+static void html_bookmark_parser_begin_value(HtmlBookmarkParser *parser) {
+    parser->attribute[parser->attribute_length] = '\0';
+    parser->keep_value = !parser->closing && strcmp(parser->tag, "a") == 0 &&
+                         (strcmp(parser->attribute, "href") == 0 || strcmp(parser->attribute, "tags") == 0);
+    parser->value_overflow = FALSE;
+    g_string_truncate(parser->value, 0);
+}
+
+static void html_bookmark_parser_tag_finished(HtmlBookmarkParser *parser) {
+    const gchar *tag = parser->tag;
+    parser->state = HTML_TEXT;
+    
+    if (parser->closing) {
+        if (strcmp(tag, "a") == 0 && parser->in_link) {
+            html_bookmark_parser_emit(parser);
+        } else if (strcmp(tag, "h3") == 0 && parser->in_folder) {
+            html_bookmark_parser_trim_text(parser);
+            html_decode_entities(parser->text);
+            g_free(parser->pending_folder);
+            parser->pending_folder = g_strdup(parser->folder_root ? "" : g_strstrip(parser->text->str));
+            parser->in_folder = FALSE;
+        } else if (strcmp(tag, "dl") == 0 && parser->folders->len > 0) {
+            g_ptr_array_remove_index(parser->folders, parser->folders->len - 1);
+        }
+    } else if (strcmp(tag, "a") == 0) {
+        parser->in_link = TRUE;
+        g_string_truncate(parser->text, 0);
+    } else if (strcmp(tag, "h3") == 0) {
+        parser->in_folder = TRUE;
+        g_string_truncate(parser->text, 0);
+    } else if (strcmp(tag, "dl") == 0) {
+        if (parser->folders->len == BOOKMARK_IO_MAX_DEPTH) {
+            parser->error = g_strdup("Bookmarks are nested too deeply");
+            return;
+        }
+        // Lists without a heading, like the outermost one, add no tag
+        g_ptr_array_add(parser->folders, parser->pending_folder ? parser->pending_folder : g_strdup(""));
+        parser->pending_folder = NULL;
+    }
+}
+
+static gboolean html_bookmark_parser_feed(HtmlBookmarkParser *parser, const gchar *data, gsize length) {
+    for (gsize i = 0; i < length && !parser->error; i++) {
+        gchar c = data[i];
+        
+        switch (parser->state) {
+        case HTML_TEXT:
+            if (c == '<') {
+                parser->state = HTML_TAG_NAME;
+                parser->tag_length = 0;
+                parser->closing = FALSE;
+            } else if ((parser->in_link || parser->in_folder) && parser->text->len < MAX_TITLE_LENGTH * 2) {
+                if (!g_ascii_isspace(c)) {
+                    g_string_append_c(parser->text, c);
+                } else if (parser->text->len > 0 && parser->text->str[parser->text->len - 1] != ' ') {
+                    g_string_append_c(parser->text, ' ');
+                }
+            }
+            break;
+        case HTML_TAG_NAME:
+            if (parser->tag_length == 0 && !parser->closing && c == '/') {
+                parser->closing = TRUE;
+            } else if (parser->tag_length == 0 && !g_ascii_isalpha(c) && c != '!') {
+                // A stray '<' in text
+                if (parser->in_link || parser->in_folder) {
+                    g_string_append_c(parser->text, '<');
+                    if (parser->closing) g_string_append_c(parser->text, '/');
+                }
+                parser->state = HTML_TEXT;
+                i--; // Read this character again as text
+            } else if (g_ascii_isspace(c) || c == '>' || c == '/') {
+                html_bookmark_parser_tag_started(parser);
+                if (c == '>') {
+                    html_bookmark_parser_tag_finished(parser);
+                } else {
+                    parser->state = HTML_ATTRIBUTES;
+                }
+            } else if (parser->tag_length < sizeof(parser->tag) - 1) {
+                parser->tag[parser->tag_length++] = g_ascii_tolower(c);
+                if (parser->tag_length == 3 && strncmp(parser->tag, "!--", 3) == 0) {
+                    parser->state = HTML_COMMENT;
+                    parser->dashes = 0;
+                }
+            }
+            break;
+        case HTML_ATTRIBUTES:
+            if (c == '>') {
+                html_bookmark_parser_tag_finished(parser);
+            } else if (!g_ascii_isspace(c) && c != '/') {
+                parser->attribute_length = 0;
+                parser->attribute[parser->attribute_length++] = g_ascii_tolower(c);
+                parser->state = HTML_ATTRIBUTE_NAME;
+            }
+            break;
+        case HTML_ATTRIBUTE_NAME:
+        case HTML_AFTER_ATTRIBUTE_NAME:
+            if (c == '=') {
+                html_bookmark_parser_begin_value(parser);
+                parser->state = HTML_BEFORE_VALUE;
+            } else if (c == '>') {
+                html_bookmark_parser_attribute(parser);
+                html_bookmark_parser_tag_finished(parser);
+            } else if (g_ascii_isspace(c)) {
+                parser->state = HTML_AFTER_ATTRIBUTE_NAME;
+            } else if (parser->state == HTML_AFTER_ATTRIBUTE_NAME) {
+                // The previous attribute had no value
+                html_bookmark_parser_attribute(parser);
+                parser->state = HTML_ATTRIBUTES;
+                i--;
+            } else if (parser->attribute_length < sizeof(parser->attribute) - 1) {
+                parser->attribute[parser->attribute_length++] = g_ascii_tolower(c);
+            }
+            break;
+        case HTML_BEFORE_VALUE:
+            if (c == '"' || c == '\'') {
+                parser->quote = c;
+                parser->state = HTML_VALUE;
+            } else if (c == '>') {
+                html_bookmark_parser_attribute(parser);
+                html_bookmark_parser_tag_finished(parser);
+            } else if (!g_ascii_isspace(c)) {
+                parser->quote = '\0';
+                parser->state = HTML_VALUE;
+                i--;
+            }
+            break;
+        case HTML_VALUE:
+            if (parser->quote ? c == parser->quote : (g_ascii_isspace(c) || c == '>')) {
+                html_bookmark_parser_attribute(parser);
+                parser->state = HTML_ATTRIBUTES;
+                if (c == '>') html_bookmark_parser_tag_finished(parser);
+            } else if (parser->keep_value && parser->value->len < BOOKMARK_IO_MAX_VALUE * 2) {
+                g_string_append_c(parser->value, c);
+            } else if (parser->keep_value) {
+                parser->value_overflow = TRUE;
+            }
+            break;
+        case HTML_COMMENT:
+            if (c == '>' && parser->dashes >= 2) {
+                parser->state = HTML_TEXT;
+            }
+            parser->dashes = c == '-' ? parser->dashes + 1 : 0;
+            break;
+        }
+    }
+    return !parser->error;
+}
+
+// Chrome and Firefox JSON: nested objects, where folders have "children"
+// and entries have "url" (Chrome) or "uri" (Firefox), with the title in
+// "name" or "title". Firefox also has comma separated "tags", and "root"
+// on its built-in folders. A folder's title becomes a tag only when it
+// comes before "children", as Firefox writes it; Chrome writes the name
+// last, so its folders are imported without tags.
+enum {
+    JSON_FIELD_OTHER,
+    JSON_FIELD_TITLE,
+    JSON_FIELD_URL,
+    JSON_FIELD_TAGS,
+    JSON_FIELD_ROOT,
+    JSON_FIELD_CHILDREN,
+};
+
+typedef enum {
+    JSON_VALUE,
+    JSON_LITERAL,
+    JSON_STRING,
+    JSON_ESCAPE,
+    JSON_UNICODE,
+} JsonState;
+
+typedef struct {
+    gboolean object;
+    gboolean expect_key;
+    gint field;                // Member whose value comes next
+    gboolean folder;           // Its title is a tag for the entries inside
+    gboolean root;
+    GString *title;
+    GString *url;
+    GString *tags;
+} JsonFrame;
+
+typedef struct {
+    BookmarkSink *sink;
+    JsonState state;
+    JsonFrame frames[BOOKMARK_IO_MAX_DEPTH];
+    guint depth;
+    GString *key;
+    GString *string;           // Where the current string goes, or NULL
+    gboolean string_is_key;
+    gchar unicode[5];
+    guint unicode_length;
+    gunichar high_surrogate;
+    GPtrArray *folders;
+    gchar *error;
+} JsonBookmarkParser;
+
+static JsonBookmarkParser *json_bookmark_parser_new(BookmarkSink *sink) {
+    JsonBookmarkParser *parser = g_new0(JsonBookmarkParser, 1);
+    parser->sink = sink;
+    parser->key = g_string_new(NULL);
+    parser->folders = g_ptr_array_new();
+    return parser;
+}
+
+static void json_bookmark_parser_free(JsonBookmarkParser *parser) {
+    for (guint i = 0; i < BOOKMARK_IO_MAX_DEPTH && parser->frames[i].title; i++) {
+        g_string_free(parser->frames[i].title, TRUE);
+        g_string_free(parser->frames[i].url, TRUE);
+        g_string_free(parser->frames[i].tags, TRUE);
+    }
+    g_string_free(parser->key, TRUE);
+    g_ptr_array_free(parser->folders, TRUE);
+    g_free(parser->error);
+    g_free(parser);
+}
+
+static JsonFrame *json_bookmark_parser_top(JsonBookmarkParser *parser) {
+    return parser->depth > 0 ? &parser->frames[parser->depth - 1] : NULL;
+}
+
+static gboolean json_bookmark_parser_push(JsonBookmarkParser *parser, gboolean object) {
+    JsonFrame *parent = json_bookmark_parser_top(parser);
+    
+    if (parser->depth == BOOKMARK_IO_MAX_DEPTH) {
+        parser->error = g_strdup("Bookmarks are nested too deeply");
+        return FALSE;
+    }
+    if (parent && parent->object && parent->field == JSON_FIELD_CHILDREN) {
+        parent->folder = parent->title->len > 0 && !parent->root;
+    }
+    
+    // Frames and their strings are reused, so deep files cost no more
+    JsonFrame *frame = &parser->frames[parser->depth++];
+    if (!frame->title) {
+        frame->title = g_string_new(NULL);
+        frame->url = g_string_new(NULL);
+        frame->tags = g_string_new(NULL);
+    }
+    frame->object = object;
+    frame->expect_key = object;
+    frame->field = JSON_FIELD_OTHER;
+    frame->folder = FALSE;
+    frame->root = FALSE;
+    g_string_truncate(frame->title, 0);
+    g_string_truncate(frame->url, 0);
+    g_string_truncate(frame->tags, 0);
+    return TRUE;
+}
+
+static void json_bookmark_parser_pop(JsonBookmarkParser *parser) {
+    JsonFrame *frame = json_bookmark_parser_top(parser);
+    if (!frame) return;
+    
+    if (frame->object && frame->url->len > 0) {
+        g_ptr_array_set_size(parser->folders, 0);
+        for (guint i = 0; i + 1 < parser->depth; i++) {
+            if (parser->frames[i].folder) {
+                g_ptr_array_add(parser->folders, parser->frames[i].title->str);
+            }
+        }
+        bookmark_sink_add(parser->sink, frame->title->str, frame->url->str, frame->tags->str,
+                          (const gchar **)parser->folders->pdata, parser->folders->len);
+    }
+    parser->depth--;
+}
+
+static void json_bookmark_parser_begin_string(JsonBookmarkParser *parser) {
+    JsonFrame *frame = json_bookmark_parser_top(parser);
+    
+    parser->state = JSON_STRING;
+    parser->string = NULL;
+    parser->string_is_key = frame && frame->object && frame->expect_key;
+    if (parser->string_is_key) {
+        parser->string = parser->key;
+    } else if (frame && frame->object) {
+        parser->string = frame->field == JSON_FIELD_TITLE ? frame->title
+                       : frame->field == JSON_FIELD_URL ? frame->url
+                       : frame->field == JSON_FIELD_TAGS ? frame->tags : NULL;
+        if (frame->field == JSON_FIELD_ROOT) frame->root = TRUE;
+    }
+    if (parser->string) g_string_truncate(parser->string, 0);
+}
+
+static void json_bookmark_parser_end_string(JsonBookmarkParser *parser) {
+    JsonFrame *frame = json_bookmark_parser_top(parser);
+    
+    parser->state = JSON_VALUE;
+    if (!parser->string_is_key) return;
+    
+    const gchar *key = parser->key->str;
+    frame->expect_key = FALSE;
+    frame->field = strcmp(key, "name") == 0 || strcmp(key, "title") == 0 ? JSON_FIELD_TITLE
+                 : strcmp(key, "url") == 0 || strcmp(key, "uri") == 0 ? JSON_FIELD_URL
+                 : strcmp(key, "tags") == 0 ? JSON_FIELD_TAGS
+                 : strcmp(key, "root") == 0 ? JSON_FIELD_ROOT
+                 : strcmp(key, "children") == 0 ? JSON_FIELD_CHILDREN : JSON_FIELD_OTHER;
+}
+
+static void json_bookmark_parser_append(JsonBookmarkParser *parser, const gchar *text, gsize length) {
+    if (parser->string && parser->string->len < BOOKMARK_IO_MAX_VALUE) {
+        g_string_append_len(parser->string, text, length);
+    }
+}
+
+static void json_bookmark_parser_append_unichar(JsonBookmarkParser *parser, gunichar character) {
+    gchar utf8[6];
+    if (!g_unichar_validate(character)) character = 0xFFFD;
+    json_bookmark_parser_append(parser, utf8, g_unichar_to_utf8(character, utf8));
+}
+
+static void json_bookmark_parser_unicode(JsonBookmarkParser *parser) {
+    gunichar character = (gunichar)g_ascii_strtoull(parser->unicode, NULL, 16);
+    
+    if (character >= 0xD800 && character < 0xDC00) {
+        if (parser->high_surrogate) json_bookmark_parser_append_unichar(parser, 0xFFFD);
+        parser->high_surrogate = character;
+        return;
+    }
+    if (character >= 0xDC00 && character < 0xE000 && parser->high_surrogate) {
+        character = 0x10000 + ((parser->high_surrogate - 0xD800) << 10) + (character - 0xDC00);
+    } else if (parser->high_surrogate) {
+        json_bookmark_parser_append_unichar(parser, 0xFFFD);
+    }
+    parser->high_surrogate = 0;
+    json_bookmark_parser_append_unichar(parser, character);
+}
+
+static gboolean json_bookmark_parser_feed(JsonBookmarkParser *parser, const gchar *data, gsize length) {
+    for (gsize i = 0; i < length; i++) {
+        gchar c = data[i];
+        
+        switch (parser->state) {
+        case JSON_STRING: {
+            // Copy the run up to the next quote or escape at once
+            gsize run = i;
+            while (run < length && data[run] != '"' && data[run] != '\\') run++;
+            if (run > i) {
+                if (parser->high_surrogate) {
+                    json_bookmark_parser_append_unichar(parser, 0xFFFD);
+                    parser->high_surrogate = 0;
+                }
+                json_bookmark_parser_append(parser, data + i, run - i);
+                i = run - 1;
+            } else if (c == '"') {
+                if (parser->high_surrogate) {
+                    json_bookmark_parser_append_unichar(parser, 0xFFFD);
+                    parser->high_surrogate = 0;
+                }
+                json_bookmark_parser_end_string(parser);
+            } else {
+                parser->state = JSON_ESCAPE;
+            }
+            break;
+        }
+        case JSON_ESCAPE:
+            parser->state = JSON_STRING;
+            if (c == 'u') {
+                parser->state = JSON_UNICODE;
+                parser->unicode_length = 0;
+                break;
+            }
+            if (parser->high_surrogate) {
+                json_bookmark_parser_append_unichar(parser, 0xFFFD);
+                parser->high_surrogate = 0;
+            }
+            c = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c == 'b' ? '\b' : c == 'f' ? '\f' : c;
+            json_bookmark_parser_append(parser, &c, 1);
+            break;
+        case JSON_UNICODE:
+            parser->unicode[parser->unicode_length++] = c;
+            if (parser->unicode_length == 4) {
+                parser->unicode[4] = '\0';
+                json_bookmark_parser_unicode(parser);
+                parser->state = JSON_STRING;
+            }
+            break;
+        case JSON_LITERAL:
+            // Numbers, true, false and null carry nothing we keep
+            if (!g_ascii_isspace(c) && c != ',' && c != ']' && c != '}') break;
+            parser->state = JSON_VALUE;
+            // Fall through
+        case JSON_VALUE: {
+            JsonFrame *frame = json_bookmark_parser_top(parser);
+            
+            if (c == '"') {
+                json_bookmark_parser_begin_string(parser);
+            } else if (c == '{' || c == '[') {
+                if (!json_bookmark_parser_push(parser, c == '{')) return FALSE;
+            } else if (c == '}' || c == ']') {
+                json_bookmark_parser_pop(parser);
+            } else if (c == ',') {
+                if (frame && frame->object) {
+                    frame->expect_key = TRUE;
+                    frame->field = JSON_FIELD_OTHER;
+                }
+            } else if (c != ':' && !g_ascii_isspace(c)) {
+                parser->state = JSON_LITERAL;
+            }
+            break;
+        }
+        }
+    }
+    return TRUE;
+}
+
+// Parser thread: read the file in blocks and pick the parser from the
+// first character, since JSON exports start with a brace
+static gpointer bookmark_import_thread(gpointer data) {
+    BookmarkTransfer *transfer = (BookmarkTransfer *)data;
+    BookmarkSink sink = { transfer, bookmark_batch_new(transfer), 0, g_string_new(NULL) };
+    HtmlBookmarkParser *html = NULL;
+    JsonBookmarkParser *json = NULL;
+    gchar *error = NULL;
+    
+    int fd = open(transfer->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = g_strdup_printf("Cannot open %s: %s", transfer->path, g_strerror(errno));
+    }
+    
+    gchar *buffer = g_malloc(BOOKMARK_IO_READ_SIZE);
+    while (fd >= 0 && !error && !g_cancellable_is_cancelled(transfer->cancellable)) {
+        ssize_t got = read(fd, buffer, BOOKMARK_IO_READ_SIZE);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            error = g_strdup_printf("Cannot read %s: %s", transfer->path, g_strerror(errno));
+            break;
+        }
+        if (got == 0) break;
+        sink.done += got;
+        
+        const gchar *p = buffer;
+        gsize length = got;
+        if (!html && !json) {
+            if (sink.done == (guint64)got && length >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) {
+                p += 3; // Byte order mark
+                length -= 3;
+            }
+            while (length > 0 && g_ascii_isspace(*p)) {
+                p++;
+                length--;
+            }
+            if (length == 0) continue;
+            
+            if (*p == '{' || *p == '[') {
+                json = json_bookmark_parser_new(&sink);
+            } else {
+                html = html_bookmark_parser_new(&sink);
+            }
+        }
+        
+        if (html) {
+            if (!html_bookmark_parser_feed(html, p, length)) {
+                error = g_strdup(html->error);
+            }
+        } else if (!json_bookmark_parser_feed(json, p, length)) {
+            error = g_strdup(json->error);
+        }
+    }
+    g_free(buffer);
+    
+    if (json && !error && json->depth > 0 && !g_cancellable_is_cancelled(transfer->cancellable)) {
+        error = g_strdup_printf("%s ends in the middle of the bookmarks", transfer->path);
+    }
+    if (fd >= 0) close(fd);
+    if (html) html_bookmark_parser_free(html);
+    if (json) json_bookmark_parser_free(json);
+    
+    bookmark_sink_flush(&sink, TRUE, error);
+    g_string_free(sink.tags, TRUE);
+    g_free(error);
+    return NULL;
+}
+
+// Sort the elements appended after the first `sorted` ones and merge them
+// in. Merging from the back moves each element once, so adding a batch
+// costs one pass over the index rather than a full sort.
+static void array_merge_sorted_tail(GArray *array, guint sorted, GCompareFunc compare) {
+    guint size = g_array_get_element_size(array);
+    guint added = array->len - sorted;
+    gchar *base = array->data;
+    
+    if (added == 0) return;
+    qsort(base + (gsize)sorted * size, added, size, compare);
+    if (sorted == 0 || compare(base + (gsize)(sorted - 1) * size, base + (gsize)sorted * size) <= 0) return;
+    
+    gchar *tail = g_malloc((gsize)added * size);
+    memcpy(tail, base + (gsize)sorted * size, (gsize)added * size);
+    
+    gsize i = sorted, j = added, k = array->len;
+    while (j > 0) {
+        if (i > 0 && compare(base + (i - 1) * size, tail + (j - 1) * size) > 0) {
+            memcpy(base + --k * size, base + --i * size, size);
+        } else {
+            memcpy(base + --k * size, tail + --j * size, size);
+        }
+    }
+    g_free(tail);
+}
+
+// Add parsed entries to the journal and the in-memory set. Like
+// store_bookmark(), but with one journal write for the batch and the new
+// index keys merged in at once.
+static gboolean store_bookmark_batch(BookmarkTransfer *transfer, BookmarkBatch *batch) {
+    BrowserData *browser_data = transfer->browser_data;
+    GPtrArray *added = g_ptr_array_new();
+    GString *records = g_string_sized_new(batch->entries->len + batch->count * 2);
+    const gchar *p = batch->entries->str;
+    
+    for (guint i = 0; i < batch->count; i++) {
+        const gchar *title = p;
+        const gchar *url = title + strlen(title) + 1;
+        const gchar *tags = url + strlen(url) + 1;
+        p = tags + strlen(tags) + 1;
+        
+        // Sanitize data before saving
+        gchar *safe_title = sanitize_string(title);
+        gchar *safe_url = sanitize_string(url);
+        gchar *safe_tags = sanitize_string(tags);
+        Bookmark *bookmark = bookmark_new(title, url, safe_tags, browser_data->bookmarks_next_record + added->len);
+        
+        // Already bookmarked, or earlier in the same file
+        if (g_hash_table_contains(browser_data->bookmark_urls, bookmark->key)) {
+            transfer->duplicates++;
+            bookmark_free(bookmark);
+        } else {
+            g_hash_table_insert(browser_data->bookmark_urls, bookmark->key, bookmark);
+            g_ptr_array_add(added, bookmark);
+            g_string_append_printf(records, "%s|%s%s%s\n", safe_title, safe_url,
+                                   *safe_tags ? "|" : "", safe_tags);
+        }
+        
+        g_free(safe_tags);
+        g_free(safe_title);
+        g_free(safe_url);
+    }
+    
+    gboolean ok = added->len == 0 || append_bookmark_record(browser_data, records->str, records->len);
+    if (ok) {
+        BookmarkIndex *index = browser_data->bookmark_index;
+        CompletionIndex *completion_index = browser_data->completion_index;
+        guint index_keys = index->keys->len;
+        guint completion_keys = completion_index->keys->len;
+        
+        for (guint i = 0; i < added->len; i++) {
+            Bookmark *bookmark = g_ptr_array_index(added, i);
+            g_ptr_array_add(browser_data->bookmarks, bookmark);
+            bookmark_index_add(index, bookmark, FALSE);
+            completion_index_add(completion_index, bookmark->title, bookmark->url, FALSE);
+        }
+        array_merge_sorted_tail(index->keys, index_keys, compare_bookmark_keys);
+        array_merge_sorted_tail(completion_index->keys, completion_keys, compare_completion_keys);
+        browser_data->bookmarks_next_record += added->len;
+        transfer->added += added->len;
+    } else {
+        for (guint i = 0; i < added->len; i++) {
+            Bookmark *bookmark = g_ptr_array_index(added, i);
+            g_hash_table_remove(browser_data->bookmark_urls, bookmark->key);
+            bookmark_free(bookmark);
+        }
+    }
+    
+    g_ptr_array_free(added, TRUE);
+    g_string_free(records, TRUE);
+    return ok;
+}
+
+static void bookmark_transfer_free(BookmarkTransfer *transfer) {
+    if (transfer->writer) {
+        g_thread_pool_free(transfer->writer, FALSE, TRUE);
+    }
+    g_object_unref(transfer->cancellable);
+    g_mutex_clear(&transfer->lock);
+    g_cond_clear(&transfer->drained);
+    g_free(transfer->tmp_path);
+    g_free(transfer->path);
+    g_free(transfer->error);
+    g_free(transfer);
+}
+
+static void bookmark_transfer_cancel(BookmarkTransfer *transfer) {
+    g_cancellable_cancel(transfer->cancellable);
+    
+    // Wake the parser if it is waiting for the main thread
+    g_mutex_lock(&transfer->lock);
+    g_cond_broadcast(&transfer->drained);
+    g_mutex_unlock(&transfer->lock);
+}
+
+// Report the outcome and free the transfer
+static void bookmark_transfer_finish(BookmarkTransfer *transfer) {
+    BrowserData *browser_data = transfer->browser_data;
+    
+    transfer->finished = TRUE;
+    browser_data->bookmark_transfer = NULL;
+    transfer->notify(transfer, transfer->notify_data);
+    if (!browser_data->shutting_down) {
+        maybe_compact_bookmarks(browser_data);
+    }
+    bookmark_transfer_free(transfer);
+}
+
+static gboolean bookmark_batch_idle(gpointer data) {
+    BookmarkBatch *batch = (BookmarkBatch *)data;
+    BookmarkTransfer *transfer = batch->transfer;
+    
+    g_mutex_lock(&transfer->lock);
+    transfer->queued--;
+    g_cond_signal(&transfer->drained);
+    g_mutex_unlock(&transfer->lock);
+    
+    // After a cancel nothing more is written, also not during shutdown
+    if (!g_cancellable_is_cancelled(transfer->cancellable)) {
+        transfer->done = batch->done;
+        transfer->invalid += batch->invalid;
+        if (!store_bookmark_batch(transfer, batch)) {
+            transfer->error = g_strdup_printf("Cannot write to %s",
+                                              transfer->browser_data->bookmarks_path
+                                              ? transfer->browser_data->bookmarks_path : "the bookmarks file");
+            bookmark_transfer_cancel(transfer);
+        }
+    }
+    
+    if (batch->last) {
+        g_thread_join(transfer->thread);
+        transfer->thread = NULL;
+        if (batch->error && !transfer->error) {
+            transfer->error = g_strdup(batch->error);
+        }
+        bookmark_batch_free(batch);
+        bookmark_transfer_finish(transfer);
+    } else {
+        bookmark_batch_free(batch);
+        transfer->notify(transfer, transfer->notify_data);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void builtin_append_text(GString *html, const gchar *text);
+
+// Netscape TAGS and Firefox "tags" are written without spaces
+static gchar *bookmark_export_tags(const gchar *tags) {
+    gchar **parts = g_strsplit(tags, ", ", -1);
+    gchar *joined = g_strjoinv(",", parts);
+    g_strfreev(parts);
+    return joined;
+}
+
+static void bookmark_export_header(BookmarkTransfer *transfer, GString *out) {
+    switch (transfer->format) {
+    case BOOKMARK_FORMAT_HTML:
+        g_string_append(out, "<!DOCTYPE NETSCAPE-Bookmark-file-1>\n"
+                             "<!-- This is an automatically generated file.\n"
+                             "     It will be read and overwritten.\n"
+                             "     DO NOT EDIT! -->\n"
+                             "<META HTTP-EQUIV=\"Content-Type\" CONTENT=\"text/html; charset=UTF-8\">\n"
+                             "<TITLE>Bookmarks</TITLE>\n"
+                             "<H1>Bookmarks</H1>\n"
+                             "<DL><p>\n");
+        break;
+    case BOOKMARK_FORMAT_CHROME:
+        g_string_append(out, "{\n   \"roots\": {\n"
+                             "      \"bookmark_bar\": {\n"
+                             "         \"children\": [  ],\n"
+                             "         \"id\": \"1\",\n"
+                             "         \"name\": \"Bookmarks bar\",\n"
+                             "         \"type\": \"folder\"\n"
+                             "      },\n"
+                             "      \"other\": {\n"
+                             "         \"children\": [ ");
+        break;
+    case BOOKMARK_FORMAT_FIREFOX:
+        g_string_append(out, "{\"guid\":\"root________\",\"title\":\"\",\"index\":0,\"id\":1,\"typeCode\":2,"
+                             "\"type\":\"text/x-moz-place-container\",\"root\":\"placesRoot\",\"children\":["
+                             "{\"guid\":\"unfiled_____\",\"title\":\"unfiled\",\"index\":0,\"id\":2,\"typeCode\":2,"
+                             "\"type\":\"text/x-moz-place-container\",\"root\":\"unfiledBookmarksFolder\","
+                             "\"children\":[\n");
+        break;
+    }
+}
+
+// The n-th bookmark written, counting from zero
+static void bookmark_export_entry(BookmarkTransfer *transfer, GString *out, Bookmark *bookmark, guint n) {
+    gchar *tags = bookmark_export_tags(bookmark->tags);
+    
+    switch (transfer->format) {
+    case BOOKMARK_FORMAT_HTML:
+        g_string_append(out, "    <DT><A HREF=\"");
+        builtin_append_text(out, bookmark->url);
+        if (*tags) {
+            g_string_append(out, "\" TAGS=\"");
+            builtin_append_text(out, tags);
+        }
+        g_string_append(out, "\">");
+        builtin_append_text(out, bookmark->title);
+        g_string_append(out, "</A>\n");
+        break;
+    case BOOKMARK_FORMAT_CHROME:
+        // Ids 1 to 3 are the roots
+        g_string_append_printf(out, "%s{\n            \"id\": \"%u\",\n            \"name\": ", n ? ", " : "", n + 4);
+        json_append_string(out, bookmark->title);
+        g_string_append(out, ",\n            \"type\": \"url\",\n            \"url\": ");
+        json_append_string(out, bookmark->url);
+        g_string_append(out, "\n         }");
+        break;
+    case BOOKMARK_FORMAT_FIREFOX:
+        g_string_append_printf(out, "%s{\"title\":", n ? ",\n" : "");
+        json_append_string(out, bookmark->title);
+        g_string_append_printf(out, ",\"index\":%u,\"id\":%u,\"typeCode\":1,\"type\":\"text/x-moz-place\",\"uri\":",
+                               n, n + 3);
+        json_append_string(out, bookmark->url);
+        if (*tags) {
+            g_string_append(out, ",\"tags\":");
+            json_append_string(out, tags);
+        }
+        g_string_append_c(out, '}');
+        break;
+    }
+    g_free(tags);
+}
+
+static void bookmark_export_footer(BookmarkTransfer *transfer, GString *out) {
+    switch (transfer->format) {
+    case BOOKMARK_FORMAT_HTML:
+        g_string_append(out, "</DL><p>\n");
+        break;
+    case BOOKMARK_FORMAT_CHROME:
+        g_string_append(out, " ],\n"
+                             "         \"id\": \"2\",\n"
+                             "         \"name\": \"Other bookmarks\",\n"
+                             "         \"type\": \"folder\"\n"
+                             "      },\n"
+                             "      \"synced\": {\n"
+                             "         \"children\": [  ],\n"
+                             "         \"id\": \"3\",\n"
+                             "         \"name\": \"Mobile bookmarks\",\n"
+                             "         \"type\": \"folder\"\n"
+                             "      }\n"
+                             "   },\n"
+                             "   \"version\": 1\n"
+                             "}\n");
+        break;
+    case BOOKMARK_FORMAT_FIREFOX:
+        g_string_append(out, "]}]}\n");
+        break;
+    }
+}
+
+static gboolean bookmark_export_done(gpointer data) {
+    BookmarkTransfer *transfer = (BookmarkTransfer *)data;
+    gint write_errno = g_atomic_int_get(&transfer->write_errno);
+    
+    if (write_errno && !transfer->error) {
+        transfer->error = g_strdup_printf("Cannot write %s: %s", transfer->path, g_strerror(write_errno));
+    }
+    bookmark_transfer_finish(transfer);
+    return G_SOURCE_REMOVE;
+}
+
+// Writer thread. An empty block ends the file: it is synced and renamed
+// over PATH, or removed if the export failed or was cancelled.
+static void bookmark_export_write(gpointer data, gpointer user_data) {
+    GBytes *bytes = (GBytes *)data;
+    BookmarkTransfer *transfer = (BookmarkTransfer *)user_data;
+    gsize length;
+    const gchar *buffer = g_bytes_get_data(bytes, &length);
+    
+    if (length > 0) {
+        if (!g_atomic_int_get(&transfer->write_errno) && !write_all(transfer->fd, buffer, length)) {
+            g_atomic_int_set(&transfer->write_errno, errno);
+        }
+    } else {
+        gboolean ok = !g_atomic_int_get(&transfer->write_errno) &&
+                      !g_cancellable_is_cancelled(transfer->cancellable);
+        if (ok && fsync(transfer->fd) != 0) {
+            g_atomic_int_set(&transfer->write_errno, errno);
+            ok = FALSE;
+        }
+        if (close(transfer->fd) != 0 && ok) {
+            g_atomic_int_set(&transfer->write_errno, errno);
+            ok = FALSE;
+        }
+        if (ok && rename(transfer->tmp_path, transfer->path) != 0) {
+            g_atomic_int_set(&transfer->write_errno, errno);
+            ok = FALSE;
+        }
+        if (!ok) unlink(transfer->tmp_path);
+        g_idle_add(bookmark_export_done, transfer);
+    }
+    g_bytes_unref(bytes);
+}
+
+// Format the next slice of bookmarks. The position is kept as a record
+// index, so bookmarks deleted meanwhile do not shift it.
+static gboolean bookmark_export_slice(gpointer data) {
+    BookmarkTransfer *transfer = (BookmarkTransfer *)data;
+    GPtrArray *bookmarks = transfer->browser_data->bookmarks;
+    
+    transfer->source = 0;
+    if (g_cancellable_is_cancelled(transfer->cancellable) || g_atomic_int_get(&transfer->write_errno)) {
+        g_thread_pool_push(transfer->writer, g_bytes_new(NULL, 0), NULL);
+        return G_SOURCE_REMOVE;
+    }
+    
+    // Wait for the writer rather than queue up the whole file
+    guint queued = g_thread_pool_unprocessed(transfer->writer);
+    transfer->peak_queued = MAX(transfer->peak_queued, queued);
+    if (queued >= BOOKMARK_IO_MAX_QUEUED) {
+        transfer->source = g_timeout_add(10, bookmark_export_slice, transfer);
+        return G_SOURCE_REMOVE;
+    }
+    
+    guint low = 0, high = bookmarks->len;
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+        if (((Bookmark *)g_ptr_array_index(bookmarks, mid))->record < transfer->next_record) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    
+    GString *out = g_string_sized_new(BOOKMARK_IO_BATCH * 160);
+    guint end = MIN(bookmarks->len, low + BOOKMARK_IO_BATCH);
+    for (guint i = low; i < end; i++) {
+        Bookmark *bookmark = g_ptr_array_index(bookmarks, i);
+        bookmark_export_entry(transfer, out, bookmark, transfer->added++);
+        transfer->next_record = bookmark->record + 1;
+    }
+    transfer->done = transfer->added;
+    transfer->total = MAX(transfer->total, transfer->done);
+    
+    gboolean last = end == bookmarks->len;
+    if (last) {
+        bookmark_export_footer(transfer, out);
+    }
+    gsize length = out->len;
+    g_thread_pool_push(transfer->writer, g_bytes_new_take(g_string_free(out, FALSE), length), NULL);
+    
+    if (last) {
+        g_thread_pool_push(transfer->writer, g_bytes_new(NULL, 0), NULL);
+    } else {
+        transfer->source = g_idle_add(bookmark_export_slice, transfer);
+        transfer->notify(transfer, transfer->notify_data);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Start importing PATH (any supported format) or exporting to it. Returns
+// NULL, or why the transfer could not start. The notify function is called
+// as it progresses and once more when it has finished.
+static gchar *bookmark_transfer_start(BrowserData *browser_data, gboolean exporting, const gchar *path,
+                                      BookmarkFormat format, BookmarkTransferNotify notify, gpointer notify_data) {
+    if (browser_data->bookmark_transfer) {
+        return g_strdup("A bookmark import or export is already running");
+    }
+    
+    BookmarkTransfer *transfer = g_new0(BookmarkTransfer, 1);
+    transfer->browser_data = browser_data;
+    transfer->exporting = exporting;
+    transfer->format = format;
+    transfer->path = g_strdup(path);
+    transfer->cancellable = g_cancellable_new();
+    transfer->notify = notify;
+    transfer->notify_data = notify_data;
+    transfer->start = g_get_monotonic_time();
+    transfer->fd = -1;
+    g_mutex_init(&transfer->lock);
+    g_cond_init(&transfer->drained);
+    
+    if (exporting) {
+        transfer->tmp_path = g_strconcat(path, ".tmp", NULL);
+        transfer->fd = open(transfer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (transfer->fd < 0) {
+            gchar *error = g_strdup_printf("Cannot create %s: %s", transfer->tmp_path, g_strerror(errno));
+            bookmark_transfer_free(transfer);
+            return error;
+        }
+        
+        transfer->total = browser_data->bookmarks->len;
+        transfer->writer = g_thread_pool_new(bookmark_export_write, transfer, 1, FALSE, NULL);
+        GString *header = g_string_new(NULL);
+        bookmark_export_header(transfer, header);
+        gsize length = header->len;
+        g_thread_pool_push(transfer->writer, g_bytes_new_take(g_string_free(header, FALSE), length), NULL);
+        transfer->source = g_idle_add(bookmark_export_slice, transfer);
+    } else {
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            gchar *error = g_strdup_printf("Cannot open %s: %s", path, g_strerror(errno));
+            bookmark_transfer_free(transfer);
+            return error;
+        }
+        transfer->total = st.st_size;
+        transfer->thread = g_thread_new("bookmark-import", bookmark_import_thread, transfer);
+    }
+    
+    browser_data->bookmark_transfer = transfer;
+    return NULL;
+}
+
+static gdouble bookmark_transfer_fraction(BookmarkTransfer *transfer) {
+    return transfer->total ? MIN(1.0, (gdouble)transfer->done / transfer->total) : 0;
+}
+
+// One line for the status bar or the terminal
+static gchar *bookmark_transfer_describe(BookmarkTransfer *transfer) {
+    const gchar *name = transfer->exporting ? "export" : "import";
+    
+    if (!transfer->finished) {
+        return g_strdup_printf("%s bookmarks: %u (%.0f%%)", transfer->exporting ? "Exporting" : "Importing",
+                               transfer->added, bookmark_transfer_fraction(transfer) * 100);
+    } else if (transfer->error) {
+        return g_strdup_printf("Bookmark %s failed after %u bookmarks: %s", name, transfer->added,
+                               transfer->error);
+    } else if (g_cancellable_is_cancelled(transfer->cancellable)) {
+        return g_strdup_printf("Bookmark %s stopped after %u bookmarks", name, transfer->added);
+    } else if (transfer->exporting) {
+        return g_strdup_printf("Exported %u bookmarks to %s", transfer->added, transfer->path);
+    }
+    return g_strdup_printf("Imported %u bookmarks (%u already bookmarked, %u invalid)",
+                           transfer->added, transfer->duplicates, transfer->invalid);
+}
+
+// Read-only GtkTreeModel over an array of bookmarks, so the manager shows
+// any number of rows without copying them into a GtkListStore. Columns are
+// title, URL, tags and the Bookmark pointer. A new model is set on every
+// refilter; rows only go away through bookmark_model_remove_row().
+enum {
+    BOOKMARK_COLUMN_TITLE,
+    BOOKMARK_COLUMN_URL,
+    BOOKMARK_COLUMN_TAGS,
+    BOOKMARK_COLUMN_POINTER,
+    BOOKMARK_N_COLUMNS
+};
+
+typedef struct {
+    GObject parent_instance;
+    GPtrArray *rows;
+    gint stamp;
+} BookmarkModel;
+
+typedef struct {
+    GObjectClass parent_class;
+} BookmarkModelClass;
+
+static void bookmark_model_tree_model_init(GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(BookmarkModel, bookmark_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, bookmark_model_tree_model_init))
+
+static void bookmark_model_finalize(GObject *object) {
+    BookmarkModel *model = (BookmarkModel *)object;
+    g_ptr_array_unref(model->rows);
+    G_OBJECT_CLASS(bookmark_model_parent_class)->finalize(object);
+}
+
+static void bookmark_model_class_init(BookmarkModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = bookmark_model_finalize;
+}
+
+static void bookmark_model_init(BookmarkModel *model) {
+    model->stamp = g_random_int();
+}
+
+// Takes a reference to rows
+static BookmarkModel *bookmark_model_new(GPtrArray *rows) {
+    BookmarkModel *model = g_object_new(bookmark_model_get_type(), NULL);
+    model->rows = g_ptr_array_ref(rows);
+    return model;
+}
+
+static gboolean bookmark_model_set_iter(BookmarkModel *model, GtkTreeIter *iter, guint row) {
+    if (row >= model->rows->len) {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    iter->stamp = model->stamp;
+    iter->user_data = GUINT_TO_POINTER(row);
+    return TRUE;
+}
+
+static GtkTreeModelFlags bookmark_model_get_flags(GtkTreeModel *tree_model) {
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint bookmark_model_get_n_columns(GtkTreeModel *tree_model) {
+    return BOOKMARK_N_COLUMNS;
+}
+
+static GType bookmark_model_get_column_type(GtkTreeModel *tree_model, gint column) {
+    return column == BOOKMARK_COLUMN_POINTER ? G_TYPE_POINTER : G_TYPE_STRING;
+}
+
+static gboolean bookmark_model_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path) {
+    if (gtk_tree_path_get_depth(path) != 1) return FALSE;
+    return bookmark_model_set_iter((BookmarkModel *)tree_model, iter, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *bookmark_model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return gtk_tree_path_new_from_indices(GPOINTER_TO_UINT(iter->user_data), -1);
+}
+
+static void bookmark_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
+    BookmarkModel *model = (BookmarkModel *)tree_model;
+    Bookmark *bookmark = g_ptr_array_index(model->rows, GPOINTER_TO_UINT(iter->user_data));
+    
+    switch (column) {
+    case BOOKMARK_COLUMN_TITLE:
+        g_value_init(value, G_TYPE_STRING);
+        g_value_set_string(value, bookmark->title);
+        break;
+    case BOOKMARK_COLUMN_URL:
+        g_value_init(value, G_TYPE_STRING);
+        g_value_set_string(value, bookmark->url);
+        break;
+    case BOOKMARK_COLUMN_TAGS:
+        g_value_init(value, G_TYPE_STRING);
+        g_value_set_string(value, bookmark->tags);
+        break;
+    default:
+        g_value_init(value, G_TYPE_POINTER);
+        g_value_set_pointer(value, bookmark);
+        break;
+    }
+}
+
+static gboolean bookmark_model_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return bookmark_model_set_iter((BookmarkModel *)tree_model, iter,
+                                   GPOINTER_TO_UINT(iter->user_data) + 1);
+}
+
+static gboolean bookmark_model_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent) {
+    if (parent) return FALSE;
+    return bookmark_model_set_iter((BookmarkModel *)tree_model, iter, 0);
+}
+
+static gboolean bookmark_model_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return FALSE;
+}
+
+static gint bookmark_model_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return iter ? 0 : (gint)((BookmarkModel *)tree_model)->rows->len;
+}
+
+static gboolean bookmark_model_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                                              GtkTreeIter *parent, gint n) {
+    if (parent || n < 0) return FALSE;
+    return bookmark_model_set_iter((BookmarkModel *)tree_model, iter, n);
+}
+
+static gboolean bookmark_model_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child) {
+    return FALSE;
+}
+
+static void bookmark_model_tree_model_init(GtkTreeModelIface *iface) {
+    iface->get_flags = bookmark_model_get_flags;
+    iface->get_n_columns = bookmark_model_get_n_columns;
+    iface->get_column_type = bookmark_model_get_column_type;
+    iface->get_iter = bookmark_model_get_iter;
+    iface->get_path = bookmark_model_get_path;
+    iface->get_value = bookmark_model_get_value;
+    iface->iter_next = bookmark_model_iter_next;
+    iface->iter_children = bookmark_model_iter_children;
+    iface->iter_has_child = bookmark_model_iter_has_child;
+    iface->iter_n_children = bookmark_model_iter_n_children;
+    iface->iter_nth_child = bookmark_model_iter_nth_child;
+    iface->iter_parent = bookmark_model_iter_parent;
+}
+
+static void bookmark_model_remove_row(BookmarkModel *model, guint row) {
+    GtkTreePath *path = gtk_tree_path_new_from_indices(row, -1);
+    g_ptr_array_remove_index(model->rows, row);
+    gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), path);
+    gtk_tree_path_free(path);
+}
+
+static void bookmark_model_replace_row(BookmarkModel *model, guint row, Bookmark *bookmark) {
+    GtkTreePath *path = gtk_tree_path_new_from_indices(row, -1);
+    GtkTreeIter iter;
+    
+    g_ptr_array_index(model->rows, row) = bookmark;
+    bookmark_model_set_iter(model, &iter, row);
+    gtk_tree_model_row_changed(GTK_TREE_MODEL(model), path, &iter);
+    gtk_tree_path_free(path);
+}
+
+// Bookmark manager: live search over the word index, a tag ("folder")
+// filter and sortable columns. The tree view runs in fixed-height mode so
+// only visible rows are measured.
+struct _BookmarkManager {
+    BrowserData *browser_data;
+    GtkWidget *dialog;
+    GtkWidget *search_entry;
+    GtkWidget *tag_combo;
+    GtkWidget *tree_view;
+    GtkWidget *count_label;
+    GtkWidget *progress_bar;   // Import or export progress
+    GtkWidget *stop_button;
+    BookmarkModel *model;
+    gint sort_column;          // -1 keeps the order bookmarks were added
+    gboolean sort_descending;
+};
+
+// Needs the collate keys, see bookmark_manager_refilter()
+static gint compare_bookmark_titles(gconstpointer a, gconstpointer b) {
+    return strcmp((*(Bookmark * const *)a)->collate_key, (*(Bookmark * const *)b)->collate_key);
+}
+
+static gint compare_bookmark_urls(gconstpointer a, gconstpointer b) {
+    return strcmp(completion_url_key((*(Bookmark * const *)a)->url),
+                  completion_url_key((*(Bookmark * const *)b)->url));
+}
+
+static gint compare_bookmark_tags(gconstpointer a, gconstpointer b) {
+    return strcmp((*(Bookmark * const *)a)->tags, (*(Bookmark * const *)b)->tags);
+}
+
+static void bookmark_manager_update_count(BookmarkManager *manager) {
+    gchar *text = g_strdup_printf("%u of %u bookmarks", manager->model->rows->len,
+                                  manager->browser_data->bookmarks->len);
+    gtk_label_set_text(GTK_LABEL(manager->count_label), text);
+    g_free(text);
+}
+
+static void bookmark_manager_refilter(BookmarkManager *manager) {
+    BrowserData *browser_data = manager->browser_data;
+    GPtrArray *rows = g_ptr_array_new();
+    gchar *tag = NULL;
+    
+    if (gtk_combo_box_get_active(GTK_COMBO_BOX(manager->tag_combo)) > 0) {
+        tag = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(manager->tag_combo));
+    }
+    bookmark_index_query(browser_data->bookmark_index, browser_data->bookmarks,
+                         gtk_entry_get_text(GTK_ENTRY(manager->search_entry)), tag, rows);
+    g_free(tag);
+    
+    static GCompareFunc compare[] = { compare_bookmark_titles, compare_bookmark_urls, compare_bookmark_tags };
+    if (manager->sort_column == 0) {
+        for (guint i = 0; i < rows->len; i++) {
+            Bookmark *bookmark = g_ptr_array_index(rows, i);
+            if (!bookmark->collate_key) {
+                bookmark->collate_key = g_utf8_collate_key(bookmark->title, -1);
+            }
+        }
+    }
+    if (manager->sort_column >= 0) {
+        g_ptr_array_sort(rows, compare[manager->sort_column]);
+    }
+    if (manager->sort_descending) {
+        for (guint i = 0, j = rows->len; i + 1 < j; i++, j--) {
+            gpointer swap = rows->pdata[i];
+            rows->pdata[i] = rows->pdata[j - 1];
+            rows->pdata[j - 1] = swap;
+        }
+    }
+    
+    BookmarkModel *model = bookmark_model_new(rows);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(manager->tree_view), GTK_TREE_MODEL(model));
+    if (manager->model) g_object_unref(manager->model);
+    manager->model = model;
+    g_ptr_array_unref(rows);
+    
+    bookmark_manager_update_count(manager);
+}
+
+static void on_bookmark_search_changed(GtkWidget *widget, gpointer data) {
+    bookmark_manager_refilter((BookmarkManager *)data);
+}
+
+// Clicking a column header sorts by it; clicking again reverses the order
+static void on_bookmark_column_clicked(GtkTreeViewColumn *column, gpointer data) {
+    BookmarkManager *manager = (BookmarkManager *)data;
+    gint sort_column = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(column), "sort-column"));
+    
+    if (manager->sort_column == sort_column) {
+        manager->sort_descending = !manager->sort_descending;
+    } else {
+        manager->sort_column = sort_column;
+        manager->sort_descending = FALSE;
+    }
+    
+    GList *columns = gtk_tree_view_get_columns(GTK_TREE_VIEW(manager->tree_view));
+    for (GList *l = columns; l; l = l->next) {
+        gtk_tree_view_column_set_sort_indicator(l->data, l->data == column);
+    }
+    g_list_free(columns);
+    gtk_tree_view_column_set_sort_order(column, manager->sort_descending ? GTK_SORT_DESCENDING
+                                                                         : GTK_SORT_ASCENDING);
+    bookmark_manager_refilter(manager);
+}
+
+// Refill the tag filter, keeping the selected tag while any bookmark still
+// has it. The list is only filtered again if that tag is gone.
+static void bookmark_manager_fill_tags(BookmarkManager *manager) {
+    GtkComboBoxText *combo = GTK_COMBO_BOX_TEXT(manager->tag_combo);
+    GPtrArray *tags = bookmark_index_tags(manager->browser_data->bookmark_index);
+    gchar *selected = NULL;
+    gint active = 0;
+    
+    if (gtk_combo_box_get_active(GTK_COMBO_BOX(combo)) > 0) {
+        selected = gtk_combo_box_text_get_active_text(combo);
+    }
+    
+    g_signal_handlers_block_by_func(combo, on_bookmark_search_changed, manager);
+    gtk_combo_box_text_remove_all(combo);
+    gtk_combo_box_text_append_text(combo, "All bookmarks");
+    for (guint i = 0; i < tags->len; i++) {
+        const gchar *tag = g_ptr_array_index(tags, i);
+        gtk_combo_box_text_append_text(combo, tag);
+        if (selected && strcmp(tag, selected) == 0) active = i + 1;
+    }
+    gtk_combo_box_set_active(GTK_COMBO_BOX(combo), active);
+    g_signal_handlers_unblock_by_func(combo, on_bookmark_search_changed, manager);
+    
+    if (selected && active == 0) {
+        bookmark_manager_refilter(manager);
+    }
+    g_free(selected);
+    g_ptr_array_free(tags, TRUE);
+}
+
+// Selected row of the manager, or FALSE when nothing is selected
+static gboolean bookmark_manager_get_selected(BookmarkManager *manager, guint *row) {
+    GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(manager->tree_view));
+    GtkTreeIter iter;
+    
+    if (!gtk_tree_selection_get_selected(selection, NULL, &iter)) return FALSE;
+    *row = GPOINTER_TO_UINT(iter.user_data);
+    return TRUE;
+}
+
+// Delete selected bookmark
+static void delete_bookmark(GtkWidget *widget, gpointer data) {
+    BookmarkManager *manager = (BookmarkManager *)data;
+    guint row;
+    
+    if (!bookmark_manager_get_selected(manager, &row)) return;
+    
+    Bookmark *bookmark = g_ptr_array_index(manager->model->rows, row);
+    bookmark_model_remove_row(manager->model, row);
+    if (!remove_bookmark(manager->browser_data, bookmark)) {
+        bookmark_manager_refilter(manager);
+        return;
+    }
+    bookmark_manager_update_count(manager);
+}
+
+// Edit the tags of the selected bookmark
+static void edit_bookmark_tags(GtkWidget *widget, gpointer data) {
+    BookmarkManager *manager = (BookmarkManager *)data;
+    guint row;
+    
+    if (!bookmark_manager_get_selected(manager, &row)) return;
+    Bookmark *bookmark = g_ptr_array_index(manager->model->rows, row);
+    
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("Edit tags", GTK_WINDOW(manager->dialog),
+                                                    GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                    "Cancel", GTK_RESPONSE_CANCEL,
+                                                    "Save", GTK_RESPONSE_OK,
+                                                    NULL);
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_text(GTK_ENTRY(entry), bookmark->tags);
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Comma separated, e.g. work, docs");
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(dialog))), entry, TRUE, TRUE, 5);
+    gtk_widget_show_all(dialog);
+    
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK) {
+        gchar *tags = normalize_bookmark_tags(gtk_entry_get_text(GTK_ENTRY(entry)));
+        BrowserData *browser_data = manager->browser_data;
+        Bookmark *updated = replace_bookmark(browser_data, bookmark, tags);
+        
+        if (updated) {
+            bookmark_model_replace_row(manager->model, row, updated);
+            bookmark_manager_fill_tags(manager);
+        } else {
+            gtk_statusbar_push(GTK_STATUSBAR(browser_data->status_bar), browser_data->status_context,
+                               "Failed to save the tags");
+        }
+        g_free(tags);
+    }
+    gtk_widget_destroy(dialog);
+}
+
+// Progress of an import or export started in the browser: a status bar
+// message, and the progress bar of the bookmark manager while it is open
+static void bookmark_transfer_show_progress(BookmarkTransfer *transfer, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    BookmarkManager *manager = browser_data->bookmark_manager;
+    if (browser_data->shutting_down) return;
+    
+    gchar *text = bookmark_transfer_describe(transfer);
+    GtkStatusbar *status_bar = GTK_STATUSBAR(browser_data->status_bar);
+    guint context = gtk_statusbar_get_context_id(status_bar, "bookmark-transfer");
+    gtk_statusbar_remove_all(status_bar, context);
+    gtk_statusbar_push(status_bar, context, text);
+    
+    if (manager) {
+        gtk_widget_show(manager->progress_bar);
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(manager->progress_bar),
+                                      transfer->finished ? 1.0 : bookmark_transfer_fraction(transfer));
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(manager->progress_bar), text);
+        gtk_widget_set_visible(manager->stop_button, !transfer->finished);
+        if (!transfer->finished) {
+            bookmark_manager_update_count(manager);
+        } else if (!transfer->exporting) {
+            bookmark_manager_fill_tags(manager);
+            bookmark_manager_refilter(manager);
+        }
+    }
+    g_free(text);
+}
+
+// Start an import or export from the bookmark manager or the control
+// socket. The format only matters for exports; NULL picks it from the
+// file name. Returns NULL, or why it could not start.
+static gchar *begin_bookmark_transfer(BrowserData *browser_data, gboolean exporting, const gchar *path,
+                                      const gchar *format_name) {
+    BookmarkFormat format = bookmark_format_for_path(path);
+    if (format_name && !parse_bookmark_format(format_name, &format)) {
+        return g_strdup_printf("Unknown bookmark format %s", format_name);
+    }
+    
+    // Duplicates and record indexes are only known once the journal has been replayed
+    load_deferred_state(browser_data);
+    
+    gchar *error = bookmark_transfer_start(browser_data, exporting, path, format,
+                                           bookmark_transfer_show_progress, browser_data);
+    if (!error) {
+        bookmark_transfer_show_progress(browser_data->bookmark_transfer, browser_data);
+    }
+    return error;
+}
+
+static void bookmark_manager_begin_transfer(BookmarkManager *manager, gboolean exporting, const gchar *path,
+                                            const gchar *format_name) {
+    gchar *error = begin_bookmark_transfer(manager->browser_data, exporting, path, format_name);
+    
+    if (error) {
+        gtk_widget_show(manager->progress_bar);
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(manager->progress_bar), 0);
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(manager->progress_bar), error);
+        g_free(error);
+    }
+}
+
+static void import_bookmarks(GtkWidget *widget, gpointer data) {
+    BookmarkManager *manager = (BookmarkManager *)data;
+    GtkWidget *chooser = gtk_file_chooser_dialog_new("Import bookmarks", GTK_WINDOW(manager->dialog),
+                                                     GTK_FILE_CHOOSER_ACTION_OPEN,
+                                                     "Cancel", GTK_RESPONSE_CANCEL,
+                                                     "Import", GTK_RESPONSE_ACCEPT,
+                                                     NULL);
+    
+    // The format is recognized from the contents
+    GtkFileFilter *filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter, "Bookmark files (HTML, Chrome or Firefox JSON)");
+    gtk_file_filter_add_pattern(filter, "*.html");
+    gtk_file_filter_add_pattern(filter, "*.htm");
+    gtk_file_filter_add_pattern(filter, "*.json");
+    gtk_file_filter_add_pattern(filter, "Bookmarks"); // Chrome's profile file
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(chooser), filter);
+    
+    filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter, "All files");
+    gtk_file_filter_add_pattern(filter, "*");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(chooser), filter);
+    
+    if (gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT) {
+        gchar *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+        bookmark_manager_begin_transfer(manager, FALSE, path, NULL);
+        g_free(path);
+    }
+    gtk_widget_destroy(chooser);
+}
+
+static void export_bookmarks(GtkWidget *widget, gpointer data) {
+    static const gchar *labels[] = { "Bookmark file (HTML)", "Chrome (JSON)", "Firefox (JSON)" };
+    BookmarkManager *manager = (BookmarkManager *)data;
+    GtkWidget *chooser = gtk_file_chooser_dialog_new("Export bookmarks", GTK_WINDOW(manager->dialog),
+                                                     GTK_FILE_CHOOSER_ACTION_SAVE,
+                                                     "Cancel", GTK_RESPONSE_CANCEL,
+                                                     "Export", GTK_RESPONSE_ACCEPT,
+                                                     NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(chooser), TRUE);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(chooser), "bookmarks.html");
+    
+    // The selected filter picks the format
+    for (guint i = 0; i < G_N_ELEMENTS(labels); i++) {
+        GtkFileFilter *filter = gtk_file_filter_new();
+        gtk_file_filter_set_name(filter, labels[i]);
+        gtk_file_filter_add_pattern(filter, i == BOOKMARK_FORMAT_HTML ? "*.html" : "*.json");
+        g_object_set_data(G_OBJECT(filter), "format", (gpointer)bookmark_format_names[i]);
+        gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(chooser), filter);
+    }
+    
+    if (gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT) {
+        gchar *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+        GtkFileFilter *filter = gtk_file_chooser_get_filter(GTK_FILE_CHOOSER(chooser));
+        bookmark_manager_begin_transfer(manager, TRUE, path,
+                                        filter ? g_object_get_data(G_OBJECT(filter), "format") : NULL);
+        g_free(path);
+    }
+    gtk_widget_destroy(chooser);
+}
+
+static void stop_bookmark_transfer(GtkWidget *widget, gpointer data) {
+    BookmarkManager *manager = (BookmarkManager *)data;
+    
+    if (manager->browser_data->bookmark_transfer) {
+        bookmark_transfer_cancel(manager->browser_data->bookmark_transfer);
+    }
+}
+
+// Navigate to selected bookmark
+static void navigate_to_bookmark(GtkTreeView *tree_view, GtkTreePath *path,
+                               GtkTreeViewColumn *column, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    GtkTreeModel *model = gtk_tree_view_get_model(tree_view);
+    GtkTreeIter iter;
+    
+    if (gtk_tree_model_get_iter(model, &iter, path)) {
+        gchar *url;
+        gtk_tree_model_get(model, &iter, BOOKMARK_COLUMN_URL, &url, -1);
+        
+        WebKitWebView *web_view = get_current_web_view(browser_data);
+        gchar *full_url = url ? url_normalize(url) : NULL;
+        if (web_view && full_url) {
+            webkit_web_view_load_uri(web_view, full_url);
+        }
+        
+        g_free(full_url);
+        g_free(url);
+    }
+}
+
+static void bookmark_manager_add_column(BookmarkManager *manager, const gchar *title, gint model_column,
+                                        gint width) {
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+    g_object_set(renderer, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+    
+    GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(title, renderer,
+                                                                         "text", model_column, NULL);
+    // Fixed-height mode needs fixed-size columns
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, width);
+    gtk_tree_view_column_set_resizable(column, TRUE);
+    gtk_tree_view_column_set_clickable(column, TRUE);
+    g_object_set_data(G_OBJECT(column), "sort-column", GINT_TO_POINTER(model_column));
+    g_signal_connect(column, "clicked", G_CALLBACK(on_bookmark_column_clicked), manager);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(manager->tree_view), column);
+}
+
+static BookmarkManager *bookmark_manager_new(BrowserData *browser_data, GtkWindow *parent) {
+    BookmarkManager *manager = g_new0(BookmarkManager, 1);
+    manager->browser_data = browser_data;
+    manager->sort_column = -1;
+    
+    manager->dialog = gtk_dialog_new_with_buttons("Bookmarks", parent,
+                                                  GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                  "Close", GTK_RESPONSE_CLOSE,
+                                                  NULL);
+    gtk_window_set_default_size(GTK_WINDOW(manager->dialog), 700, 450);
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(manager->dialog));
+    
+    // Search and folder filter
+    GtkWidget *filter_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    manager->search_entry = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(manager->search_entry), "Search bookmarks");
+    manager->tag_combo = gtk_combo_box_text_new();
+    bookmark_manager_fill_tags(manager);
+    gtk_box_pack_start(GTK_BOX(filter_box), manager->search_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(filter_box), manager->tag_combo, FALSE, FALSE, 0);
+    
+    // Create bookmark view
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
+                                GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    manager->tree_view = gtk_tree_view_new();
+    bookmark_manager_add_column(manager, "Title", BOOKMARK_COLUMN_TITLE, 280);
+    bookmark_manager_add_column(manager, "URL", BOOKMARK_COLUMN_URL, 280);
+    bookmark_manager_add_column(manager, "Tags", BOOKMARK_COLUMN_TAGS, 120);
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(manager->tree_view), TRUE);
+    gtk_tree_view_set_enable_search(GTK_TREE_VIEW(manager->tree_view), FALSE);
+    g_signal_connect(manager->tree_view, "row-activated",
+                   G_CALLBACK(navigate_to_bookmark), browser_data);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), manager->tree_view);
+    
+    // Count and action buttons
+    GtkWidget *button_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    manager->count_label = gtk_label_new(NULL);
+    gtk_box_pack_start(GTK_BOX(button_box), manager->count_label, FALSE, FALSE, 0);
+    
+    GtkWidget *delete_button = gtk_button_new_with_label("Delete");
+    g_signal_connect(delete_button, "clicked", G_CALLBACK(delete_bookmark), manager);
+    gtk_box_pack_end(GTK_BOX(button_box), delete_button, FALSE, FALSE, 0);
+    
+    GtkWidget *tags_button = gtk_button_new_with_label("Tags…");
+    g_signal_connect(tags_button, "clicked", G_CALLBACK(edit_bookmark_tags), manager);
+    gtk_box_pack_end(GTK_BOX(button_box), tags_button, FALSE, FALSE, 0);
+    
+    GtkWidget *export_button = gtk_button_new_with_label("Export…");
+    g_signal_connect(export_button, "clicked", G_CALLBACK(export_bookmarks), manager);
+    gtk_box_pack_end(GTK_BOX(button_box), export_button, FALSE, FALSE, 0);
+    
+    GtkWidget *import_button = gtk_button_new_with_label("Import…");
+    g_signal_connect(import_button, "clicked", G_CALLBACK(import_bookmarks), manager);
+    gtk_box_pack_end(GTK_BOX(button_box), import_button, FALSE, FALSE, 0);
+    
+    // Import and export progress, shown once one starts
+    GtkWidget *progress_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    manager->progress_bar = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(manager->progress_bar), TRUE);
+    gtk_widget_set_valign(manager->progress_bar, GTK_ALIGN_CENTER);
+    gtk_widget_set_no_show_all(manager->progress_bar, TRUE);
+    gtk_box_pack_start(GTK_BOX(progress_box), manager->progress_bar, TRUE, TRUE, 0);
+    
+    manager->stop_button = gtk_button_new_with_label("Stop");
+    g_signal_connect(manager->stop_button, "clicked", G_CALLBACK(stop_bookmark_transfer), manager);
+    gtk_widget_set_no_show_all(manager->stop_button, TRUE);
+    gtk_box_pack_end(GTK_BOX(progress_box), manager->stop_button, FALSE, FALSE, 0);
+    
+    // Add widgets to dialog
+    gtk_box_pack_start(GTK_BOX(content_area), filter_box, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(content_area), scrolled_window, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(content_area), button_box, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(content_area), progress_box, FALSE, FALSE, 0);
+    
+    bookmark_manager_refilter(manager);
+    g_signal_connect(manager->search_entry, "search-changed", G_CALLBACK(on_bookmark_search_changed), manager);
+    g_signal_connect(manager->tag_combo, "changed", G_CALLBACK(on_bookmark_search_changed), manager);
+    
+    gtk_widget_show_all(content_area);
+    browser_data->bookmark_manager = manager;
+    if (browser_data->bookmark_transfer) {
+        bookmark_transfer_show_progress(browser_data->bookmark_transfer, browser_data);
+    }
+    return manager;
+}
+
+static void bookmark_manager_free(BookmarkManager *manager) {
+    // An import or export keeps running; its progress stays in the status bar
+    manager->browser_data->bookmark_manager = NULL;
+    gtk_widget_destroy(manager->dialog);
+    if (manager->model) g_object_unref(manager->model);
+    g_free(manager);
+}
+
+// Show bookmark manager dialog
+static void show_bookmarks(GtkWidget *widget, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    load_deferred_state(browser_data);
+    
+    BookmarkManager *manager = bookmark_manager_new(browser_data, GTK_WINDOW(gtk_widget_get_toplevel(widget)));
+    gtk_dialog_run(GTK_DIALOG(manager->dialog));
+    bookmark_manager_free(manager);
+}
+
+// Compositing policy of every view, set with --hw-accel. Values are in the
+// order of WebKitHardwareAccelerationPolicy.
+static WebKitHardwareAccelerationPolicy hardware_acceleration = WEBKIT_HARDWARE_ACCELERATION_POLICY_ON_DEMAND;
+static const char *hardware_acceleration_names[] = { "on-demand", "always", "never" };
+
+static gboolean parse_hardware_acceleration(const char *name, WebKitHardwareAccelerationPolicy *policy) {
+    for (guint i = 0; i < G_N_ELEMENTS(hardware_acceleration_names); i++) {
+        if (strcmp(name, hardware_acceleration_names[i]) == 0) {
+            *policy = (WebKitHardwareAccelerationPolicy)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Build the WebKit settings shared by every view
+static WebKitSettings *create_web_settings(void) {
+    WebKitSettings *settings = webkit_settings_new();
+    webkit_settings_set_hardware_acceleration_policy(settings, hardware_acceleration);
+    
+    // Enable HTML5 media features
+    webkit_settings_set_enable_html5_database(settings, TRUE);
+    webkit_settings_set_enable_html5_local_storage(settings, TRUE);
+    webkit_settings_set_enable_media_stream(settings, TRUE);
+    webkit_settings_set_enable_mediasource(settings, TRUE);
+    webkit_settings_set_media_playback_requires_user_gesture(settings, FALSE);
+    webkit_settings_set_enable_webaudio(settings, TRUE);
+    webkit_settings_set_enable_webgl(settings, TRUE);
+    
+    // Common browser features
+    webkit_settings_set_enable_javascript(settings, TRUE);
+    webkit_settings_set_enable_developer_extras(settings, TRUE);
+    webkit_settings_set_javascript_can_access_clipboard(settings, TRUE);
+    
+    // Set a mainstream user agent for site compatibility
+    webkit_settings_set_user_agent(settings, 
+        "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+        "Chrome/100.0.4896.127 Safari/537.36");
+    
+    return settings;
+}
+
+// Configure web context for caching and cookies. All tabs share this
+// context, so they share one network process and one cache; each view
+// still gets its own web process so discarded tabs actually free memory.
+typedef struct {
+    gchar *path;
+    goffset size;
+    gint64 used;
+} CacheFile;
+
+static void cache_file_free(gpointer data) {
+    CacheFile *file = (CacheFile *)data;
+    g_free(file->path);
+    g_free(file);
+}
+
+static gint compare_cache_files(gconstpointer a, gconstpointer b) {
+    const CacheFile *x = *(const CacheFile **)a, *y = *(const CacheFile **)b;
+    return x->used < y->used ? -1 : (x->used > y->used ? 1 : 0);
+}
+
+// Collect the regular files below dir, returning their total size
+static goffset collect_cache_files(const gchar *dir, GPtrArray *files) {
+    GDir *handle = g_dir_open(dir, 0, NULL);
+    const gchar *name;
+    goffset total = 0;
+    
+    if (!handle) return 0;
+    
+    while ((name = g_dir_read_name(handle))) {
+        gchar *path = g_build_filename(dir, name, NULL);
+        struct stat st;
+        
+        if (lstat(path, &st) != 0) {
+            g_free(path);
+        } else if (S_ISDIR(st.st_mode)) {
+            total += collect_cache_files(path, files);
+            g_free(path);
+        } else if (S_ISREG(st.st_mode) && strcmp(name, "salt") != 0) {
+            // Deleting the salt would invalidate the whole cache
+            CacheFile *file = g_new(CacheFile, 1);
+            file->path = path;
+            file->size = st.st_size;
+            file->used = MAX(st.st_atime, st.st_mtime);
+            total += st.st_size;
+            g_ptr_array_add(files, file);
+        } else {
+            g_free(path);
+        }
+    }
+    
+    g_dir_close(handle);
+    return total;
+}
+
+// Keep the HTTP disk cache under max_bytes by deleting the least recently
+// used entries down to 90% of the limit. Runs before the network process
+// starts, so WebKit never sees a half-trimmed cache; missing records are
+// treated as misses.
+static void trim_disk_cache(const gchar *cache_dir, guint64 max_bytes) {
+    gchar *dir = g_build_filename(cache_dir, "WebKitCache", NULL);
+    GPtrArray *files = g_ptr_array_new_with_free_func(cache_file_free);
+    goffset total = collect_cache_files(dir, files);
+    guint removed = 0;
+    
+    if ((guint64)total > max_bytes) {
+        guint64 target = max_bytes / 10 * 9;
+        
+        g_ptr_array_sort(files, compare_cache_files);
+        for (guint i = 0; i < files->len && (guint64)total > target; i++) {
+            CacheFile *file = g_ptr_array_index(files, i);
+            if (unlink(file->path) == 0) {
+                total -= file->size;
+                removed++;
+            }
+        }
+        g_debug("Disk cache: removed %u entries, %" G_GUINT64_FORMAT " KiB left",
+                removed, (guint64)total / 1024);
+    }
+    
+    g_ptr_array_free(files, TRUE);
+    g_free(dir);
+}
+
+// Create the web context with its own website data manager. Cookies and
+// other site data stay in WebKit's usual data directory; the disk cache
+// goes to cache_dir.
+static WebKitWebContext *configure_web_context(WebKitCacheModel cache_model, const gchar *cache_dir,
+                                               guint cache_max_mb, const MemoryConfig *memory) {
+    gchar *data_dir = g_build_filename(g_get_user_data_dir(), "webkitgtk", NULL);
+    WebKitMemoryPressureSettings *pressure = memory_config_to_webkit(memory);
+    
+    if (cache_max_mb > 0) {
+        trim_disk_cache(cache_dir, (guint64)cache_max_mb * 1024 * 1024);
+    }
+    
+    // The network process settings must be set before the first context
+    if (pressure) {
+        webkit_website_data_manager_set_memory_pressure_settings(pressure);
+    }
+    
+    WebKitWebsiteDataManager *manager = webkit_website_data_manager_new("base-data-directory", data_dir,
+                                                                        "base-cache-directory", cache_dir,
+                                                                        NULL);
+    WebKitWebContext *context = WEBKIT_WEB_CONTEXT(g_object_new(WEBKIT_TYPE_WEB_CONTEXT,
+                                                                "website-data-manager", manager,
+                                                                "memory-pressure-settings", pressure,
+                                                                NULL));
+    g_object_unref(manager);
+    g_free(data_dir);
+    if (pressure) {
+        webkit_memory_pressure_settings_free(pressure);
+    }
+    
+    webkit_web_context_set_cache_model(context, cache_model);
+    webkit_web_context_set_process_model(context, WEBKIT_PROCESS_MODEL_MULTIPLE_SECONDARY_PROCESSES);
+    return context;
+}
+
+// Parse a non-negative integer command line value
+static gboolean parse_uint_arg(const char *text, guint *value) {
+    gchar *end = NULL;
+    guint64 parsed = g_ascii_strtoull(text, &end, 10);
+    
+    if (!end || end == text || *end != '\0' || text[0] == '-' || parsed > G_MAXUINT) {
+        return FALSE;
+    }
+    *value = (guint)parsed;
+    return TRUE;
+}
+
+static gboolean parse_cache_model(const char *name, WebKitCacheModel *model) {
+    if (g_strcmp0(name, "web-browser") == 0) {
+        *model = WEBKIT_CACHE_MODEL_WEB_BROWSER;
+    } else if (g_strcmp0(name, "document-browser") == 0) {
+        *model = WEBKIT_CACHE_MODEL_DOCUMENT_BROWSER;
+    } else if (g_strcmp0(name, "document-viewer") == 0) {
+        *model = WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+#define HISTORY_DIALOG_LIMIT 500
+
+// Fill the history dialog list from a frecency-ranked query
+static void refresh_history_list(GtkEntry *search_entry, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    GtkListStore *store = g_object_get_data(G_OBJECT(search_entry), "history-store");
+    GPtrArray *results = history_query(browser_data->history, gtk_entry_get_text(search_entry),
+                                       HISTORY_DIALOG_LIMIT);
+    
+    gtk_list_store_clear(store);
+    for (guint i = 0; i < results->len; i++) {
+        HistoryEntry *entry = g_ptr_array_index(results, i);
+        gtk_list_store_insert_with_values(store, NULL, -1,
+                                          0, entry->title, 1, entry->url,
+                                          2, entry->visit_count, -1);
+    }
+    
+    g_ptr_array_free(results, TRUE);
+}
+
+// Show browsing history dialog
+static void show_history(GtkWidget *widget, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    if (!browser_data->history) return;
+    load_deferred_state(browser_data);
+    
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("History",
+                                                 GTK_WINDOW(gtk_widget_get_toplevel(widget)),
+                                                 GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                 "Close", GTK_RESPONSE_CLOSE,
+                                                 NULL);
+    
+    gtk_window_set_default_size(GTK_WINDOW(dialog), 600, 400);
+    
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    
+    // Search entry
+    GtkListStore *store = gtk_list_store_new(3, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_UINT);
+    GtkWidget *search_entry = gtk_search_entry_new();
+    g_object_set_data(G_OBJECT(search_entry), "history-store", store);
+    g_signal_connect(search_entry, "search-changed", G_CALLBACK(refresh_history_list), browser_data);
+    
+    // Create history view
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
+                                GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    
+    GtkWidget *tree_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
+    g_object_unref(store);
+    
+    // Add columns
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(tree_view),
+                                             -1, "Title", renderer, "text", 0, NULL);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(tree_view),
+                                             -1, "URL", renderer, "text", 1, NULL);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(tree_view),
+                                             -1, "Visits", renderer, "text", 2, NULL);
+    
+    // Same columns as the bookmarks list, so reuse its activation handler
+    g_signal_connect(tree_view, "row-activated",
+                   G_CALLBACK(navigate_to_bookmark), browser_data);
+    
+    gtk_container_add(GTK_CONTAINER(scrolled_window), tree_view);
+    
+    // Add widgets to dialog
+    gtk_box_pack_start(GTK_BOX(content_area), search_entry, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(content_area), scrolled_window, TRUE, TRUE, 0);
+    
+    refresh_history_list(GTK_ENTRY(search_entry), browser_data);
+    gtk_widget_show_all(content_area);
+    
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+}
+
+// Benchmark mode: load every URL of a list several times in an offscreen
+// view, with a cold and a warm cache, and report load-event and Navigation
+// Timing percentiles as JSON.
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_LOAD_TIMEOUT 30
+
+enum {
+    BENCH_STARTED,
+    BENCH_COMMITTED,
+    BENCH_FINISHED,
+    BENCH_RESPONSE_START,
+    BENCH_DOM_CONTENT_LOADED,
+    BENCH_LOAD_EVENT,
+    BENCH_N_METRICS
+};
+
+static const char *bench_metric_names[BENCH_N_METRICS] = {
+    "started_ms", "committed_ms", "finished_ms",
+    "response_start_ms", "dom_content_loaded_ms", "load_event_ms"
+};
+
+// Navigation Timing values relative to navigationStart, comma separated
+#define BENCH_TIMING_SCRIPT \
+    "(function() { var t = performance.timing, s = t.navigationStart;" \
+    " return [t.responseStart - s, t.domContentLoadedEventEnd - s," \
+    " t.loadEventEnd - s].map(function(v) { return Math.max(v, 0); }).join(','); })()"
+
+typedef struct {
+    WebKitSettings *settings;
+    WebKitWebContext *context;
+    GtkWidget *window;
+    WebKitWebView *web_view;
+    GPtrArray *urls;
+    guint runs;
+    guint url_index;
+    gboolean warm;
+    guint iteration;     // Warm runs use iteration 0 to prime the cache
+    gint64 load_start;
+    gdouble current[BENCH_N_METRICS];
+    GArray *samples[BENCH_N_METRICS];
+    guint failures;
+    guint timeout_source;
+    GString *report;
+    gboolean first_result;
+} Benchmark;
+
+static void bench_next(Benchmark *bench);
+
+static gdouble bench_elapsed_ms(Benchmark *bench) {
+    return (g_get_monotonic_time() - bench->load_start) / 1000.0;
+}
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Nearest-rank percentile of a sorted sample set
+static gdouble percentile(GArray *sorted, guint percent) {
+    if (sorted->len == 0) return 0;
+    guint rank = (percent * sorted->len + 99) / 100;
+    return g_array_index(sorted, gdouble, rank > 0 ? rank - 1 : 0);
+}
+
+// Append the percentiles of the finished URL/variant to the report
+static void bench_report_variant(Benchmark *bench) {
+    GString *json = bench->report;
+    
+    g_string_append(json, bench->first_result ? "\n    {" : ",\n    {");
+    bench->first_result = FALSE;
+    g_string_append(json, "\"url\": ");
+    json_append_string(json, g_ptr_array_index(bench->urls, bench->url_index));
+    g_string_append_printf(json, ", \"cache\": \"%s\", \"samples\": %u, \"failures\": %u",
+                           bench->warm ? "warm" : "cold",
+                           bench->samples[BENCH_FINISHED]->len, bench->failures);
+    
+    for (guint m = 0; m < BENCH_N_METRICS; m++) {
+        GArray *samples = bench->samples[m];
+        g_array_sort(samples, compare_doubles);
+        g_string_append_printf(json, ", \"%s\": {\"p50\": %.2f, \"p95\": %.2f, \"p99\": %.2f}",
+                               bench_metric_names[m], percentile(samples, 50),
+                               percentile(samples, 95), percentile(samples, 99));
+        g_array_set_size(samples, 0);
+    }
+    g_string_append(json, "}");
+    bench->failures = 0;
+}
+
+// Advance to the next iteration, variant or URL
+static gboolean bench_advance(gpointer data) {
+    Benchmark *bench = (Benchmark *)data;
+    
+    bench->iteration++;
+    if (bench->iteration > bench->runs || (!bench->warm && bench->iteration == bench->runs)) {
+        bench_report_variant(bench);
+        bench->iteration = 0;
+        if (bench->warm) {
+            bench->warm = FALSE;
+            bench->url_index++;
+        } else {
+            bench->warm = TRUE;
+        }
+    }
+    
+    bench_next(bench);
+    return G_SOURCE_REMOVE;
+}
+
+static void bench_record_sample(Benchmark *bench) {
+    // The first warm load only primes the cache
+    if (bench->warm && bench->iteration == 0) return;
+    
+    for (guint m = 0; m < BENCH_N_METRICS; m++) {
+        g_array_append_val(bench->samples[m], bench->current[m]);
+    }
+}
+
+static void on_bench_timing_ready(GObject *object, GAsyncResult *result, gpointer data) {
+    Benchmark *bench = (Benchmark *)data;
+    GError *error = NULL;
+    WebKitJavascriptResult *js_result = webkit_web_view_run_javascript_finish(WEBKIT_WEB_VIEW(object),
+                                                                              result, &error);
+    
+    if (js_result) {
+        gchar *timing = jsc_value_to_string(webkit_javascript_result_get_js_value(js_result));
+        gchar **values = g_strsplit(timing, ",", 3);
+        for (guint i = 0; values[i] && i < 3; i++) {
+            bench->current[BENCH_RESPONSE_START + i] = g_ascii_strtod(values[i], NULL);
+        }
+        g_strfreev(values);
+        g_free(timing);
+        webkit_javascript_result_unref(js_result);
+    } else {
+        // Pages without script access (e.g. JS disabled) still count
+        g_clear_error(&error);
+    }
+    
+    bench_record_sample(bench);
+    g_idle_add(bench_advance, bench);
+}
+
+static void bench_load_changed(WebKitWebView *web_view, WebKitLoadEvent event, gpointer data) {
+    Benchmark *bench = (Benchmark *)data;
+    
+    switch (event) {
+    case WEBKIT_LOAD_STARTED:
+        bench->current[BENCH_STARTED] = bench_elapsed_ms(bench);
+        break;
+    case WEBKIT_LOAD_COMMITTED:
+        bench->current[BENCH_COMMITTED] = bench_elapsed_ms(bench);
+        break;
+    case WEBKIT_LOAD_FINISHED:
+        if (bench->timeout_source == 0) break; // Already failed or timed out
+        g_source_remove(bench->timeout_source);
+        bench->timeout_source = 0;
+        bench->current[BENCH_FINISHED] = bench_elapsed_ms(bench);
+        webkit_web_view_run_javascript(web_view, BENCH_TIMING_SCRIPT, NULL,
+                                       on_bench_timing_ready, bench);
+        break;
+    default:
+        break;
+    }
+}
+
+static gboolean bench_load_failed(WebKitWebView *web_view, WebKitLoadEvent event,
+                                  gchar *failing_uri, GError *error, gpointer data) {
+    Benchmark *bench = (Benchmark *)data;
+    
+    // Cancellation after a timeout was already counted
+    if (bench->timeout_source == 0) return TRUE;
+    
+    g_printerr("Benchmark: failed to load %s: %s\n", failing_uri, error->message);
+    g_source_remove(bench->timeout_source);
+    bench->timeout_source = 0;
+    bench->failures++;
+    
+    // LOAD_FINISHED still follows a failure; timeout_source == 0 makes it a no-op
+    g_idle_add(bench_advance, bench);
+    return TRUE;
+}
+
+static gboolean bench_load_timeout(gpointer data) {
+    Benchmark *bench = (Benchmark *)data;
+    
+    g_printerr("Benchmark: timed out loading %s\n",
+               (const gchar *)g_ptr_array_index(bench->urls, bench->url_index));
+    bench->timeout_source = 0;
+    bench->failures++;
+    webkit_web_view_stop_loading(bench->web_view);
+    g_idle_add(bench_advance, bench);
+    return G_SOURCE_REMOVE;
+}
+
+static void bench_create_view(Benchmark *bench) {
+    if (bench->web_view) {
+        g_signal_handlers_disconnect_by_data(bench->web_view, bench);
+        gtk_widget_destroy(GTK_WIDGET(bench->web_view));
+    }
+    
+    bench->web_view = WEBKIT_WEB_VIEW(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+                                                   "web-context", bench->context,
+                                                   "settings", bench->settings,
+                                                   NULL));
+    g_signal_connect(bench->web_view, "load-changed", G_CALLBACK(bench_load_changed), bench);
+    g_signal_connect(bench->web_view, "load-failed", G_CALLBACK(bench_load_failed), bench);
+    gtk_container_add(GTK_CONTAINER(bench->window), GTK_WIDGET(bench->web_view));
+    gtk_widget_show_all(bench->window);
+}
+
+static void bench_start_load(Benchmark *bench) {
+    memset(bench->current, 0, sizeof(bench->current));
+    bench->load_start = g_get_monotonic_time();
+    bench->timeout_source = g_timeout_add_seconds(BENCH_LOAD_TIMEOUT, bench_load_timeout, bench);
+    webkit_web_view_load_uri(bench->web_view, g_ptr_array_index(bench->urls, bench->url_index));
+}
+
+static void on_bench_cache_cleared(GObject *object, GAsyncResult *result, gpointer data) {
+    Benchmark *bench = (Benchmark *)data;
+    GError *error = NULL;
+    
+    if (!webkit_website_data_manager_clear_finish(WEBKIT_WEBSITE_DATA_MANAGER(object), result, &error)) {
+        g_printerr("Benchmark: failed to clear cache: %s\n", error->message);
+        g_error_free(error);
+    }
+    
+    // A fresh view also gets a fresh web process and memory cache
+    bench_create_view(bench);
+    bench_start_load(bench);
+}
+
+static void bench_next(Benchmark *bench) {
+    if (bench->url_index >= bench->urls->len) {
+        g_string_append(bench->report, "\n  ]\n}\n");
+        g_print("%s", bench->report->str);
+        gtk_main_quit();
+        return;
+    }
+    
+    if (bench->warm) {
+        bench_start_load(bench);
+        return;
+    }
+    
+    // Cold runs start with empty disk and memory caches
+    WebKitWebsiteDataManager *manager =
+        webkit_web_context_get_website_data_manager(webkit_web_view_get_context(bench->web_view));
+    webkit_website_data_manager_clear(manager,
+                                      WEBKIT_WEBSITE_DATA_DISK_CACHE | WEBKIT_WEBSITE_DATA_MEMORY_CACHE,
+                                      0, NULL, on_bench_cache_cleared, bench);
+}
+
+// Local stand-in server so benchmarks can run offline: serves files below
+// the given directory on 127.0.0.1. Files carry an ETag and Last-Modified
+// and single ranges are honoured, so downloads can be resumed against it.
+static void bench_serve_file(SoupServer *server, SoupMessage *msg, const char *path,
+                             GHashTable *query, SoupClientContext *client, gpointer data) {
+    const gchar *root = (const gchar *)data;
+    
+    if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+        soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+        return;
+    }
+    if (strstr(path, "..")) {
+        soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+        return;
+    }
+    
+    gchar *file_path = g_build_filename(root, path, NULL);
+    if (g_file_test(file_path, G_FILE_TEST_IS_DIR)) {
+        gchar *index_path = g_build_filename(file_path, "index.html", NULL);
+        g_free(file_path);
+        file_path = index_path;
+    }
+    
+    gchar *contents;
+    gsize length;
+    struct stat st;
+    if (stat(file_path, &st) == 0 && g_file_get_contents(file_path, &contents, &length, NULL)) {
+        gchar *content_type = g_content_type_guess(file_path, (const guchar *)contents, length, NULL);
+        gchar *mime_type = g_content_type_get_mime_type(content_type);
+        SoupMessageHeaders *request = msg->request_headers;
+        SoupMessageHeaders *response = msg->response_headers;
+        
+        gchar *etag = g_strdup_printf("\"%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x\"",
+                                      (gint64)st.st_size, (gint64)st.st_mtime);
+        SoupDate *date = soup_date_new_from_time_t(st.st_mtime);
+        gchar *last_modified = soup_date_to_string(date, SOUP_DATE_HTTP);
+        soup_date_free(date);
+        soup_message_headers_replace(response, "ETag", etag);
+        soup_message_headers_replace(response, "Last-Modified", last_modified);
+        soup_message_headers_replace(response, "Accept-Ranges", "bytes");
+        
+        // A range of a file that changed since is answered with all of it
+        const char *if_range = soup_message_headers_get_one(request, "If-Range");
+        gboolean ranged = soup_message_headers_get_one(request, "Range") &&
+                          (!if_range || strcmp(if_range, etag) == 0 || strcmp(if_range, last_modified) == 0);
+        SoupRange *ranges = NULL;
+        int n_ranges = 0;
+        
+        if (ranged && !soup_message_headers_get_ranges(request, length, &ranges, &n_ranges)) {
+            gchar *content_range = g_strdup_printf("bytes */%" G_GSIZE_FORMAT, length);
+            soup_message_headers_replace(response, "Content-Range", content_range);
+            soup_message_set_status(msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+            g_free(content_range);
+            g_free(contents);
+        } else if (ranged && n_ranges == 1) {
+            goffset start = ranges[0].start, end = ranges[0].end;
+            soup_message_set_status(msg, SOUP_STATUS_PARTIAL_CONTENT);
+            soup_message_set_response(msg, mime_type ? mime_type : "application/octet-stream",
+                                      SOUP_MEMORY_COPY, contents + start, end - start + 1);
+            soup_message_headers_set_content_range(response, start, end, length);
+            g_free(contents);
+        } else {
+            soup_message_set_status(msg, SOUP_STATUS_OK);
+            soup_message_set_response(msg, mime_type ? mime_type : "application/octet-stream",
+                                      SOUP_MEMORY_TAKE, contents, length);
+        }
+        
+        if (ranges) soup_message_headers_free_ranges(request, ranges);
+        g_free(last_modified);
+        g_free(etag);
+        g_free(mime_type);
+        g_free(content_type);
+    } else {
+        soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+    }
+    
+    g_free(file_path);
+}
+
+// Start the stand-in server and return its base URL, or NULL on failure
+static gchar *start_bench_server(const gchar *root) {
+    GError *error = NULL;
+    SoupServer *server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "tinyweb-bench", NULL);
+    
+    soup_server_add_handler(server, NULL, bench_serve_file, g_strdup(root), g_free);
+    if (!soup_server_listen_local(server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error)) {
+        g_printerr("Benchmark: cannot start local server: %s\n", error->message);
+        g_error_free(error);
+        g_object_unref(server);
+        return NULL;
+    }
+    
+    // The server lives until the process exits
+    GSList *uris = soup_server_get_uris(server);
+    gchar *base_url = g_strdup_printf("http://127.0.0.1:%u", soup_uri_get_port(uris->data));
+    g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+    
+    return base_url;
+}
+
+// Read the URL list. With a local server, lines starting with "/" are
+// served from it; otherwise they are taken as file paths.
+static GPtrArray *read_url_list(const gchar *path, const gchar *base_url) {
+    gchar *contents;
+    GError *error = NULL;
+    
+    if (!g_file_get_contents(path, &contents, NULL, &error)) {
+        g_printerr("Cannot read %s: %s\n", path, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    
+    GPtrArray *urls = g_ptr_array_new_with_free_func(g_free);
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    
+    for (guint i = 0; lines[i]; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        gchar *url;
+        
+        if (*line == '\0' || *line == '#') continue;
+        
+        if (line[0] == '/' && base_url) {
+            url = g_strconcat(base_url, line, NULL);
+        } else if (line[0] == '/') {
+            url = g_filename_to_uri(line, NULL, NULL);
+        } else {
+            url = g_strdup(line);
+        }
+        
+        if (url && is_valid_url(url)) {
+            g_ptr_array_add(urls, url);
+        } else {
+            g_printerr("Skipping invalid URL: %s\n", line);
+            g_free(url);
+        }
+    }
+    
+    g_strfreev(lines);
+    g_free(contents);
+    return urls;
+}
+
+// Run the benchmark and return the process exit code
+static int run_benchmark(WebKitSettings *settings, WebKitWebContext *context, const gchar *list_path,
+                         guint runs, const gchar *serve_root, const gchar *cache_model_name) {
+    gchar *base_url = NULL;
+    
+    if (serve_root && !(base_url = start_bench_server(serve_root))) {
+        return 1;
+    }
+    
+    GPtrArray *urls = read_url_list(list_path, base_url);
+    g_free(base_url);
+    if (!urls || urls->len == 0) {
+        g_printerr("Benchmark: no URLs to load\n");
+        if (urls) g_ptr_array_free(urls, TRUE);
+        return 1;
+    }
+    
+    Benchmark bench = { 0 };
+    bench.settings = settings;
+    bench.context = context;
+    bench.urls = urls;
+    bench.runs = runs > 0 ? runs : 1;
+    bench.first_result = TRUE;
+    for (guint m = 0; m < BENCH_N_METRICS; m++) {
+        bench.samples[m] = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    }
+    
+    // Offscreen, so it runs under a virtual display in CI
+    bench.window = gtk_offscreen_window_new();
+    gtk_window_set_default_size(GTK_WINDOW(bench.window), 1280, 800);
+    bench_create_view(&bench);
+    
+    bench.report = g_string_new("{\n  \"runs\": ");
+    g_string_append_printf(bench.report, "%u,\n  \"cache_model\": ", bench.runs);
+    json_append_string(bench.report, cache_model_name);
+    g_string_append(bench.report, ",\n  \"hw_accel\": ");
+    json_append_string(bench.report, hardware_acceleration_names[hardware_acceleration]);
+    g_string_append(bench.report, ",\n  \"results\": [");
+    
+    bench_next(&bench);
+    gtk_main();
+    
+    gtk_widget_destroy(bench.window);
+    for (guint m = 0; m < BENCH_N_METRICS; m++) {
+        g_array_free(bench.samples[m], TRUE);
+    }
+    g_string_free(bench.report, TRUE);
+    g_ptr_array_free(urls, TRUE);
+    return 0;
+}
+
+// Cache pre-warming: load every URL of a list once in an offscreen view,
+// which fills the HTTP disk cache, and save an MHTML snapshot of each page
+// for --prefer-cache.
+typedef struct {
+    WebKitWebView *web_view;
+    GPtrArray *urls;
+    const gchar *cache_dir;
+    guint url_index;
+    guint saved;
+    guint timeout_source;
+    gchar *snapshot_path;
+} Prewarm;
+
+static void prewarm_next(Prewarm *prewarm);
+
+static gboolean prewarm_advance(gpointer data) {
+    Prewarm *prewarm = (Prewarm *)data;
+    
+    prewarm->url_index++;
+    prewarm_next(prewarm);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_prewarm_saved(GObject *object, GAsyncResult *result, gpointer data) {
+    Prewarm *prewarm = (Prewarm *)data;
+    GError *error = NULL;
+    const gchar *url = g_ptr_array_index(prewarm->urls, prewarm->url_index);
+    gchar *tmp_path = g_strconcat(prewarm->snapshot_path, ".tmp", NULL);
+    
+    if (!webkit_web_view_save_to_file_finish(WEBKIT_WEB_VIEW(object), result, &error)) {
+        g_printerr("Prewarm: cannot save %s: %s\n", url, error->message);
+        g_error_free(error);
+        unlink(tmp_path);
+    } else if (rename(tmp_path, prewarm->snapshot_path) != 0) {
+        g_printerr("Prewarm: cannot save %s: %s\n", url, g_strerror(errno));
+        unlink(tmp_path);
+    } else {
+        g_print("Prewarmed %s\n", url);
+        prewarm->saved++;
+    }
+    
+    g_free(tmp_path);
+    g_idle_add(prewarm_advance, prewarm);
+}
+
+static void prewarm_load_changed(WebKitWebView *web_view, WebKitLoadEvent event, gpointer data) {
+    Prewarm *prewarm = (Prewarm *)data;
+    
+    if (event != WEBKIT_LOAD_FINISHED || prewarm->timeout_source == 0) return;
+    g_source_remove(prewarm->timeout_source);
+    prewarm->timeout_source = 0;
+    
+    // Written next to the final name and renamed, so --prefer-cache never
+    // serves a partial snapshot
+    gchar *tmp_path = g_strconcat(prewarm->snapshot_path, ".tmp", NULL);
+    GFile *file = g_file_new_for_path(tmp_path);
+    webkit_web_view_save_to_file(web_view, file, WEBKIT_SAVE_MODE_MHTML, NULL,
+                                 on_prewarm_saved, prewarm);
+    g_object_unref(file);
+    g_free(tmp_path);
+}
+
+static gboolean prewarm_load_failed(WebKitWebView *web_view, WebKitLoadEvent event,
+                                    gchar *failing_uri, GError *error, gpointer data) {
+    Prewarm *prewarm = (Prewarm *)data;
+    
+    if (prewarm->timeout_source == 0) return TRUE;
+    
+    g_printerr("Prewarm: failed to load %s: %s\n", failing_uri, error->message);
+    g_source_remove(prewarm->timeout_source);
+    prewarm->timeout_source = 0;
+    g_idle_add(prewarm_advance, prewarm);
+    return TRUE;
+}
+
+static gboolean prewarm_load_timeout(gpointer data) {
+    Prewarm *prewarm = (Prewarm *)data;
+    
+    g_printerr("Prewarm: timed out loading %s\n",
+               (const gchar *)g_ptr_array_index(prewarm->urls, prewarm->url_index));
+    prewarm->timeout_source = 0;
+    webkit_web_view_stop_loading(prewarm->web_view);
+    g_idle_add(prewarm_advance, prewarm);
+    return G_SOURCE_REMOVE;
+}
+
+static void prewarm_next(Prewarm *prewarm) {
+    g_clear_pointer(&prewarm->snapshot_path, g_free);
+    
+    if (prewarm->url_index >= prewarm->urls->len) {
+        gtk_main_quit();
+        return;
+    }
+    
+    const gchar *url = g_ptr_array_index(prewarm->urls, prewarm->url_index);
+    prewarm->snapshot_path = offline_snapshot_path(prewarm->cache_dir, url);
+    prewarm->timeout_source = g_timeout_add_seconds(BENCH_LOAD_TIMEOUT, prewarm_load_timeout, prewarm);
+    webkit_web_view_load_uri(prewarm->web_view, url);
+}
+
+// Run the pre-warm and return the process exit code
+static int run_prewarm(WebKitSettings *settings, WebKitWebContext *context, const gchar *list_path,
+                       const gchar *cache_dir) {
+    GPtrArray *urls = read_url_list(list_path, NULL);
+    if (!urls || urls->len == 0) {
+        g_printerr("Prewarm: no URLs to load\n");
+        if (urls) g_ptr_array_free(urls, TRUE);
+        return 1;
+    }
+    
+    gchar *offline_dir = g_build_filename(cache_dir, "offline", NULL);
+    if (g_mkdir_with_parents(offline_dir, 0700) != 0) {
+        g_printerr("Prewarm: cannot create %s: %s\n", offline_dir, g_strerror(errno));
+        g_free(offline_dir);
+        g_ptr_array_free(urls, TRUE);
+        return 1;
+    }
+    g_free(offline_dir);
+    
+    Prewarm prewarm = { 0 };
+    prewarm.urls = urls;
+    prewarm.cache_dir = cache_dir;
+    
+    GtkWidget *window = gtk_offscreen_window_new();
+    gtk_window_set_default_size(GTK_WINDOW(window), 1280, 800);
+    prewarm.web_view = WEBKIT_WEB_VIEW(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+                                                    "web-context", context,
+                                                    "settings", settings,
+                                                    NULL));
+    g_signal_connect(prewarm.web_view, "load-changed", G_CALLBACK(prewarm_load_changed), &prewarm);
+    g_signal_connect(prewarm.web_view, "load-failed", G_CALLBACK(prewarm_load_failed), &prewarm);
+    gtk_container_add(GTK_CONTAINER(window), GTK_WIDGET(prewarm.web_view));
+    gtk_widget_show_all(window);
+    
+    prewarm_next(&prewarm);
+    gtk_main();
+    
+    g_print("Prewarmed %u of %u URLs into %s\n", prewarm.saved, urls->len, cache_dir);
+    gtk_widget_destroy(window);
+    
+    int status = prewarm.saved == urls->len ? 0 : 1;
+    g_ptr_array_free(urls, TRUE);
+    return status;
+}
+
+// Render farm: renders every URL of a list to PNG and/or PDF with a pool of
+// offscreen views sharing one context. Every view has its own web process,
+// so the pool spreads over the cores. Output files are named after the
+// position of the URL in the list and the report follows the list order,
+// so results do not depend on which view finished first. The timeout
+// covers loading; a page that fails or times out is retried at the end.
+#define RENDER_DEFAULT_JOBS 4
+#define RENDER_DEFAULT_TIMEOUT 30
+#define RENDER_DEFAULT_RETRIES 1
+#define RENDER_WIDTH 1280
+#define RENDER_HEIGHT 800
+
+enum {
+    RENDER_PNG = 1 << 0,
+    RENDER_PDF = 1 << 1,
+};
+
+typedef struct {
+    const gchar *url;
+    guint attempts;
+    gdouble latency_ms;
+    gchar *error;
+} RenderPage;
+
+typedef struct _RenderFarm RenderFarm;
+
+typedef struct {
+    RenderFarm *farm;
+    GtkWidget *window;
+    WebKitWebView *web_view;
+    guint page_index;
+    gboolean committed;
+    gint64 start;
+    guint timeout_source;
+    guint pending_outputs;
+    gchar *error;
+} RenderWorker;
+
+struct _RenderFarm {
+    GPtrArray *urls;
+    RenderPage *pages;
+    RenderWorker *workers;
+    guint n_workers;
+    guint next_page;
+    GQueue retry_queue;
+    guint busy_workers;
+    const gchar *out_dir;
+    guint formats;
+    guint timeout;
+    guint retries;
+    gchar *file_printer;    // GTK's print-to-file printer, for PDF output
+};
+
+static gboolean parse_render_formats(const char *name, guint *formats) {
+    if (strcmp(name, "png") == 0) {
+        *formats = RENDER_PNG;
+    } else if (strcmp(name, "pdf") == 0) {
+        *formats = RENDER_PDF;
+    } else if (strcmp(name, "both") == 0) {
+        *formats = RENDER_PNG | RENDER_PDF;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gchar *render_output_path(RenderFarm *farm, guint page_index, const gchar *extension) {
+    gchar name[32];
+    g_snprintf(name, sizeof(name), "%05u.%s", page_index + 1, extension);
+    return g_build_filename(farm->out_dir, name, NULL);
+}
+
+static void render_worker_next(RenderWorker *worker);
+
+static gboolean render_worker_advance(gpointer data) {
+    render_worker_next((RenderWorker *)data);
+    return G_SOURCE_REMOVE;
+}
+
+// End the current attempt; failed pages go back in the queue while they
+// have retries left
+static void render_worker_finish(RenderWorker *worker) {
+    RenderFarm *farm = worker->farm;
+    RenderPage *page = &farm->pages[worker->page_index];
+    
+    page->latency_ms = (g_get_monotonic_time() - worker->start) / 1000.0;
+    g_free(page->error);
+    page->error = worker->error;
+    worker->error = NULL;
+    
+    if (page->error && page->attempts <= farm->retries) {
+        g_printerr("Render: %s: %s, retrying\n", page->url, page->error);
+        g_queue_push_tail(&farm->retry_queue, GUINT_TO_POINTER(worker->page_index));
+    } else if (page->error) {
+        g_printerr("Render: %s: %s\n", page->url, page->error);
+    }
+    
+    farm->busy_workers--;
+    g_idle_add(render_worker_advance, worker);
+}
+
+static void render_worker_fail(RenderWorker *worker, const gchar *message) {
+    if (!worker->error) {
+        worker->error = g_strdup(message);
+    }
+}
+
+static void render_output_done(RenderWorker *worker) {
+    if (--worker->pending_outputs == 0) {
+        render_worker_finish(worker);
+    }
+}
+
+// Move a finished output file into place, so a file with the final name is
+// always complete
+static void render_commit_output(RenderWorker *worker, const gchar *tmp_path, const gchar *path) {
+    if (worker->error) {
+        unlink(tmp_path);
+    } else if (rename(tmp_path, path) != 0) {
+        render_worker_fail(worker, g_strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+static void on_render_snapshot(GObject *object, GAsyncResult *result, gpointer data) {
+    RenderWorker *worker = (RenderWorker *)data;
+    GError *error = NULL;
+    cairo_surface_t *surface = webkit_web_view_get_snapshot_finish(WEBKIT_WEB_VIEW(object), result, &error);
+    
+    if (!surface) {
+        render_worker_fail(worker, error->message);
+        g_error_free(error);
+    } else {
+        gchar *path = render_output_path(worker->farm, worker->page_index, "png");
+        gchar *tmp_path = g_strconcat(path, ".tmp", NULL);
+        cairo_status_t status = cairo_surface_write_to_png(surface, tmp_path);
+        
+        if (status != CAIRO_STATUS_SUCCESS) {
+            render_worker_fail(worker, cairo_status_to_string(status));
+        }
+        render_commit_output(worker, tmp_path, path);
+        
+        cairo_surface_destroy(surface);
+        g_free(tmp_path);
+        g_free(path);
+    }
+    render_output_done(worker);
+}
+
+static void on_render_print_failed(WebKitPrintOperation *operation, GError *error, gpointer data) {
+    render_worker_fail((RenderWorker *)data, error->message);
+}
+
+static void on_render_print_finished(WebKitPrintOperation *operation, gpointer data) {
+    RenderWorker *worker = (RenderWorker *)data;
+    gchar *path = render_output_path(worker->farm, worker->page_index, "pdf");
+    gchar *tmp_path = g_strconcat(path, ".tmp", NULL);
+    
+    render_commit_output(worker, tmp_path, path);
+    g_free(tmp_path);
+    g_free(path);
+    g_object_unref(operation);
+    render_output_done(worker);
+}
+
+// The printer of GTK's file backend. Its display name is translated, so it
+// is recognized by its backend rather than by name.
+static gboolean render_find_file_printer(GtkPrinter *printer, gpointer data) {
+    gchar **name = (gchar **)data;
+    GObject *backend = NULL;
+    
+    g_object_get(printer, "backend", &backend, NULL);
+    if (backend && strcmp(G_OBJECT_TYPE_NAME(backend), "GtkPrintBackendFile") == 0) {
+        *name = g_strdup(gtk_printer_get_name(printer));
+    }
+    if (backend) g_object_unref(backend);
+    return *name != NULL; // Stop once found
+}
+
+// Print to a PDF file through GTK's file printer
+static void render_start_pdf(RenderWorker *worker) {
+    gchar *path = render_output_path(worker->farm, worker->page_index, "pdf");
+    gchar *tmp_path = g_strconcat(path, ".tmp", NULL);
+    gchar *tmp_uri = g_filename_to_uri(tmp_path, NULL, NULL);
+    
+    GtkPrintSettings *print_settings = gtk_print_settings_new();
+    gtk_print_settings_set_printer(print_settings, worker->farm->file_printer);
+    gtk_print_settings_set(print_settings, GTK_PRINT_SETTINGS_OUTPUT_FILE_FORMAT, "pdf");
+    gtk_print_settings_set(print_settings, GTK_PRINT_SETTINGS_OUTPUT_URI, tmp_uri);
+    
+    WebKitPrintOperation *operation = webkit_print_operation_new(worker->web_view);
+    webkit_print_operation_set_print_settings(operation, print_settings);
+    g_signal_connect(operation, "failed", G_CALLBACK(on_render_print_failed), worker);
+    g_signal_connect(operation, "finished", G_CALLBACK(on_render_print_finished), worker);
+    webkit_print_operation_print(operation);
+    
+    g_object_unref(print_settings);
+    g_free(tmp_uri);
+    g_free(tmp_path);
+    g_free(path);
+}
+
+static void render_load_changed(WebKitWebView *web_view, WebKitLoadEvent event, gpointer data) {
+    RenderWorker *worker = (RenderWorker *)data;
+    
+    // A load cut short by a timeout can still report finishing after the
+    // next page started; only a load committed in this attempt counts
+    if (event == WEBKIT_LOAD_COMMITTED) {
+        worker->committed = TRUE;
+    }
+    if (event != WEBKIT_LOAD_FINISHED || worker->timeout_source == 0 || !worker->committed) return;
+    g_source_remove(worker->timeout_source);
+    worker->timeout_source = 0;
+    
+    // Both outputs must be written before the view takes the next page
+    guint formats = worker->farm->formats;
+    worker->pending_outputs = ((formats & RENDER_PNG) ? 1 : 0) + ((formats & RENDER_PDF) ? 1 : 0);
+    if (formats & RENDER_PNG) {
+        webkit_web_view_get_snapshot(web_view, WEBKIT_SNAPSHOT_REGION_FULL_DOCUMENT,
+                                     WEBKIT_SNAPSHOT_OPTIONS_NONE, NULL, on_render_snapshot, worker);
+    }
+    if (formats & RENDER_PDF) {
+        render_start_pdf(worker);
+    }
+}
+
+static gboolean render_load_failed(WebKitWebView *web_view, WebKitLoadEvent event,
+                                   gchar *failing_uri, GError *error, gpointer data) {
+    RenderWorker *worker = (RenderWorker *)data;
+    
+    // Cancellation comes from our own timeout, which already ended the attempt
+    if (worker->timeout_source == 0 ||
+        g_error_matches(error, WEBKIT_NETWORK_ERROR, WEBKIT_NETWORK_ERROR_CANCELLED)) {
+        return TRUE;
+    }
+    
+    g_source_remove(worker->timeout_source);
+    worker->timeout_source = 0;
+    render_worker_fail(worker, error->message);
+    render_worker_finish(worker);
+    return TRUE;
+}
+
+static gboolean render_load_timeout(gpointer data) {
+    RenderWorker *worker = (RenderWorker *)data;
+    
+    worker->timeout_source = 0;
+    webkit_web_view_stop_loading(worker->web_view);
+    render_worker_fail(worker, "timed out");
+    render_worker_finish(worker);
+    return G_SOURCE_REMOVE;
+}
+
+// Give the worker the next page: retries first, then the rest of the list
+static void render_worker_next(RenderWorker *worker) {
+    RenderFarm *farm = worker->farm;
+    
+    if (!g_queue_is_empty(&farm->retry_queue)) {
+        worker->page_index = GPOINTER_TO_UINT(g_queue_pop_head(&farm->retry_queue));
+    } else if (farm->next_page < farm->urls->len) {
+        worker->page_index = farm->next_page++;
+    } else {
+        if (farm->busy_workers == 0) {
+            gtk_main_quit();
+        }
+        return;
+    }
+    
+    RenderPage *page = &farm->pages[worker->page_index];
+    page->attempts++;
+    worker->committed = FALSE;
+    farm->busy_workers++;
+    worker->start = g_get_monotonic_time();
+    worker->timeout_source = g_timeout_add_seconds(farm->timeout, render_load_timeout, worker);
+    webkit_web_view_load_uri(worker->web_view, page->url);
+}
+
+static void render_report(RenderFarm *farm, gdouble elapsed_s, guint jobs) {
+    GArray *latencies = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    GString *json = g_string_new(NULL);
+    guint rendered = 0;
+    
+    g_string_append(json, "{\n  \"pages\": [");
+    for (guint i = 0; i < farm->urls->len; i++) {
+        RenderPage *page = &farm->pages[i];
+        
+        g_string_append(json, i == 0 ? "\n    {" : ",\n    {");
+        g_string_append_printf(json, "\"index\": %u, \"url\": ", i + 1);
+        json_append_string(json, page->url);
+        g_string_append_printf(json, ", \"attempts\": %u, \"latency_ms\": %.2f", page->attempts, page->latency_ms);
+        if (page->error) {
+            g_string_append(json, ", \"error\": ");
+            json_append_string(json, page->error);
+        } else {
+            g_array_append_val(latencies, page->latency_ms);
+            rendered++;
+        }
+        g_string_append(json, "}");
+    }
+    
+    g_array_sort(latencies, compare_doubles);
+    g_string_append_printf(json, "\n  ],\n  \"jobs\": %u,\n  \"rendered\": %u,\n  \"failed\": %u,\n"
+                           "  \"elapsed_s\": %.2f,\n  \"pages_per_second\": %.2f,\n"
+                           "  \"latency_ms\": {\"p50\": %.2f, \"p95\": %.2f, \"p99\": %.2f}\n}\n",
+                           jobs, rendered, farm->urls->len - rendered, elapsed_s,
+                           elapsed_s > 0 ? rendered / elapsed_s : 0,
+                           percentile(latencies, 50), percentile(latencies, 95), percentile(latencies, 99));
+    g_print("%s", json->str);
+    
+    g_string_free(json, TRUE);
+    g_array_free(latencies, TRUE);
+}
+
+// Run the render farm and return the process exit code
+static int run_render_farm(WebKitSettings *settings, WebKitWebContext *context, const gchar *list_path,
+                           const gchar *out_dir, guint jobs, guint formats, guint timeout, guint retries) {
+    GPtrArray *urls = read_url_list(list_path, NULL);
+    if (!urls || urls->len == 0) {
+        g_printerr("Render: no URLs to render\n");
+        if (urls) g_ptr_array_free(urls, TRUE);
+        return 1;
+    }
+    if (g_mkdir_with_parents(out_dir, 0755) != 0) {
+        g_printerr("Render: cannot create %s: %s\n", out_dir, g_strerror(errno));
+        g_ptr_array_free(urls, TRUE);
+        return 1;
+    }
+    
+    RenderFarm farm = { 0 };
+    if (formats & RENDER_PDF) {
+        gtk_enumerate_printers(render_find_file_printer, &farm.file_printer, NULL, TRUE);
+        if (!farm.file_printer) {
+            g_printerr("Render: GTK's print-to-file backend is not available for PDF output\n");
+            g_ptr_array_free(urls, TRUE);
+            return 1;
+        }
+    }
+    farm.urls = urls;
+    farm.out_dir = out_dir;
+    farm.formats = formats;
+    farm.timeout = timeout;
+    farm.retries = retries;
+    farm.pages = g_new0(RenderPage, urls->len);
+    for (guint i = 0; i < urls->len; i++) {
+        farm.pages[i].url = g_ptr_array_index(urls, i);
+    }
+    g_queue_init(&farm.retry_queue);
+    
+    // More views than pages would only sit idle
+    farm.n_workers = MIN(jobs, urls->len);
+    farm.workers = g_new0(RenderWorker, farm.n_workers);
+    for (guint i = 0; i < farm.n_workers; i++) {
+        RenderWorker *worker = &farm.workers[i];
+        worker->farm = &farm;
+        worker->window = gtk_offscreen_window_new();
+        gtk_window_set_default_size(GTK_WINDOW(worker->window), RENDER_WIDTH, RENDER_HEIGHT);
+        worker->web_view = WEBKIT_WEB_VIEW(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+                                                        "web-context", context,
+                                                        "settings", settings,
+                                                        NULL));
+        g_signal_connect(worker->web_view, "load-changed", G_CALLBACK(render_load_changed), worker);
+        g_signal_connect(worker->web_view, "load-failed", G_CALLBACK(render_load_failed), worker);
+        gtk_container_add(GTK_CONTAINER(worker->window), GTK_WIDGET(worker->web_view));
+        gtk_widget_show_all(worker->window);
+    }
+    
+    gint64 start = g_get_monotonic_time();
+    for (guint i = 0; i < farm.n_workers; i++) {
+        render_worker_next(&farm.workers[i]);
+    }
+    gtk_main();
+    render_report(&farm, (g_get_monotonic_time() - start) / 1e6, farm.n_workers);
+    
+    int status = 0;
+    for (guint i = 0; i < farm.n_workers; i++) {
+        gtk_widget_destroy(farm.workers[i].window);
+    }
+    for (guint i = 0; i < urls->len; i++) {
+        if (farm.pages[i].error) status = 1;
+        g_free(farm.pages[i].error);
+    }
+    g_free(farm.workers);
+    g_free(farm.pages);
+    g_free(farm.file_printer);
+    g_ptr_array_free(urls, TRUE);
+    return status;
+}
+
+// Downloads. WebKit reports every download of the shared context through
+// download-started. Once WebKit has picked a file name, plain GET
+// downloads over http(s) are taken over by a libsoup transfer that copies
+// the body chunk by chunk into DEST.part, so nothing is held in memory, and
+// continues an interrupted transfer from the size of that file with a Range
+// request. If-Range makes the server send the whole file again if it
+// changed meanwhile. Other downloads (POST results, blob: and data: URLs)
+// stay with WebKit, which cannot resume them. The list and per-download
+// throughput are kept in ~/.config/tinyweb/downloads across restarts.
+#define DOWNLOAD_DEFAULT_JOBS 3
+#define DOWNLOAD_CHUNK_SIZE (64 * 1024)
+#define DOWNLOAD_MAX_RETRIES 5
+#define DOWNLOAD_RETRY_DELAY 2             // Seconds, doubled after every failed attempt
+#define DOWNLOAD_IDLE_TIMEOUT 60           // Seconds without data before an attempt fails
+#define DOWNLOAD_PROGRESS_INTERVAL_MS 500
+#define DOWNLOAD_SAVE_DELAY 1              // Seconds
+#define DOWNLOAD_RESUME_DELAY 2            // Seconds after startup
+#define DOWNLOAD_KEEP_FINISHED 100
+#define DOWNLOAD_MAX_REDIRECTS 10
+
+typedef enum {
+    DOWNLOAD_QUEUED,
+    DOWNLOAD_RUNNING,
+    DOWNLOAD_PAUSED,
+    DOWNLOAD_FAILED,
+    DOWNLOAD_FINISHED
+} DownloadState;
+
+static const char *download_state_names[] = { "queued", "running", "paused", "failed", "finished" };
+
+typedef struct {
+    DownloadManager *manager;
+    gchar *url;
+    gchar *referer;
+    gchar *request_url;            // Where the attempt is after following redirects
+    guint redirects;               // Redirects followed in this attempt
+    gchar *path;                   // Destination; NULL until the response names it
+    gchar *validator;              // ETag or Last-Modified of the partial file
+    DownloadState state;
+    guint64 received;              // Bytes in the .part (or finished) file
+    guint64 total;                 // 0 while unknown
+    guint attempts;                // Failed attempts in a row
+    guint retries;                 // Failed attempts in all
+    gchar *error;
+    gboolean removed;              // Freed when the running attempt ends
+    
+    // Throughput over every attempt, including those of earlier sessions
+    guint64 transferred;
+    gdouble active_seconds;
+    guint64 resumed_bytes;         // Bytes kept from interrupted attempts
+    gint64 attempt_start;
+    gdouble rate;                  // Recent bytes per second, for the ETA
+    guint64 rate_bytes;
+    gint64 rate_time;
+    
+    GCancellable *cancellable;
+    SoupMessage *message;
+    GInputStream *input;
+    GOutputStream *output;
+    GBytes *chunk;                 // The chunk being written
+    guint retry_source;
+    WebKitDownload *webkit_download;   // Set while WebKit does the transfer
+    
+    GtkWidget *row;
+    GtkWidget *name_label;
+    GtkWidget *progress_bar;
+    GtkWidget *status_label;
+    GtkWidget *action_button;
+} Download;
+
+struct _DownloadManager {
+    BrowserData *browser_data;     // NULL in --download mode
+    WebKitWebContext *context;
+    SoupSession *session;
+    GPtrArray *downloads;
+    guint max_jobs;
+    guint running;                 // Transfers of our own, WebKit's do not count
+    gchar *dir;
+    gchar *state_path;             // NULL when the list is not kept
+    guint save_source;
+    guint progress_source;
+    gboolean closing;
+    gboolean quit_when_idle;       // --download mode
+    
+    GtkWidget *window;
+    GtkWidget *list_box;
+    GtkWidget *summary_label;
+};
+
+static void download_manager_schedule(DownloadManager *manager);
+static void download_copy_next(Download *download);
+
+static gboolean download_is_resumable(const gchar *url) {
+    return g_str_has_prefix(url, "http://") || g_str_has_prefix(url, "https://");
+}
+
+static gchar *download_part_path(Download *download) {
+    return g_strconcat(download->path, ".part", NULL);
+}
+
+static gboolean download_path_taken(DownloadManager *manager, const gchar *path) {
+    gchar *part = g_strconcat(path, ".part", NULL);
+    gboolean taken = g_file_test(path, G_FILE_TEST_EXISTS) || g_file_test(part, G_FILE_TEST_EXISTS);
+    g_free(part);
+    
+    for (guint i = 0; !taken && i < manager->downloads->len; i++) {
+        Download *download = g_ptr_array_index(manager->downloads, i);
+        taken = download->path && strcmp(download->path, path) == 0;
+    }
+    return taken;
+}
+
+// A free path in the download directory: "name.ext", then "name (1).ext"
+static gchar *download_unique_path(DownloadManager *manager, const gchar *name) {
+    gchar *base = g_path_get_basename(name && *name ? name : "download");
+    if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 || strcmp(base, G_DIR_SEPARATOR_S) == 0) {
+        g_free(base);
+        base = g_strdup("download");
+    }
+    
+    const gchar *extension = strrchr(base, '.');
+    if (extension == base) extension = NULL;
+    gint stem = extension ? extension - base : (gint)strlen(base);
+    gchar *path = g_build_filename(manager->dir, base, NULL);
+    
+    for (guint n = 1; download_path_taken(manager, path); n++) {
+        gchar *candidate = g_strdup_printf("%.*s (%u)%s", stem, base, n, extension ? extension : "");
+        g_free(path);
+        path = g_build_filename(manager->dir, candidate, NULL);
+        g_free(candidate);
+    }
+    
+    g_free(base);
+    return path;
+}
+
+// File name from Content-Disposition, or else the last segment of the URL
+static gchar *download_name_from_response(SoupMessage *message, const gchar *url) {
+    GHashTable *params = NULL;
+    gchar *name = NULL;
+    
+    if (soup_message_headers_get_content_disposition(message->response_headers, NULL, &params)) {
+        name = g_strdup(g_hash_table_lookup(params, "filename"));
+        g_hash_table_destroy(params);
+    }
+    if (!name) {
+        SoupURI *uri = soup_uri_new(url);
+        const gchar *path = uri ? soup_uri_get_path(uri) : NULL;
+        const gchar *segment = path ? strrchr(path, '/') : NULL;
+        if (segment && segment[1]) {
+            name = soup_uri_decode(segment + 1);
+        }
+        if (uri) soup_uri_free(uri);
+    }
+    return name;
+}
+
+static gdouble download_average_rate(Download *download) {
+    return download->active_seconds > 0 ? download->transferred / download->active_seconds : 0.0;
+}
+
+// "42 s", "7 min" or "2 h 05 min"
+static gchar *download_format_eta(gdouble seconds) {
+    guint total = (guint)(seconds + 0.5);
+    
+    if (total < 60) return g_strdup_printf("%u s", total);
+    if (total < 3600) return g_strdup_printf("%u min", (total + 30) / 60);
+    return g_strdup_printf("%u h %02u min", total / 3600, total % 3600 / 60);
+}
+
+static void download_update_row(Download *download) {
+    if (!download->row) return;
+    
+    gchar *name = download->path ? g_path_get_basename(download->path) : g_strdup(download->url);
+    gchar *received = g_format_size(download->received);
+    gchar *total = download->total ? g_format_size(download->total) : NULL;
+    GString *status = g_string_new(NULL);
+    const gchar *action = NULL;
+    
+    switch (download->state) {
+    case DOWNLOAD_QUEUED:
+    case DOWNLOAD_RUNNING:
+        g_string_append_printf(status, total ? "%s of %s" : "%s", received, total);
+        if (download->state == DOWNLOAD_QUEUED) {
+            g_string_append(status, download->retry_source ? " · Retrying soon" : " · Waiting");
+        } else if (download->rate > 0) {
+            gchar *rate = g_format_size((guint64)download->rate);
+            g_string_append_printf(status, " · %s/s", rate);
+            g_free(rate);
+            if (download->total > download->received) {
+                gchar *eta = download_format_eta((download->total - download->received) / download->rate);
+                g_string_append_printf(status, " · %s left", eta);
+                g_free(eta);
+            }
+        }
+        action = download->webkit_download ? "Cancel" : "Pause";
+        break;
+    case DOWNLOAD_PAUSED:
+        g_string_append_printf(status, total ? "Paused · %s of %s" : "Paused · %s", received, total);
+        action = "Resume";
+        break;
+    case DOWNLOAD_FAILED:
+        g_string_append_printf(status, "Failed: %s", download->error ? download->error : "unknown error");
+        action = download_is_resumable(download->url) ? "Retry" : NULL;
+        break;
+    case DOWNLOAD_FINISHED: {
+        gchar *rate = g_format_size((guint64)download_average_rate(download));
+        g_string_append_printf(status, "%s · %s/s average", received, rate);
+        g_free(rate);
+        action = "Open";
+        break;
+    }
+    }
+    
+    gtk_label_set_text(GTK_LABEL(download->name_label), name);
+    gtk_label_set_text(GTK_LABEL(download->status_label), status->str);
+    if (download->state == DOWNLOAD_FINISHED) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(download->progress_bar), 1.0);
+    } else if (download->total) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(download->progress_bar),
+                                      MIN(1.0, (gdouble)download->received / download->total));
+    } else if (download->state == DOWNLOAD_RUNNING) {
+        gtk_progress_bar_pulse(GTK_PROGRESS_BAR(download->progress_bar));
+    }
+    gtk_widget_set_visible(download->action_button, action != NULL);
+    if (action) {
+        gtk_button_set_label(GTK_BUTTON(download->action_button), action);
+    }
+    
+    g_string_free(status, TRUE);
+    g_free(total);
+    g_free(received);
+    g_free(name);
+}
+
+static void download_manager_update_summary(DownloadManager *manager) {
+    if (!manager->summary_label) return;
+    
+    guint active = 0;
+    gdouble rate = 0;
+    for (guint i = 0; i < manager->downloads->len; i++) {
+        Download *download = g_ptr_array_index(manager->downloads, i);
+        if (download->state == DOWNLOAD_RUNNING) {
+            active++;
+            rate += download->rate;
+        }
+    }
+    
+    gchar *size = g_format_size((guint64)rate);
+    gchar *text = active ? g_strdup_printf("%u active · %s/s", active, size) : g_strdup("No active downloads");
+    gtk_label_set_text(GTK_LABEL(manager->summary_label), text);
+    g_free(text);
+    g_free(size);
+}
+
+// One line per download: STATE URL PATH TOTAL VALIDATOR TRANSFERRED
+// SECONDS RESUMED, separated by tabs; the path is escaped. Downloads still
+// running are written as queued, so they continue on the next start.
+static void download_manager_save(DownloadManager *manager) {
+    if (!manager->state_path) return;
+    
+    GString *contents = g_string_new(NULL);
+    for (guint i = 0; i < manager->downloads->len; i++) {
+        Download *download = g_ptr_array_index(manager->downloads, i);
+        DownloadState state = download->state == DOWNLOAD_RUNNING ? DOWNLOAD_QUEUED : download->state;
+        
+        // WebKit cannot continue its own transfers, and without a path
+        // there is nothing on disk yet
+        if (download->webkit_download || (!download->path && state != DOWNLOAD_QUEUED)) continue;
+        
+        gchar *path = g_strescape(download->path ? download->path : "", NULL);
+        gchar seconds[G_ASCII_DTOSTR_BUF_SIZE];
+        g_ascii_formatd(seconds, sizeof(seconds), "%.3f", download->active_seconds);
+        g_string_append_printf(contents, "%s\t%s\t%s\t%" G_GUINT64_FORMAT "\t%s\t%" G_GUINT64_FORMAT "\t%s\t%"
+                               G_GUINT64_FORMAT "\n",
+                               download_state_names[state], download->url, path, download->total,
+                               download->validator ? download->validator : "", download->transferred,
+                               seconds, download->resumed_bytes);
+        g_free(path);
+    }
+    
+    GError *error = NULL;
+    if (!g_file_set_contents(manager->state_path, contents->str, contents->len, &error)) {
+        g_warning("Failed to save downloads: %s", error->message);
+        g_error_free(error);
+    }
+    g_string_free(contents, TRUE);
+}
+
+static gboolean download_manager_save_idle(gpointer data) {
+    DownloadManager *manager = (DownloadManager *)data;
+    
+    manager->save_source = 0;
+    download_manager_save(manager);
+    return G_SOURCE_REMOVE;
+}
+
+static void download_manager_schedule_save(DownloadManager *manager) {
+    if (manager->state_path && manager->save_source == 0) {
+        manager->save_source = g_timeout_add_seconds(DOWNLOAD_SAVE_DELAY, download_manager_save_idle, manager);
+    }
+}
+
+static void download_set_state(Download *download, DownloadState state) {
+    download->state = state;
+    download->rate = 0;
+    download_update_row(download);
+    download_manager_update_summary(download->manager);
+    download_manager_schedule_save(download->manager);
+}
+
+static void download_free(Download *download) {
+    if (download->row) {
+        gtk_widget_destroy(download->row);
+    }
+    if (download->retry_source) {
+        g_source_remove(download->retry_source);
+    }
+    if (download->webkit_download) {
+        g_signal_handlers_disconnect_by_data(download->webkit_download, download);
+        g_object_unref(download->webkit_download);
+    }
+    g_free(download->url);
+    g_free(download->referer);
+    g_free(download->request_url);
+    g_free(download->path);
+    g_free(download->validator);
+    g_free(download->error);
+    g_free(download);
+}
+
+// Append a throughput record for a finished download to the --perf-log file
+static void download_log_stats(Download *download) {
+    BrowserData *browser_data = download->manager->browser_data;
+    if (!browser_data || browser_data->perf_log_fd < 0) return;
+    
+    GString *record = g_string_new("{\"time\": ");
+    g_string_append_printf(record, "%" G_GINT64_FORMAT ", \"download\": ", g_get_real_time() / G_USEC_PER_SEC);
+    json_append_string(record, download->url);
+    g_string_append_printf(record, ", \"bytes\": %" G_GUINT64_FORMAT ", \"transferred\": %" G_GUINT64_FORMAT ", "
+                           "\"resumed\": %" G_GUINT64_FORMAT ", \"seconds\": %.3f, \"bytes_per_second\": %.0f}\n",
+                           download->received, download->transferred, download->resumed_bytes,
+                           download->active_seconds, download_average_rate(download));
+    
+    if (!write_all(browser_data->perf_log_fd, record->str, record->len)) {
+        g_warning("Failed to write performance log: %s", g_strerror(errno));
+    }
+    g_string_free(record, TRUE);
+}
+
+static gboolean download_retry(gpointer data) {
+    Download *download = (Download *)data;
+    
+    download->retry_source = 0;
+    download_manager_schedule(download->manager);
+    return G_SOURCE_REMOVE;
+}
+
+// End the running attempt. ERROR is NULL on success; RETRY says whether the
+// failure may go away by itself (network trouble, server errors).
+static void download_attempt_end(Download *download, const gchar *error, gboolean retry) {
+    DownloadManager *manager = download->manager;
+    
+    manager->running--;
+    download->active_seconds += (g_get_monotonic_time() - download->attempt_start) / 1e6;
+    g_clear_object(&download->message);
+    g_clear_object(&download->input);
+    g_clear_object(&download->cancellable);
+    if (download->output) {
+        g_output_stream_close(download->output, NULL, NULL);
+        g_clear_object(&download->output);
+    }
+    
+    if (manager->closing) return;
+    if (download->removed) {
+        download_free(download);
+        download_manager_schedule(manager);
+        return;
+    }
+    
+    // Paused meanwhile: the .part file stays for later
+    if (download->state != DOWNLOAD_RUNNING) {
+        download_manager_schedule(manager);
+        return;
+    }
+    
+    if (!error) {
+        gchar *part = download_part_path(download);
+        if (rename(part, download->path) == 0) {
+            download->attempts = 0;
+            download_set_state(download, DOWNLOAD_FINISHED);
+            download_log_stats(download);
+        } else {
+            g_free(download->error);
+            download->error = g_strdup(g_strerror(errno));
+            download_set_state(download, DOWNLOAD_FAILED);
+        }
+        g_free(part);
+    } else if (retry && ++download->attempts <= DOWNLOAD_MAX_RETRIES) {
+        download->retries++;
+        guint delay = DOWNLOAD_RETRY_DELAY << (download->attempts - 1);
+        g_printerr("Download: %s: %s, retrying in %u s\n", download->url, error, delay);
+        download->retry_source = g_timeout_add_seconds(delay, download_retry, download);
+        download_set_state(download, DOWNLOAD_QUEUED);
+    } else {
+        g_printerr("Download: %s: %s\n", download->url, error);
+        g_free(download->error);
+        download->error = g_strdup(error);
+        download_set_state(download, DOWNLOAD_FAILED);
+    }
+    download_manager_schedule(manager);
+}
+
+static void download_attempt_error(Download *download, GError *error) {
+    gboolean cancelled = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+    download_attempt_end(download, cancelled ? "Cancelled" : error->message, !cancelled);
+}
+
+static void on_download_chunk_written(GObject *object, GAsyncResult *result, gpointer data) {
+    Download *download = (Download *)data;
+    GError *error = NULL;
+    gsize written;
+    
+    g_clear_pointer(&download->chunk, g_bytes_unref);
+    if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(object), result, &written, &error)) {
+        // A full disk will not free itself up
+        gboolean cancelled = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+        download_attempt_end(download, cancelled ? "Cancelled" : error->message, FALSE);
+        g_error_free(error);
+        return;
+    }
+    
+    download->received += written;
+    download->transferred += written;
+    download_copy_next(download);
+}
+
+static void on_download_chunk_read(GObject *object, GAsyncResult *result, gpointer data) {
+    Download *download = (Download *)data;
+    GError *error = NULL;
+    GBytes *chunk = g_input_stream_read_bytes_finish(G_INPUT_STREAM(object), result, &error);
+    
+    if (!chunk) {
+        download_attempt_error(download, error);
+        g_error_free(error);
+        return;
+    }
+    
+    gsize size;
+    gconstpointer bytes = g_bytes_get_data(chunk, &size);
+    if (size == 0) {
+        g_bytes_unref(chunk);
+        if (download->total && download->received != download->total) {
+            download_attempt_end(download, "Connection closed early", TRUE);
+        } else {
+            download_attempt_end(download, NULL, FALSE);
+        }
+        return;
+    }
+    
+    // The chunk stays alive until it is written
+    download->chunk = chunk;
+    g_output_stream_write_all_async(download->output, bytes, size, G_PRIORITY_DEFAULT, download->cancellable,
+                                    on_download_chunk_written, download);
+}
+
+// Copy the next chunk of the body; only one chunk is in memory at a time
+static void download_copy_next(Download *download) {
+    g_input_stream_read_bytes_async(download->input, DOWNLOAD_CHUNK_SIZE, G_PRIORITY_DEFAULT,
+                                    download->cancellable, on_download_chunk_read, download);
+}
+
+// Validator for If-Range; weak ETags cannot be used for ranges
+static gchar *download_validator(SoupMessageHeaders *headers) {
+    const char *etag = soup_message_headers_get_one(headers, "ETag");
+    if (etag && !g_str_has_prefix(etag, "W/")) return g_strdup(etag);
+    return g_strdup(soup_message_headers_get_one(headers, "Last-Modified"));
+}
+
+static void download_follow_redirect(Download *download);
+
+static void on_download_response(GObject *object, GAsyncResult *result, gpointer data) {
+    Download *download = (Download *)data;
+    SoupMessage *message = download->message;
+    GError *error = NULL;
+    
+    download->input = soup_session_send_finish(SOUP_SESSION(object), result, &error);
+    if (!download->input) {
+        download_attempt_error(download, error);
+        g_error_free(error);
+        return;
+    }
+    
+    SoupMessageHeaders *headers = message->response_headers;
+    if (SOUP_STATUS_IS_REDIRECTION(message->status_code) &&
+        soup_message_headers_get_one(headers, "Location")) {
+        download_follow_redirect(download);
+        return;
+    }
+    
+    goffset start = 0, end = 0, total = 0;
+    gboolean partial = message->status_code == SOUP_STATUS_PARTIAL_CONTENT &&
+                       soup_message_headers_get_content_range(headers, &start, &end, &total) &&
+                       (guint64)start == download->received;
+    
+    if (message->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE &&
+        download->total && download->received == download->total) {
+        // Everything arrived before the last attempt ended
+        download_attempt_end(download, NULL, FALSE);
+        return;
+    }
+    if (download->received && !partial && message->status_code != SOUP_STATUS_OK) {
+        // The range did not fit the partial file; fetch the whole file
+        g_clear_pointer(&download->validator, g_free);
+        download_attempt_end(download, "Cannot continue the partial file", TRUE);
+        return;
+    }
+    if (!partial && message->status_code != SOUP_STATUS_OK) {
+        gchar *reason = g_strdup_printf("HTTP %u %s", message->status_code, message->reason_phrase);
+        download_attempt_end(download, reason, SOUP_STATUS_IS_SERVER_ERROR(message->status_code));
+        g_free(reason);
+        return;
+    }
+    
+    if (!download->path) {
+        gchar *name = download_name_from_response(message, download->request_url);
+        download->path = download_unique_path(download->manager, name);
+        g_free(name);
+    }
+    
+    // A full response replaces whatever an earlier attempt left
+    if (partial) {
+        download->resumed_bytes += download->received;
+        download->total = total > 0 ? (guint64)total : 0;
+    } else {
+        download->received = 0;
+        download->total = soup_message_headers_get_encoding(headers) == SOUP_ENCODING_CONTENT_LENGTH
+            ? (guint64)soup_message_headers_get_content_length(headers) : 0;
+        g_free(download->validator);
+        download->validator = download_validator(headers);
+    }
+    
+    gchar *part = download_part_path(download);
+    GFile *file = g_file_new_for_path(part);
+    download->output = partial
+        ? G_OUTPUT_STREAM(g_file_append_to(file, G_FILE_CREATE_NONE, NULL, &error))
+        : G_OUTPUT_STREAM(g_file_replace(file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error));
+    g_object_unref(file);
+    g_free(part);
+    
+    if (!download->output) {
+        download_attempt_end(download, error->message, FALSE);
+        g_error_free(error);
+        return;
+    }
+    
+    download_update_row(download);
+    download_manager_schedule_save(download->manager);
+    download_copy_next(download);
+}
+
+static void on_download_cookies(GObject *object, GAsyncResult *result, gpointer data);
+
+// Redirects are followed here rather than by libsoup, which would carry the
+// Cookie header of the first host to the next one. Every hop gets the
+// cookies of its own URL.
+static void download_follow_redirect(Download *download) {
+    SoupMessage *message = download->message;
+    const char *location = soup_message_headers_get_one(message->response_headers, "Location");
+    SoupURI *target = soup_uri_new_with_base(soup_message_get_uri(message), location);
+    
+    g_input_stream_close(download->input, NULL, NULL);
+    g_clear_object(&download->input);
+    g_clear_object(&download->message);
+    
+    if (!target || !SOUP_URI_VALID_FOR_HTTP(target)) {
+        if (target) soup_uri_free(target);
+        download_attempt_end(download, "Invalid redirect", FALSE);
+        return;
+    }
+    if (++download->redirects > DOWNLOAD_MAX_REDIRECTS) {
+        soup_uri_free(target);
+        download_attempt_end(download, "Too many redirects", FALSE);
+        return;
+    }
+    
+    g_free(download->request_url);
+    download->request_url = soup_uri_to_string(target, FALSE);
+    soup_uri_free(target);
+    webkit_cookie_manager_get_cookies(webkit_web_context_get_cookie_manager(download->manager->context),
+                                      download->request_url, download->cancellable, on_download_cookies, download);
+}
+
+// Send the request with the cookies of the browsing context
+static void on_download_cookies(GObject *object, GAsyncResult *result, gpointer data) {
+    Download *download = (Download *)data;
+    GError *error = NULL;
+    GList *cookies = webkit_cookie_manager_get_cookies_finish(WEBKIT_COOKIE_MANAGER(object), result, &error);
+    
+    if (error) {
+        download_attempt_error(download, error);
+        g_error_free(error);
+        return;
+    }
+    
+    SoupMessage *message = soup_message_new(SOUP_METHOD_GET, download->request_url);
+    if (!message) {
+        g_list_free_full(cookies, (GDestroyNotify)soup_cookie_free);
+        download_attempt_end(download, "Invalid URL", FALSE);
+        return;
+    }
+    
+    if (cookies) {
+        GString *header = g_string_new(NULL);
+        for (GList *l = cookies; l; l = l->next) {
+            gchar *cookie = soup_cookie_to_cookie_header(l->data);
+            g_string_append_printf(header, "%s%s", header->len ? "; " : "", cookie);
+            g_free(cookie);
+        }
+        soup_message_headers_replace(message->request_headers, "Cookie", header->str);
+        g_string_free(header, TRUE);
+        g_list_free_full(cookies, (GDestroyNotify)soup_cookie_free);
+    }
+    if (download->referer) {
+        soup_message_headers_replace(message->request_headers, "Referer", download->referer);
+    }
+    
+    // Continue a partial file only if the server can prove it is unchanged
+    gchar *part = download->path ? download_part_path(download) : NULL;
+    struct stat st;
+    download->received = 0;
+    if (part && download->validator && *download->validator && stat(part, &st) == 0 && st.st_size > 0) {
+        download->received = st.st_size;
+        soup_message_headers_set_range(message->request_headers, st.st_size, -1);
+        soup_message_headers_replace(message->request_headers, "If-Range", download->validator);
+    }
+    g_free(part);
+    
+    soup_message_set_flags(message, SOUP_MESSAGE_NO_REDIRECT);
+    download->message = message;
+    soup_session_send_async(download->manager->session, message, download->cancellable,
+                            on_download_response, download);
+}
+
+static gboolean download_manager_progress(gpointer data) {
+    DownloadManager *manager = (DownloadManager *)data;
+    gint64 now = g_get_monotonic_time();
+    gboolean active = FALSE;
+    
+    for (guint i = 0; i < manager->downloads->len; i++) {
+        Download *download = g_ptr_array_index(manager->downloads, i);
+        if (download->state != DOWNLOAD_RUNNING) continue;
+        
+        active = TRUE;
+        if (download->webkit_download) {
+            WebKitURIResponse *response = webkit_download_get_response(download->webkit_download);
+            download->received = download->transferred =
+                webkit_download_get_received_data_length(download->webkit_download);
+            download->total = response ? webkit_uri_response_get_content_length(response) : 0;
+        }
+        
+        // Smooth the rate over the last few seconds
+        if (download->rate_time) {
+            gdouble elapsed = (now - download->rate_time) / 1e6;
+            gdouble rate = (download->transferred - download->rate_bytes) / elapsed;
+            download->rate = download->rate > 0 ? 0.7 * download->rate + 0.3 * rate : rate;
+        }
+        download->rate_bytes = download->transferred;
+        download->rate_time = now;
+        download_update_row(download);
+    }
+    download_manager_update_summary(manager);
+    
+    if (!active) {
+        manager->progress_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void download_manager_watch_progress(DownloadManager *manager) {
+    if (manager->progress_source == 0) {
+        manager->progress_source = g_timeout_add(DOWNLOAD_PROGRESS_INTERVAL_MS, download_manager_progress, manager);
+    }
+}
+
+static void download_start(Download *download) {
+    DownloadManager *manager = download->manager;
+    
+    manager->running++;
+    download->attempt_start = g_get_monotonic_time();
+    download->rate_time = 0;
+    download->cancellable = g_cancellable_new();
+    download_set_state(download, DOWNLOAD_RUNNING);
+    download_manager_watch_progress(manager);
+    
+    g_free(download->request_url);
+    download->request_url = g_strdup(download->url);
+    download->redirects = 0;
+    webkit_cookie_manager_get_cookies(webkit_web_context_get_cookie_manager(manager->context), download->url,
+                                      download->cancellable, on_download_cookies, download);
+}
+
+// Start queued downloads while job slots are free
+static void download_manager_schedule(DownloadManager *manager) {
+    gboolean pending = FALSE;
+    
+    for (guint i = 0; i < manager->downloads->len; i++) {
+        Download *download = g_ptr_array_index(manager->downloads, i);
+        if (download->state != DOWNLOAD_QUEUED) continue;
+        
+        if (download->retry_source == 0 && manager->running < manager->max_jobs) {
+            download_start(download);
+        } else {
+            pending = TRUE;
+        }
+    }
+    
+    if (manager->quit_when_idle && manager->running == 0 && !pending && gtk_main_level() > 0) {
+        gtk_main_quit();
+    }
+}
+
+static void download_manager_add_row(DownloadManager *manager, Download *download);
+
+static Download *download_manager_add(DownloadManager *manager, const gchar *url, const gchar *path) {
+    Download *download = g_new0(Download, 1);
+    download->manager = manager;
+    download->url = g_strdup(url);
+    download->path = g_strdup(path);
+    g_ptr_array_add(manager->downloads, download);
+    
+    if (manager->list_box) {
+        download_manager_add_row(manager, download);
+    }
+    return download;
+}
+
+// Stop a transfer and keep what arrived
+static void download_pause(Download *download) {
+    if (download->webkit_download) {
+        webkit_download_cancel(download->webkit_download);
+        return;
+    }
+    if (download->retry_source) {
+        g_source_remove(download->retry_source);
+        download->retry_source = 0;
+    }
+    
+    gboolean running = download->state == DOWNLOAD_RUNNING;
+    download_set_state(download, DOWNLOAD_PAUSED);
+    if (running) {
+        g_cancellable_cancel(download->cancellable);
+    }
+}
+
+static void download_resume(Download *download) {
+    download->attempts = 0;
+    g_clear_pointer(&download->error, g_free);
+    download_set_state(download, DOWNLOAD_QUEUED);
+    download_manager_schedule(download->manager);
+}
+
+// Take a download out of the list; a partial file is deleted, a finished
+// one is kept
+static void download_remove(Download *download) {
+    DownloadManager *manager = download->manager;
+    
+    g_ptr_array_remove(manager->downloads, download);
+    download_manager_schedule_save(manager);
+    download_manager_update_summary(manager);
+    
+    if (download->path && download->state != DOWNLOAD_FINISHED) {
+        gchar *part = download_part_path(download);
+        unlink(part);
+        g_free(part);
+    }
+    if (download->webkit_download) {
+        g_signal_handlers_disconnect_by_data(download->webkit_download, download);
+        webkit_download_cancel(download->webkit_download);
+    }
+    
+    if (download->state == DOWNLOAD_RUNNING && !download->webkit_download) {
+        // The attempt ends asynchronously; the row goes right away
+        g_clear_pointer(&download->row, gtk_widget_destroy);
+        download->removed = TRUE;
+        g_cancellable_cancel(download->cancellable);
+    } else {
+        download_free(download);
+    }
+}
+
+static void on_download_action(GtkWidget *button, gpointer data) {
+    Download *download = (Download *)data;
+    
+    switch (download->state) {
+    case DOWNLOAD_QUEUED:
+    case DOWNLOAD_RUNNING:
+        download_pause(download);
+        break;
+    case DOWNLOAD_PAUSED:
+    case DOWNLOAD_FAILED:
+        download_resume(download);
+        break;
+    case DOWNLOAD_FINISHED: {
+        GError *error = NULL;
+        gchar *uri = g_filename_to_uri(download->path, NULL, NULL);
+        if (uri && !gtk_show_uri_on_window(GTK_WINDOW(download->manager->window), uri, GDK_CURRENT_TIME, &error)) {
+            g_warning("Failed to open %s: %s", download->path, error->message);
+            g_error_free(error);
+        }
+        g_free(uri);
+        break;
+    }
+    }
+}
+
+static void on_download_remove(GtkWidget *button, gpointer data) {
+    download_remove((Download *)data);
+}
+
+static void download_manager_add_row(DownloadManager *manager, Download *download) {
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *text_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+    gtk_container_set_border_width(GTK_CONTAINER(box), 5);
+    
+    download->name_label = gtk_label_new(NULL);
+    gtk_label_set_ellipsize(GTK_LABEL(download->name_label), PANGO_ELLIPSIZE_MIDDLE);
+    gtk_label_set_xalign(GTK_LABEL(download->name_label), 0);
+    download->progress_bar = gtk_progress_bar_new();
+    download->status_label = gtk_label_new(NULL);
+    gtk_label_set_ellipsize(GTK_LABEL(download->status_label), PANGO_ELLIPSIZE_END);
+    gtk_label_set_xalign(GTK_LABEL(download->status_label), 0);
+    gtk_box_pack_start(GTK_BOX(text_box), download->name_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(text_box), download->progress_bar, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(text_box), download->status_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(box), text_box, TRUE, TRUE, 0);
+    
+    download->action_button = gtk_button_new_with_label("Pause");
+    gtk_widget_set_no_show_all(download->action_button, TRUE);
+    g_signal_connect(download->action_button, "clicked", G_CALLBACK(on_download_action), download);
+    gtk_box_pack_start(GTK_BOX(box), download->action_button, FALSE, FALSE, 0);
+    
+    GtkWidget *remove_button = gtk_button_new_with_label("✕");
+    gtk_widget_set_tooltip_text(remove_button, "Remove from the list");
+    g_signal_connect(remove_button, "clicked", G_CALLBACK(on_download_remove), download);
+    gtk_box_pack_start(GTK_BOX(box), remove_button, FALSE, FALSE, 0);
+    
+    // Newest first
+    gtk_list_box_insert(GTK_LIST_BOX(manager->list_box), box, 0);
+    download->row = gtk_widget_get_parent(box);
+    gtk_widget_show_all(download->row);
+    download_update_row(download);
+}
+
+static void on_downloads_clear(GtkWidget *button, gpointer data) {
+    DownloadManager *manager = (DownloadManager *)data;
+    
+    for (guint i = manager->downloads->len; i > 0; i--) {
+        Download *download = g_ptr_array_index(manager->downloads, i - 1);
+        if (download->state == DOWNLOAD_FINISHED) {
+            download_remove(download);
+        }
+    }
+}
+
+// The panel is built on first use and hidden, not destroyed, when closed
+static void download_manager_show(DownloadManager *manager) {
+    if (!manager->window) {
+        manager->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+        gtk_window_set_title(GTK_WINDOW(manager->window), "Downloads");
+        gtk_window_set_default_size(GTK_WINDOW(manager->window), 500, 350);
+        gtk_window_set_transient_for(GTK_WINDOW(manager->window), GTK_WINDOW(manager->browser_data->window));
+        g_signal_connect(manager->window, "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+        
+        GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+        gtk_container_set_border_width(GTK_CONTAINER(vbox), 5);
+        GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+        gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
+                                    GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+        manager->list_box = gtk_list_box_new();
+        gtk_list_box_set_selection_mode(GTK_LIST_BOX(manager->list_box), GTK_SELECTION_NONE);
+        gtk_container_add(GTK_CONTAINER(scrolled_window), manager->list_box);
+        
+        GtkWidget *button_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+        manager->summary_label = gtk_label_new(NULL);
+        gtk_box_pack_start(GTK_BOX(button_box), manager->summary_label, FALSE, FALSE, 0);
+        GtkWidget *clear_button = gtk_button_new_with_label("Clear finished");
+        g_signal_connect(clear_button, "clicked", G_CALLBACK(on_downloads_clear), manager);
+        gtk_box_pack_end(GTK_BOX(button_box), clear_button, FALSE, FALSE, 0);
+        
+        gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
+        gtk_box_pack_start(GTK_BOX(vbox), button_box, FALSE, FALSE, 0);
+        gtk_container_add(GTK_CONTAINER(manager->window), vbox);
+        
+        for (guint i = 0; i < manager->downloads->len; i++) {
+            download_manager_add_row(manager, g_ptr_array_index(manager->downloads, i));
+        }
+        download_manager_update_summary(manager);
+        gtk_widget_show_all(vbox);
+    }
+    gtk_window_present(GTK_WINDOW(manager->window));
+}
+
+static void show_downloads(GtkWidget *widget, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    download_manager_show(browser_data->download_manager);
+}
+
+static void on_webkit_download_failed(WebKitDownload *webkit_download, GError *error, gpointer data) {
+    Download *download = (Download *)data;
+    
+    g_free(download->error);
+    download->error = g_error_matches(error, WEBKIT_DOWNLOAD_ERROR, WEBKIT_DOWNLOAD_ERROR_CANCELLED_BY_USER)
+        ? g_strdup("Cancelled") : g_strdup(error->message);
+}
+
+// Emitted after "failed" as well
+static void on_webkit_download_finished(WebKitDownload *webkit_download, gpointer data) {
+    Download *download = (Download *)data;
+    
+    download->received = download->transferred = webkit_download_get_received_data_length(webkit_download);
+    download->active_seconds = webkit_download_get_elapsed_time(webkit_download);
+    g_signal_handlers_disconnect_by_data(webkit_download, download);
+    g_clear_object(&download->webkit_download);
+    
+    if (download->error) {
+        download_set_state(download, DOWNLOAD_FAILED);
+    } else {
+        download_set_state(download, DOWNLOAD_FINISHED);
+        download_log_stats(download);
+    }
+}
+
+// Take over resumable downloads; leave the rest to WebKit
+static gboolean on_download_decide_destination(WebKitDownload *webkit_download, const gchar *suggested_filename,
+                                               gpointer data) {
+    DownloadManager *manager = (DownloadManager *)data;
+    WebKitURIRequest *request = webkit_download_get_request(webkit_download);
+    const gchar *url = webkit_uri_request_get_uri(request);
+    const gchar *method = webkit_uri_request_get_http_method(request);
+    SoupMessageHeaders *headers = webkit_uri_request_get_http_headers(request);
+    
+    gchar *path = download_unique_path(manager, suggested_filename);
+    Download *download = download_manager_add(manager, url, path);
+    g_free(path);
+    if (headers) {
+        download->referer = g_strdup(soup_message_headers_get_one(headers, "Referer"));
+    }
+    
+    if (download_is_resumable(url) && (!method || strcmp(method, "GET") == 0)) {
+        webkit_download_cancel(webkit_download);
+        download_set_state(download, DOWNLOAD_QUEUED);
+        download_manager_schedule(manager);
+    } else {
+        gchar *uri = g_filename_to_uri(download->path, NULL, NULL);
+        download->webkit_download = g_object_ref(webkit_download);
+        g_signal_connect(webkit_download, "failed", G_CALLBACK(on_webkit_download_failed), download);
+        g_signal_connect(webkit_download, "finished", G_CALLBACK(on_webkit_download_finished), download);
+        webkit_download_set_destination(webkit_download, uri);
+        download->attempt_start = g_get_monotonic_time();
+        download_set_state(download, DOWNLOAD_RUNNING);
+        download_manager_watch_progress(manager);
+        g_free(uri);
+    }
+    
+    download_manager_show(manager);
+    return TRUE;
+}
+
+static void on_download_started(WebKitWebContext *context, WebKitDownload *webkit_download, gpointer data) {
+    g_signal_connect(webkit_download, "decide-destination", G_CALLBACK(on_download_decide_destination), data);
+}
+
+// Read the list saved by download_manager_save(); finished downloads past
+// DOWNLOAD_KEEP_FINISHED are dropped, oldest first
+static void download_manager_load(DownloadManager *manager) {
+    gchar *contents;
+    if (!manager->state_path || !g_file_get_contents(manager->state_path, &contents, NULL, NULL)) return;
+    
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    guint finished = 0;
+    for (guint i = 0; lines[i]; i++) {
+        finished += g_str_has_prefix(lines[i], "finished\t");
+    }
+    
+    for (guint i = 0; lines[i]; i++) {
+        gchar **fields = g_strsplit(lines[i], "\t", 8);
+        if (g_strv_length(fields) == 8) {
+            DownloadState state = DOWNLOAD_QUEUED;
+            for (guint s = 0; s < G_N_ELEMENTS(download_state_names); s++) {
+                if (strcmp(fields[0], download_state_names[s]) == 0) state = s;
+            }
+            
+            if (state != DOWNLOAD_FINISHED || finished-- <= DOWNLOAD_KEEP_FINISHED) {
+                gchar *path = g_strcompress(fields[2]);
+                Download *download = download_manager_add(manager, fields[1], *path ? path : NULL);
+                download->state = state;
+                download->total = g_ascii_strtoull(fields[3], NULL, 10);
+                download->validator = *fields[4] ? g_strdup(fields[4]) : NULL;
+                download->transferred = g_ascii_strtoull(fields[5], NULL, 10);
+                download->active_seconds = g_ascii_strtod(fields[6], NULL);
+                download->resumed_bytes = g_ascii_strtoull(fields[7], NULL, 10);
+                
+                struct stat st;
+                gchar *file = download->path && state != DOWNLOAD_FINISHED ? download_part_path(download)
+                                                                           : g_strdup(download->path);
+                if (file && stat(file, &st) == 0) {
+                    download->received = st.st_size;
+                }
+                g_free(file);
+                g_free(path);
+            }
+        }
+        g_strfreev(fields);
+    }
+    
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+static gboolean download_manager_resume(gpointer data) {
+    download_manager_schedule((DownloadManager *)data);
+    return G_SOURCE_REMOVE;
+}
+
+static DownloadManager *download_manager_new(BrowserData *browser_data, WebKitWebContext *context,
+                                             WebKitSettings *settings, const gchar *dir, guint jobs) {
+    DownloadManager *manager = g_new0(DownloadManager, 1);
+    manager->browser_data = browser_data;
+    manager->context = context;
+    manager->max_jobs = jobs;
+    manager->downloads = g_ptr_array_new();
+    manager->dir = g_strdup(dir ? dir : g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD));
+    if (!manager->dir) {
+        manager->dir = g_strdup(g_get_home_dir());
+    }
+    g_mkdir_with_parents(manager->dir, 0755);
+    
+    manager->session = soup_session_new_with_options(SOUP_SESSION_USER_AGENT, webkit_settings_get_user_agent(settings),
+                                                     SOUP_SESSION_TIMEOUT, DOWNLOAD_IDLE_TIMEOUT,
+                                                     NULL);
+    // Sizes and Range offsets count the bytes on the wire; a decoded body
+    // would not match Content-Length or the .part file on resume
+    soup_session_remove_feature_by_type(manager->session, SOUP_TYPE_CONTENT_DECODER);
+    
+    // The browser keeps its list and picks up downloads WebKit starts;
+    // --download mode only runs the list it was given
+    if (browser_data) {
+        manager->state_path = get_config_path("downloads");
+        download_manager_load(manager);
+        g_signal_connect(context, "download-started", G_CALLBACK(on_download_started), manager);
+        g_timeout_add_seconds(DOWNLOAD_RESUME_DELAY, download_manager_resume, manager);
+    }
+    return manager;
+}
+
+// Save the list and stop transfers; partial files are continued next time
+static void download_manager_close(DownloadManager *manager) {
+    if (manager->save_source) {
+        g_source_remove(manager->save_source);
+        manager->save_source = 0;
+    }
+    if (manager->progress_source) {
+        g_source_remove(manager->progress_source);
+        manager->progress_source = 0;
+    }
+    if (manager->window) {
+        gtk_widget_hide(manager->window);
+    }
+    download_manager_save(manager);
+    
+    manager->closing = TRUE;
+    for (guint i = 0; i < manager->downloads->len; i++) {
+        Download *download = g_ptr_array_index(manager->downloads, i);
+        if (download->cancellable) {
+            g_cancellable_cancel(download->cancellable);
+        }
+    }
+}
+
+// Download every URL of a list (same format as --bench) into DIR with JOBS
+// transfers at a time, print per-download and total throughput as JSON and
+// return the process exit code
+static int run_download_list(WebKitSettings *settings, WebKitWebContext *context, const gchar *list_path,
+                             const gchar *serve_root, const gchar *dir, guint jobs) {
+    gchar *base_url = NULL;
+    
+    if (serve_root && !(base_url = start_bench_server(serve_root))) {
+        return 1;
+    }
+    
+    GPtrArray *urls = read_url_list(list_path, base_url);
+    g_free(base_url);
+    if (!urls || urls->len == 0) {
+        g_printerr("Download: no URLs to download\n");
+        if (urls) g_ptr_array_free(urls, TRUE);
+        return 1;
+    }
+    
+    DownloadManager *manager = download_manager_new(NULL, context, settings, dir, jobs);
+    manager->quit_when_idle = TRUE;
+    for (guint i = 0; i < urls->len; i++) {
+        const gchar *url = g_ptr_array_index(urls, i);
+        if (download_is_resumable(url)) {
+            download_manager_add(manager, url, NULL);
+        } else {
+            g_printerr("Download: %s: only http and https URLs can be downloaded\n", url);
+        }
+    }
+    
+    gint64 start = g_get_monotonic_time();
+    download_manager_schedule(manager);
+    if (manager->running > 0) {
+        gtk_main();
+    }
+    gdouble seconds = (g_get_monotonic_time() - start) / 1e6;
+    
+    GString *json = g_string_new("{\n  \"jobs\": ");
+    guint64 bytes = 0;
+    int status = manager->downloads->len == urls->len ? 0 : 1;
+    g_string_append_printf(json, "%u,\n  \"downloads\": [", jobs);
+    
+    for (guint i = 0; i < manager->downloads->len; i++) {
+        Download *download = g_ptr_array_index(manager->downloads, i);
+        
+        g_string_append(json, i ? ",\n    {\"url\": " : "\n    {\"url\": ");
+        json_append_string(json, download->url);
+        g_string_append(json, ", \"path\": ");
+        json_append_string(json, download->path ? download->path : "");
+        g_string_append_printf(json, ", \"state\": \"%s\", \"bytes\": %" G_GUINT64_FORMAT ", "
+                               "\"transferred\": %" G_GUINT64_FORMAT ", \"resumed\": %" G_GUINT64_FORMAT ", "
+                               "\"retries\": %u, \"seconds\": %.3f, \"bytes_per_second\": %.0f",
+                               download_state_names[download->state], download->received,
+                               download->transferred, download->resumed_bytes, download->retries,
+                               download->active_seconds, download_average_rate(download));
+        if (download->error) {
+            g_string_append(json, ", \"error\": ");
+            json_append_string(json, download->error);
+        }
+        g_string_append_c(json, '}');
+        
+        bytes += download->transferred;
+        if (download->state != DOWNLOAD_FINISHED) status = 1;
+    }
+    
+    g_string_append_printf(json, "\n  ],\n  \"seconds\": %.3f,\n  \"bytes\": %" G_GUINT64_FORMAT ",\n"
+                           "  \"bytes_per_second\": %.0f\n}\n",
+                           seconds, bytes, seconds > 0 ? bytes / seconds : 0.0);
+    g_print("%s", json->str);
+    g_string_free(json, TRUE);
+    g_ptr_array_free(urls, TRUE);
+    return status;
+}
+
+// Built-in pages: tinyweb://start (the default home page), bookmarks,
+// history, search (of the page index) and stats. They are generated from the browser's in-memory state
+// with the compiled-in markup below, so they load without disk or network
+// I/O. The scheme is registered as local, which keeps web pages from
+// loading or embedding them.
+#define BUILTIN_SCHEME "tinyweb"
+#define BUILTIN_START_URL BUILTIN_SCHEME "://start"
+#define BUILTIN_START_SITES 8
+#define BUILTIN_START_BOOKMARKS 8
+#define BUILTIN_MAX_ROWS 500
+#define BUILTIN_SEARCH_RESULTS 50
+
+#define BUILTIN_PAGE_HEAD \
+    "<!DOCTYPE html><html><head><meta charset=\"utf-8\">" \
+    "<meta name=\"color-scheme\" content=\"light dark\"><style>" \
+    "body{font:15px/1.45 sans-serif;max-width:60em;margin:0 auto;padding:1em 2em;color:#222;background:#fafafa}" \
+    "nav a{margin-right:1.2em}h1{font-size:1.5em}h2{font-size:1.1em;margin-top:1.6em}" \
+    "a{color:#1a57b5;text-decoration:none}a:hover{text-decoration:underline}" \
+    "input[type=search]{width:60%;padding:.4em}select,button{padding:.35em}" \
+    "table{border-collapse:collapse;width:100%}" \
+    "td,th{text-align:left;vertical-align:top;padding:.35em .5em;border-bottom:1px solid #e4e4e4;" \
+    "overflow-wrap:anywhere}th{font-weight:600}" \
+    ".url,.muted{color:#777;font-size:.85em}" \
+    ".tiles{display:grid;grid-template-columns:repeat(auto-fill,minmax(13em,1fr));gap:.7em}" \
+    ".tiles a{display:block;padding:.8em;background:#fff;border:1px solid #ddd;border-radius:6px;" \
+    "white-space:nowrap;overflow:hidden;text-overflow:ellipsis}" \
+    "@media (prefers-color-scheme:dark){body{background:#1d1d1d;color:#ddd}a{color:#8ab4f8}" \
+    ".tiles a{background:#282828;border-color:#444}td,th{border-color:#333}}" \
+    "</style><title>"
+
+#define BUILTIN_PAGE_NAV \
+    "</title></head><body><nav>" \
+    "<a href=\"tinyweb://start\">Start</a><a href=\"tinyweb://bookmarks\">Bookmarks</a>" \
+    "<a href=\"tinyweb://history\">History</a><a href=\"tinyweb://search\">Search</a>" \
+    "<a href=\"tinyweb://stats\">Stats</a></nav>"
+
+#define BUILTIN_PAGE_TAIL "</body></html>"
+
+static void builtin_append_text(GString *html, const gchar *text) {
+    gchar *escaped = g_markup_escape_text(text ? text : "", -1);
+    g_string_append(html, escaped);
+    g_free(escaped);
+}
+
+// Only addresses is_valid_url() accepts become links, so stored data cannot
+// smuggle in javascript: URLs
+static void builtin_append_link(GString *html, const gchar *url, const gchar *title) {
+    const gchar *label = title && *title ? title : url;
+    
+    if (is_valid_url(url)) {
+        g_string_append(html, "<a href=\"");
+        builtin_append_text(html, url);
+        g_string_append(html, "\">");
+        builtin_append_text(html, label);
+        g_string_append(html, "</a>");
+    } else {
+        builtin_append_text(html, label);
+    }
+}
+
+static GString *builtin_page_begin(const gchar *title) {
+    GString *html = g_string_new(BUILTIN_PAGE_HEAD);
+    builtin_append_text(html, title);
+    g_string_append(html, BUILTIN_PAGE_NAV "<h1>");
+    builtin_append_text(html, title);
+    g_string_append(html, "</h1>");
+    return html;
+}
+
+// Search box submitting to the page itself
+static void builtin_append_search(GString *html, const gchar *action, const gchar *placeholder,
+                                  const gchar *query) {
+    g_string_append_printf(html, "<form action=\"%s\"><input type=\"search\" name=\"q\" placeholder=\"%s\" value=\"",
+                           action, placeholder);
+    builtin_append_text(html, query);
+    g_string_append(html, "\" autofocus> <button>Search</button></form>");
+}
+
+// Most visited sites and the newest bookmarks. Before bookmarks and
+// history are loaded the page is shown without them and reloaded after.
+static void builtin_start_page(BrowserData *browser_data, GHashTable *params, GString *html) {
+    builtin_append_search(html, "tinyweb://history", "Search history", NULL);
+    if (!browser_data->deferred_loaded) return;
+    
+    GPtrArray *top = browser_data->history
+        ? history_query(browser_data->history, NULL, BUILTIN_START_SITES) : g_ptr_array_new();
+    if (top->len) {
+        g_string_append(html, "<h2>Most visited</h2><div class=\"tiles\">");
+        for (guint i = 0; i < top->len; i++) {
+            HistoryEntry *entry = g_ptr_array_index(top, i);
+            builtin_append_link(html, entry->url, entry->title);
+        }
+        g_string_append(html, "</div>");
+    }
+    g_ptr_array_free(top, TRUE);
+    
+    GPtrArray *bookmarks = browser_data->bookmarks;
+    if (bookmarks->len) {
+        g_string_append(html, "<h2>Recent bookmarks</h2><div class=\"tiles\">");
+        for (guint i = bookmarks->len; i > 0 && i + BUILTIN_START_BOOKMARKS > bookmarks->len; i--) {
+            Bookmark *bookmark = g_ptr_array_index(bookmarks, i - 1);
+            builtin_append_link(html, bookmark->url, bookmark->title);
+        }
+        g_string_append(html, "</div>");
+    }
+}
+
+static void builtin_bookmarks_page(BrowserData *browser_data, GHashTable *params, GString *html) {
+    const gchar *query = params ? g_hash_table_lookup(params, "q") : NULL;
+    const gchar *tag = params ? g_hash_table_lookup(params, "tag") : NULL;
+    GPtrArray *tags = bookmark_index_tags(browser_data->bookmark_index);
+    GPtrArray *rows = g_ptr_array_new();
+    
+    // Search box with the tags as folders
+    g_string_append(html, "<form><input type=\"search\" name=\"q\" placeholder=\"Search bookmarks\" value=\"");
+    builtin_append_text(html, query);
+    g_string_append(html, "\" autofocus> <select name=\"tag\"><option value=\"\">All bookmarks</option>");
+    for (guint i = 0; i < tags->len; i++) {
+        const gchar *name = g_ptr_array_index(tags, i);
+        g_string_append(html, "<option");
+        if (tag && strcmp(tag, name) == 0) g_string_append(html, " selected");
+        g_string_append(html, ">");
+        builtin_append_text(html, name);
+        g_string_append(html, "</option>");
+    }
+    g_string_append(html, "</select> <button>Search</button></form>");
+    
+    bookmark_index_query(browser_data->bookmark_index, browser_data->bookmarks, query, tag, rows);
+    g_string_append_printf(html, "<p class=\"muted\">%u bookmarks", rows->len);
+    if (rows->len > BUILTIN_MAX_ROWS) {
+        g_string_append_printf(html, ", showing the first %u", BUILTIN_MAX_ROWS);
+    }
+    g_string_append(html, "</p>");
+    
+    g_string_append(html, "<table><tr><th>Title</th><th>Tags</th></tr>");
+    for (guint i = 0; i < rows->len && i < BUILTIN_MAX_ROWS; i++) {
+        Bookmark *bookmark = g_ptr_array_index(rows, i);
+        g_string_append(html, "<tr><td>");
+        builtin_append_link(html, bookmark->url, bookmark->title);
+        g_string_append(html, "<div class=\"url\">");
+        builtin_append_text(html, bookmark->url);
+        g_string_append(html, "</div></td><td>");
+        builtin_append_text(html, bookmark->tags);
+        g_string_append(html, "</td></tr>");
+    }
+    g_string_append(html, "</table>");
+    
+    g_ptr_array_free(rows, TRUE);
+    g_ptr_array_free(tags, TRUE);
+}
+
+static void builtin_history_page(BrowserData *browser_data, GHashTable *params, GString *html) {
+    const gchar *query = params ? g_hash_table_lookup(params, "q") : NULL;
+    
+    builtin_append_search(html, "tinyweb://history", "Search history", query);
+    if (!browser_data->history) {
+        g_string_append(html, "<p class=\"muted\">History is not available.</p>");
+        return;
+    }
+    
+    GPtrArray *entries = history_query(browser_data->history, query, BUILTIN_MAX_ROWS);
+    g_string_append(html, "<table><tr><th>Page</th><th>Visits</th><th>Last visit</th></tr>");
+    for (guint i = 0; i < entries->len; i++) {
+        HistoryEntry *entry = g_ptr_array_index(entries, i);
+        GDateTime *time = g_date_time_new_from_unix_local(entry->recent_visits[0]);
+        gchar *when = time ? g_date_time_format(time, "%Y-%m-%d %H:%M") : g_strdup("");
+        
+        g_string_append(html, "<tr><td>");
+        builtin_append_link(html, entry->url, entry->title);
+        g_string_append(html, "<div class=\"url\">");
+        builtin_append_text(html, entry->url);
+        g_string_append_printf(html, "</div></td><td>%u</td><td>%s</td></tr>", entry->visit_count, when);
+        
+        g_free(when);
+        if (time) g_date_time_unref(time);
+    }
+    g_string_append(html, "</table>");
+    g_ptr_array_free(entries, TRUE);
+}
+
+// Full-text search of visited pages
+static void builtin_search_page(BrowserData *browser_data, GHashTable *params, GString *html) {
+    const gchar *query = params ? g_hash_table_lookup(params, "q") : NULL;
+    
+    builtin_append_search(html, "tinyweb://search", "Search the text of visited pages", query);
+    if (!browser_data->page_index) {
+        g_string_append(html, "<p class=\"muted\">Pages are not indexed. Start tinyweb with "
+                        "<code>--index-pages</code> or set <code>index=true</code> in the "
+                        "<code>[pages]</code> group of tinyweb.conf.</p>");
+        return;
+    }
+    if (!query || !*query) return;
+    
+    gint64 start = g_get_monotonic_time();
+    GPtrArray *hits = page_index_query(browser_data->page_index, query, FALSE, BUILTIN_SEARCH_RESULTS);
+    gdouble elapsed_ms = (g_get_monotonic_time() - start) / 1000.0;
+    guint pages, segments;
+    guint64 bytes;
+    page_index_stats(browser_data->page_index, &pages, &segments, &bytes);
+    
+    g_string_append_printf(html, "<p class=\"muted\">%u results from %u pages in %.1f ms</p><table>",
+                           hits->len, pages, elapsed_ms);
+    for (guint i = 0; i < hits->len; i++) {
+        PageHit *hit = g_ptr_array_index(hits, i);
+        GDateTime *time = g_date_time_new_from_unix_local(hit->time);
+        gchar *when = time ? g_date_time_format(time, "%Y-%m-%d %H:%M") : g_strdup("");
+        
+        g_string_append(html, "<tr><td>");
+        builtin_append_link(html, hit->url, hit->title);
+        g_string_append(html, "<div class=\"url\">");
+        builtin_append_text(html, hit->url);
+        g_string_append_printf(html, "</div></td><td>%s</td></tr>", when);
+        
+        g_free(when);
+        if (time) g_date_time_unref(time);
+    }
+    g_string_append(html, "</table>");
+    g_ptr_array_free(hits, TRUE);
+}
+
+static void builtin_append_stat(GString *html, const gchar *name, const gchar *format, ...) G_GNUC_PRINTF(3, 4);
+
+static void builtin_append_stat(GString *html, const gchar *name, const gchar *format, ...) {
+    va_list args;
+    
+    g_string_append_printf(html, "<tr><th>%s</th><td>", name);
+    va_start(args, format);
+    g_string_append_vprintf(html, format, args);
+    va_end(args);
+    g_string_append(html, "</td></tr>");
+}
+
+// The counters of the status bar and its tooltip, and a few more
+static void builtin_stats_page(BrowserData *browser_data, GHashTable *params, GString *html) {
+    guint live = 0;
+    for (guint i = 0; i < browser_data->tabs->len; i++) {
+        Tab *tab = g_ptr_array_index(browser_data->tabs, i);
+        live += tab->web_view != NULL;
+    }
+    gchar *rss = g_format_size(get_web_process_rss_kb() * 1024);
+    
+    g_string_append(html, "<table>");
+    builtin_append_stat(html, "Tabs", "%u open, %u loaded (limit %u in the background)",
+                        browser_data->tabs->len, live, browser_data->max_live_tabs);
+    builtin_append_stat(html, "Web processes", "%s", rss);
+    
+    MemoryGuard *guard = browser_data->memory_guard;
+    if (guard) {
+        builtin_append_stat(html, "Memory budget",
+                            "%u MiB, stage %s, peak %" G_GUINT64_FORMAT " MiB; %" G_GUINT64_FORMAT " cache drops, "
+                            "%" G_GUINT64_FORMAT " media stops, %" G_GUINT64_FORMAT " suspends, "
+                            "%" G_GUINT64_FORMAT " reloads",
+                            guard->config.limit_mb, memory_stage_names[guard->stage], guard->peak_rss_kb / 1024,
+                            guard->cache_drops, guard->media_stops, guard->suspends, guard->reloads);
+    }
+    Prefetcher *prefetcher = browser_data->prefetcher;
+    if (prefetcher) {
+        builtin_append_stat(html, "DNS prefetch",
+                            "%" G_GUINT64_FORMAT " issued, %" G_GUINT64_FORMAT " deduplicated, "
+                            "%" G_GUINT64_FORMAT " rate limited; %" G_GUINT64_FORMAT " hits, "
+                            "%" G_GUINT64_FORMAT " misses",
+                            prefetcher->issued, prefetcher->deduplicated, prefetcher->rate_limited,
+                            prefetcher->hits, prefetcher->misses);
+    }
+    if (browser_data->content_blocker) {
+        builtin_append_stat(html, "Blocked requests", "%" G_GUINT64_FORMAT,
+                            browser_data->content_blocker->blocked_total);
+    }
+    if (browser_data->deferred_loaded) {
+        builtin_append_stat(html, "Bookmarks", "%u", browser_data->bookmarks->len);
+        if (browser_data->history) {
+            builtin_append_stat(html, "History", "%u pages", g_hash_table_size(browser_data->history->entries));
+        }
+    }
+    
+    if (browser_data->page_index) {
+        guint pages, segments;
+        guint64 bytes;
+        page_index_stats(browser_data->page_index, &pages, &segments, &bytes);
+        gchar *size = g_format_size(bytes);
+        builtin_append_stat(html, "Page index", "%u pages in %u segments, %s; %" G_GUINT64_FORMAT
+                            " skipped while busy", pages, segments, size, browser_data->page_index->dropped);
+        g_free(size);
+    }
+    
+    DownloadManager *downloads = browser_data->download_manager;
+    if (downloads) {
+        guint64 bytes = 0;
+        gdouble seconds = 0;
+        for (guint i = 0; i < downloads->downloads->len; i++) {
+            Download *download = g_ptr_array_index(downloads->downloads, i);
+            bytes += download->transferred;
+            seconds += download->active_seconds;
+        }
+        gchar *size = g_format_size(bytes);
+        gchar *rate = g_format_size(seconds > 0 ? (guint64)(bytes / seconds) : 0);
+        builtin_append_stat(html, "Downloads", "%u listed, %u running; %s at %s/s on average",
+                            downloads->downloads->len, downloads->running, size, rate);
+        g_free(rate);
+        g_free(size);
+    }
+    g_string_append(html, "</table>");
+    g_free(rss);
+}
+
+typedef struct {
+    const gchar *name;
+    const gchar *title;
+    void (*build)(BrowserData *browser_data, GHashTable *params, GString *html);
+    gboolean needs_state;      // Load bookmarks and history first
+} BuiltinPage;
+
+static const BuiltinPage builtin_pages[] = {
+    { "start", "New tab", builtin_start_page, FALSE },
+    { "bookmarks", "Bookmarks", builtin_bookmarks_page, TRUE },
+    { "history", "History", builtin_history_page, TRUE },
+    { "search", "Search pages", builtin_search_page, FALSE },
+    { "stats", "Stats", builtin_stats_page, FALSE },
+};
+
+static void builtin_scheme_request(WebKitURISchemeRequest *request, gpointer data) {
+    BrowserData *browser_data = (BrowserData *)data;
+    SoupURI *uri = soup_uri_new(webkit_uri_scheme_request_get_uri(request));
+    const gchar *name = uri ? soup_uri_get_host(uri) : NULL;
+    const BuiltinPage *page = NULL;
+    
+    for (guint i = 0; name && i < G_N_ELEMENTS(builtin_pages); i++) {
+        if (g_ascii_strcasecmp(name, builtin_pages[i].name) == 0) page = &builtin_pages[i];
+    }
+    if (!page) {
+        GError *error = g_error_new(G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No such page: %s",
+                                    webkit_uri_scheme_request_get_uri(request));
+        webkit_uri_scheme_request_finish_error(request, error);
+        g_error_free(error);
+        if (uri) soup_uri_free(uri);
+        return;
+    }
+    
+    if (page->needs_state) {
+        load_deferred_state(browser_data);
+    }
+    GHashTable *params = soup_uri_get_query(uri) ? soup_form_decode(soup_uri_get_query(uri)) : NULL;
+    GString *html = builtin_page_begin(page->title);
+    page->build(browser_data, params, html);
+    g_string_append(html, BUILTIN_PAGE_TAIL);
+    
+    gsize length = html->len;
+    GInputStream *stream = g_memory_input_stream_new_from_data(g_string_free(html, FALSE), length, g_free);
+    webkit_uri_scheme_request_finish(request, stream, length, "text/html");
+    
+    g_object_unref(stream);
+    if (params) g_hash_table_destroy(params);
+    soup_uri_free(uri);
+}
+
+static void builtin_pages_register(BrowserData *browser_data, WebKitWebContext *context) {
+    webkit_web_context_register_uri_scheme(context, BUILTIN_SCHEME, builtin_scheme_request, browser_data, NULL);
+    webkit_security_manager_register_uri_scheme_as_local(webkit_web_context_get_security_manager(context),
+                                                         BUILTIN_SCHEME);
+}
+
+// Bookmark manager benchmark: builds N synthetic bookmarks in memory (the
+// journal is not touched), then times building the word index, opening the
+// manager and filtering it, and prints the results as JSON
+#define BOOKMARK_BENCH_FILTER_RUNS 20
+#define BOOKMARK_BENCH_DEFAULT_COUNT 100000
+
+static gdouble bookmark_bench_elapsed_ms(gint64 start) {
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+static void bookmark_bench_settle(void) {
+    while (gtk_events_pending()) {
+        gtk_main_iteration();
+    }
+}
+
+static int run_bookmark_benchmark(BrowserData *browser_data, guint count) {
+    static const gchar *words[] = {
+        "linux", "kernel", "release", "notes", "recipe", "pasta", "weather", "forecast",
+        "rust", "compiler", "guide", "news", "football", "results", "travel", "tokyo",
+        "paper", "memory", "allocator", "design", "music", "review", "garden", "tools"
+    };
+    static const gchar *tags[] = { "work", "docs", "reading", "cooking", "travel", "music", "" };
+    static const gchar *queries[] = { "l", "linux", "rust guide", "tokyo travel", "site42", "zzz" };
+    const guint n_words = G_N_ELEMENTS(words);
+    
+    GRand *rand = g_rand_new_with_seed(42);
+    gint64 start = g_get_monotonic_time();
+    
+    for (guint i = 0; i < count; i++) {
+        gchar *title = g_strdup_printf("%s %s %s %u", words[g_rand_int_range(rand, 0, n_words)],
+                                       words[g_rand_int_range(rand, 0, n_words)],
+                                       words[g_rand_int_range(rand, 0, n_words)], i);
+        gchar *url = g_strdup_printf("https://site%u.example/%s/%u", i % 5000,
+                                     words[g_rand_int_range(rand, 0, n_words)], i);
+        Bookmark *bookmark = bookmark_new(title, url, tags[g_rand_int_range(rand, 0, G_N_ELEMENTS(tags))], i);
+        g_ptr_array_add(browser_data->bookmarks, bookmark);
+        bookmark_index_add(browser_data->bookmark_index, bookmark, FALSE);
+        g_free(title);
+        g_free(url);
+    }
+    bookmark_index_sort(browser_data->bookmark_index);
+    gdouble build_ms = bookmark_bench_elapsed_ms(start);
+    g_rand_free(rand);
+    
+    // Open: build the dialog and let it lay out and draw its first rows
+    start = g_get_monotonic_time();
+    BookmarkManager *manager = bookmark_manager_new(browser_data, NULL);
+    gtk_widget_show(manager->dialog);
+    bookmark_bench_settle();
+    gdouble open_ms = bookmark_bench_elapsed_ms(start);
+    
+    GString *json = g_string_new(NULL);
+    g_string_append_printf(json, "{\n  \"bookmarks\": %u,\n  \"index_keys\": %u,\n"
+                           "  \"index_build_ms\": %.2f,\n  \"open_ms\": %.2f,\n  \"filters\": [",
+                           count, browser_data->bookmark_index->keys->len, build_ms, open_ms);
+    
+    // Filter latency: from the text changing until the view has redrawn
+    // The last case lists every bookmark sorted by title
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    for (guint q = 0; q <= G_N_ELEMENTS(queries) + 1; q++) {
+        gboolean tag_filter = q == G_N_ELEMENTS(queries);
+        gboolean sorted = q == G_N_ELEMENTS(queries) + 1;
+        
+        for (guint run = 0; run < BOOKMARK_BENCH_FILTER_RUNS; run++) {
+            manager->sort_column = -1;
+            gtk_entry_set_text(GTK_ENTRY(manager->search_entry), "");
+            gtk_combo_box_set_active(GTK_COMBO_BOX(manager->tag_combo), 0);
+            bookmark_bench_settle();
+            
+            start = g_get_monotonic_time();
+            if (tag_filter) {
+                gtk_combo_box_set_active(GTK_COMBO_BOX(manager->tag_combo), 1);
+            } else if (sorted) {
+                manager->sort_column = 0;
+                bookmark_manager_refilter(manager);
+            } else {
+                // Set directly rather than waiting for the search-changed delay
+                gtk_entry_set_text(GTK_ENTRY(manager->search_entry), queries[q]);
+                bookmark_manager_refilter(manager);
+            }
+            bookmark_bench_settle();
+            gdouble elapsed = bookmark_bench_elapsed_ms(start);
+            g_array_append_val(samples, elapsed);
+        }
+        
+        g_array_sort(samples, compare_doubles);
+        g_string_append(json, q == 0 ? "\n    {" : ",\n    {");
+        if (tag_filter) {
+            g_string_append(json, "\"tag\": ");
+            gchar *tag = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(manager->tag_combo));
+            json_append_string(json, tag ? tag : "");
+            g_free(tag);
+        } else if (sorted) {
+            g_string_append(json, "\"sort\": \"title\"");
+        } else {
+            g_string_append(json, "\"query\": ");
+            json_append_string(json, queries[q]);
+        }
+        g_string_append_printf(json, ", \"matches\": %u, \"p50\": %.2f, \"p95\": %.2f, \"p99\": %.2f}",
+                               manager->model->rows->len, percentile(samples, 50),
+                               percentile(samples, 95), percentile(samples, 99));
+        g_array_set_size(samples, 0);
+    }
+    g_string_append(json, "\n  ]\n}\n");
+    g_print("%s", json->str);
+    
+    g_array_free(samples, TRUE);
+    g_string_free(json, TRUE);
+    bookmark_manager_free(manager);
+    return 0;
+}
+
+// Page index benchmark: indexes N synthetic pages with a Zipf word
+// distribution into a temporary directory, reopens the index, times ranked
+// queries and prints the results as JSON. Only the indexing calls are
+// timed, not generating the text.
+#define PAGE_BENCH_DEFAULT_COUNT 100000
+#define PAGE_BENCH_VOCABULARY 50000
+#define PAGE_BENCH_QUERY_RUNS 50
+#define PAGE_BENCH_RESULTS 10
+
+// Distinct pronounceable word for a frequency rank
+static gchar *page_bench_word(guint rank) {
+    static const gchar *syllables[] = {
+        "ka", "lo", "mi", "ne", "ru", "sa", "ti", "vo", "ze", "da", "fe", "gu", "ho", "ji", "pa", "be"
+    };
+    GString *word = g_string_new(NULL);
+    
+    do {
+        g_string_append(word, syllables[rank % G_N_ELEMENTS(syllables)]);
+        rank /= G_N_ELEMENTS(syllables);
+    } while (rank > 0);
+    return g_string_free(word, FALSE);
+}
+
+static void page_bench_remove_dir(const gchar *path) {
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *name;
+    
+    while (dir && (name = g_dir_read_name(dir))) {
+        gchar *file = g_build_filename(path, name, NULL);
+        unlink(file);
+        g_free(file);
+    }
+    if (dir) g_dir_close(dir);
+    rmdir(path);
+}
+
+static int run_page_index_benchmark(guint count) {
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("tinyweb-pages-XXXXXX", &error);
+    if (!dir) {
+        g_printerr("Cannot create a directory for the benchmark: %s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    
+    // Cumulative weights 1/rank, sampled by binary search
+    gchar **words = g_new0(gchar *, PAGE_BENCH_VOCABULARY + 1);
+    gdouble *weights = g_new(gdouble, PAGE_BENCH_VOCABULARY);
+    gdouble total = 0;
+    for (guint i = 0; i < PAGE_BENCH_VOCABULARY; i++) {
+        words[i] = page_bench_word(i);
+        total += 1.0 / (i + 1);
+        weights[i] = total;
+    }
+    
+    GRand *rand = g_rand_new_with_seed(42);
+    GString *text = g_string_new(NULL);
+    PageIndex *index = page_index_new(dir);
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    guint64 words_indexed = 0;
+    gint64 indexing_us = 0;
+    
+    for (guint i = 0; i < count; i++) {
+        guint length = g_rand_int_range(rand, 100, 500);
+        g_string_truncate(text, 0);
+        for (guint w = 0; w < length; w++) {
+            gdouble target = g_rand_double(rand) * total;
+            guint low = 0, high = PAGE_BENCH_VOCABULARY - 1;
+            while (low < high) {
+                guint mid = (low + high) / 2;
+                if (weights[mid] < target) low = mid + 1; else high = mid;
+            }
+            g_string_append(text, words[low]);
+            g_string_append_c(text, w % 12 == 11 ? '\n' : ' ');
+        }
+        words_indexed += length;
+        gchar *url = g_strdup_printf("https://site%u.example/page/%u", i % 5000, i);
+        gchar *title = g_strdup_printf("%s %s %u", words[g_rand_int_range(rand, 0, 1000)],
+                                       words[g_rand_int_range(rand, 0, 1000)], i);
+        
+        gint64 start = g_get_monotonic_time();
+        page_index_add_document(index, url, title, text->str, now - (count - i));
+        indexing_us += g_get_monotonic_time() - start;
+        g_free(title);
+        g_free(url);
+    }
+    gint64 start = g_get_monotonic_time();
+    page_index_flush(index);
+    indexing_us += g_get_monotonic_time() - start;
+    g_rand_free(rand);
+    g_string_free(text, TRUE);
+    
+    // Reopen, as a new start would
+    page_index_free(index);
+    index = page_index_new(dir);
+    start = g_get_monotonic_time();
+    page_index_load(index);
+    gdouble load_ms = (g_get_monotonic_time() - start) / 1000.0;
+    
+    guint pages, segments;
+    guint64 bytes;
+    page_index_stats(index, &pages, &segments, &bytes);
+    gdouble index_ms = indexing_us / 1000.0;
+    
+    GString *json = g_string_new(NULL);
+    g_string_append_printf(json, "{\n  \"pages\": %u,\n  \"words\": %" G_GUINT64_FORMAT ",\n"
+                           "  \"index_ms\": %.1f,\n  \"pages_per_second\": %.0f,\n  \"segments\": %u,\n"
+                           "  \"index_bytes\": %" G_GUINT64_FORMAT ",\n  \"bytes_per_page\": %.1f,\n"
+                           "  \"load_ms\": %.2f,\n  \"queries\": [",
+                           pages, words_indexed, index_ms, index_ms > 0 ? count / (index_ms / 1000) : 0.0,
+                           segments, bytes, pages ? (gdouble)bytes / pages : 0.0, load_ms);
+    
+    // Frequent, medium and rare words alone and together, and a prefix as typed
+    gchar *prefix = g_strndup(words[3000], 5);
+    struct {
+        gchar *text;
+        gboolean prefix;
+    } queries[] = {
+        { g_strdup(words[1]), FALSE },
+        { g_strdup(words[200]), FALSE },
+        { g_strdup(words[20000]), FALSE },
+        { g_strdup_printf("%s %s", words[1], words[200]), FALSE },
+        { g_strdup_printf("%s %s %s", words[20000], words[200], words[5]), FALSE },
+        { g_strdup_printf("%s %s", words[40], prefix), TRUE },
+    };
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    for (guint q = 0; q < G_N_ELEMENTS(queries); q++) {
+        guint results = 0;
+        for (guint run = 0; run < PAGE_BENCH_QUERY_RUNS; run++) {
+            start = g_get_monotonic_time();
+            GPtrArray *hits = page_index_query(index, queries[q].text, queries[q].prefix, PAGE_BENCH_RESULTS);
+            gdouble elapsed = (g_get_monotonic_time() - start) / 1000.0;
+            g_array_append_val(samples, elapsed);
+            results = hits->len;
+            g_ptr_array_free(hits, TRUE);
+        }
+        
+        g_array_sort(samples, compare_doubles);
+        g_string_append(json, q == 0 ? "\n    {\"query\": " : ",\n    {\"query\": ");
+        json_append_string(json, queries[q].text);
+        g_string_append_printf(json, ", \"prefix\": %s, \"results\": %u, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f}",
+                               queries[q].prefix ? "true" : "false", results, percentile(samples, 50),
+                               percentile(samples, 95), percentile(samples, 99));
+        g_array_set_size(samples, 0);
+        g_free(queries[q].text);
+    }
+    g_string_append(json, "\n  ]\n}\n");
+    g_print("%s", json->str);
+    
+    g_string_free(json, TRUE);
+    g_array_free(samples, TRUE);
+    g_free(prefix);
+    page_index_free(index);
+    page_bench_remove_dir(dir);
+    g_free(dir);
+    g_free(weights);
+    g_strfreev(words);
+    return 0;
+}
+
+// --import and --export without a running browser, and the import
+// benchmark: one transfer against a bookmark store on a plain main loop
+typedef struct {
+    GMainLoop *loop;
+    gboolean verbose;          // Progress on stderr
+    gboolean ok;
+    guint added;
+    guint duplicates;
+    guint invalid;
+    guint peak_queued;
+    gdouble seconds;
+} BookmarkTransferRun;
+
+static void bookmark_transfer_run_notify(BookmarkTransfer *transfer, gpointer data) {
+    BookmarkTransferRun *run = (BookmarkTransferRun *)data;
+    
+    if (run->verbose) {
+        gchar *text = bookmark_transfer_describe(transfer);
+        g_printerr("\r%s%s", text, transfer->finished ? "\n" : "");
+        g_free(text);
+    }
+    if (!transfer->finished) return;
+    
+    run->ok = !transfer->error && !g_cancellable_is_cancelled(transfer->cancellable);
+    run->added = transfer->added;
+    run->duplicates = transfer->duplicates;
+    run->invalid = transfer->invalid;
+    run->peak_queued = transfer->peak_queued;
+    run->seconds = (g_get_monotonic_time() - transfer->start) / (gdouble)G_USEC_PER_SEC;
+    g_main_loop_quit(run->loop);
+}
+
+static gboolean bookmark_transfer_run(BrowserData *browser_data, gboolean exporting, const gchar *path,
+                                      BookmarkFormat format, BookmarkTransferRun *run) {
+    run->loop = g_main_loop_new(NULL, FALSE);
+    run->ok = FALSE;
+    
+    gchar *error = bookmark_transfer_start(browser_data, exporting, path, format,
+                                           bookmark_transfer_run_notify, run);
+    if (error) {
+        g_printerr("%s\n", error);
+        g_free(error);
+    } else {
+        g_main_loop_run(run->loop);
+    }
+    g_main_loop_unref(run->loop);
+    return run->ok;
+}
+
+static void bookmark_store_init(BrowserData *browser_data, gchar *path) {
+    browser_data->bookmarks_path = path;
+    browser_data->bookmarks_fd = -1;
+    browser_data->bookmarks = g_ptr_array_new_with_free_func(bookmark_free);
+    browser_data->bookmark_index = bookmark_index_new();
+    browser_data->bookmark_urls = g_hash_table_new(g_str_hash, g_str_equal);
+    browser_data->completion_index = completion_index_new();
+}
+
+// Import into or export from the bookmarks file, then print a summary as JSON
+static int run_bookmark_transfer(BrowserData *browser_data, const char *import_path, const char *export_path,
+                                 const char *export_format) {
+    if (import_path && export_path) {
+        g_printerr("Import and export bookmarks one at a time\n");
+        return 1;
+    }
+    
+    // A running browser owns the journal and numbers its records; appending
+    // behind its back would make its deletions remove the wrong bookmarks
+    int fd = control_connect();
+    if (fd >= 0) {
+        close(fd);
+        g_printerr("tinyweb is running; import and export bookmarks from it, or quit it first\n");
+        return 1;
+    }
+    
+    const char *path = import_path ? import_path : export_path;
+    BookmarkFormat format = bookmark_format_for_path(path);
+    if (export_format && !parse_bookmark_format(export_format, &format)) {
+        g_printerr("Unknown bookmark format %s, expected html, chrome or firefox\n", export_format);
+        return 1;
+    }
+    
+    gchar *bookmarks_path = get_bookmarks_path();
+    if (!bookmarks_path) {
+        g_printerr("Could not create the bookmarks directory\n");
+        return 1;
+    }
+    bookmark_store_init(browser_data, bookmarks_path);
+    load_bookmarks(browser_data);
+    
+    BookmarkTransferRun run = { NULL, TRUE };
+    bookmark_transfer_run(browser_data, export_path != NULL, path, format, &run);
+    
+    // Synced like on exit, so the imported bookmarks survive a crash
+    if (browser_data->bookmarks_fd >= 0) {
+        fsync(browser_data->bookmarks_fd);
+        close(browser_data->bookmarks_fd);
+        browser_data->bookmarks_fd = -1;
+    }
+    
+    GString *json = g_string_new("{\n  \"operation\": ");
+    json_append_string(json, import_path ? "import" : "export");
+    g_string_append(json, ",\n  \"file\": ");
+    json_append_string(json, path);
+    if (export_path) {
+        g_string_append(json, ",\n  \"format\": ");
+        json_append_string(json, bookmark_format_names[format]);
+    }
+    g_string_append_printf(json, ",\n  \"ok\": %s,\n  \"bookmarks\": %u,\n  \"%s\": %u,\n",
+                           run.ok ? "true" : "false", browser_data->bookmarks->len,
+                           import_path ? "added" : "written", run.added);
+    if (import_path) {
+        g_string_append_printf(json, "  \"duplicates\": %u,\n  \"invalid\": %u,\n", run.duplicates, run.invalid);
+    }
+    g_string_append_printf(json, "  \"seconds\": %.2f\n}\n", run.seconds);
+    g_print("%s", json->str);
+    g_string_free(json, TRUE);
+    
+    return run.ok ? 0 : 1;
 }
 
-static void refresh_page(GtkWidget *widget, gpointer data) {
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(data);
-    webkit_web_view_reload(web_view);
-}
+// Import benchmark: writes a Netscape bookmark file and a Firefox JSON
+// backup with N generated bookmarks in nested folders, imports each into
+// an empty journal in a temporary directory, reloads the journal, exports
+// it in every format and prints the throughput as JSON. Every 50th entry
+// repeats the previous address and every 200th is a javascript: link, so
+// duplicates and refused entries are part of the run. Writing the input
+// files is not timed.
+#define BOOKMARK_IO_BENCH_DEFAULT_COUNT 200000
+#define BOOKMARK_IO_BENCH_FOLDER_SIZE 500
 
-static void go_home(GtkWidget *widget, gpointer data) {
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(data);
-    const gchar *home_url = g_object_get_data(G_OBJECT(widget), "home-url");
+static void bookmark_io_bench_entry(guint i, GString *title, GString *url, GString *tags) {
+    static const gchar *words[] = {
+        "linux", "kernel", "release", "notes", "recipe", "pasta", "weather", "forecast",
+        "rust", "compiler", "guide", "news", "football", "results", "travel", "tokyo"
+    };
+    const guint n = G_N_ELEMENTS(words);
+    guint site = i % 200 == 199 ? 0 : (i % 50 == 49 ? i - 1 : i);
     
-    if (is_valid_url(home_url)) {
-        webkit_web_view_load_uri(web_view, home_url);
+    g_string_printf(title, "%s %s – %s %u", words[i % n], words[(i / n) % n], words[(i * 7) % n], i);
+    if (i % 200 == 199) {
+        g_string_assign(url, "javascript:void(0)");
     } else {
-        webkit_web_view_load_uri(web_view, DEFAULT_URL);
+        g_string_printf(url, "https://site%u.example/%s/%u?page=1&ref=%s", site % 5000, words[site % n],
+                        site, words[(site / n) % n]);
     }
+    g_string_assign(tags, i % 3 ? words[(i * 3) % n] : "");
 }
 
-// Handle TLS errors
-static gboolean on_load_failed_with_tls_errors(WebKitWebView *web_view,
-                                           gchar *failing_uri,
-                                           GTlsCertificate *certificate,
-                                           GTlsCertificateFlags errors,
-                                           gpointer user_data) {
-    GtkWidget *dialog;
-    GtkWidget *window = gtk_widget_get_toplevel(GTK_WIDGET(web_view));
-    gint response;
+// Escape for HTML (entities) or JSON (a string literal) into out
+static void bookmark_io_bench_append(GString *out, const gchar *text, gboolean json) {
+    if (json) {
+        json_append_string(out, text);
+    } else {
+        builtin_append_text(out, text);
+    }
+}
+
+static gboolean bookmark_io_bench_write_file(const gchar *path, guint count, gboolean json) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return FALSE;
     
-    dialog = gtk_message_dialog_new(GTK_WINDOW(window),
-                                  GTK_DIALOG_MODAL,
-                                  GTK_MESSAGE_WARNING,
-                                  GTK_BUTTONS_YES_NO,
-                                  "The website's security certificate is not trusted:\n%s\n\nDo you want to continue?",
-                                  failing_uri);
+    GString *out = g_string_new(NULL);
+    GString *title = g_string_new(NULL), *url = g_string_new(NULL), *tags = g_string_new(NULL);
+    gboolean ok = TRUE;
     
-    response = gtk_dialog_run(GTK_DIALOG(dialog));
-    gtk_widget_destroy(dialog);
+    if (json) {
+        g_string_append(out, "{\"guid\":\"root________\",\"title\":\"\",\"index\":0,\"id\":1,\"typeCode\":2,"
+                             "\"type\":\"text/x-moz-place-container\",\"root\":\"placesRoot\",\"children\":["
+                             "{\"guid\":\"toolbar_____\",\"title\":\"toolbar\",\"index\":1,\"id\":3,\"typeCode\":2,"
+                             "\"type\":\"text/x-moz-place-container\",\"root\":\"toolbarFolder\",\"children\":[");
+    } else {
+        g_string_append(out, "<!DOCTYPE NETSCAPE-Bookmark-file-1>\n"
+                             "<META HTTP-EQUIV=\"Content-Type\" CONTENT=\"text/html; charset=UTF-8\">\n"
+                             "<TITLE>Bookmarks</TITLE>\n<H1>Bookmarks</H1>\n<DL><p>\n"
+                             "    <DT><H3 ADD_DATE=\"1700000000\" PERSONAL_TOOLBAR_FOLDER=\"true\">Bookmarks Toolbar</H3>\n"
+                             "    <DL><p>\n");
+    }
     
-    if (response == GTK_RESPONSE_YES) {
-        // Create a new WebKitWebContext with certificate exception
-        WebKitWebContext *context = webkit_web_context_new();
-        webkit_web_context_allow_tls_certificate_for_host(context, certificate, failing_uri);
+    for (guint i = 0; i < count && ok; i++) {
+        guint folder = i / BOOKMARK_IO_BENCH_FOLDER_SIZE;
+        gboolean first = i % BOOKMARK_IO_BENCH_FOLDER_SIZE == 0;
+        gboolean last = i % BOOKMARK_IO_BENCH_FOLDER_SIZE == BOOKMARK_IO_BENCH_FOLDER_SIZE - 1 || i + 1 == count;
         
-        // Load the URI in a new WebView with this context
-        WebKitWebView *new_view = WEBKIT_WEB_VIEW(webkit_web_view_new_with_context(context));
-        webkit_web_view_load_uri(new_view, failing_uri);
+        // Folders of folders: "Projects N" holding "Folder N"
+        if (first && json) {
+            g_string_append_printf(out, "%s{\"title\":\"Projects %u\",\"typeCode\":2,"
+                                   "\"type\":\"text/x-moz-place-container\",\"children\":["
+                                   "{\"title\":\"Folder %u\",\"typeCode\":2,"
+                                   "\"type\":\"text/x-moz-place-container\",\"children\":[",
+                                   folder ? "," : "", folder / 10, folder);
+        } else if (first) {
+            g_string_append_printf(out, "    <DT><H3>Projects %u</H3>\n    <DL><p>\n"
+                                   "        <DT><H3>Folder %u &amp; more</H3>\n        <DL><p>\n",
+                                   folder / 10, folder);
+        }
         
-        // Replace the existing WebView
-        GtkWidget *parent = gtk_widget_get_parent(GTK_WIDGET(web_view));
-        if (parent) {
-            gtk_container_remove(GTK_CONTAINER(parent), GTK_WIDGET(web_view));
-            gtk_container_add(GTK_CONTAINER(parent), GTK_WIDGET(new_view));
-            gtk_widget_show(GTK_WIDGET(new_view));
+        bookmark_io_bench_entry(i, title, url, tags);
+        if (json) {
+            g_string_append_printf(out, "%s{\"guid\":\"bench%07u\",\"title\":", first ? "" : ",", i);
+            bookmark_io_bench_append(out, title->str, TRUE);
+            g_string_append_printf(out, ",\"index\":%u,\"dateAdded\":1700000000000000,\"id\":%u,\"typeCode\":1,"
+                                   "\"type\":\"text/x-moz-place\",\"uri\":", i % BOOKMARK_IO_BENCH_FOLDER_SIZE, i + 10);
+            bookmark_io_bench_append(out, url->str, TRUE);
+            if (tags->len) {
+                g_string_append(out, ",\"tags\":");
+                bookmark_io_bench_append(out, tags->str, TRUE);
+            }
+            g_string_append_c(out, '}');
+        } else {
+            g_string_append(out, "            <DT><A HREF=\"");
+            bookmark_io_bench_append(out, url->str, FALSE);
+            g_string_append(out, "\" ADD_DATE=\"1700000000\"");
+            if (i % 10 == 0) {
+                // Favicons are inline data URIs of a few kilobytes
+                g_string_append(out, " ICON=\"data:image/png;base64,");
+                for (guint k = 0; k < 40; k++) {
+                    g_string_append(out, "iVBORw0KGgoAAAANSUhEUgAAABAAAAAQCAYAAAAf8/9hAAAA");
+                }
+                g_string_append_c(out, '"');
+            }
+            if (tags->len) {
+                g_string_append(out, " TAGS=\"");
+                bookmark_io_bench_append(out, tags->str, FALSE);
+                g_string_append_c(out, '"');
+            }
+            g_string_append_c(out, '>');
+            bookmark_io_bench_append(out, title->str, FALSE);
+            g_string_append(out, "</A>\n");
         }
         
-        return TRUE;
+        if (last) {
+            g_string_append(out, json ? "]}]}" : "        </DL><p>\n    </DL><p>\n");
+        }
+        if (out->len >= 1024 * 1024) {
+            ok = write_all(fd, out->str, out->len);
+            g_string_truncate(out, 0);
+        }
     }
+    g_string_append(out, json ? "]}]}\n" : "    </DL><p>\n</DL><p>\n");
+    ok = ok && write_all(fd, out->str, out->len);
+    ok = close(fd) == 0 && ok;
     
-    return TRUE; // We handled the error
+    g_string_free(out, TRUE);
+    g_string_free(title, TRUE);
+    g_string_free(url, TRUE);
+    g_string_free(tags, TRUE);
+    return ok;
 }
 
-// Update address bar when page loads
-static void web_view_load_changed(WebKitWebView *web_view, WebKitLoadEvent event, gpointer data) {
-    if (event == WEBKIT_LOAD_FINISHED) {
-        BrowserData *browser_data = (BrowserData *)data;
-        const gchar *uri = webkit_web_view_get_uri(web_view);
-        gtk_entry_set_text(GTK_ENTRY(browser_data->url_entry), uri ? uri : "");
-    }
+static void bookmark_io_bench_store_free(BrowserData *browser_data) {
+    if (browser_data->bookmarks_fd >= 0) close(browser_data->bookmarks_fd);
+    g_hash_table_destroy(browser_data->bookmark_urls);
+    g_ptr_array_free(browser_data->bookmarks, TRUE);
+    g_array_free(browser_data->bookmark_index->keys, TRUE);
+    g_string_chunk_free(browser_data->bookmark_index->words);
+    g_free(browser_data->bookmark_index);
+    g_array_free(browser_data->completion_index->entries, TRUE);
+    g_array_free(browser_data->completion_index->keys, TRUE);
+    g_string_chunk_free(browser_data->completion_index->strings);
+    g_hash_table_destroy(browser_data->completion_index->by_url);
+    g_free(browser_data->completion_index);
+    g_free(browser_data->bookmarks_path);
 }
 
-// Load bookmarks from file
-static void load_bookmarks(GtkListStore *store, const gchar *bookmarks_path) {
-    if (!bookmarks_path) return;
-    
-    FILE *file = fopen(bookmarks_path, "r");
-    if (!file) return;
-    
-    char line[MAX_LINE_LENGTH];
-    char title[MAX_TITLE_LENGTH];
-    char url[MAX_URL_LENGTH];
+static guint64 bookmark_io_bench_file_size(const gchar *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (guint64)st.st_size : 0;
+}
+
+// Peak resident memory of the process, in KiB
+static guint64 bookmark_io_bench_peak_rss(void) {
+    gchar *status = NULL;
+    guint64 kib = 0;
     
-    while (fgets(line, sizeof(line), file)) {
-        // Remove newline
-        size_t len = strlen(line);
-        if (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
-            line[len-1] = '\0';
-            if (len > 1 && line[len-2] == '\r') {
-                line[len-2] = '\0';
-            }
-        }
-        
-        // Split into title and URL with size limits
-        char *delim = strchr(line, '|');
-        if (delim) {
-            *delim = '\0';
-            safe_strcpy(title, line, MAX_TITLE_LENGTH);
-            safe_strcpy(url, delim + 1, MAX_URL_LENGTH);
-            
-            // Only add if URL is valid
-            if (is_valid_url(url)) {
-                GtkTreeIter iter;
-                gtk_list_store_append(store, &iter);
-                gtk_list_store_set(store, &iter, 0, title, 1, url, -1);
-            }
-        }
+    if (g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+        const gchar *line = strstr(status, "VmHWM:");
+        if (line) kib = g_ascii_strtoull(line + 6, NULL, 10);
     }
-    
-    fclose(file);
+    g_free(status);
+    return kib;
 }
 
-// Save bookmarks to file
-static void save_bookmarks(GtkListStore *store, const gchar *bookmarks_path) {
-    if (!bookmarks_path) {
-        g_warning("No bookmarks path specified");
-        return;
-    }
-    
-    FILE *file = fopen(bookmarks_path, "w");
-    if (!file) {
-        g_warning("Failed to save bookmarks to %s", bookmarks_path);
-        return;
+static int run_bookmark_import_benchmark(guint count) {
+    static const gchar *inputs[] = { "html", "firefox" };
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("tinyweb-import-XXXXXX", &error);
+    if (!dir) {
+        g_printerr("Cannot create a directory for the benchmark: %s\n", error->message);
+        g_error_free(error);
+        return 1;
     }
     
-    GtkTreeIter iter;
-    gboolean valid = gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store), &iter);
+    GString *json = g_string_new(NULL);
+    g_string_append_printf(json, "{\n  \"entries\": %u,\n  \"imports\": [", count);
+    GString *exports = g_string_new(NULL);
+    gboolean ok = TRUE;
     
-    while (valid) {
-        gchar *title, *url;
-        gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, 0, &title, 1, &url, -1);
+    for (guint n = 0; n < G_N_ELEMENTS(inputs) && ok; n++) {
+        gboolean is_json = n == 1;
+        gchar *input = g_build_filename(dir, is_json ? "bookmarks.json" : "bookmarks.html", NULL);
+        if (!bookmark_io_bench_write_file(input, count, is_json)) {
+            g_printerr("Cannot write %s: %s\n", input, g_strerror(errno));
+            g_free(input);
+            ok = FALSE;
+            break;
+        }
+        guint64 input_bytes = bookmark_io_bench_file_size(input);
         
-        // Sanitize data before saving
-        gchar *safe_title = sanitize_string(title);
-        gchar *safe_url = sanitize_string(url);
+        BrowserData store = { 0 };
+        gchar *journal = g_build_filename(dir, is_json ? "journal-json.txt" : "journal-html.txt", NULL);
+        bookmark_store_init(&store, g_strdup(journal));
+        BookmarkTransferRun run = { NULL, FALSE };
+        ok = bookmark_transfer_run(&store, FALSE, input, BOOKMARK_FORMAT_HTML, &run);
         
-        fprintf(file, "%s|%s\n", safe_title, safe_url);
+        // Replaying the journal gives back what the import kept in memory
+        BrowserData reloaded = { 0 };
+        bookmark_store_init(&reloaded, g_strdup(journal));
+        gint64 start = g_get_monotonic_time();
+        load_bookmarks(&reloaded);
+        gdouble reload_ms = (g_get_monotonic_time() - start) / 1000.0;
+        ok = ok && reloaded.bookmarks->len == store.bookmarks->len;
         
-        g_free(safe_title);
-        g_free(safe_url);
-        g_free(title);
-        g_free(url);
+        g_string_append_printf(json, "%s\n    {\"format\": \"%s\", \"file_bytes\": %" G_GUINT64_FORMAT
+                               ", \"seconds\": %.3f, \"entries_per_second\": %.0f, \"mb_per_second\": %.1f"
+                               ", \"added\": %u, \"duplicates\": %u, \"invalid\": %u, \"peak_queued_batches\": %u"
+                               ", \"reload_ms\": %.1f, \"reloaded\": %u}",
+                               n ? "," : "", inputs[n], input_bytes, run.seconds,
+                               run.seconds > 0 ? count / run.seconds : 0.0,
+                               run.seconds > 0 ? input_bytes / run.seconds / (1024 * 1024) : 0.0,
+                               run.added, run.duplicates, run.invalid, run.peak_queued,
+                               reload_ms, reloaded.bookmarks->len);
+        bookmark_io_bench_store_free(&reloaded);
         
-        valid = gtk_tree_model_iter_next(GTK_TREE_MODEL(store), &iter);
-    }
-    
-    fclose(file);
-    // Set secure permissions on the file
-    chmod(bookmarks_path, 0600);
-}
-
-// Add current page to bookmarks
-static void add_bookmark(GtkWidget *widget, gpointer data) {
-    BrowserData *browser_data = (BrowserData *)data;
-    const gchar *uri = webkit_web_view_get_uri(browser_data->web_view);
-    const gchar *title = webkit_web_view_get_title(browser_data->web_view);
-    
-    if (uri && is_valid_url(uri)) {
-        // Limit title length
-        gchar *safe_title;
-        if (title) {
-            safe_title = g_strndup(title, MAX_TITLE_LENGTH - 1);
-        } else {
-            safe_title = g_strndup(uri, MAX_TITLE_LENGTH - 1);
+        // Export what the HTML import produced in every format
+        for (guint format = 0; !is_json && ok && format < G_N_ELEMENTS(bookmark_format_names); format++) {
+            gchar *name = g_strdup_printf("export-%s.%s", bookmark_format_names[format],
+                                          format == BOOKMARK_FORMAT_HTML ? "html" : "json");
+            gchar *output = g_build_filename(dir, name, NULL);
+            BookmarkTransferRun export_run = { NULL, FALSE };
+            ok = bookmark_transfer_run(&store, TRUE, output, (BookmarkFormat)format, &export_run);
+            
+            g_string_append_printf(exports, "%s\n    {\"format\": \"%s\", \"file_bytes\": %" G_GUINT64_FORMAT
+                                   ", \"seconds\": %.3f, \"entries_per_second\": %.0f, \"peak_queued_slices\": %u}",
+                                   format ? "," : "", bookmark_format_names[format],
+                                   bookmark_io_bench_file_size(output), export_run.seconds,
+                                   export_run.seconds > 0 ? export_run.added / export_run.seconds : 0.0,
+                                   export_run.peak_queued);
+            g_free(output);
+            g_free(name);
         }
         
-        GtkTreeIter iter;
-        gtk_list_store_append(browser_data->bookmarks_store, &iter);
-        gtk_list_store_set(browser_data->bookmarks_store, &iter,
-                         0, safe_title,
-                         1, uri,
-                         -1);
-        
-        g_free(safe_title);
-        
-        save_bookmarks(browser_data->bookmarks_store, browser_data->bookmarks_path);
+        bookmark_io_bench_store_free(&store);
+        g_free(journal);
+        g_free(input);
     }
-}
-
-// Delete selected bookmark
-static void delete_bookmark(GtkWidget *widget, gpointer data) {
-    GtkTreeView *tree_view = GTK_TREE_VIEW(data);
-    GtkTreeSelection *selection = gtk_tree_view_get_selection(tree_view);
-    GtkTreeModel *model;
-    GtkTreeIter iter;
     
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-        BrowserData *browser_data = g_object_get_data(G_OBJECT(tree_view), "browser-data");
-        gtk_list_store_remove(GTK_LIST_STORE(model), &iter);
-        save_bookmarks(GTK_LIST_STORE(model), browser_data->bookmarks_path);
+    g_string_append_printf(json, "\n  ],\n  \"exports\": [%s\n  ],\n  \"peak_rss_mb\": %.1f\n}\n",
+                           exports->str, bookmark_io_bench_peak_rss() / 1024.0);
+    if (ok) {
+        g_print("%s", json->str);
+    } else {
+        g_printerr("Benchmark failed\n");
     }
+    
+    g_string_free(exports, TRUE);
+    g_string_free(json, TRUE);
+    page_bench_remove_dir(dir);
+    g_free(dir);
+    return ok ? 0 : 1;
 }
 
-// Navigate to selected bookmark
-static void navigate_to_bookmark(GtkTreeView *tree_view, GtkTreePath *path,
-                               GtkTreeViewColumn *column, gpointer data) {
-    BrowserData *browser_data = (BrowserData *)data;
-    GtkTreeModel *model = gtk_tree_view_get_model(tree_view);
-    GtkTreeIter iter;
+// URL micro-benchmark: times validation, normalization and canonical keys
+// over N synthetic bookmark URLs, or over the lines of a file such as a
+// fuzz corpus, and prints nanoseconds per URL as JSON. Every input is also
+// checked for the properties the rest of the browser relies on: a
+// normalized URL is valid, normalizes to itself and has the same key.
+#define URL_BENCH_DEFAULT_COUNT 100000
+
+static GPtrArray *url_bench_inputs(const gchar *source) {
+    GPtrArray *inputs = g_ptr_array_new_with_free_func(g_free);
+    guint count;
     
-    if (gtk_tree_model_get_iter(model, &iter, path)) {
+    if (!parse_uint_arg(source, &count)) {
+        gchar *contents = NULL;
+        GError *error = NULL;
+        if (!g_file_get_contents(source, &contents, NULL, &error)) {
+            g_printerr("Cannot read %s: %s\n", source, error->message);
+            g_error_free(error);
+            g_ptr_array_free(inputs, TRUE);
+            return NULL;
+        }
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        for (guint i = 0; lines[i]; i++) {
+            if (*lines[i]) g_ptr_array_add(inputs, g_strdup(lines[i]));
+        }
+        g_strfreev(lines);
+        g_free(contents);
+        return inputs;
+    }
+    
+    // A mix of what bookmarks, history and the address bar produce
+    for (guint i = 0; i < count; i++) {
         gchar *url;
-        gtk_tree_model_get(model, &iter, 1, &url, -1);
-        
-        if (url && is_valid_url(url)) {
-            webkit_web_view_load_uri(browser_data->web_view, url);
+        switch (i % 8) {
+        case 0:
+            url = g_strdup_printf("https://site%u.example.com/articles/%u/", i % 5000, i);
+            break;
+        case 1:
+            url = g_strdup_printf("HTTP://WWW.Site%u.Example.COM:80/Path/%u?ref=feed&id=%u#comments", i % 5000, i, i);
+            break;
+        case 2:
+            url = g_strdup_printf("http://docs.example.org:8080/guide/section-%u.html", i);
+            break;
+        case 3:
+            url = g_strdup_printf("site%u.example/search?q=tinyweb+%u", i % 5000, i);
+            break;
+        case 4:
+            url = g_strdup_printf("https://bücher%u.example/katalog/%u", i % 100, i);
+            break;
+        case 5:
+            url = g_strdup_printf("file:///home/user/notes/%u.html", i);
+            break;
+        case 6:
+            url = g_strdup_printf("https://[2001:db8::%x]:443/status", i % 0x10000);
+            break;
+        default:
+            url = g_strdup_printf("javascript:alert(%u)", i);
+            break;
         }
-        
-        g_free(url);
+        g_ptr_array_add(inputs, url);
     }
+    return inputs;
 }
 
-// Show bookmark manager dialog
-static void show_bookmarks(GtkWidget *widget, gpointer data) {
-    BrowserData *browser_data = (BrowserData *)data;
-    
-    GtkWidget *dialog = gtk_dialog_new_with_buttons("Bookmarks",
-                                                 GTK_WINDOW(gtk_widget_get_toplevel(widget)),
-                                                 GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
-                                                 "Close", GTK_RESPONSE_CLOSE,
-                                                 NULL);
-    
-    gtk_window_set_default_size(GTK_WINDOW(dialog), 400, 300);
-    
-    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
-    
-    // Create bookmark view
-    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
-                                GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    
-    GtkWidget *tree_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(browser_data->bookmarks_store));
-    g_object_set_data(G_OBJECT(tree_view), "browser-data", browser_data);
-    
-    // Add columns
-    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
-    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(tree_view),
-                                             -1, "Title", renderer, "text", 0, NULL);
-    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(tree_view),
-                                             -1, "URL", renderer, "text", 1, NULL);
-    
-    g_signal_connect(tree_view, "row-activated",
-                   G_CALLBACK(navigate_to_bookmark), browser_data);
-    
-    gtk_container_add(GTK_CONTAINER(scrolled_window), tree_view);
+static int run_url_benchmark(const gchar *source) {
+    GPtrArray *inputs = url_bench_inputs(source);
+    if (!inputs || inputs->len == 0) {
+        g_printerr("URL benchmark: no input\n");
+        if (inputs) g_ptr_array_free(inputs, TRUE);
+        return 1;
+    }
     
-    // Create delete button
-    GtkWidget *button_box = gtk_button_box_new(GTK_ORIENTATION_HORIZONTAL);
-    gtk_button_box_set_layout(GTK_BUTTON_BOX(button_box), GTK_BUTTONBOX_END);
+    guint valid = 0, violations = 0;
+    gint64 start = g_get_monotonic_time();
+    for (guint i = 0; i < inputs->len; i++) {
+        valid += is_valid_url(g_ptr_array_index(inputs, i));
+    }
+    gint64 validate_us = g_get_monotonic_time() - start;
     
-    GtkWidget *delete_button = gtk_button_new_with_label("Delete");
-    g_signal_connect(delete_button, "clicked", G_CALLBACK(delete_bookmark), tree_view);
-    gtk_container_add(GTK_CONTAINER(button_box), delete_button);
+    UrlBuffer url = { g_string_new(NULL), 0, 0, 0 };
+    GString *key = g_string_new(NULL);
+    start = g_get_monotonic_time();
+    for (guint i = 0; i < inputs->len; i++) {
+        if (url_parse(g_ptr_array_index(inputs, i), &url)) {
+            g_string_truncate(key, 0);
+            url_buffer_key(&url, key);
+        }
+    }
+    gint64 key_us = g_get_monotonic_time() - start;
     
-    // Add widgets to dialog
-    gtk_box_pack_start(GTK_BOX(content_area), scrolled_window, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(content_area), button_box, FALSE, FALSE, 5);
+    // Properties, checked outside the timed loops
+    for (guint i = 0; i < inputs->len; i++) {
+        const gchar *input = g_ptr_array_index(inputs, i);
+        gchar *normalized = url_normalize(input);
+        if (!normalized) continue;
+        
+        gchar *again = url_normalize(normalized);
+        gchar *input_key = url_canonical_key(input);
+        gchar *normalized_key = url_canonical_key(normalized);
+        if (!again || strcmp(again, normalized) != 0 || !normalized_key ||
+            strcmp(input_key, normalized_key) != 0) {
+            g_printerr("URL benchmark: unstable normalization of %s\n", input);
+            violations++;
+        }
+        g_free(normalized_key);
+        g_free(input_key);
+        g_free(again);
+        g_free(normalized);
+    }
     
-    gtk_widget_show_all(content_area);
+    g_print("{\n  \"urls\": %u,\n  \"valid\": %u,\n  \"validate_ns_per_url\": %.1f,\n"
+            "  \"normalize_and_key_ns_per_url\": %.1f,\n  \"total_validate_ms\": %.2f,\n"
+            "  \"violations\": %u\n}\n",
+            inputs->len, valid, validate_us * 1000.0 / inputs->len, key_us * 1000.0 / inputs->len,
+            validate_us / 1000.0, violations);
     
-    gtk_dialog_run(GTK_DIALOG(dialog));
-    gtk_widget_destroy(dialog);
+    g_string_free(key, TRUE);
+    g_string_free(url.text, TRUE);
+    g_ptr_array_free(inputs, TRUE);
+    return violations == 0 ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {
@@ -437,27 +11328,244 @@ int main(int argc, char *argv[]) {
     // Optional: For troubleshooting, you can enable more GStreamer debugging
     // setenv("GST_DEBUG", "2", 1);
     
-    BrowserData browser_data;
+    // Before anything else, so the trace covers GTK initialization
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--startup-trace") == 0) {
+            startup_trace_origin = get_process_start_us();
+            startup_trace_mark("main");
+        }
+    }
+    
+    // Hand the URL to a running instance before paying for GTK initialization
+    gboolean remote_only;
+    gchar *remote_command = control_command_from_args(argc, argv, &remote_only);
+    if (remote_command) {
+        gchar *reply = control_send(remote_command);
+        gboolean transfer = g_str_has_prefix(remote_command, "import ") ||
+                            g_str_has_prefix(remote_command, "export ");
+        g_free(remote_command);
+        
+        if (reply || remote_only) {
+            int status = reply && g_str_has_prefix(reply, "ok") ? 0 : 1;
+            if (!reply) {
+                g_printerr("No running tinyweb to send the command to\n");
+            } else if (status != 0) {
+                g_printerr("%s\n", reply);
+            } else if (remote_only && reply[2] == ' ') {
+                g_print("%s\n", reply + 3);
+            } else if (transfer) {
+                g_print("The running tinyweb is doing it; its status bar shows the progress\n");
+            }
+            g_free(reply);
+            return status;
+        }
+    }
+    
+    BrowserData browser_data = { 0 };
+    browser_data.bookmarks_fd = -1;
+    browser_data.perf_log_fd = -1;
+    browser_data.control_fd = -1;
     
     // Initialize GTK
     gtk_init(&argc, &argv);
+    startup_trace_mark("gtk-initialized");
     
-    // Process command line arguments
+    // Process command line arguments. Without a URL the last session is restored.
     const char *home_url = DEFAULT_URL;
+    browser_data.restore_session = TRUE;
+    browser_data.max_live_tabs = DEFAULT_MAX_LIVE_TABS;
+    WebKitCacheModel cache_model = WEBKIT_CACHE_MODEL_WEB_BROWSER;
+    const char *cache_model_name = "web-browser";
+    const char *bench_path = NULL;
+    const char *perf_log_path = NULL;
+    gboolean content_filters = TRUE;
+    gboolean frame_profile = FALSE;
+    PrefetchMode prefetch_mode = PREFETCH_CONSERVATIVE;
+    const char *bench_serve_root = NULL;
+    guint bench_runs = BENCH_DEFAULT_RUNS;
+    guint bench_bookmarks = 0;
+    guint bench_index = 0;
+    guint bench_import = 0;
+    const char *import_path = NULL;
+    const char *export_path = NULL;
+    const char *export_format = NULL;
+    gboolean index_pages = page_index_config_enabled();
+    const char *bench_urls = NULL;
+    const char *cache_dir = NULL;
+    guint cache_max_mb = 0;
+    const char *prewarm_path = NULL;
+    gboolean new_instance = FALSE;
+    const char *render_path = NULL;
+    const char *render_out = ".";
+    guint render_jobs = MIN(RENDER_DEFAULT_JOBS, g_get_num_processors());
+    guint render_formats = RENDER_PNG;
+    guint render_timeout = RENDER_DEFAULT_TIMEOUT;
+    guint render_retries = RENDER_DEFAULT_RETRIES;
+    const char *download_path = NULL;
+    const char *download_dir = NULL;
+    guint download_jobs = DOWNLOAD_DEFAULT_JOBS;
+    MemoryConfig memory_config;
+    memory_config_init(&memory_config);
+    memory_config_load(&memory_config);
     
     for (int i = 1; i < argc; i++) {
         if ((strcmp(argv[i], "--home") == 0 || strcmp(argv[i], "-h") == 0) && i + 1 < argc) {
             // Validate home URL
             if (is_valid_url(argv[i + 1])) {
                 home_url = argv[i + 1];
+                browser_data.restore_session = FALSE;
             } else {
                 g_print("Warning: Invalid home URL provided, using default\n");
             }
             i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--max-live-tabs") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &browser_data.max_live_tabs)) {
+                g_print("Warning: Invalid tab limit provided, using %d\n", DEFAULT_MAX_LIVE_TABS);
+                browser_data.max_live_tabs = DEFAULT_MAX_LIVE_TABS;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--cache-model") == 0 && i + 1 < argc) {
+            if (parse_cache_model(argv[i + 1], &cache_model)) {
+                cache_model_name = argv[i + 1];
+            } else {
+                g_print("Warning: Unknown cache model provided, using %s\n", cache_model_name);
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-max-mb") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &cache_max_mb)) {
+                g_print("Warning: Invalid cache size provided, not limiting the disk cache\n");
+                cache_max_mb = 0;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &memory_config.limit_mb)) {
+                g_print("Warning: Invalid memory limit provided, not limiting memory\n");
+                memory_config.limit_mb = 0;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--memory-thresholds") == 0 && i + 1 < argc) {
+            // CONSERVATIVE,STRICT as fractions of the limit
+            gchar **values = g_strsplit(argv[++i], ",", 2);
+            if (values[0] && values[1]) {
+                memory_config.conservative = g_ascii_strtod(values[0], NULL);
+                memory_config.strict = g_ascii_strtod(values[1], NULL);
+            } else {
+                memory_config.conservative = 0;
+            }
+            g_strfreev(values);
+        } else if (strcmp(argv[i], "--memory-poll") == 0 && i + 1 < argc) {
+            memory_config.poll_interval = g_ascii_strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--new-instance") == 0) {
+            new_instance = TRUE;
+        } else if (strcmp(argv[i], "--prefer-cache") == 0) {
+            browser_data.prefer_cache = TRUE;
+        } else if (strcmp(argv[i], "--prewarm") == 0 && i + 1 < argc) {
+            prewarm_path = argv[++i];
+        } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            if (!parse_prefetch_mode(argv[i + 1], &prefetch_mode)) {
+                g_print("Warning: Unknown prefetch mode provided, using conservative\n");
+                prefetch_mode = PREFETCH_CONSERVATIVE;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--no-content-filters") == 0) {
+            content_filters = FALSE;
+        } else if (strcmp(argv[i], "--startup-trace") == 0) {
+            // Handled before gtk_init()
+        } else if (strcmp(argv[i], "--shutdown-trace") == 0) {
+            shutdown_trace = TRUE;
+        } else if (strcmp(argv[i], "--perf-log") == 0 && i + 1 < argc) {
+            perf_log_path = argv[++i];
+        } else if (strcmp(argv[i], "--frame-profile") == 0) {
+            frame_profile = TRUE;
+        } else if (strcmp(argv[i], "--index-pages") == 0) {
+            index_pages = TRUE;
+        } else if (strcmp(argv[i], "--hw-accel") == 0 && i + 1 < argc) {
+            if (!parse_hardware_acceleration(argv[i + 1], &hardware_acceleration)) {
+                g_print("Warning: Unknown hardware acceleration policy provided, using on-demand\n");
+                hardware_acceleration = WEBKIT_HARDWARE_ACCELERATION_POLICY_ON_DEMAND;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_path = argv[++i];
+        } else if (strcmp(argv[i], "--bench-runs") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &bench_runs) || bench_runs == 0) {
+                g_print("Warning: Invalid run count provided, using %d\n", BENCH_DEFAULT_RUNS);
+                bench_runs = BENCH_DEFAULT_RUNS;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--bench-serve") == 0 && i + 1 < argc) {
+            bench_serve_root = argv[++i];
+        } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            render_path = argv[++i];
+        } else if (strcmp(argv[i], "--render-out") == 0 && i + 1 < argc) {
+            render_out = argv[++i];
+        } else if (strcmp(argv[i], "--render-jobs") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &render_jobs) || render_jobs == 0) {
+                g_print("Warning: Invalid job count provided, using %d\n", RENDER_DEFAULT_JOBS);
+                render_jobs = RENDER_DEFAULT_JOBS;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--render-format") == 0 && i + 1 < argc) {
+            if (!parse_render_formats(argv[i + 1], &render_formats)) {
+                g_print("Warning: Unknown render format provided, using png\n");
+                render_formats = RENDER_PNG;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--render-timeout") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &render_timeout) || render_timeout == 0) {
+                g_print("Warning: Invalid timeout provided, using %d\n", RENDER_DEFAULT_TIMEOUT);
+                render_timeout = RENDER_DEFAULT_TIMEOUT;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--render-retries") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &render_retries)) {
+                g_print("Warning: Invalid retry count provided, using %d\n", RENDER_DEFAULT_RETRIES);
+                render_retries = RENDER_DEFAULT_RETRIES;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--download") == 0 && i + 1 < argc) {
+            download_path = argv[++i];
+        } else if (strcmp(argv[i], "--download-dir") == 0 && i + 1 < argc) {
+            download_dir = argv[++i];
+        } else if (strcmp(argv[i], "--download-jobs") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &download_jobs) || download_jobs == 0) {
+                g_print("Warning: Invalid job count provided, using %d\n", DOWNLOAD_DEFAULT_JOBS);
+                download_jobs = DOWNLOAD_DEFAULT_JOBS;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--bench-urls") == 0 && i + 1 < argc) {
+            bench_urls = argv[++i];
+        } else if (strcmp(argv[i], "--bench-bookmarks") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &bench_bookmarks) || bench_bookmarks == 0) {
+                g_print("Warning: Invalid bookmark count provided, using %d\n", BOOKMARK_BENCH_DEFAULT_COUNT);
+                bench_bookmarks = BOOKMARK_BENCH_DEFAULT_COUNT;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--bench-index") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &bench_index) || bench_index == 0) {
+                g_print("Warning: Invalid page count provided, using %d\n", PAGE_BENCH_DEFAULT_COUNT);
+                bench_index = PAGE_BENCH_DEFAULT_COUNT;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--bench-import") == 0 && i + 1 < argc) {
+            if (!parse_uint_arg(argv[i + 1], &bench_import) || bench_import == 0) {
+                g_print("Warning: Invalid bookmark count provided, using %d\n", BOOKMARK_IO_BENCH_DEFAULT_COUNT);
+                bench_import = BOOKMARK_IO_BENCH_DEFAULT_COUNT;
+            }
+            i++; // Skip the next argument
+        } else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc) {
+            import_path = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_path = argv[++i];
+        } else if (strcmp(argv[i], "--export-format") == 0 && i + 1 < argc) {
+            export_format = argv[++i];
         } else if (strstr(argv[i], "://") != NULL) {
             // Validate URL
             if (is_valid_url(argv[i])) {
                 home_url = argv[i];
+                browser_data.restore_session = FALSE;
             } else {
                 g_print("Warning: Invalid URL provided, using default\n");
             }
@@ -466,25 +11574,140 @@ int main(int argc, char *argv[]) {
             g_print("  tinyweb [URL]\n");
             g_print("  tinyweb --home URL\n");
             g_print("  tinyweb -h URL\n");
+            g_print("  tinyweb --new-instance      (do not hand URLs to an already running tinyweb)\n");
+            g_print("  tinyweb --remote open|load URL, --remote reload|uri|title|present\n");
+            g_print("  tinyweb --max-live-tabs N   (background tabs kept loaded, default %d)\n",
+                    DEFAULT_MAX_LIVE_TABS);
+            g_print("  tinyweb --cache-model web-browser|document-browser|document-viewer\n");
+            g_print("  tinyweb --cache-dir DIR     (disk cache location, default ~/.cache/tinyweb)\n");
+            g_print("  tinyweb --cache-max-mb N    (trim the disk cache to N MiB at startup)\n");
+            g_print("  tinyweb --prefer-cache      (open pages from saved snapshots when available)\n");
+            g_print("  tinyweb --prewarm URL_LIST  (fill the cache and save snapshots, then exit)\n");
+            g_print("  tinyweb --memory-limit MB   (web process memory budget)\n");
+            g_print("  tinyweb --memory-thresholds CONSERVATIVE,STRICT   (fractions of the budget, default %.2f,%.2f)\n",
+                    MEMORY_DEFAULT_CONSERVATIVE, MEMORY_DEFAULT_STRICT);
+            g_print("  tinyweb --memory-poll SECONDS   (memory check interval, default %.0f)\n",
+                    MEMORY_DEFAULT_POLL_INTERVAL);
+            g_print("  tinyweb --perf-log FILE     (append one JSON line per navigation)\n");
+            g_print("  tinyweb --frame-profile     (report frame times and long tasks per page on exit)\n");
+            g_print("  tinyweb --hw-accel on-demand|always|never   (compositing policy, default on-demand)\n");
+            g_print("  tinyweb --index-pages       (index the text of visited pages; search with ?WORDS)\n");
+            g_print("  tinyweb --no-content-filters\n");
+            g_print("  tinyweb --startup-trace     (print startup milestones to stderr)\n");
+            g_print("  tinyweb --shutdown-trace    (print shutdown phase timings to stderr)\n");
+            g_print("  tinyweb --prefetch off|conservative|aggressive   (DNS prefetch, default conservative)\n");
+            g_print("  tinyweb --bench URL_LIST [--bench-runs N] [--bench-serve DIR]\n");
+            g_print("  tinyweb --render URL_LIST [--render-out DIR] [--render-jobs N] [--render-format png|pdf|both]\n");
+            g_print("          [--render-timeout SECONDS] [--render-retries N]   (render pages to files, then exit)\n");
+            g_print("  tinyweb --download-dir DIR  (where downloads go, default your Downloads folder)\n");
+            g_print("  tinyweb --download-jobs N   (downloads running at once, default %d)\n", DOWNLOAD_DEFAULT_JOBS);
+            g_print("  tinyweb --download URL_LIST [--bench-serve DIR]   (download a list, print throughput, then exit)\n");
+            g_print("  tinyweb --bench-urls N|FILE (time URL parsing over N synthetic URLs or a file)\n");
+            g_print("  tinyweb --bench-bookmarks N (time the bookmark manager with N bookmarks)\n");
+            g_print("  tinyweb --bench-index N     (time indexing and searching N synthetic pages)\n");
+            g_print("  tinyweb --import FILE       (add bookmarks from a bookmark file, Chrome or Firefox JSON)\n");
+            g_print("  tinyweb --export FILE [--export-format html|chrome|firefox]   (default from the file name)\n");
+            g_print("  tinyweb --bench-import N    (time importing and exporting N generated bookmarks, default %d)\n",
+                    BOOKMARK_IO_BENCH_DEFAULT_COUNT);
             return 0;
         }
     }
     
+    // Needs neither a context nor a window
+    if (bench_urls) {
+        return run_url_benchmark(bench_urls);
+    }
+    if (bench_index) {
+        return run_page_index_benchmark(bench_index);
+    }
+    if (bench_import) {
+        return run_bookmark_import_benchmark(bench_import);
+    }
+    if (import_path || export_path) {
+        // No browser is running, or --new-instance was given
+        return run_bookmark_transfer(&browser_data, import_path, export_path, export_format);
+    }
+    
+    browser_data.cache_dir = cache_dir ? g_strdup(cache_dir)
+                                       : g_build_filename(g_get_user_cache_dir(), "tinyweb", NULL);
+    
+    WebKitSettings *settings = create_web_settings();
+    memory_config_validate(&memory_config);
+    WebKitWebContext *context = configure_web_context(cache_model, browser_data.cache_dir, cache_max_mb,
+                                                      &memory_config);
+    browser_data.web_context = context;
+    load_tls_exceptions(context);
+    
+    // Benchmark, pre-warm and render modes never show the browser window
+    if (bench_path) {
+        return run_benchmark(settings, context, bench_path, bench_runs, bench_serve_root, cache_model_name);
+    }
+    if (prewarm_path) {
+        return run_prewarm(settings, context, prewarm_path, browser_data.cache_dir);
+    }
+    if (render_path) {
+        return run_render_farm(settings, context, render_path, render_out, render_jobs, render_formats,
+                               render_timeout, render_retries);
+    }
+    if (download_path) {
+        return run_download_list(settings, context, download_path, bench_serve_root, download_dir, download_jobs);
+    }
+    if (bench_bookmarks) {
+        browser_data.bookmarks = g_ptr_array_new_with_free_func(bookmark_free);
+        browser_data.bookmark_index = bookmark_index_new();
+        browser_data.bookmark_urls = g_hash_table_new(g_str_hash, g_str_equal);
+        return run_bookmark_benchmark(&browser_data, bench_bookmarks);
+    }
+    
+    // Per-navigation performance log
+    if (perf_log_path) {
+        browser_data.perf_log_fd = open(perf_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (browser_data.perf_log_fd < 0) {
+            g_print("Warning: Cannot open performance log %s: %s\n", perf_log_path, g_strerror(errno));
+        }
+    }
+    
     // Setup bookmarks directory and file
     browser_data.bookmarks_path = get_bookmarks_path();
     if (!browser_data.bookmarks_path) {
         g_print("Warning: Could not create bookmarks directory, using temporary storage\n");
     }
     
-    // Create the bookmarks store
-    browser_data.bookmarks_store = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_STRING);
-    load_bookmarks(browser_data.bookmarks_store, browser_data.bookmarks_path);
+    // Bookmarks with their word index, and the address bar completion index.
+    // Bookmarks and history are read after the first navigation starts.
+    browser_data.bookmarks = g_ptr_array_new_with_free_func(bookmark_free);
+    browser_data.bookmark_index = bookmark_index_new();
+    browser_data.bookmark_urls = g_hash_table_new(g_str_hash, g_str_equal);
+    browser_data.completion_index = completion_index_new();
+    
+    // Open the browsing history
+    gchar *history_path = get_config_path("history.log");
+    if (history_path) {
+        browser_data.history = history_open(history_path);
+        g_free(history_path);
+    }
+    
+    // The full-text index reads its files on its own thread
+    if (index_pages) {
+        browser_data.page_index = page_index_open();
+    }
+    
+    // Tabs are saved while browsing and on exit
+    session_open(&browser_data);
+    if (!browser_data.session_dir) {
+        browser_data.restore_session = FALSE;
+    }
     
     // Create a top-level window
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "TinyWeb - by Steve");
     gtk_window_set_default_size(GTK_WINDOW(window), 800, 600);
     g_signal_connect(window, "destroy", G_CALLBACK(on_destroy), &browser_data);
+    g_signal_connect(window, "map-event", G_CALLBACK(on_window_mapped), NULL);
+    browser_data.window = window;
+    if (!new_instance) {
+        control_server_start(&browser_data);
+    }
     
     // Create main vertical layout
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
@@ -519,6 +11742,24 @@ int main(int argc, char *argv[]) {
     GtkWidget *url_entry = gtk_entry_new();
     browser_data.url_entry = url_entry;
     g_signal_connect(url_entry, "activate", G_CALLBACK(navigate_to_url), &browser_data);
+    
+    // As-you-type suggestions; the index fills the list before the
+    // completion popup reads it, so this must be connected first
+    browser_data.completion_store = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_STRING);
+    g_signal_connect(url_entry, "changed", G_CALLBACK(url_entry_changed), &browser_data);
+    
+    GtkEntryCompletion *completion = gtk_entry_completion_new();
+    gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(browser_data.completion_store));
+    gtk_entry_completion_set_match_func(completion, completion_match_all, NULL, NULL);
+    gtk_entry_completion_set_minimum_key_length(completion, 1);
+    gtk_entry_completion_set_text_column(completion, 1);
+    GtkCellRenderer *title_renderer = gtk_cell_renderer_text_new();
+    g_object_set(title_renderer, "ellipsize", PANGO_ELLIPSIZE_END, "width-chars", 30, NULL);
+    gtk_cell_layout_pack_start(GTK_CELL_LAYOUT(completion), title_renderer, FALSE);
+    gtk_cell_layout_add_attribute(GTK_CELL_LAYOUT(completion), title_renderer, "text", 0);
+    g_signal_connect(completion, "match-selected", G_CALLBACK(completion_match_selected), &browser_data);
+    gtk_entry_set_completion(GTK_ENTRY(url_entry), completion);
+    g_object_unref(completion);
     gtk_box_pack_start(GTK_BOX(toolbar), url_entry, TRUE, TRUE, 0);
     
     // Go button
@@ -539,71 +11780,81 @@ int main(int argc, char *argv[]) {
     g_signal_connect(bookmarks_button, "clicked", G_CALLBACK(show_bookmarks), &browser_data);
     gtk_box_pack_start(GTK_BOX(toolbar), bookmarks_button, FALSE, FALSE, 0);
     
-    gtk_box_pack_start(GTK_BOX(vbox), toolbar, FALSE, FALSE, 0);
-    
-    // Configure WebKit settings for media playback
-    WebKitSettings *settings = webkit_settings_new();
+    // History button
+    GtkWidget *history_button = gtk_button_new_with_label("🕘");
+    gtk_widget_set_tooltip_text(history_button, "Show history");
+    g_signal_connect(history_button, "clicked", G_CALLBACK(show_history), &browser_data);
+    gtk_box_pack_start(GTK_BOX(toolbar), history_button, FALSE, FALSE, 0);
     
-    // Enable HTML5 media features
-    webkit_settings_set_enable_html5_database(settings, TRUE);
-    webkit_settings_set_enable_html5_local_storage(settings, TRUE);
-    webkit_settings_set_enable_media_stream(settings, TRUE);
-    webkit_settings_set_enable_mediasource(settings, TRUE);
-    webkit_settings_set_media_playback_requires_user_gesture(settings, FALSE);
-    webkit_settings_set_enable_webaudio(settings, TRUE);
-    webkit_settings_set_enable_webgl(settings, TRUE);
+    // Downloads button
+    GtkWidget *downloads_button = gtk_button_new_with_label("⬇");
+    gtk_widget_set_tooltip_text(downloads_button, "Show downloads");
+    g_signal_connect(downloads_button, "clicked", G_CALLBACK(show_downloads), &browser_data);
+    gtk_box_pack_start(GTK_BOX(toolbar), downloads_button, FALSE, FALSE, 0);
     
-    // Common browser features
-    webkit_settings_set_enable_javascript(settings, TRUE);
-    webkit_settings_set_enable_developer_extras(settings, TRUE);
-    webkit_settings_set_javascript_can_access_clipboard(settings, TRUE);
+    // New tab button
+    GtkWidget *new_tab_button = gtk_button_new_with_label("+");
+    gtk_widget_set_tooltip_text(new_tab_button, "New tab");
+    g_object_set_data_full(G_OBJECT(new_tab_button), "home-url", g_strdup(home_url), g_free);
+    g_signal_connect(new_tab_button, "clicked", G_CALLBACK(new_tab), &browser_data);
+    gtk_box_pack_start(GTK_BOX(toolbar), new_tab_button, FALSE, FALSE, 0);
     
-    // Set a mainstream user agent for site compatibility
-    webkit_settings_set_user_agent(settings, 
-        "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
-        "Chrome/100.0.4896.127 Safari/537.36");
+    gtk_box_pack_start(GTK_BOX(vbox), toolbar, FALSE, FALSE, 0);
     
-    // Create a WebKit WebView widget with secure settings
-    browser_data.web_view = WEBKIT_WEB_VIEW(webkit_web_view_new_with_settings(settings));
+    browser_data.settings = settings;
+    browser_data.site_policies = site_policies_new(&browser_data);
+    browser_data.prefetcher = prefetcher_new(prefetch_mode, context);
+    browser_data.memory_guard = memory_guard_new(&browser_data, &memory_config);
+    browser_data.download_manager = download_manager_new(&browser_data, context, settings, download_dir,
+                                                         download_jobs);
+    builtin_pages_register(&browser_data, context);
     
-    // Configure web context for caching and cookies
-    WebKitWebContext *context = webkit_web_context_get_default();
-    webkit_web_context_set_cache_model(context, WEBKIT_CACHE_MODEL_WEB_BROWSER);
+    // Shared by all tabs; carries the content blocker rule lists
+    browser_data.user_content_manager = webkit_user_content_manager_new();
+    if (content_filters) {
+        browser_data.content_blocker = content_blocker_new(browser_data.user_content_manager);
+    }
+    if (frame_profile) {
+        browser_data.frame_profiler = frame_profiler_new(browser_data.user_content_manager,
+                                                         hardware_acceleration_names[hardware_acceleration]);
+    }
     
     // Connect navigation button callbacks
-    g_signal_connect(back_button, "clicked", G_CALLBACK(go_back), browser_data.web_view);
-    g_signal_connect(forward_button, "clicked", G_CALLBACK(go_forward), browser_data.web_view);
-    g_signal_connect(reload_button, "clicked", G_CALLBACK(refresh_page), browser_data.web_view);
-    g_signal_connect(home_button, "clicked", G_CALLBACK(go_home), browser_data.web_view);
-    
-    // Handle TLS errors
-    g_signal_connect(browser_data.web_view, "load-failed-with-tls-errors", 
-                    G_CALLBACK(on_load_failed_with_tls_errors), NULL);
-    
-    // Connect load changed signal
-    g_signal_connect(browser_data.web_view, "load-changed", 
-                    G_CALLBACK(web_view_load_changed), &browser_data);
+    g_signal_connect(back_button, "clicked", G_CALLBACK(go_back), &browser_data);
+    g_signal_connect(forward_button, "clicked", G_CALLBACK(go_forward), &browser_data);
+    g_signal_connect(reload_button, "clicked", G_CALLBACK(refresh_page), &browser_data);
+    g_signal_connect(home_button, "clicked", G_CALLBACK(go_home), &browser_data);
     
-    // Create WebView container
-    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
-                                GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    gtk_container_add(GTK_CONTAINER(scrolled_window), GTK_WIDGET(browser_data.web_view));
-    gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
+    // Create the tab strip
+    browser_data.tabs = g_ptr_array_new();
+    browser_data.notebook = gtk_notebook_new();
+    gtk_notebook_set_scrollable(GTK_NOTEBOOK(browser_data.notebook), TRUE);
+    g_signal_connect(browser_data.notebook, "switch-page", G_CALLBACK(on_switch_page), &browser_data);
+    g_signal_connect(browser_data.notebook, "page-reordered", G_CALLBACK(on_page_reordered), &browser_data);
+    gtk_box_pack_start(GTK_BOX(vbox), browser_data.notebook, TRUE, TRUE, 0);
     
-    // Add a status bar for security information
+    // Add a status bar for the performance HUD
     GtkWidget *status_bar = gtk_statusbar_new();
+    browser_data.status_bar = status_bar;
+    browser_data.status_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(status_bar),
+                                                               "performance");
     gtk_box_pack_end(GTK_BOX(vbox), status_bar, FALSE, FALSE, 0);
     
-    // Load the specified URL after validating
-    if (is_valid_url(home_url)) {
-        webkit_web_view_load_uri(browser_data.web_view, home_url);
-    } else {
-        webkit_web_view_load_uri(browser_data.web_view, DEFAULT_URL);
-    }
-    
     // Show all widgets
     gtk_widget_show_all(window);
+    startup_trace_mark("window-shown");
+    
+    // Open the first tab with the specified URL right after the first
+    // frame is drawn, then load the rest of the state
+    browser_data.home_url = home_url;
+    g_idle_add(open_first_tab, &browser_data);
+    browser_data.deferred_source = g_idle_add_full(G_PRIORITY_LOW, load_deferred_state_idle,
+                                                   &browser_data, NULL);
+    
+    // Warm DNS for likely destinations once startup has settled
+    if (browser_data.prefetcher) {
+        g_timeout_add_seconds(PREFETCH_STARTUP_DELAY, prefetch_top_sites, &browser_data);
+    }
     
     // Run the GTK main loop
     gtk_main();